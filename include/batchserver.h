@@ -0,0 +1,109 @@
+//
+//  batchserver.h
+//  Vertex Simulations
+//
+//  Created by Antoni Wójcik on 11/06/2020.
+//  Copyright © 2020 Antoni Wójcik. All rights reserved.
+//
+
+#ifndef batchserver_h
+#define batchserver_h
+
+// include the OpenCL library (C++ binding)
+#define __CL_ENABLE_EXCEPTIONS
+#define CL_HPP_TARGET_OPENCL_VERSION 120
+#define CL_HPP_MINIMUM_OPENCL_VERSION 120
+#include "cl2.hpp"
+
+#include <vector>
+#include <string>
+#include <queue>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <fstream>
+
+enum BatchJobType {
+    JOB_CLOTH, // ClothStrips on one device, size x size vertices
+    JOB_NBODY // NBodySlab with a single rank, a periodic grid of size^3 cells
+};
+
+// one headless run, parsed from a line of key=value pairs such as
+//     type=cloth size=512 steps=1000 stiffness=500 damping=0.2 dt=0.03 priority=2
+//     type=nbody size=64 bodies=100000 steps=10 dt=0.01 precision=double
+struct BatchJob {
+    long id;
+    int priority; // the larger the earlier, the jobs of equal priority run in the order they came
+    BatchJobType type;
+    int size;
+    long bodies;
+    int steps;
+    float length, mass, stiffness, damping, time_step;
+    bool fp64;
+    std::string spec;
+    
+    BatchJob();
+    
+    // max_alloc is the largest buffer the devices allow, 0 does not check the size
+    static bool parse(const std::string& line, BatchJob& job, std::string& error, size_t max_alloc = 0);
+    double largestBuffer() const; // bytes
+};
+
+// long-running server of the headless simulations: every device, or every sub-device of the CPU, has a worker thread holding a
+// context with the programs already built, the jobs come over a Unix socket into a bounded priority queue and the results are
+// written to the output directory as each job finishes
+class BatchServer {
+private:
+    struct Worker {
+        cl::Device device;
+        cl::Context context;
+        cl::Program cloth_program[2]; // float and double, the double ones only on the devices with cl_khr_fp64
+        cl::Program nbody_program[2];
+        bool fp64;
+        bool nbody_fp64; // the double n-body deposits the density with 64-bit atomics as well
+        size_t max_alloc;
+        std::string name;
+        std::thread thread;
+    };
+    
+    struct JobOrder {
+        inline bool operator()(const BatchJob& a, const BatchJob& b) const { return a.priority < b.priority || (a.priority == b.priority && a.id > b.id); }
+    };
+    
+    std::string output_dir;
+    size_t capacity; // queued jobs beyond which the submissions are refused
+    size_t max_alloc; // the smallest of the workers, any of them can take a job
+    
+    std::priority_queue<BatchJob, std::vector<BatchJob>, JobOrder> jobs;
+    std::mutex mutex; // guards the queue, the counters and the results file
+    std::condition_variable job_ready, job_done;
+    bool stopping;
+    long next_id;
+    size_t running, done;
+    
+    std::vector<Worker*> workers;
+    std::ofstream results;
+    
+    // builds every program the device supports, or only the one that job needs
+    static void prepareWorker(Worker& worker, const std::string& cloth_source, const std::string& nbody_source, const BatchJob* job = NULL);
+    static bool supports(const Worker& worker, const BatchJob& job);
+    static double runJob(const BatchJob& job, const Worker& worker, const std::string& output_dir);
+    
+    void workerLoop(Worker* worker);
+    std::string handleLine(const std::string& line, bool& shutdown);
+    
+public:
+    BatchServer(const std::vector<cl::Device>& devices, const char* cloth_kernel_path, const char* nbody_kernel_path, const std::string& out_dir, size_t cap = 1024);
+    ~BatchServer();
+    
+    static std::vector<cl::Device> findDevices(int cpu_parts);
+    
+    long submit(BatchJob job); // -1 if the queue is full
+    void drain();
+    void serve(const char* socket_path);
+    
+    // the jobs run by the server against one process per job, with as many processes at once as the server has workers
+    static void benchmarkThroughput(const std::vector<std::string>& specs, int cpu_parts, const char* cloth_kernel_path, const char* nbody_kernel_path, const std::string& out_dir);
+};
+
+#endif /* batchserver_h */
@@ -0,0 +1,71 @@
+//
+//  capture.h
+//  Vertex Simulations
+//
+//  Created by Antoni Wójcik on 04/06/2020.
+//  Copyright © 2020 Antoni Wójcik. All rights reserved.
+//
+
+#ifndef capture_h
+#define capture_h
+
+#include <GL/glew.h>
+
+#include <vector>
+#include <deque>
+#include <string>
+#include <fstream>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+enum CaptureFormat {
+    CAPTURE_PNG, // numbered PNG files
+    CAPTURE_Y4M // one raw YUV 4:4:4 stream
+};
+
+// records every frame: the scene is drawn into an offscreen framebuffer, read back through a ring of pixel buffers and written by a separate thread
+class FrameCapture {
+private:
+    int width, height;
+    CaptureFormat format;
+    std::string path;
+    int fps;
+    bool present; // copy the frame to the window as well
+    
+    GLuint FBO, colour_RBO, depth_RBO;
+    
+    // ring of reads in flight, a slot is copied out once its fence has been passed
+    int ring_size, ring_head, ring_tail;
+    std::vector<GLuint> PBOs;
+    std::vector<GLsync> fences;
+    size_t frame_size;
+    
+    // frames waiting for the writer, the memory is recycled through the free list
+    std::thread writer;
+    std::mutex mutex;
+    std::condition_variable cond_write, cond_free;
+    std::deque<std::vector<unsigned char>> queue;
+    std::vector<std::vector<unsigned char>> free_frames;
+    bool finished;
+    
+    long frame_count;
+    double stall_time; // seconds the render thread waited for the device or for the writer
+    
+    void createFramebuffer();
+    void collect(bool block);
+    void write();
+    void writePNG(const std::vector<unsigned char>& rgba, long index) const;
+    void writeY4M(std::ofstream& stream, const std::vector<unsigned char>& rgba) const;
+    
+public:
+    FrameCapture(int w, int h, CaptureFormat f, const std::string& p, int frame_rate = 60, bool show = true, int ring = 3, int queue_frames = 8);
+    ~FrameCapture();
+    
+    void begin();
+    void end(int window_width, int window_height);
+    
+    inline long getFrameCount() const { return frame_count; }
+};
+
+#endif /* capture_h */
@@ -14,12 +14,22 @@
 
 #include "glm.hpp"
 
+#include <vector>
+
+enum ClothIntegrator {
+    INTEGRATOR_LEAPFROG, // kick-drift-kick with the velocities in two buffers
+    INTEGRATOR_VERLET // position Verlet, the previous positions replace both velocity buffers
+};
+
+// T is the scalar type of the simulation, float or double
+template<typename T>
 class Cloth : public KernelGL {
 private:
     struct ClothProperties {
         int size_x, size_y;
         float length; // distance between vertices
         float mass, stiffness, damping;
+        float shear_stiffness, bend_stiffness; // springs of the extended stencil, the stiffness is of the four direct neighbours
         float time_step;
         glm::vec3 pos;
         glm::mat4 model_matrix;
@@ -29,6 +39,17 @@ private:
         
     } cloth_prop;
     
+    StateStorage storage;
+    ClothIntegrator integrator;
+    
+    // adaptive step, the record of the steps taken is compared against the fixed step in printStepStats
+    bool adaptive;
+    T step_dt; // step of the next drift, read back once per iterate
+    T dt_max; // largest step of the controller, below the stability limit
+    double sim_time;
+    long steps_taken;
+    float dt_lowest, dt_highest;
+    
     // OpenGL related variables
     
     GLuint VBO, VAO, EBO;
@@ -40,23 +61,52 @@ private:
     
     cl::Kernel kernel_pos;
     cl::Kernel kernel_vel;
+    cl::Kernel kernel_diag;
+    cl::Kernel kernel_limit;
+    cl::Kernel kernel_adapt;
+    cl::Kernel kernel_verlet;
+    cl::Kernel kernel_stencil;
+    size_t stencil_group; // side of the work-group of the extended stencil, 0 if the device cannot run it
     
-    cl::Buffer buff_pos_prev;
-    cl::BufferGL buff_pos_next;
+    cl::Buffer buff_pos_prev; // positions in the state storage
+    cl::BufferGL buff_pos_next; // float positions for drawing
     cl::Buffer buff_vel_prev;
     cl::Buffer buff_vel_next;
+    cl::Buffer buff_pos_old; // previous positions of the Verlet integrator, swapped with buff_pos_prev every step
+    cl::Buffer buff_step; // step of the next drift, next kick, simulated time and steps, shared by the kernels
+    cl::Buffer buff_limit; // largest speed and strain of each work-group
+    
+    size_t buff_size; // float buffer size
+    size_t buff_state_size; // size of the position and velocity buffers in the state storage
     
-    size_t buff_size;
+    static std::string programOptions(int x, int y, float l, StateStorage s);
     
     void createGLBuffers();
     void createCLBuffers();
     void createKernels();
     void setConstKernelArgs();
+    void writeStep(cl::CommandQueue& queue, T dt, T kick);
+    void enqueueVel(cl::CommandQueue& queue);
+    void stepVerlet(cl::CommandQueue& queue, std::vector<cl::Memory>& mem_objs);
+    
+    virtual void initialiseKernels();
+    virtual void createDiagnostics(const cl::Program& diagnostics_program, const std::function<void(const DiagnosticsRecord&)>& callback);
+    virtual bool stateBuffer(StateField field, cl::Buffer& buffer, size_t& size, size_t& item_size);
     
 public:
-    Cloth(int x, int y, float l, float m, float k, float b, const glm::vec3& p, float dt, const char* vs_path, const char* gs_path, const char* fs_path, const char* kernel_path);
+    Cloth(int x, int y, float l, float m, float k, float b, const glm::vec3& p, float dt, const char* vs_path, const char* gs_path, const char* fs_path, const char* kernel_path, StateStorage s = STORAGE_FLOAT, ClothIntegrator i = INTEGRATOR_LEAPFROG);
     ~Cloth();
     
+    void setAdaptive(bool a);
+    void setSpringStiffness(float shear, float bend);
+    float advance(float time, int max_steps);
+    void printStepStats();
+    inline long getStepsTaken() const { return steps_taken; }
+    double benchmarkIterate(int steps = 1000);
+    void readPositions(std::vector<float>& positions);
+    void readVelocities(std::vector<float>& velocities);
+    
+    virtual bool setParameter(const std::string& name, float value);
     virtual void iterate(int steps = 1);
     virtual void draw(const Camera* camera);
 };
@@ -0,0 +1,79 @@
+//
+//  clothmesh.h
+//  Vertex Simulations
+//
+//  Created by Antoni Wójcik on 10/06/2020.
+//  Copyright © 2020 Antoni Wójcik. All rights reserved.
+//
+
+#ifndef clothmesh_h
+#define clothmesh_h
+
+#include "kernelgl.h"
+#include "shader.h"
+#include "trianglemesh.h"
+
+#include "glm.hpp"
+
+#include <vector>
+
+// cloth of an arbitrary triangle mesh, the springs are read from the compressed sparse row adjacency of the mesh on the device;
+// the vertices are stored in the order of the mesh, see TriangleMesh::reorder
+template<typename T>
+class ClothMesh : public KernelGL {
+private:
+    int vertex_num, spring_num;
+    float mass, stiffness, damping;
+    float time_step;
+    MeshOrder order;
+    double mean_span;
+    
+    glm::vec3 pos;
+    glm::mat4 model_matrix;
+    
+    // OpenGL related variables
+    
+    GLuint VBO, VAO, EBO;
+    GLsizei indices_num;
+    
+    Shader shader;
+    
+    // OpenCL related variables
+    
+    cl::Kernel kernel_pos;
+    cl::Kernel kernel_vel;
+    cl::Kernel kernel_diag;
+    
+    cl::Buffer buff_pos;
+    cl::BufferGL buff_pos_gl; // float positions for drawing
+    cl::Buffer buff_vel_prev;
+    cl::Buffer buff_vel_next;
+    cl::Buffer buff_offsets; // first spring of each vertex
+    cl::Buffer buff_neighbours;
+    cl::Buffer buff_rest; // rest length of each spring
+    cl::Buffer buff_inv_mass; // 0 for the pinned vertices
+    
+    size_t buff_size; // float buffer size
+    size_t buff_state_size;
+    
+    void createGLBuffers(const TriangleMesh& mesh);
+    void createCLBuffers(const TriangleMesh& mesh);
+    void createKernels();
+    void setConstKernelArgs();
+    
+    virtual void initialiseKernels();
+    virtual void createDiagnostics(const cl::Program& diagnostics_program, const std::function<void(const DiagnosticsRecord&)>& callback);
+    
+public:
+    ClothMesh(const TriangleMesh& mesh, float m, float k, float b, const glm::vec3& p, float dt, const char* vs_path, const char* gs_path, const char* fs_path, const char* kernel_path);
+    ~ClothMesh();
+    
+    void benchmarkIterate(int steps = 1000);
+    void readPositions(std::vector<float>& positions);
+    void readVelocities(std::vector<float>& velocities);
+    
+    virtual void iterate(int steps = 1);
+    virtual void draw(const Camera* camera);
+};
+
+#endif /* clothmesh_h */
@@ -0,0 +1,83 @@
+//
+//  clothstrips.h
+//  Vertex Simulations
+//
+//  Created by Antoni Wójcik on 05/06/2020.
+//  Copyright © 2020 Antoni Wójcik. All rights reserved.
+//
+
+#ifndef clothstrips_h
+#define clothstrips_h
+
+// include the OpenCL library (C++ binding)
+#define __CL_ENABLE_EXCEPTIONS
+#define CL_HPP_TARGET_OPENCL_VERSION 120
+#define CL_HPP_MINIMUM_OPENCL_VERSION 120
+#include "cl2.hpp"
+
+#include <vector>
+#include <string>
+
+// a cloth too large for one device: the rows are split into strips, one per device, each strip keeps one halo row on either side
+// which is exchanged every step while the interior rows are computed, there is no drawing so that it also runs on CPU sub-devices
+template<typename T>
+class ClothStrips {
+private:
+    struct Strip {
+        cl::Device device;
+        cl::CommandQueue queue; // kernels
+        cl::CommandQueue copy_queue; // halo copies, overlapped with the interior rows
+        
+        int row_start, row_num; // first owned row of the cloth and number of owned rows, the buffers hold row_num + 2 rows
+        
+        cl::Kernel kernel_pos;
+        cl::Kernel kernel_vel;
+        
+        cl::Buffer buff_pos;
+        cl::Buffer buff_vel[2]; // ping-pong, the input of the step is buff_vel[parity]
+        cl::Buffer buff_step;
+        
+        // events of the current step, a copy into a strip waits for the last kernel of the strip reading its halo rows
+        cl::Event pos_boundary, pos_interior, vel_boundary, vel_interior;
+        std::vector<cl::Event> pos_halo, vel_halo; // copies into this strip, waited for by its velocity update
+        std::vector<cl::Event> sent; // copies out of this strip, waited for before its boundary rows are overwritten
+    };
+    
+    int size_x, size_y;
+    float length, mass, stiffness, damping;
+    float time_step;
+    
+    cl::Context context;
+    cl::Program program;
+    std::vector<Strip> strips;
+    int parity;
+    
+    size_t row_size; // bytes of one row of positions or velocities
+    
+    void initialise(const std::vector<cl::Device>& devices, bool balance);
+    void createStrips(const std::vector<cl::Device>& devices, const std::vector<int>& rows);
+    void uploadInitial();
+    std::vector<int> balanceRows(int calibration_steps);
+    
+    void launchRows(Strip& s, cl::Kernel& kernel, int first, int num, const std::vector<cl::Event>* wait, cl::Event* event);
+    void copyHalo(Strip& from, Strip& to, const cl::Buffer& src, const cl::Buffer& dst, const std::vector<cl::Event>& wait, std::vector<cl::Event>& halo);
+    void stepPositions();
+    void stepVelocities();
+    void gatherRows(bool velocities, std::vector<float>& values);
+    
+public:
+    ClothStrips(int x, int y, float l, float m, float k, float b, float dt, const std::vector<cl::Device>& devices, const char* kernel_path, bool balance = true);
+    // with a context of the devices and kernel_cloth.ocl built for them with -D HEADLESS, kept between the cloths
+    ClothStrips(int x, int y, float l, float m, float k, float b, float dt, const std::vector<cl::Device>& devices, const cl::Context& c, const cl::Program& p, bool balance = false);
+    
+    static std::vector<cl::Device> partitionCPU(int parts);
+    
+    void iterate(int steps = 1);
+    void readPositions(std::vector<float>& positions);
+    void readVelocities(std::vector<float>& velocities);
+    void printRows() const;
+    
+    static void benchmarkScaling(int x, int y, float l, float m, float k, float b, float dt, const std::vector<cl::Device>& devices, const char* kernel_path, int steps = 100);
+};
+
+#endif /* clothstrips_h */
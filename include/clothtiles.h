@@ -0,0 +1,82 @@
+//
+//  clothtiles.h
+//  Vertex Simulations
+//
+//  Created by Antoni Wójcik on 07/06/2020.
+//  Copyright © 2020 Antoni Wójcik. All rights reserved.
+//
+
+#ifndef clothtiles_h
+#define clothtiles_h
+
+// include the OpenCL library (C++ binding)
+#define __CL_ENABLE_EXCEPTIONS
+#define CL_HPP_TARGET_OPENCL_VERSION 120
+#define CL_HPP_MINIMUM_OPENCL_VERSION 120
+#include "cl2.hpp"
+
+#include <vector>
+#include <string>
+
+// a cloth larger than the device memory: the state stays in host memory, mapped from a file if one is given, and every step
+// streams it through the device in tiles of rows with one halo row on either side, the upload of the next tile and the download
+// of the last one overlap with the computation of the current one
+template<typename T>
+class ClothTiles {
+private:
+    struct Slot {
+        cl::Buffer buff_pos; // positions of the tile and its halo rows
+        cl::Buffer buff_vel_i;
+        cl::Buffer buff_vel_f;
+        cl::Event uploaded, computed;
+    };
+    
+    int size_x, size_y;
+    float length, mass, stiffness, damping;
+    float time_step;
+    
+    int tile_rows, tile_num;
+    size_t row_size; // bytes of one row of positions or velocities
+    
+    // host state: two copies of the positions and of the velocities, a pass reads one and writes the other
+    std::string state_path;
+    int state_file;
+    char* state;
+    size_t state_size;
+    int parity;
+    
+    cl::Device device;
+    cl::Context context;
+    cl::Program program;
+    cl::CommandQueue transfer_queue;
+    cl::CommandQueue compute_queue;
+    
+    cl::Kernel kernel_pos;
+    cl::Kernel kernel_vel;
+    cl::Buffer buff_step;
+    Slot slots[3];
+    
+    void mapState();
+    void createSlots(int rows);
+    
+    T* hostPos(int p) const;
+    T* hostVel(int p) const;
+    void upload(int tile);
+    void compute(int tile, bool drift);
+    void download(int tile);
+    void pass(bool drift);
+    
+public:
+    ClothTiles(int x, int y, float l, float m, float k, float b, float dt, const cl::Device& d, const char* kernel_path, const std::string& path = "", int rows = 0);
+    ~ClothTiles();
+    
+    void iterate(int steps = 1);
+    void readPositions(std::vector<float>& positions) const;
+    void readVelocities(std::vector<float>& velocities) const;
+    
+    inline int getTileRows() const { return tile_rows; }
+    
+    static void benchmarkOutOfCore(int x_core, int x_large, float l, float m, float k, float b, float dt, const cl::Device& d, const char* kernel_path, const std::string& path, int steps = 10);
+};
+
+#endif /* clothtiles_h */
@@ -0,0 +1,71 @@
+//
+//  devicememory.h
+//  Vertex Simulations
+//
+//  Created by Antoni Wójcik on 03/06/2020.
+//  Copyright © 2020 Antoni Wójcik. All rights reserved.
+//
+
+#ifndef devicememory_h
+#define devicememory_h
+
+// include the OpenCL library (C++ binding)
+#define __CL_ENABLE_EXCEPTIONS
+#define CL_HPP_TARGET_OPENCL_VERSION 120
+#define CL_HPP_MINIMUM_OPENCL_VERSION 120
+#include "cl2.hpp"
+
+#include <vector>
+#include <string>
+
+// plans the device buffers of a simulation: every buffer is requested with a mask of the pipeline phases in which it is live,
+// buffers whose masks do not intersect share one allocation and the peak over the phases is checked against the device before anything is allocated;
+// only the buffers of the same flags share an allocation
+class DeviceMemory {
+private:
+    struct Request {
+        std::string name;
+        size_t size;
+        unsigned int phases;
+        cl_mem_flags flags;
+        cl::Buffer* target;
+        int slab;
+    };
+    
+    struct Slab {
+        size_t size; // size of the largest request sharing the slab
+        unsigned int phases; // union of the phases of the requests sharing the slab
+        cl_mem_flags flags;
+        bool allocated;
+        cl::Buffer buffer;
+    };
+    
+    std::vector<Request> requests;
+    std::vector<Slab> slabs;
+    std::vector<std::pair<std::string, size_t>> reserved; // memory allocated outside the pool, e.g. the shared OpenGL buffers
+    
+    size_t budget, max_alloc;
+    size_t peak;
+    bool planned;
+    
+    size_t liveSize(unsigned int phase) const;
+    void check();
+    
+public:
+    static const unsigned int PERSISTENT = ~0u;
+    
+    DeviceMemory();
+    
+    void request(cl::Buffer& buffer, size_t size, unsigned int phases, const char* name, cl_mem_flags flags = CL_MEM_READ_WRITE);
+    void reserve(size_t size, const char* name);
+    
+    void plan(const cl::Device& device);
+    void acquire(const cl::Context& context, unsigned int phases);
+    void release(unsigned int phases);
+    void report() const;
+    
+    inline size_t getPeak() const { return peak; }
+    inline size_t getBudget() const { return budget; }
+};
+
+#endif /* devicememory_h */
@@ -0,0 +1,66 @@
+//
+//  diagnostics.h
+//  Vertex Simulations
+//
+//  Created by Antoni Wójcik on 02/06/2020.
+//  Copyright © 2020 Antoni Wójcik. All rights reserved.
+//
+
+#ifndef diagnostics_h
+#define diagnostics_h
+
+// include the OpenCL library (C++ binding)
+#define __CL_ENABLE_EXCEPTIONS
+#define CL_HPP_TARGET_OPENCL_VERSION 120
+#define CL_HPP_MINIMUM_OPENCL_VERSION 120
+#include "cl2.hpp"
+
+#include "glm.hpp"
+
+#include <vector>
+#include <memory>
+#include <atomic>
+#include <functional>
+
+struct DiagnosticsRecord {
+    long step;
+    float kinetic, potential;
+    glm::vec3 momentum, centre;
+};
+
+class Diagnostics {
+private:
+    cl::Kernel kernel_reduce;
+    
+    cl::Buffer buff_partial; // one record per work-group, written by the simulation kernel
+    cl::Buffer buff_ring; // reduced records waiting to be read back
+    
+    size_t group_num;
+    float total_mass;
+    
+    // ring of records read back asynchronously, a slot is ready once its read has completed (1) or failed (-1)
+    int ring_size, ring_head, ring_tail;
+    std::vector<cl_float8> host_ring;
+    std::vector<long> ring_step;
+    std::vector<cl::Event> ring_events;
+    std::unique_ptr<std::atomic<int>[]> ring_ready;
+    size_t dropped;
+    
+    std::function<void(const DiagnosticsRecord&)> callback;
+    
+    static void CL_CALLBACK readComplete(cl_event event, cl_int status, void* ready);
+    
+public:
+    Diagnostics(const cl::Context& context, const cl::Program& program, size_t items, float mass, const std::function<void(const DiagnosticsRecord&)>& cb, int ring = 8);
+    ~Diagnostics();
+    
+    void enqueue(cl::CommandQueue& queue, long step);
+    void poll();
+    
+    inline const cl::Buffer& getPartialBuffer() const { return buff_partial; }
+    inline size_t getGlobalSize() const { return group_num * getGroupSize(); }
+    inline size_t getDropped() const { return dropped; }
+    static size_t getGroupSize();
+};
+
+#endif /* diagnostics_h */
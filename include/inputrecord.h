@@ -0,0 +1,93 @@
+//
+//  inputrecord.h
+//  Vertex Simulations
+//
+//  Created by Antoni Wójcik on 11/06/2020.
+//  Copyright © 2020 Antoni Wójcik. All rights reserved.
+//
+
+#ifndef inputrecord_h
+#define inputrecord_h
+
+#include <GLFW/glfw3.h>
+
+#include <vector>
+#include <string>
+#include <fstream>
+#include <chrono>
+
+enum InputMode {
+    INPUT_LIVE, // the window input, nothing is written
+    INPUT_RECORD, // the window input, logged together with the frame times
+    INPUT_REPLAY // the logged input, the logged frame times are the clock of the simulation
+};
+
+// source of the input of the main loop: the keys are read with getKey and the events with pollEvents instead of GLFW, so that
+// a recording can be fed back frame by frame; the period of the loop and the simulation steps of every frame are kept for printStats
+//
+// the log is a text file of one line per frame or event, the events follow the frame during which they were polled and the keys
+// held when the recording started come before the first frame:
+//     F <delta_time>
+//     K <key> <action>
+//     C <x> <y>
+//     S <offset x> <offset y>
+//     B <button> <action> <mods>
+class InputRecorder {
+private:
+    struct Event {
+        char type;
+        int a, b, c;
+        double x, y;
+    };
+    
+    struct Frame {
+        float delta_time;
+        std::vector<Event> events;
+    };
+    
+    GLFWwindow* window;
+    InputMode mode;
+    
+    GLFWcursorposfun cursor_callback;
+    GLFWscrollfun scroll_callback;
+    GLFWmousebuttonfun button_callback;
+    
+    std::ofstream log;
+    
+    // the recording and the keys held at the current frame of the replay
+    std::vector<Frame> frames;
+    size_t frame_index;
+    std::vector<char> keys;
+    
+    // measurements
+    std::chrono::high_resolution_clock::time_point frame_start;
+    long last_steps;
+    std::vector<double> frame_times; // ms, from the start of a frame to the start of the next
+    std::vector<long> frame_steps;
+    
+    void load(const std::string& path);
+    
+    static InputRecorder* fromWindow(GLFWwindow* window);
+    static void keyCallback(GLFWwindow* window, int key, int scancode, int action, int mods);
+    static void cursorCallback(GLFWwindow* window, double x, double y);
+    static void scrollCallback(GLFWwindow* window, double x, double y);
+    static void buttonCallback(GLFWwindow* window, int button, int action, int mods);
+    
+public:
+    // takes the place of the cursor, scroll and mouse button callbacks of the window, they are called from pollEvents
+    InputRecorder(GLFWwindow* w, InputMode m, const std::string& path, GLFWcursorposfun cursor, GLFWscrollfun scroll, GLFWmousebuttonfun button);
+    ~InputRecorder();
+    
+    // the delta time of the frame, the recorded one in the replay; the window is closed after the last recorded frame
+    float beginFrame(float delta_time);
+    void endFrame(long steps_taken);
+    
+    int getKey(int key) const;
+    void pollEvents();
+    
+    void printStats() const;
+    
+    inline InputMode getMode() const { return mode; }
+};
+
+#endif /* inputrecord_h */
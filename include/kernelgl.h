@@ -18,26 +18,111 @@
 
 // include project libraries
 #include "camera.h"
+#include "diagnostics.h"
+#include "devicememory.h"
+
+#include <string>
+#include <atomic>
+#include <vector>
+#include <utility>
+
+enum StateStorage {
+    STORAGE_FLOAT, // the scalar type of the simulation
+    STORAGE_HALF, // positions and velocities stored as fp16, the arithmetic stays in the scalar type
+    STORAGE_FIXED // positions stored as 16-bit fixed point relative to a tile origin, velocities as fp16
+};
+
+enum StateField {
+    FIELD_POSITIONS,
+    FIELD_VELOCITIES
+};
 
 class KernelGL {
 private:
-    std::string loadSource(const char* kernel_path);
     void initialiseOpenCL();
-    void buildProgram(const char* kernel_path);
+    void buildProgram(const char* kernel_path, cl::Program& prog, const std::string& options = "", bool async = false);
+    void checkBuild(const cl::Program& prog);
+    
+    // the programs are built in the background, the simulation finishes its initialisation once all of them are done
+    std::atomic<int> builds_pending;
+    bool kernels_ready;
+    
+    static void CL_CALLBACK buildComplete(cl_program prog, void* pending);
+    
+    // diagnostics enabled before the programs were built are created by ready()
+    int diagnostics_every;
+    bool diagnostics_pending;
+    cl::Program diagnostics_program;
+    std::function<void(const DiagnosticsRecord&)> diagnostics_callback;
+    
+    std::vector<std::pair<void*, cl::Buffer>> mapped; // host views of the state handed out by mapState
+    
+    static thread_local int recoverable_errors;
     
 protected:
     cl::Device device;
     cl::Context context;
     cl::Program program;
     
+    Diagnostics* diagnostics;
+    long step_count;
+    
+    DeviceMemory memory; // plans the buffers of the simulation against the device memory
+    
     void processError(cl::Error& e);
     
+    static std::string storageOptions(StateStorage storage, float fixed_span);
+    template<typename T> static inline size_t storageSize(StateStorage storage) { return storage == STORAGE_FLOAT ? sizeof(T) : sizeof(cl_half); }
+    static float halfToFloat(cl_half h); // for reading the fp16 storage on the host
+    
+    virtual void initialiseKernels() = 0; // creates the kernels and the initial state, called once the program is built
+    
+    bool diagnosticsDue();
+    virtual void createDiagnostics(const cl::Program& diagnostics_program, const std::function<void(const DiagnosticsRecord&)>& callback) = 0;
+    
+    // the flags of the buffers returned by stateBuffer, on a device sharing the host memory they are mapped in place
+    cl_mem_flags stateFlags() const;
+    
+    // the state buffer behind a field, 3 components of item_size bytes per vertex; false if the field has no host view
+    virtual bool stateBuffer(StateField field, cl::Buffer& buffer, size_t& size, size_t& item_size) { return false; }
+    
 public:
-    KernelGL(const char* kernel_path);
-    virtual ~KernelGL() {}
+    // fp64_extensions are needed by the double precision program besides cl_khr_fp64
+    KernelGL(const char* kernel_path, const std::string& options = "", bool fp64 = false, const std::vector<const char*>& fp64_extensions = {});
+    virtual ~KernelGL() { delete diagnostics; }
+    
+    // the constructor only starts the build, iterate and draw must not be called before ready() returns true
+    bool ready();
+    void wait();
     
     virtual void iterate(int steps = 1) = 0;
     virtual void draw(const Camera* const) = 0;
+    
+    void enableDiagnostics(const char* kernel_path, int every, const std::function<void(const DiagnosticsRecord&)>& callback);
+    void pollDiagnostics();
+    
+    // the state mapped into the host memory, in place on a device sharing it and through a copy made by the runtime otherwise;
+    // iterate must not be called until every view is unmapped
+    void* mapState(StateField field, size_t& count, size_t& item_size);
+    void unmapState(void* ptr);
+    inline bool stateMapped() const { return !mapped.empty(); }
+    
+    // changes a named parameter between the steps, false if the simulation does not have it
+    virtual bool setParameter(const std::string& name, float value) { return false; }
+    
+    // shared with the backends that hold their own contexts, the errors end the program with owner at the start of the message
+    static std::string loadSource(const char* kernel_path, const char* owner = "OpenCL KERNEL");
+    static bool deviceSupports(const cl::Device& device, const char* extension);
+    static void requireExtension(const std::vector<cl::Device>& devices, const char* extension, const char* owner);
+    static cl::Program buildProgram(const cl::Context& context, const std::vector<cl::Device>& devices, const std::string& source, const std::string& options, bool fp64, const char* owner, const std::vector<const char*>& fp64_extensions = {});
+    static void processError(cl::Error& e, const char* owner);
+    
+    // while one lives, processError on its thread rethrows the error after the message instead of ending the program, so that
+    // a server fails a single job and keeps the rest
+    struct RecoverableErrors {
+        RecoverableErrors() { recoverable_errors++; }
+        ~RecoverableErrors() { recoverable_errors--; }
+    };
 };
 
 #endif /* kernelgl_h */
@@ -11,43 +11,200 @@
 
 #include "kernelgl.h"
 #include "shader.h"
+#include "splatter.h"
 
+#include <vector>
+
+enum NBodyInitial {
+    INITIAL_UNIFORM,
+    INITIAL_PLUMMER,
+    INITIAL_ZELDOVICH // displaced lattice, needs a cubic number of bodies
+};
+
+enum NBodySolver {
+    SOLVER_FFT, // periodic domain
+    SOLVER_MULTIGRID // isolated domain
+};
+
+// phases of the pipeline for the device memory plan, buffers live in disjoint phases share an allocation
+enum NBodyPhase {
+    PHASE_INITIAL = 1 << 0, // initial conditions
+    PHASE_DEPOSIT = 1 << 1, // mass assignment
+    PHASE_SOLVE = 1 << 2, // packing of the density (FFT) or the V-cycles (multigrid)
+    PHASE_TRANSFORM = 1 << 3, // FFT passes and the convolution
+    PHASE_FORCE = 1 << 4 // force interpolation and diagnostics
+};
+
+#define PHASE_STEP (PHASE_DEPOSIT | PHASE_SOLVE | PHASE_TRANSFORM | PHASE_FORCE)
+
+// T is the scalar type of the simulation, float or double
+template<typename T>
 class NBody : public KernelGL {
 private:
-    int grid_num;
+    int grid_num; // has to be a power of 2 for the FFT
     GLsizei body_num;
     float body_mass;
+    float time_step;
+    NBodyInitial initial;
+    NBodySolver solver;
+    StateStorage storage;
+    
+    // P3M short-range correction, disabled when r_split is 0
+    float r_split, r_cut;
+    int cell_num;
+    
+    // multigrid parameters, the cycles stop when the residual drops below mg_tolerance times the norm of the source
+    float mg_tolerance;
+    int mg_max_cycles;
+    int mg_levels;
+    int mg_cycles; // number of V-cycles taken by the last solve
+    
+    // block time-steps of the short-range force, the levels are reassigned after every step
+    int max_level, min_level;
+    float block_eta;
+    std::vector<int> level_count; // number of bodies on each level
+    size_t block_steps, block_updates; // steps taken and short-range force evaluations since the last benchmark
+    
+    // mesh refinement of the long-range force, disabled when amr_levels is 0; the patches are placed where a cell holds more than
+    // amr_threshold times the mean mass of a base cell and are rebuilt every amr_every force evaluations
+    int amr_levels;
+    float amr_threshold;
+    int amr_every;
+    int amr_max_patches;
+    int amr_evaluations; // since the last rebuild
+    std::vector<cl_int> amr_patches; // origin and parent of each patch, sorted by level
+    std::vector<int> amr_first, amr_count; // patches of each level
+    std::vector<int> amr_map_offset; // block map of each level in buff_amr_map
+    size_t amr_memory;
     
     GLuint VBO, VAO;
     
     Shader shader;
+    ParticleSplatter* splatter; // draws the bodies culled by kernel_cull instead of the points, if enabled
     
     cl::Kernel kernel_pos;
     cl::Kernel kernel_vel;
     cl::Kernel kernel_dens;
     cl::Kernel kernel_pot;
     cl::Kernel kernel_acc;
+    cl::Kernel kernel_pack;
+    cl::Kernel kernel_FFT;
+    cl::Kernel kernel_FFT_h;
+    cl::Kernel kernel_cell;
+    cl::Kernel kernel_acc_short;
+    cl::Kernel kernel_acc_direct;
+    cl::Kernel kernel_mg_source;
+    cl::Kernel kernel_mg_smooth;
+    cl::Kernel kernel_mg_residual;
+    cl::Kernel kernel_mg_restrict;
+    cl::Kernel kernel_mg_prolong;
+    cl::Kernel kernel_mg_norm;
+    cl::Kernel kernel_compact;
+    cl::Kernel kernel_drift;
+    cl::Kernel kernel_kick;
+    cl::Kernel kernel_level;
+    cl::Kernel kernel_diag;
+    cl::Kernel kernel_cull;
+    cl::Kernel kernel_amr_deposit;
+    cl::Kernel kernel_amr_boundary;
+    cl::Kernel kernel_amr_smooth;
+    cl::Kernel kernel_amr_acc;
     
-    cl::Buffer buff_pos_0;
-    cl::BufferGL buff_pos_1;
+    cl::Buffer buff_pos_0; // positions in the state storage
+    cl::BufferGL buff_pos_1; // float positions for drawing
     cl::Buffer buff_vel_0;
     cl::Buffer buff_vel_1;
-    cl::Buffer buff_acc;
+    cl::Buffer buff_acc; // long-range (mesh) acceleration
+    cl::Buffer buff_acc_short; // short-range (P3M) acceleration
     cl::Buffer buff_dens; // stores density distribution
-    cl::Buffer buff_pot; // stores potential
+    cl::Buffer buff_pot; // stores potential (complex for the FFT solver, real for the multigrid solver)
+    cl::Buffer buff_FFT_tmp; // scratch space for the FFT passes (complex)
     cl::Buffer buff_FFT_h; // stores data to speed up FFT by convolution thm.
+    std::vector<cl::Buffer> buff_mg_phi; // multigrid levels, level 0 shares buff_pot and buff_dens
+    std::vector<cl::Buffer> buff_mg_rhs;
+    std::vector<cl::Buffer> buff_mg_res;
+    cl::Buffer buff_mg_partial; // partial sums of the residual norm
+    cl::Buffer buff_cell_head; // first body in each cell of the short-range cell list, one list per time-step level
+    cl::Buffer buff_cell_next; // next body in the same cell
+    cl::Buffer buff_level; // time-step level of each body
+    cl::Buffer buff_level_count;
+    cl::Buffer buff_active; // compacted list of the active bodies
+    cl::Buffer buff_active_num;
+    cl::Buffer buff_ic_noise; // complex grids of the Zel'dovich initial conditions, only allocated while generating them
+    cl::Buffer buff_ic_disp;
+    cl::Buffer buff_ic_tmp;
+    cl::BufferGL buff_visible; // positions of the bodies inside the view, drawn by the splatter
+    cl::BufferGL buff_indirect; // draw command of the splatter
+    cl::Buffer buff_amr_patch; // refinement patches, allocated outside the memory plan by setRefinement
+    cl::Buffer buff_amr_map;
+    cl::Buffer buff_amr_mass;
+    cl::Buffer buff_amr_pot; // with a layer of ghost cells
     
-    size_t buff_v_size, buff_s_size; // vector buffer size; scalar buffer size
+    size_t buff_v_size, buff_s_size; // vector buffer size; scalar buffer size, both in the scalar type
+    size_t buff_gl_size; // float positions for drawing
+    size_t buff_state_size; // size of the position and velocity buffers in the state storage
     
     void createGLBuffers();
     void createCLBuffers();
+    void createCellBuffers();
+    void createMultigridBuffers();
+    void generateZeldovich(cl::CommandQueue& queue, unsigned int seed);
     void createKernels();
     void setConstKernelArgs();
     
+    virtual void initialiseKernels();
+    
+    void transformFFT(cl::CommandQueue& queue, cl::Buffer& data, cl::Buffer& scratch, int n, float sign);
+    void solveFFT(cl::CommandQueue& queue);
+    float normMultigrid(cl::CommandQueue& queue, const cl::Buffer& buff, size_t size);
+    void smoothMultigrid(cl::CommandQueue& queue, int level, int sweeps);
+    void residualMultigrid(cl::CommandQueue& queue, int level);
+    void cycleMultigrid(cl::CommandQueue& queue, int level);
+    void solveMultigrid(cl::CommandQueue& queue);
+    void depositRefinement(cl::CommandQueue& queue, int level);
+    void rebuildRefinement(cl::CommandQueue& queue);
+    void solveRefinement(cl::CommandQueue& queue, bool rebuilt);
+    void calculateLongRange(cl::CommandQueue& queue);
+    void calculateShortRange(cl::CommandQueue& queue, int tick, size_t active_num);
+    void calculateForces(cl::CommandQueue& queue);
+    
+    void createCellLists();
+    int firstActiveLevel(int tick) const;
+    size_t compactActive(cl::CommandQueue& queue, int tick);
+    void binActive(cl::CommandQueue& queue, int tick, size_t active_num);
+    void driftActive(cl::CommandQueue& queue, std::vector<cl::Memory>& mem_objs, size_t active_num);
+    void kickActive(cl::CommandQueue& queue, size_t active_num, float factor);
+    void assignLevels(cl::CommandQueue& queue);
+    
+    void cullBodies(const Camera* camera);
+    
+    virtual void createDiagnostics(const cl::Program& diagnostics_program, const std::function<void(const DiagnosticsRecord&)>& callback);
+    virtual bool stateBuffer(StateField field, cl::Buffer& buffer, size_t& size, size_t& item_size);
+    
 public:
-    NBody(int g, int n, float m, const char* vs_path, const char* fs_path, const char* kernel_path);
+    NBody(int g, int n, float m, float dt, const char* vs_path, const char* fs_path, const char* kernel_path, NBodyInitial init = INITIAL_UNIFORM, NBodySolver s = SOLVER_FFT, float rs = 0.0f, float rc = 0.0f, StateStorage st = STORAGE_FLOAT);
     ~NBody();
     
+    void generateInitial(NBodyInitial init, unsigned int seed);
+    void setShortRange(float rs, float rc);
+    void setMultigrid(float tolerance, int max_cycles);
+    void setBlockSteps(int max_l, float eta = 0.025f);
+    void setRefinement(int levels, float threshold, int every = 10, int max_patches = 512);
+    void enableSplatting(float radius, const char* splat_vs, const char* splat_fs, const char* tone_vs, const char* tone_fs, float exposure = 1.0f);
+    void benchmarkForces(int repeats = 10);
+    void benchmarkPoisson(int repeats = 10);
+    void benchmarkBlockSteps(int steps = 10);
+    void benchmarkIterate(int steps = 100);
+    void benchmarkDraw(const Camera* camera, int frames = 100);
+    void printBlockStats();
+    void printRefinementStats();
+    
+    inline const std::vector<int>& getLevelCount() const { return level_count; }
+    inline size_t getDeviceMemory() const { return memory.getPeak() + amr_memory; }
+    void readPositions(std::vector<float>& positions);
+    void readVelocities(std::vector<float>& velocities);
+    
+    virtual bool setParameter(const std::string& name, float value);
     virtual void iterate(int steps = 1);
     virtual void draw(const Camera* camera);
 };
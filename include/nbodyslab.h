@@ -0,0 +1,95 @@
+//
+//  nbodyslab.h
+//  Vertex Simulations
+//
+//  Created by Antoni Wójcik on 06/06/2020.
+//  Copyright © 2020 Antoni Wójcik. All rights reserved.
+//
+
+#ifndef nbodyslab_h
+#define nbodyslab_h
+
+// include the OpenCL library (C++ binding)
+#define __CL_ENABLE_EXCEPTIONS
+#define CL_HPP_TARGET_OPENCL_VERSION 120
+#define CL_HPP_MINIMUM_OPENCL_VERSION 120
+#include "cl2.hpp"
+
+#include "transport.h"
+
+#include <vector>
+
+// one rank of a periodic particle-mesh simulation decomposed into slabs of z planes, every rank is a process with its own device:
+// the bodies migrate to the slab they drifted into, the density planes shared by two slabs are summed across them
+// and the FFT along z runs after a distributed transpose of the slabs
+template<typename T>
+class NBodySlab {
+private:
+    Transport& transport;
+    int rank, ranks;
+    
+    int grid_num; // has to be a power of 2 and divisible by the number of ranks
+    int slab_num, slab_start; // the slab holds the planes slab_start to slab_start + slab_num - 1
+    size_t body_num, body_capacity;
+    float body_mass;
+    float time_step;
+    
+    std::vector<int> all_ranks;
+    double exchange_time; // seconds spent in the transport since the last benchmark
+    
+    cl::Device device;
+    cl::Context context;
+    cl::Program program;
+    cl::CommandQueue queue;
+    
+    cl::Kernel kernel_pos;
+    cl::Kernel kernel_vel;
+    cl::Kernel kernel_dens;
+    cl::Kernel kernel_pack;
+    cl::Kernel kernel_FFT;
+    cl::Kernel kernel_pot;
+    cl::Kernel kernel_acc;
+    
+    cl::Buffer buff_pos;
+    cl::Buffer buff_vel;
+    cl::Buffer buff_acc;
+    cl::Buffer buff_dens; // planes of the slab and the plane above it
+    cl::Buffer buff_pot; // complex, x-y planes of the slab before the transpose and z-x planes of the y rows of the rank after it
+    cl::Buffer buff_FFT_tmp;
+    cl::Buffer buff_FFT_h; // for the transposed layout
+    cl::Buffer buff_pot_halo; // complex potential of the slab with one plane below and two above
+    
+    size_t plane_size; // cells in one plane
+    
+    void selectDevice();
+    void createBuffers();
+    void resizeBodies(size_t capacity);
+    void createKernels();
+    void initialise(long n, unsigned int seed);
+    void generateUniform(long n, unsigned int seed);
+    
+    void exchange(const std::vector<int>& to, const std::vector<std::vector<char>>& send, const std::vector<int>& from, std::vector<std::vector<char>>& recv);
+    void migrateBodies();
+    void depositDensity();
+    void transformFFT(int axis, float sign);
+    void transposeSlabs(bool forward);
+    void solvePotential();
+    void exchangePotentialHalo();
+    void calculateForces();
+    
+public:
+    NBodySlab(int g, long n, float m, float dt, Transport& t, const char* kernel_path, unsigned int seed = 1);
+    // on a device of the context with kernel_nbody_fft.ocl built for it with -D HEADLESS, kept between the simulations
+    NBodySlab(int g, long n, float m, float dt, Transport& t, const cl::Device& d, const cl::Context& c, const cl::Program& p, unsigned int seed = 1);
+    
+    void iterate(int steps = 1);
+    double benchmarkIterate(int steps = 10);
+    void readPositions(std::vector<float>& positions);
+    void readVelocities(std::vector<float>& velocities);
+    
+    inline size_t getBodyNum() const { return body_num; }
+    
+    static void benchmarkScaling(int g, long n, float dt, int max_ranks, const char* kernel_path, int steps = 10);
+};
+
+#endif /* nbodyslab_h */
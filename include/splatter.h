@@ -0,0 +1,48 @@
+//
+//  splatter.h
+//  Vertex Simulations
+//
+//  Created by Antoni Wójcik on 09/06/2020.
+//  Copyright © 2020 Antoni Wójcik. All rights reserved.
+//
+
+#ifndef splatter_h
+#define splatter_h
+
+#include <GL/glew.h>
+
+#include "shader.h"
+#include "camera.h"
+
+// draws many particles as additive point sprites into a float target and tone-maps it to the bound framebuffer, the particles
+// are read from a buffer of visible positions whose count is the first element of an indirect draw command, both filled by a cull pass
+class ParticleSplatter {
+private:
+    GLsizei capacity; // largest number of visible particles
+    int width, height;
+    float radius; // of a splat, in the units of the positions
+    float exposure;
+    
+    GLuint FBO, density_texture;
+    GLuint visible_VBO, visible_VAO;
+    GLuint indirect_buffer; // count, instance count, first vertex and base instance
+    GLuint empty_VAO; // for the full-screen triangle
+    
+    Shader splat_shader;
+    Shader tone_shader;
+    
+    void createBuffers();
+    void resizeTarget(int w, int h);
+    
+public:
+    ParticleSplatter(GLsizei c, float r, const char* splat_vs, const char* splat_fs, const char* tone_vs, const char* tone_fs, float e = 1.0f);
+    ~ParticleSplatter();
+    
+    void draw(const Camera* camera, GLsizei total);
+    GLuint readVisibleCount() const;
+    
+    inline GLuint getVisibleBuffer() const { return visible_VBO; }
+    inline GLuint getIndirectBuffer() const { return indirect_buffer; }
+};
+
+#endif /* splatter_h */
@@ -0,0 +1,84 @@
+//
+//  transport.h
+//  Vertex Simulations
+//
+//  Created by Antoni Wójcik on 06/06/2020.
+//  Copyright © 2020 Antoni Wójcik. All rights reserved.
+//
+
+#ifndef transport_h
+#define transport_h
+
+#include <vector>
+#include <string>
+#include <functional>
+#include <atomic>
+#include <cstdint>
+
+// messages between the processes of a decomposed simulation, every process is a rank from 0 to size - 1
+class Transport {
+public:
+    virtual ~Transport() {}
+    
+    virtual int getRank() const = 0;
+    virtual int getSize() const = 0;
+    
+    // send[i] goes to the rank to[i] and recv[i] comes from the rank from[i], the ranks on both sides have to make the matching calls,
+    // the messages between two ranks arrive in the order they were sent
+    virtual void exchange(const std::vector<int>& to, const std::vector<std::vector<char>>& send, const std::vector<int>& from, std::vector<std::vector<char>>& recv) = 0;
+    virtual void barrier() = 0;
+    
+    void allToAll(const std::vector<std::vector<char>>& send, std::vector<std::vector<char>>& recv);
+    double sum(double value);
+};
+
+// the ranks are processes forked on one machine, every ordered pair of ranks has a mailbox in a POSIX shared memory segment
+// through which the messages are streamed in chunks of the mailbox capacity
+class SharedMemoryTransport : public Transport {
+private:
+    struct Header {
+        std::atomic<int> arrived; // ranks waiting at the barrier
+        std::atomic<int> generation; // barriers passed
+        double result; // returned by rank 0 to the launching process
+    };
+    
+    struct Mailbox {
+        std::atomic<int> full;
+        uint64_t total; // size of the whole message
+        uint64_t size; // size of the chunk
+    };
+    
+    int rank, size;
+    size_t capacity;
+    char* segment; // mapped and unmapped by launch
+    size_t segment_size;
+    
+    SharedMemoryTransport(char* s, size_t s_size, int r, int n, size_t c);
+    
+    Header* header() const;
+    Mailbox* mailbox(int from, int to) const;
+    char* mailboxData(int from, int to) const;
+    static size_t mailboxSize(size_t c);
+    
+public:
+    // forks the ranks, each of them runs the function and exits, the result of rank 0 is returned to the calling process
+    static double launch(const char* name, int ranks, size_t c, const std::function<double(Transport&)>& run);
+    
+    virtual int getRank() const { return rank; }
+    virtual int getSize() const { return size; }
+    
+    virtual void exchange(const std::vector<int>& to, const std::vector<std::vector<char>>& send, const std::vector<int>& from, std::vector<std::vector<char>>& recv);
+    virtual void barrier();
+};
+
+// the only rank, in the calling process: runs a decomposed simulation undivided, every message goes to itself
+class LocalTransport : public Transport {
+public:
+    virtual int getRank() const { return 0; }
+    virtual int getSize() const { return 1; }
+    
+    virtual void exchange(const std::vector<int>& to, const std::vector<std::vector<char>>& send, const std::vector<int>& from, std::vector<std::vector<char>>& recv);
+    virtual void barrier() {}
+};
+
+#endif /* transport_h */
@@ -0,0 +1,54 @@
+//
+//  trianglemesh.h
+//  Vertex Simulations
+//
+//  Created by Antoni Wójcik on 10/06/2020.
+//  Copyright © 2020 Antoni Wójcik. All rights reserved.
+//
+
+#ifndef trianglemesh_h
+#define trianglemesh_h
+
+#include <vector>
+
+enum MeshOrder {
+    ORDER_FILE, // as produced or loaded
+    ORDER_RCM, // reverse Cuthill-McKee, small spread of the neighbour indices
+    ORDER_MORTON // Z-order curve of the positions
+};
+
+// triangle mesh of a cloth, the springs are the edges of the triangles and are stored for every vertex in the compressed sparse
+// row form: the springs of the vertex i are offsets[i] to offsets[i + 1] - 1, each spring appears once for each of its ends
+struct TriangleMesh {
+    std::vector<float> positions; // 3 per vertex
+    std::vector<unsigned int> triangles; // 3 per triangle
+    std::vector<unsigned char> pinned; // the pinned vertices do not move
+    
+    std::vector<int> offsets;
+    std::vector<int> neighbours; // the other end of each spring
+    std::vector<float> rest_lengths;
+    
+    MeshOrder order;
+    
+    TriangleMesh();
+    
+    static TriangleMesh grid(int x, int y, float l);
+    static TriangleMesh lattice(int x, int y, float l); // the vertices and triangles of grid only, without the springs
+    static bool loadOBJ(const char* path, TriangleMesh& mesh);
+    
+    void pinTop(float tolerance);
+    void reorder(MeshOrder o);
+    
+    inline int vertexCount() const { return (int)(positions.size() / 3); }
+    inline int springCount() const { return (int)(neighbours.size() / 2); }
+    double meanSpan() const;
+    
+private:
+    void buildAdjacency();
+    void permute(const std::vector<int>& old_index);
+    std::vector<int> orderRCM() const;
+    std::vector<int> orderMorton() const;
+    int levelStructure(int start, std::vector<int>& level, std::vector<int>& component) const;
+};
+
+#endif /* trianglemesh_h */
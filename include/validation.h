@@ -0,0 +1,175 @@
+//
+//  validation.h
+//  Vertex Simulations
+//
+//  Created by Antoni Wójcik on 08/06/2020.
+//  Copyright © 2020 Antoni Wójcik. All rights reserved.
+//
+
+#ifndef validation_h
+#define validation_h
+
+#include "cloth.h"
+#include "nbody.h"
+#include "trianglemesh.h"
+
+#include <vector>
+#include <string>
+#include <map>
+#include <cmath>
+#include <complex>
+
+// the timing baseline and the failed checks of a validation, the baseline has one entry per backend, device and configuration;
+// a run slower than its baseline by more than the threshold fails
+class Validation {
+private:
+    std::string baseline_path;
+    double regression; // largest slowdown as a fraction of the baseline time
+    std::map<std::string, double> baseline; // milliseconds per step
+    bool baseline_changed;
+    
+protected:
+    const char* owner; // at the start of the messages
+    int failures;
+    
+    Validation(const char* o, const std::string& b_path, double reg);
+    
+    void readBaseline();
+    void writeBaseline() const;
+    void checkTime(const std::string& key, double ms_per_step);
+    bool finish(); // writes the new entries of the baseline and reports the result
+    
+    static std::vector<cl::Device> allDevices();
+    static std::string deviceName(const cl::Device& device);
+    
+public:
+    virtual ~Validation() {}
+    
+    virtual bool run() = 0;
+};
+
+// runs every configuration of the cloth through each backend and compares the states with a spring network integrated on the host
+// in double precision: ClothStrips and ClothTiles on every OpenCL device, Cloth with each state storage, the Verlet integrator, the
+// extended stencil and the adaptive step, and ClothMesh on the device of the OpenGL context, which has to be current; the energy
+// has to agree with the reference and must not grow
+template<typename T>
+class ClothValidation : public Validation {
+private:
+    struct Configuration {
+        int size, steps;
+    };
+    
+    // the structural stiffness of the extended stencil gives up what its shear and bend springs add, the stable step stays the same
+    struct Variant {
+        const char* name;
+        StateStorage storage;
+        ClothIntegrator integrator;
+        bool stencil, adaptive;
+    };
+    
+    struct Spring {
+        int i, j;
+        double rest, stiffness, damping;
+        bool structural; // a spring between direct neighbours of the lattice, the adaptive step limits their strain
+    };
+    
+    struct Network {
+        std::vector<double> pos; // at rest
+        std::vector<unsigned char> pinned;
+        std::vector<Spring> springs;
+    };
+    
+    struct State {
+        std::vector<double> pos, vel;
+        double dt; // step of the next drift
+    };
+    
+    struct Energy {
+        double kinetic, potential;
+        
+        inline double total() const { return kinetic + potential; }
+        inline double scale() const { return kinetic + std::abs(potential); }
+    };
+    
+    const char* kernel_path;
+    const char* vs_path;
+    const char* gs_path;
+    const char* fs_path;
+    double tolerance; // largest position error as a fraction of the rest length
+    double energy_tolerance; // largest energy error as a fraction of the kinetic and potential energies
+    
+    float length, mass, stiffness, damping;
+    float shear_stiffness, bend_stiffness;
+    float time_step;
+    
+    std::vector<Configuration> configurations;
+    
+    Network lattice(int size, const Variant& variant) const;
+    Network mesh(const TriangleMesh& triangles) const;
+    double maxStep() const;
+    double nextStep(const Network& net, const State& state, double dt_max) const;
+    void acceleration(const Network& net, const State& state, bool drag, std::vector<double>& acc) const;
+    State runReference(const Network& net, const Variant& variant, int steps) const;
+    Energy energy(const Network& net, const State& state, bool drag, double lead) const;
+    double storageSpacing(StateStorage storage, int size) const;
+    
+    void check(const std::string& key, const Network& net, const Variant& variant, const State& reference, const std::vector<float>& pos, const std::vector<float>& vel, double spacing, double ms_per_step);
+    
+public:
+    ClothValidation(float l, float m, float k, float b, float dt, const char* k_path, const char* v_path, const char* g_path, const char* f_path, const std::string& b_path, double tol = 1e-2, double energy_tol = 1e-2, double reg = 0.1);
+    
+    void setStencil(float shear, float bend);
+    void addConfiguration(int size, int steps);
+    virtual bool run();
+};
+
+// runs every configuration of the n-body simulation through each backend and compares the bodies with a particle-mesh integrator
+// on the host in double precision, with its own transforms and solvers: NBody with the FFT solver in each state storage, with the
+// P3M correction and with the multigrid solver on the device of the OpenGL context, and NBodySlab as a single rank on every OpenCL
+// device; the reference starts from the bodies generated by the backend, and the momentum has to agree with it
+template<typename T>
+class NBodyValidation : public Validation {
+private:
+    struct Configuration {
+        int grid, bodies, steps;
+    };
+    
+    struct Variant {
+        const char* name;
+        NBodySolver solver;
+        StateStorage storage;
+        bool short_range;
+    };
+    
+    struct State {
+        std::vector<double> pos, vel;
+    };
+    
+    const char* kernel_path;
+    const char* vs_path;
+    const char* fs_path;
+    double tolerance; // largest position error in grid cells
+    double momentum_tolerance; // largest momentum error as a fraction of the sum of the momenta of the bodies
+    
+    float time_step;
+    float r_split; // of the P3M variant
+    
+    std::vector<Configuration> configurations;
+    
+    void transform(std::vector<std::complex<double>>& grid, int n, double sign) const;
+    void solvePeriodic(const std::vector<double>& dens, int n, double rs, std::vector<double>& pot) const;
+    void solveIsolated(const std::vector<double>& dens, int n, double total_mass, std::vector<double>& pot) const;
+    void acceleration(const State& state, int n, const Variant& variant, double mass, std::vector<double>& acc) const;
+    State runReference(State state, int n, const Variant& variant, double mass, int steps) const;
+    double storageSpacing(StateStorage storage, int n) const;
+    
+    void check(const std::string& key, int n, const Variant& variant, const State& reference, const std::vector<float>& pos, const std::vector<float>& vel, double mass, double ms_per_step);
+    
+public:
+    NBodyValidation(float dt, float rs, const char* k_path, const char* v_path, const char* f_path, const std::string& b_path, double tol = 1e-3, double momentum_tol = 1e-2, double reg = 0.1);
+    
+    void addConfiguration(int grid, int bodies, int steps);
+    virtual bool run();
+};
+
+#endif /* validation_h */
@@ -0,0 +1,61 @@
+//
+//  vertexsim.h
+//  Vertex Simulations
+//
+//  Created by Antoni Wójcik on 11/06/2020.
+//  Copyright © 2020 Antoni Wójcik. All rights reserved.
+//
+
+#ifndef vertexsim_h
+#define vertexsim_h
+
+#include <stddef.h>
+
+// C interface of the simulations for driving them from other languages in the same process, see src/python/vertexsimmodule.cpp;
+// every call has to be made on the thread that called vsInitialise, the OpenCL errors still end the process as in the rest of
+// the program
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct VSSimulation VSSimulation;
+
+enum VSStatus {
+    VS_OK = 0,
+    VS_ERROR_ARGUMENT = -1, // null simulation, unknown field or parameter
+    VS_ERROR_MAPPED = -2, // the state is mapped, unmap every view before stepping
+    VS_ERROR_UNSUPPORTED = -3 // the field has no host view in the chosen storage or integrator
+};
+
+enum VSField {
+    VS_POSITIONS = 0,
+    VS_VELOCITIES = 1
+};
+
+// creates a hidden window for the OpenGL context shared with OpenCL, root is the directory holding src/kernels and src/shaders
+int vsInitialise(const char* root);
+void vsTerminate(void);
+
+// the arguments follow the constructors of Cloth and NBody, storage, integrator, initial and solver take the values of the
+// C++ enums; double_precision selects the scalar type of the simulation; the Verlet cloth only takes the float storage
+VSSimulation* vsCreateCloth(int size_x, int size_y, float length, float mass, float stiffness, float damping, float time_step, int storage, int integrator, int double_precision);
+VSSimulation* vsCreateNBody(int grid_num, int body_num, float body_mass, float time_step, int initial, int solver, int storage, int double_precision);
+void vsDestroy(VSSimulation* sim);
+
+// waits for the kernels on the first call, returns once the steps have finished on the device
+int vsStep(VSSimulation* sim, int steps);
+// cloth: "stiffness", "damping", "shear_stiffness", "bend_stiffness" (leapfrog only); n-body: "time_step"
+int vsSetParameter(VSSimulation* sim, const char* name, float value);
+
+// maps the state buffer into the host memory, count vertices of 3 components of item_size bytes (2 for the half storage, 4 for
+// float, 8 for double); the view is the buffer itself on a device sharing the host memory, on a discrete GPU the OpenCL runtime
+// copies the state when it is mapped and back when it is unmapped; the view can be written and stays valid until vsUnmapState
+int vsMapState(VSSimulation* sim, int field, void** data, size_t* count, size_t* item_size);
+int vsUnmapState(VSSimulation* sim, void* data);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* vertexsim_h */
@@ -11,12 +11,87 @@
 #define SCR_HEIGHT 800
 
 #define MIN_FRAME_TIME 0.003f
-#define MAX_FRAME_COUNT 6
+#define MAX_FRAME_COUNT 6 // most steps per frame, the rest of the lag is dropped
+#define TIME_SCALE 10.0f // simulated seconds per second, as the fixed-step loop that took a 0.03 s step every MIN_FRAME_TIME
+#define ADAPTIVE_STEP // the cloth chooses its step from the largest speed and strain
 #define FPS_STEPS 5
+#define DIAGNOSTICS_STEPS 1000
+#define PLACEHOLDER_PULSE 4.0f // angular frequency of the background pulse while the kernels are built
+
+//#define BLOCKING_STARTUP // wait for the kernels before the first frame, to compare the time-to-first-frame
+
+//#define RECORD // capture every frame of the run, each frame advances the simulation by 1/RECORD_FPS s
+//#define RECORD_OFFSCREEN // hidden window, the run stops after RECORD_FRAMES frames
+#define RECORD_FORMAT CAPTURE_Y4M
+#define RECORD_PATH "screenshots/run"
+#define RECORD_FPS 60
+#define RECORD_FRAMES 600
+
+//#define INPUT_RECORD // log the input and the frame times to INPUT_PATH
+//#define INPUT_REPLAY // feed INPUT_PATH back with its frame times as the clock, then print the frame time and the steps per frame
+#define INPUT_PATH "input.txt"
+
+// scalar type of the simulation, float or double (needs cl_khr_fp64)
+#define REAL float
+
+//#define BENCHMARK_STORAGE
+//#define BENCHMARK_PRECISION
+//#define BENCHMARK_VERLET // the Verlet integrator against the leapfrog, with the damping and without it
+//#define BENCHMARK_STENCIL // the 12 springs of the extended stencil against the 4 direct springs
+#define STENCIL_SHEAR_STIFFNESS 150.0f // the structural stiffness of the extended cloth is the rest of 500, the stable step stays the same
+#define STENCIL_BEND_STIFFNESS 50.0f
+#define STORAGE_STEPS 100000
+
+//#define BENCHMARK_STRIPS
+#define STRIPS_SIZE 8192
+#define STRIPS_DEVICES 0 // CPU sub-devices the cloth is split between, 0 for one per NUMA node
+#define STRIPS_STEPS 100
+
+//#define BENCHMARK_SLABS
+#define SLAB_GRID 256
+#define SLAB_BODIES 1000000 // bodies of the strong scaling, bodies per rank of the weak scaling
+#define SLAB_RANKS 8 // the ranks double from 1 up to this
+#define SLAB_STEPS 10
+
+//#define BENCHMARK_TILES
+#define TILES_CORE_SIZE 2048 // held on the device for the in-core rate
+#define TILES_LARGE_SIZE 32768 // larger than the device memory
+#define TILES_STATE_PATH "cloth_state.bin" // the host state of the large cloth is mapped from this file
+#define TILES_STEPS 10
+
+//#define BENCHMARK_SPLATTING
+#define SPLAT_GRID 64
+#define SPLAT_RADIUS 0.1f // grid units
+#define SPLAT_FRAMES 100
+
+//#define BENCHMARK_REFINEMENT
+#define REFINE_GRID 32
+#define REFINE_LEVELS 3 // compared with the uniform mesh of REFINE_GRID << REFINE_LEVELS cells
+#define REFINE_BODIES 100000
+#define REFINE_THRESHOLD 8.0f // cell mass in units of the mean mass of a base cell
+#define REFINE_EVERY 10
+#define REFINE_PATCHES 1024
+#define REFINE_REPEATS 10
+
+//#define BENCHMARK_MESH
+#define MESH_PATH "models/garment.obj" // hung from its highest vertices, the lattice of MESH_GRID_SIZE is used if it cannot be read
+#define MESH_GRID_SIZE 1024
+#define MESH_STEPS 1000
+
+//#define BATCH_SERVER // serve the headless jobs sent to BATCH_SOCKET instead of drawing, until a client sends SHUTDOWN
+//#define BENCHMARK_BATCH
+#define BATCH_SOCKET "/tmp/vertex_batch.sock"
+#define BATCH_OUTPUT "batch"
+#define BATCH_CPU_PARTS 0 // CPU sub-devices with a worker each, 0 for one per NUMA node, -1 for the GPUs only
+#define BATCH_QUEUE 1024 // queued jobs before the clients are told to retry
+#define BATCH_JOBS 64
 
 
 #include <iostream>
 #include <fstream>
+#include <cmath>
+#include <vector>
+#include <chrono>
 
 // include the OpenGL libraries
 #include <GL/glew.h>
@@ -24,7 +99,15 @@
 
 #include "shader.h"
 #include "cloth.h"
+#include "clothstrips.h"
+#include "clothtiles.h"
+#include "clothmesh.h"
+#include "nbody.h"
+#include "nbodyslab.h"
+#include "batchserver.h"
 #include "camera.h"
+#include "capture.h"
+#include "inputrecord.h"
 
 
 // function declarations
@@ -36,6 +119,22 @@ void scrollCallback(GLFWwindow*, double, double);
 void processInput(GLFWwindow*, float);
 void takeScreenshot(const std::string& name = "screenshot", bool show_image = false);
 void countFPS(float);
+void printDiagnostics(const DiagnosticsRecord&);
+void drawPlaceholder(float);
+void measureStartup(bool);
+void benchmarkStorage();
+void benchmarkPrecision();
+void benchmarkVerlet();
+void benchmarkStencil();
+void benchmarkStrips();
+void benchmarkSlabs();
+void benchmarkTiles();
+void benchmarkSplatting();
+void benchmarkRefinement();
+void benchmarkMesh();
+void runBatchServer();
+void benchmarkBatch();
+void printDrift(const std::vector<float>&, const std::vector<float>&, const char*);
 
 #ifdef RETINA
 // dimensions of the viewport (they have to be multiplied by 2 at the retina displays)
@@ -55,12 +154,89 @@ bool mouse_hidden = true;
 // camera pointer
 Camera* camera;
 
+// every key and event of the main loop is read through it
+InputRecorder* input;
+
+// start of the program, for the time-to-first-frame
+std::chrono::high_resolution_clock::time_point start_time;
+
 int main(int argc, const char * argv[]) {
+    start_time = std::chrono::high_resolution_clock::now();
+
+#ifdef BENCHMARK_SLABS
+    // the ranks are forked, before the process has any OpenGL or OpenCL state
+    benchmarkSlabs();
+#endif
+#ifdef BENCHMARK_BATCH
+    // the processes of the baseline are forked as well
+    benchmarkBatch();
+#endif
+#ifdef BATCH_SERVER
+    runBatchServer();
+    return 0;
+#endif
+    
     GLFWwindow* window = initialiseOpenGL();
     
     camera = new Camera(60.0f, (float)scr_width / (float)scr_height, glm::vec3(-3.5f), 45.0f, 45.0f);
+
+#ifdef BENCHMARK_STORAGE
+    benchmarkStorage();
+#endif
+#ifdef BENCHMARK_PRECISION
+    benchmarkPrecision();
+#endif
+#ifdef BENCHMARK_VERLET
+    benchmarkVerlet();
+#endif
+#ifdef BENCHMARK_STENCIL
+    benchmarkStencil();
+#endif
+#ifdef BENCHMARK_STRIPS
+    benchmarkStrips();
+#endif
+#ifdef BENCHMARK_TILES
+    benchmarkTiles();
+#endif
+#ifdef BENCHMARK_SPLATTING
+    benchmarkSplatting();
+#endif
+#ifdef BENCHMARK_REFINEMENT
+    benchmarkRefinement();
+#endif
+#ifdef BENCHMARK_MESH
+    benchmarkMesh();
+#endif
+    
+    Cloth<REAL>* cloth = new Cloth<REAL>(500, 500, 0.01f, 1.0f, 500.0f, 0.2f, glm::vec3(0.0f), 0.03f, "src/shaders/cloth.vs", "src/shaders/cloth.gs", "src/shaders/cloth.fs", "src/kernels/kernel_cloth.ocl");
+    cloth->enableDiagnostics("src/kernels/kernel_diagnostics.ocl", DIAGNOSTICS_STEPS, printDiagnostics);
+#ifdef BLOCKING_STARTUP
+    cloth->wait();
+#endif
+#ifdef ADAPTIVE_STEP
+    cloth->setAdaptive(true);
+#endif
+    
+#if defined(INPUT_RECORD) || defined(INPUT_REPLAY)
+    // the recording starts with the simulation, so that the frames of the replay take the same steps
+    
+    cloth->wait();
+#endif
+#if defined(INPUT_RECORD)
+    input = new InputRecorder(window, INPUT_RECORD, INPUT_PATH, mouseCallback, scrollCallback, mouseButtonCallback);
+#elif defined(INPUT_REPLAY)
+    input = new InputRecorder(window, INPUT_REPLAY, INPUT_PATH, mouseCallback, scrollCallback, mouseButtonCallback);
+#else
+    input = new InputRecorder(window, INPUT_LIVE, "", mouseCallback, scrollCallback, mouseButtonCallback);
+#endif
     
-    KernelGL* cloth = new Cloth(500, 500, 0.01f, 1.0f, 500.0f, 0.2f, glm::vec3(0.0f), 0.03f, "src/shaders/cloth.vs", "src/shaders/cloth.gs", "src/shaders/cloth.fs", "src/kernels/kernel_cloth.ocl");
+#ifdef RECORD
+#ifdef RECORD_OFFSCREEN
+    FrameCapture* capture = new FrameCapture(scr_width, scr_height, RECORD_FORMAT, RECORD_PATH, RECORD_FPS, false);
+#else
+    FrameCapture* capture = new FrameCapture(scr_width, scr_height, RECORD_FORMAT, RECORD_PATH, RECORD_FPS);
+#endif
+#endif
     
     //glPolygonMode(GL_FRONT_AND_BACK, GL_POINT);
     glEnable(GL_DEPTH_TEST);
@@ -73,6 +249,20 @@ int main(int argc, const char * argv[]) {
         float current_time = glfwGetTime();
         delta_time = current_time - last_frame_time;
         last_frame_time = current_time;
+        
+        // the kernels are built in the background, draw the placeholder until the simulation is ready
+        
+        bool ready = cloth->ready();
+        
+#ifdef RECORD
+        // the recording starts with the simulation
+        
+        if(ready) {
+            delta_time = 1.0f / RECORD_FPS;
+            capture->begin();
+        }
+#endif
+        delta_time = input->beginFrame(delta_time); // the recorded frame time in the replay
         lag += delta_time;
         
         glClearColor(0.7f, 0.8f, 1.0f, 1.0f);
@@ -80,24 +270,45 @@ int main(int argc, const char * argv[]) {
         
         processInput(window, delta_time);
         
-        cloth->draw(camera);
+        if(ready) cloth->draw(camera);
+        else drawPlaceholder(current_time);
         
-        if(run) {
-            if(lag >= MIN_FRAME_TIME) {
-                int steps = (int)(lag / MIN_FRAME_TIME);
-                lag -= steps * MIN_FRAME_TIME;
-                if(steps > MAX_FRAME_COUNT) steps = MAX_FRAME_COUNT;
-                cloth->iterate(steps);
-            }
+        if(run && ready) {
+            // the loop is driven by the simulated time, the cloth can overshoot by a part of a step which is carried in the lag; the
+            // drawing is flushed so that the shared buffer is read before the kernels write to it, without waiting for the GPU
+            
+            glFlush();
+            lag -= cloth->advance(lag * TIME_SCALE, MAX_FRAME_COUNT) / TIME_SCALE;
+            if(lag > MIN_FRAME_TIME * MAX_FRAME_COUNT) lag = 0.0f;
+            cloth->pollDiagnostics();
         } else {
             lag = 0.0f;
         }
         
+#ifdef RECORD
+        if(ready) capture->end(scr_width, scr_height);
+#ifdef RECORD_OFFSCREEN
+        if(capture->getFrameCount() >= RECORD_FRAMES) glfwSetWindowShouldClose(window, true);
+#endif
+#endif
+        
+        // nothing waits for the GPU here, so the readback of the capture overlaps the next frames and the frame times of the input
+        // recorder are the times of the loop, paced by the swap
+        
         glfwSwapBuffers(window);
-        glfwPollEvents();
-        glFinish();
+        input->pollEvents();
+        
+        input->endFrame(cloth->getStepsTaken());
+        measureStartup(ready);
     }
     
+    if(input->getMode() != INPUT_LIVE) input->printStats();
+    delete input;
+    
+#ifdef RECORD
+    delete capture;
+#endif
+    cloth->printStepStats();
     delete cloth;
     delete camera;
     
@@ -105,6 +316,218 @@ int main(int argc, const char * argv[]) {
     return 0;
 }
 
+void benchmarkStorage() {
+    // runs the cloth with each of the state storages and measures how far it drifts from the float storage
+    
+    std::vector<float> reference, positions;
+    for(int s = STORAGE_FLOAT; s <= STORAGE_FIXED; s++) {
+        Cloth<REAL>* cloth = new Cloth<REAL>(500, 500, 0.01f, 1.0f, 500.0f, 0.2f, glm::vec3(0.0f), 0.03f, "src/shaders/cloth.vs", "src/shaders/cloth.gs", "src/shaders/cloth.fs", "src/kernels/kernel_cloth.ocl", (StateStorage)s);
+        cloth->benchmarkIterate(STORAGE_STEPS);
+        cloth->readPositions(s == STORAGE_FLOAT ? reference : positions);
+        delete cloth;
+        
+        if(s != STORAGE_FLOAT) printDrift(reference, positions, "FULL PRECISION STORAGE");
+    }
+}
+        
+void benchmarkPrecision() {
+    // runs the cloth in double and in float precision and measures how far the float one drifts
+    
+    std::vector<float> reference, positions;
+    
+    Cloth<double>* cloth_double = new Cloth<double>(500, 500, 0.01f, 1.0f, 500.0f, 0.2f, glm::vec3(0.0f), 0.03f, "src/shaders/cloth.vs", "src/shaders/cloth.gs", "src/shaders/cloth.fs", "src/kernels/kernel_cloth.ocl");
+    cloth_double->benchmarkIterate(STORAGE_STEPS);
+    cloth_double->readPositions(reference);
+    delete cloth_double;
+    
+    Cloth<float>* cloth_float = new Cloth<float>(500, 500, 0.01f, 1.0f, 500.0f, 0.2f, glm::vec3(0.0f), 0.03f, "src/shaders/cloth.vs", "src/shaders/cloth.gs", "src/shaders/cloth.fs", "src/kernels/kernel_cloth.ocl");
+    cloth_float->benchmarkIterate(STORAGE_STEPS);
+    cloth_float->readPositions(positions);
+    delete cloth_float;
+    
+    printDrift(reference, positions, "DOUBLE PRECISION");
+}
+
+void benchmarkVerlet() {
+    // the Verlet drag acts on the own velocity of a vertex and the leapfrog damping on the relative velocities of the neighbours,
+    // so the undamped runs show the difference of the integrators alone
+    
+    float dampings[] = {0.2f, 0.0f};
+    for(int d = 0; d < 2; d++) {
+        std::vector<float> reference, positions;
+        
+        Cloth<REAL>* leapfrog = new Cloth<REAL>(500, 500, 0.01f, 1.0f, 500.0f, dampings[d], glm::vec3(0.0f), 0.03f, "src/shaders/cloth.vs", "src/shaders/cloth.gs", "src/shaders/cloth.fs", "src/kernels/kernel_cloth.ocl");
+        leapfrog->benchmarkIterate(STORAGE_STEPS);
+        leapfrog->readPositions(reference);
+        delete leapfrog;
+        
+        Cloth<REAL>* verlet = new Cloth<REAL>(500, 500, 0.01f, 1.0f, 500.0f, dampings[d], glm::vec3(0.0f), 0.03f, "src/shaders/cloth.vs", "src/shaders/cloth.gs", "src/shaders/cloth.fs", "src/kernels/kernel_cloth.ocl", STORAGE_FLOAT, INTEGRATOR_VERLET);
+        verlet->benchmarkIterate(STORAGE_STEPS);
+        verlet->readPositions(positions);
+        delete verlet;
+        
+        printDrift(reference, positions, dampings[d] > 0.0f ? "DAMPED LEAPFROG" : "UNDAMPED LEAPFROG");
+    }
+}
+
+void benchmarkStencil() {
+    // both cloths have the same total stiffness, the extended one shares it between the three types of springs
+    
+    Cloth<REAL>* direct = new Cloth<REAL>(500, 500, 0.01f, 1.0f, 500.0f, 0.2f, glm::vec3(0.0f), 0.03f, "src/shaders/cloth.vs", "src/shaders/cloth.gs", "src/shaders/cloth.fs", "src/kernels/kernel_cloth.ocl");
+    double direct_time = direct->benchmarkIterate(STORAGE_STEPS);
+    delete direct;
+    
+    Cloth<REAL>* extended = new Cloth<REAL>(500, 500, 0.01f, 1.0f, 500.0f - STENCIL_SHEAR_STIFFNESS - STENCIL_BEND_STIFFNESS, 0.2f, glm::vec3(0.0f), 0.03f, "src/shaders/cloth.vs", "src/shaders/cloth.gs", "src/shaders/cloth.fs", "src/kernels/kernel_cloth.ocl");
+    extended->setSpringStiffness(STENCIL_SHEAR_STIFFNESS, STENCIL_BEND_STIFFNESS);
+    double extended_time = extended->benchmarkIterate(STORAGE_STEPS);
+    delete extended;
+    
+    std::cout << "BENCHMARK: STENCIL: 12 SPRINGS TAKE " << extended_time / direct_time << " TIMES THE TIME OF 4 SPRINGS" << std::endl;
+}
+
+void benchmarkStrips() {
+    // the large cloth split into row strips, from one sub-device of the CPU to all of them
+    
+    std::vector<cl::Device> devices = ClothStrips<REAL>::partitionCPU(STRIPS_DEVICES);
+    ClothStrips<REAL>::benchmarkScaling(STRIPS_SIZE, STRIPS_SIZE, 0.01f, 1.0f, 500.0f, 0.2f, 0.03f, devices, "src/kernels/kernel_cloth.ocl", STRIPS_STEPS);
+}
+
+void benchmarkTiles() {
+    // the cloth streamed through the first GPU in tiles, compared with the cloth held on it
+    
+    std::vector<cl::Platform> platforms;
+    std::vector<cl::Device> devices;
+    cl::Platform::get(&platforms);
+    for(cl::Platform& platform : platforms) {
+        try {
+            platform.getDevices(CL_DEVICE_TYPE_GPU, &devices);
+        } catch(cl::Error e) {
+            devices.clear();
+        }
+        if(devices.size() > 0) break;
+    }
+    if(devices.size() == 0) {
+        std::cerr << "ERROR: benchmarkTiles: NO GPU DEVICES FOUND" << std::endl;
+        return;
+    }
+    
+    ClothTiles<REAL>::benchmarkOutOfCore(TILES_CORE_SIZE, TILES_LARGE_SIZE, 0.01f, 1.0f, 500.0f, 0.2f, 0.03f, devices[0], "src/kernels/kernel_cloth.ocl", TILES_STATE_PATH, TILES_STEPS);
+}
+
+void benchmarkSplatting() {
+    // the frame time of the points and of the splats at growing body counts, with the whole cluster in view and from inside it
+    
+    glm::vec3 centre(SPLAT_GRID * 0.5f);
+    Camera outside(60.0f, (float)scr_width / (float)scr_height, centre - glm::vec3(1.5f * SPLAT_GRID), 45.0f, 45.0f);
+    Camera inside(60.0f, (float)scr_width / (float)scr_height, centre - glm::vec3(0.05f * SPLAT_GRID), 45.0f, 45.0f);
+    
+    for(int n = 100000; n <= 10000000; n *= 10) {
+        NBody<REAL>* nbody = new NBody<REAL>(SPLAT_GRID, n, 1.0f / n, 0.01f, "src/shaders/nbody.vs", "src/shaders/nbody.fs", "src/kernels/kernel_nbody_fft.ocl", INITIAL_PLUMMER);
+        nbody->benchmarkDraw(&outside, SPLAT_FRAMES);
+        nbody->enableSplatting(SPLAT_RADIUS, "src/shaders/splat.vs", "src/shaders/splat.fs", "src/shaders/tonemap.vs", "src/shaders/tonemap.fs");
+        nbody->benchmarkDraw(&outside, SPLAT_FRAMES);
+        nbody->benchmarkDraw(&inside, SPLAT_FRAMES);
+        delete nbody;
+    }
+}
+
+void benchmarkRefinement() {
+    // the force error and the device memory of an isolated Plummer cluster on a coarse mesh with refinement patches and on the
+    // uniform mesh of the finest spacing, each against its own direct summation
+    
+    NBody<REAL>* refined = new NBody<REAL>(REFINE_GRID, REFINE_BODIES, 1.0f / REFINE_BODIES, 0.01f, "src/shaders/nbody.vs", "src/shaders/nbody.fs", "src/kernels/kernel_nbody_fft.ocl", INITIAL_PLUMMER, SOLVER_MULTIGRID);
+    refined->setRefinement(REFINE_LEVELS, REFINE_THRESHOLD, REFINE_EVERY, REFINE_PATCHES);
+    refined->benchmarkForces(REFINE_REPEATS);
+    refined->printRefinementStats();
+    delete refined;
+    
+    NBody<REAL>* uniform = new NBody<REAL>(REFINE_GRID << REFINE_LEVELS, REFINE_BODIES, 1.0f / REFINE_BODIES, 0.01f, "src/shaders/nbody.vs", "src/shaders/nbody.fs", "src/kernels/kernel_nbody_fft.ocl", INITIAL_PLUMMER, SOLVER_MULTIGRID);
+    uniform->benchmarkForces(REFINE_REPEATS);
+    uniform->printRefinementStats();
+    delete uniform;
+}
+
+void benchmarkMesh() {
+    // the throughput of the mesh cloth in the order of the file and in the reordered ones, with the properties of the drawn cloth
+    
+    TriangleMesh mesh;
+    if(TriangleMesh::loadOBJ(MESH_PATH, mesh)) mesh.pinTop(0.01f);
+    else mesh = TriangleMesh::grid(MESH_GRID_SIZE, MESH_GRID_SIZE, 0.01f);
+    
+    for(int o = ORDER_FILE; o <= ORDER_MORTON; o++) {
+        TriangleMesh reordered = mesh;
+        reordered.reorder((MeshOrder)o);
+        ClothMesh<REAL>* cloth = new ClothMesh<REAL>(reordered, 1.0f, 500.0f, 0.2f, glm::vec3(0.0f), 0.03f, "src/shaders/cloth.vs", "src/shaders/cloth.gs", "src/shaders/cloth.fs", "src/kernels/kernel_cloth.ocl");
+        cloth->benchmarkIterate(MESH_STEPS);
+        delete cloth;
+    }
+}
+
+void runBatchServer() {
+    BatchServer server(BatchServer::findDevices(BATCH_CPU_PARTS), "src/kernels/kernel_cloth.ocl", "src/kernels/kernel_nbody_fft.ocl", BATCH_OUTPUT, BATCH_QUEUE);
+    server.serve(BATCH_SOCKET);
+}
+
+void benchmarkBatch() {
+    // a night of small sweeps: cloths of a few stiffnesses and periodic bodies, the higher priority for every fourth job
+    
+    std::vector<std::string> specs;
+    for(int i = 0; i < BATCH_JOBS; i++) {
+        std::string priority = " priority=" + std::to_string(i % 4 == 0 ? 1 : 0);
+        if(i % 2 == 0) specs.push_back("type=cloth size=256 steps=1000 stiffness=" + std::to_string(250 + 50 * (i % 8)) + priority);
+        else specs.push_back("type=nbody size=32 bodies=20000 steps=10" + priority);
+    }
+    BatchServer::benchmarkThroughput(specs, BATCH_CPU_PARTS, "src/kernels/kernel_cloth.ocl", "src/kernels/kernel_nbody_fft.ocl", BATCH_OUTPUT);
+}
+
+void benchmarkSlabs() {
+    // the periodic particle-mesh bodies split into slabs between processes on this machine
+    
+    NBodySlab<REAL>::benchmarkScaling(SLAB_GRID, SLAB_BODIES, 0.01f, SLAB_RANKS, "src/kernels/kernel_nbody_fft.ocl", SLAB_STEPS);
+}
+
+void printDrift(const std::vector<float>& reference, const std::vector<float>& positions, const char* name) {
+        double error = 0.0, max_error = 0.0;
+        for(size_t i = 0; i < reference.size(); i += 3) {
+            double dx = positions[i] - reference[i], dy = positions[i + 1] - reference[i + 1], dz = positions[i + 2] - reference[i + 2];
+            double d2 = dx * dx + dy * dy + dz * dz;
+            error += d2;
+            if(d2 > max_error) max_error = d2;
+        }
+    std::cout << "BENCHMARK: Cloth: DRIFT FROM THE " << name << " AFTER " << STORAGE_STEPS << " STEPS: RMS " << std::sqrt(error * 3.0 / reference.size()) << ", MAX " << std::sqrt(max_error) << std::endl;
+}
+
+void printDiagnostics(const DiagnosticsRecord& record) {
+    std::cout << "step " << record.step << ": E = " << record.kinetic + record.potential << " (KE = " << record.kinetic << ", PE = " << record.potential << "), p = (" << record.momentum.x << ", " << record.momentum.y << ", " << record.momentum.z << ")" << std::endl;
+}
+
+void drawPlaceholder(float time) {
+    // pulse the background so that the window does not look frozen while the simulation is being built
+    
+    float pulse = 0.05f * (1.0f + std::sin(time * PLACEHOLDER_PULSE));
+    glClearColor(0.7f - pulse, 0.8f - pulse, 1.0f - pulse, 1.0f);
+    glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+}
+
+void measureStartup(bool ready) {
+    // the time from the start of the program to the first frame and to the first frame of the simulation
+    
+    static bool first_frame = true;
+    static bool first_simulation_frame = true;
+    
+    // the frame counts once it is finished on the GPU, only these frames wait for it
+    
+    if(!first_frame && !(ready && first_simulation_frame)) return;
+    glFinish();
+    
+    double ms = std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - start_time).count() * 1000.0;
+    if(first_frame) std::cout << "BENCHMARK: TIME TO FIRST FRAME: " << ms << " ms" << std::endl;
+    if(ready && first_simulation_frame) std::cout << "BENCHMARK: TIME TO FIRST SIMULATION FRAME: " << ms << " ms" << std::endl;
+    
+    first_frame = false;
+    if(ready) first_simulation_frame = false;
+}
+
 void framebufferSizeCallback(GLFWwindow* window, int width, int height) {
     glViewport(0, 0, width, height);
     scr_width = width;
@@ -114,33 +537,33 @@ void framebufferSizeCallback(GLFWwindow* window, int width, int height) {
 }
 
 void processInput(GLFWwindow* window, float delta_time) {
-    if(glfwGetKey(window, GLFW_KEY_ESCAPE) == GLFW_PRESS) glfwSetWindowShouldClose(window, true);
+    if(input->getKey(GLFW_KEY_ESCAPE) == GLFW_PRESS) glfwSetWindowShouldClose(window, true);
     
-    if(glfwGetKey(window, GLFW_KEY_ESCAPE) == GLFW_PRESS) glfwSetWindowShouldClose(window, true);
-    if(glfwGetKey(window, GLFW_KEY_W) == GLFW_PRESS) camera->move(FORWARD, delta_time);
-    if(glfwGetKey(window, GLFW_KEY_S) == GLFW_PRESS) camera->move(BACK, delta_time);
-    if(glfwGetKey(window, GLFW_KEY_A) == GLFW_PRESS) camera->move(LEFT, delta_time);
-    if(glfwGetKey(window, GLFW_KEY_D) == GLFW_PRESS) camera->move(RIGHT, delta_time);
+    if(input->getKey(GLFW_KEY_ESCAPE) == GLFW_PRESS) glfwSetWindowShouldClose(window, true);
+    if(input->getKey(GLFW_KEY_W) == GLFW_PRESS) camera->move(FORWARD, delta_time);
+    if(input->getKey(GLFW_KEY_S) == GLFW_PRESS) camera->move(BACK, delta_time);
+    if(input->getKey(GLFW_KEY_A) == GLFW_PRESS) camera->move(LEFT, delta_time);
+    if(input->getKey(GLFW_KEY_D) == GLFW_PRESS) camera->move(RIGHT, delta_time);
     
-    if(glfwGetKey(window, GLFW_KEY_LEFT_SHIFT) == GLFW_PRESS) camera->setFasterSpeed(true);
-    else if(glfwGetKey(window, GLFW_KEY_LEFT_SHIFT) == GLFW_RELEASE) camera->setFasterSpeed(false);
-    if(glfwGetKey(window, GLFW_KEY_LEFT_CONTROL) == GLFW_PRESS) camera->setSlowerSpeed(true);
-    else if(glfwGetKey(window, GLFW_KEY_LEFT_CONTROL) == GLFW_RELEASE && glfwGetKey(window, GLFW_KEY_LEFT_SHIFT) == GLFW_RELEASE) camera->setSlowerSpeed(false);
+    if(input->getKey(GLFW_KEY_LEFT_SHIFT) == GLFW_PRESS) camera->setFasterSpeed(true);
+    else if(input->getKey(GLFW_KEY_LEFT_SHIFT) == GLFW_RELEASE) camera->setFasterSpeed(false);
+    if(input->getKey(GLFW_KEY_LEFT_CONTROL) == GLFW_PRESS) camera->setSlowerSpeed(true);
+    else if(input->getKey(GLFW_KEY_LEFT_CONTROL) == GLFW_RELEASE && input->getKey(GLFW_KEY_LEFT_SHIFT) == GLFW_RELEASE) camera->setSlowerSpeed(false);
     
     static bool taking_screenshot = false;
     
-    if(glfwGetKey(window, GLFW_KEY_ENTER) == GLFW_PRESS) {
+    if(input->getKey(GLFW_KEY_ENTER) == GLFW_PRESS) {
         if(!taking_screenshot) takeScreenshot();
         taking_screenshot = true;
-    } else if(glfwGetKey(window, GLFW_KEY_ENTER) == GLFW_RELEASE)
+    } else if(input->getKey(GLFW_KEY_ENTER) == GLFW_RELEASE)
         taking_screenshot = false;
     
     static bool stopping = false;
     
-    if(glfwGetKey(window, GLFW_KEY_SPACE) == GLFW_PRESS) {
+    if(input->getKey(GLFW_KEY_SPACE) == GLFW_PRESS) {
         if(!stopping) run = !run;
         stopping = true;
-    } else if(glfwGetKey(window, GLFW_KEY_SPACE) == GLFW_RELEASE)
+    } else if(input->getKey(GLFW_KEY_SPACE) == GLFW_RELEASE)
         stopping = false;
 }
 
@@ -199,6 +622,9 @@ GLFWwindow* initialiseOpenGL() {
     glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
     glfwWindowHint(GLFW_OPENGL_FORWARD_COMPAT, GL_TRUE);
     glfwWindowHint(GLFW_SAMPLES, 0);
+#ifdef RECORD_OFFSCREEN
+    glfwWindowHint(GLFW_VISIBLE, GLFW_FALSE); // the frames are drawn into the capture framebuffer
+#endif
     
     GLFWwindow* window;
     
@@ -214,6 +640,9 @@ GLFWwindow* initialiseOpenGL() {
     }
     
     glfwMakeContextCurrent(window);
+#ifdef RECORD_OFFSCREEN
+    glfwSwapInterval(0); // nothing is shown, do not wait for the display
+#endif
     
     // set the callbacks
     glfwSetFramebufferSizeCallback(window, framebufferSizeCallback);
@@ -237,7 +666,8 @@ void takeScreenshot(const std::string& name, bool show_image) {
     static int photo_count = 0;
     std::string name_count = name + std::to_string(photo_count);
     std::cout << "Taking screenshot: " << name_count << ".tga" << ", dimensions: " << scr_width << ", " << scr_height << std::endl;
-    short TGA_header[] = {0, 2, 0, 0, 0, 0, (short)scr_width, (short)scr_height, 24};
+    // the width and height are unsigned 16-bit little-endian fields of the header
+    unsigned char TGA_header[18] = {0, 0, 2, 0, 0, 0, 0, 0, 0, 0, 0, 0, (unsigned char)(scr_width & 0xff), (unsigned char)(scr_width >> 8), (unsigned char)(scr_height & 0xff), (unsigned char)(scr_height >> 8), 24, 0};
     char* pixel_data = new char[3 * scr_width * scr_height]; //there are 3 colors (RGB) for each pixel
     std::ofstream file("screenshots/" + name_count + ".tga", std::ios::out | std::ios::binary);
     if(!pixel_data || !file) {
@@ -247,10 +677,11 @@ void takeScreenshot(const std::string& name, bool show_image) {
     
     glFinish();
     glReadBuffer(GL_FRONT);
+    glPixelStorei(GL_PACK_ALIGNMENT, 1); // the rows are not padded in the file
     glReadPixels(0, 0, scr_width, scr_height, GL_BGR, GL_UNSIGNED_BYTE, pixel_data);
     glFinish();
     
-    file.write((char*)TGA_header, 9 * sizeof(short));
+    file.write((char*)TGA_header, sizeof(TGA_header));
     file.write(pixel_data, 3 * scr_width * scr_height);
     file.close();
     delete [] pixel_data;
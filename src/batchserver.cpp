@@ -0,0 +1,466 @@
+//
+//  batchserver.cpp
+//  Vertex Simulations
+//
+//  Created by Antoni Wójcik on 11/06/2020.
+//  Copyright © 2020 Antoni Wójcik. All rights reserved.
+//
+
+#include "batchserver.h"
+#include "clothstrips.h"
+#include "nbodyslab.h"
+#include "transport.h"
+#include "kernelgl.h"
+
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+#include <sstream>
+#include <map>
+#include <cstring>
+#include <cerrno>
+#include <csignal>
+#include <sys/socket.h>
+#include <poll.h>
+#include <sys/un.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#define CLOTH_TIME_STEP 0.03f // defaults of the jobs, the properties of the drawn simulations
+#define NBODY_TIME_STEP 0.01f
+#define NBODY_BODIES 100000
+#define SOCKET_BACKLOG 16
+#define NBODY_BODY_ROOM 1.5 // SLAB_CAPACITY of NBodySlab, the body buffers of a single rank
+#define MB (1024.0 * 1024.0)
+
+BatchJob::BatchJob() : id(-1), priority(0), type(JOB_CLOTH), size(0), bodies(NBODY_BODIES), steps(0), length(0.01f), mass(1.0f), stiffness(500.0f), damping(0.2f), time_step(-1.0f), fp64(false) {}
+
+bool BatchJob::parse(const std::string& line, BatchJob& job, std::string& error, size_t max_alloc) {
+    job = BatchJob();
+    job.spec = line;
+    
+    std::istringstream tokens(line);
+    std::string token;
+    while(tokens >> token) {
+        size_t eq = token.find('=');
+        if(eq == std::string::npos) {
+            error = "EXPECTED key=value, GOT " + token;
+            return false;
+        }
+        std::string key = token.substr(0, eq), value = token.substr(eq + 1);
+        try {
+            if(key == "type") {
+                if(value == "cloth") job.type = JOB_CLOTH;
+                else if(value == "nbody") job.type = JOB_NBODY;
+                else {
+                    error = "UNKNOWN TYPE " + value;
+                    return false;
+                }
+            } else if(key == "precision") job.fp64 = value == "double";
+            else if(key == "priority") job.priority = std::stoi(value);
+            else if(key == "size") job.size = std::stoi(value);
+            else if(key == "bodies") job.bodies = std::stol(value);
+            else if(key == "steps") job.steps = std::stoi(value);
+            else if(key == "length") job.length = std::stof(value);
+            else if(key == "mass") job.mass = std::stof(value);
+            else if(key == "stiffness") job.stiffness = std::stof(value);
+            else if(key == "damping") job.damping = std::stof(value);
+            else if(key == "dt") job.time_step = std::stof(value);
+            else {
+                error = "UNKNOWN KEY " + key;
+                return false;
+            }
+        } catch(std::exception& e) {
+            error = "INVALID VALUE OF " + key;
+            return false;
+        }
+    }
+    
+    // the single strip needs a boundary row on either side and an interior row, the FFT a power of 2 of at least 2 planes
+    
+    if(job.time_step < 0.0f) job.time_step = job.type == JOB_CLOTH ? CLOTH_TIME_STEP : NBODY_TIME_STEP;
+    if(job.steps <= 0) error = "steps HAS TO BE POSITIVE";
+    else if(job.type == JOB_CLOTH && job.size < 5) error = "A CLOTH NEEDS size OF AT LEAST 5";
+    else if(job.type == JOB_NBODY && (job.size < 2 || (job.size & (job.size - 1)) != 0)) error = "THE GRID size HAS TO BE A POWER OF 2";
+    else if(job.type == JOB_NBODY && job.bodies <= 0) error = "bodies HAS TO BE POSITIVE";
+    else if(max_alloc > 0 && job.largestBuffer() > (double)max_alloc) {
+        std::ostringstream message;
+        message << "THE JOB NEEDS A BUFFER OF " << job.largestBuffer() / MB << " MB, THE DEVICES ALLOW " << max_alloc / MB << " MB";
+        error = message.str();
+    }
+    return error.empty();
+}
+
+double BatchJob::largestBuffer() const {
+    // in doubles, so that the sizes past the range of size_t are refused rather than wrapped
+    
+    double real_size = fp64 ? sizeof(cl_double) : sizeof(cl_float);
+    if(type == JOB_CLOTH) return (double)size * size * 3.0 * real_size; // the positions or a velocity buffer of the single strip
+    double grid = (double)size * size * (size + 3) * 2.0 * real_size; // the complex potential with its halo planes
+    double body = bodies * NBODY_BODY_ROOM * 3.0 * real_size;
+    return std::max(grid, body);
+}
+
+BatchServer::BatchServer(const std::vector<cl::Device>& devices, const char* cloth_kernel_path, const char* nbody_kernel_path, const std::string& out_dir, size_t cap) : output_dir(out_dir), capacity(cap), max_alloc(0), stopping(false), next_id(0), running(0), done(0) {
+    if(devices.empty()) {
+        std::cerr << "ERROR: BatchServer: NO DEVICES TO RUN THE JOBS ON" << std::endl;
+        exit(-1);
+    }
+    
+    mkdir(output_dir.c_str(), 0755);
+    results.open(output_dir + "/results.txt", std::ios::app);
+    if(!results.is_open()) {
+        std::cerr << "ERROR: BatchServer: CANNOT WRITE TO " << output_dir << std::endl;
+        exit(-1);
+    }
+    
+    // the programs are built once per worker, before any job is accepted
+    
+    std::string cloth_source = KernelGL::loadSource(cloth_kernel_path, "BatchServer"), nbody_source = KernelGL::loadSource(nbody_kernel_path, "BatchServer");
+    for(const cl::Device& device : devices) {
+        Worker* worker = new Worker;
+        worker->device = device;
+        prepareWorker(*worker, cloth_source, nbody_source);
+        max_alloc = workers.empty() ? worker->max_alloc : std::min(max_alloc, worker->max_alloc);
+        workers.push_back(worker);
+    }
+    for(Worker* worker : workers) worker->thread = std::thread(&BatchServer::workerLoop, this, worker);
+}
+
+BatchServer::~BatchServer() {
+    // the queued jobs are finished first
+    
+    drain();
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    job_ready.notify_all();
+    for(Worker* worker : workers) {
+        worker->thread.join();
+        delete worker;
+    }
+}
+
+void BatchServer::prepareWorker(Worker& worker, const std::string& cloth_source, const std::string& nbody_source, const BatchJob* job) {
+    // the same headless programs as ClothStrips and NBodySlab build for themselves
+    
+    typedef std::chrono::high_resolution_clock clock;
+    clock::time_point t0 = clock::now();
+    
+    try {
+        worker.name = worker.device.getInfo<CL_DEVICE_NAME>();
+        worker.max_alloc = (size_t)worker.device.getInfo<CL_DEVICE_MAX_MEM_ALLOC_SIZE>();
+        worker.fp64 = KernelGL::deviceSupports(worker.device, "cl_khr_fp64");
+        worker.nbody_fp64 = worker.fp64 && KernelGL::deviceSupports(worker.device, "cl_khr_int64_base_atomics");
+        worker.context = cl::Context(worker.device);
+        for(int p = 0; p < (worker.fp64 ? 2 : 1); p++) {
+            bool precision = job == NULL || job->fp64 == (p == 1);
+            if(precision && (job == NULL || job->type == JOB_CLOTH)) worker.cloth_program[p] = KernelGL::buildProgram(worker.context, {worker.device}, cloth_source, "-D HEADLESS", p == 1, "BatchServer");
+            if(precision && (job == NULL || job->type == JOB_NBODY) && (p == 0 || worker.nbody_fp64)) worker.nbody_program[p] = KernelGL::buildProgram(worker.context, {worker.device}, nbody_source, "-D HEADLESS", p == 1, "BatchServer");
+        }
+    } catch(cl::Error e) {
+        KernelGL::processError(e, "BatchServer");
+    }
+    
+    std::cout << "SUCCESS: BatchServer: WORKER ON " << worker.name << " READY IN " << std::chrono::duration<double>(clock::now() - t0).count() << " s" << std::endl;
+}
+
+template<typename T>
+static void runTyped(const BatchJob& job, const cl::Device& device, const cl::Context& context, const cl::Program& cloth_program, const cl::Program& nbody_program, std::vector<float>& positions) {
+    if(job.type == JOB_CLOTH) {
+        ClothStrips<T> cloth(job.size, job.size, job.length, job.mass, job.stiffness, job.damping, job.time_step, {device}, context, cloth_program);
+        cloth.iterate(job.steps);
+        cloth.readPositions(positions);
+    } else {
+        LocalTransport transport;
+        NBodySlab<T> nbody(job.size, job.bodies, 1.0f / job.bodies, job.time_step, transport, device, context, nbody_program);
+        nbody.iterate(job.steps);
+        nbody.readPositions(positions);
+    }
+}
+
+bool BatchServer::supports(const Worker& worker, const BatchJob& job) {
+    if(!job.fp64) return true;
+    return job.type == JOB_CLOTH ? worker.fp64 : worker.nbody_fp64;
+}
+
+double BatchServer::runJob(const BatchJob& job, const Worker& worker, const std::string& output_dir) {
+    // the final positions are written as floats, 3 per vertex or body
+    
+    typedef std::chrono::high_resolution_clock clock;
+    clock::time_point t0 = clock::now();
+    
+    std::vector<float> positions;
+    int p = job.fp64 ? 1 : 0;
+    if(job.fp64) runTyped<double>(job, worker.device, worker.context, worker.cloth_program[p], worker.nbody_program[p], positions);
+    else runTyped<float>(job, worker.device, worker.context, worker.cloth_program[p], worker.nbody_program[p], positions);
+    double time = std::chrono::duration<double>(clock::now() - t0).count();
+    
+    std::ofstream file(output_dir + "/job_" + std::to_string(job.id) + ".bin", std::ios::binary);
+    file.write((const char*)positions.data(), positions.size() * sizeof(float));
+    return time;
+}
+
+void BatchServer::workerLoop(Worker* worker) {
+    // the worker takes the job of the highest priority until the server stops and the queue is empty
+    
+    while(true) {
+        BatchJob job;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            job_ready.wait(lock, [this] { return stopping || !jobs.empty(); });
+            if(jobs.empty()) return;
+            job = jobs.top();
+            jobs.pop();
+            running++;
+        }
+        
+        // a job that fails on the device or runs out of the host memory is reported, the worker keeps its context for the next one
+        
+        double time = -1.0;
+        std::string failure;
+        if(supports(*worker, job)) {
+            KernelGL::RecoverableErrors recoverable;
+            try {
+                time = runJob(job, *worker, output_dir);
+            } catch(cl::Error& e) {
+                failure = std::string(e.what()) + ": " + std::to_string(e.err());
+            } catch(std::bad_alloc& e) {
+                failure = "OUT OF HOST MEMORY";
+            }
+        }
+        
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            running--;
+            done++;
+            results << job.id << " " << worker->name << " ";
+            if(!failure.empty()) results << "FAILED: " << failure;
+            else if(time < 0.0) results << "SKIPPED: NO DOUBLE PRECISION";
+            else results << time << " s " << time * 1000.0 / job.steps << " ms/step";
+            results << " | " << job.spec << std::endl;
+        }
+        job_done.notify_all();
+    }
+}
+
+long BatchServer::submit(BatchJob job) {
+    // the full queue pushes back on the client, which retries later
+    
+    long id;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if(jobs.size() >= capacity) return -1;
+        id = job.id = next_id++;
+        jobs.push(job);
+    }
+    job_ready.notify_one();
+    return id;
+}
+
+void BatchServer::drain() {
+    std::unique_lock<std::mutex> lock(mutex);
+    job_done.wait(lock, [this] { return jobs.empty() && running == 0; });
+}
+
+std::string BatchServer::handleLine(const std::string& line, bool& shutdown) {
+    // one reply line per request line
+    
+    if(line.empty()) return "";
+    if(line == "STATUS") {
+        std::lock_guard<std::mutex> lock(mutex);
+        return "QUEUED " + std::to_string(jobs.size()) + " RUNNING " + std::to_string(running) + " DONE " + std::to_string(done) + "\n";
+    }
+    if(line == "SHUTDOWN") {
+        shutdown = true;
+        return "OK\n";
+    }
+    
+    BatchJob job;
+    std::string error;
+    if(!BatchJob::parse(line, job, error, max_alloc)) return "ERROR: " + error + "\n";
+    long id = submit(job);
+    return id < 0 ? "BUSY\n" : "QUEUED " + std::to_string(id) + "\n";
+}
+
+void BatchServer::serve(const char* socket_path) {
+    // the listening socket and every connected client are polled together, so a client that stays connected without sending
+    // does not hold up the others; the jobs run on the workers while the clients are served
+    
+    signal(SIGPIPE, SIG_IGN); // a client leaving before its reply does not stop the server
+    
+    int server = socket(AF_UNIX, SOCK_STREAM, 0);
+    sockaddr_un address;
+    std::memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    std::strncpy(address.sun_path, socket_path, sizeof(address.sun_path) - 1);
+    unlink(socket_path);
+    
+    if(server < 0 || bind(server, (sockaddr*)&address, sizeof(address)) != 0 || listen(server, SOCKET_BACKLOG) != 0) {
+        std::cerr << "ERROR: BatchServer: CANNOT LISTEN ON " << socket_path << ": " << std::strerror(errno) << std::endl;
+        exit(-1);
+    }
+    std::cout << "SUCCESS: BatchServer: " << workers.size() << " WORKERS LISTENING ON " << socket_path << std::endl;
+    
+    std::vector<pollfd> fds(1, pollfd{server, POLLIN, 0});
+    std::map<int, std::string> buffers; // the partial line of every client
+    
+    bool shutdown = false;
+    while(!shutdown) {
+        if(poll(fds.data(), fds.size(), -1) < 0) {
+            if(errno == EINTR) continue;
+            std::cerr << "ERROR: BatchServer: CANNOT POLL THE CLIENTS: " << std::strerror(errno) << std::endl;
+            break;
+        }
+        
+        // the clients that are done are removed after the loop, the new ones are polled from the next pass
+        
+        std::vector<int> closed;
+        for(size_t i = 1; i < fds.size() && !shutdown; i++) {
+            if(fds[i].revents == 0) continue;
+            
+            int client = fds[i].fd;
+            char chunk[4096];
+            ssize_t n = read(client, chunk, sizeof(chunk));
+            if(n <= 0) {
+                closed.push_back(client);
+                continue;
+            }
+            
+            std::string& buffer = buffers[client];
+            buffer.append(chunk, n);
+            size_t end;
+            while(!shutdown && (end = buffer.find('\n')) != std::string::npos) {
+                std::string line = buffer.substr(0, end);
+                buffer.erase(0, end + 1);
+                if(!line.empty() && line.back() == '\r') line.pop_back();
+                std::string reply = handleLine(line, shutdown);
+                if(!reply.empty() && write(client, reply.c_str(), reply.size()) < 0) {
+                    closed.push_back(client);
+                    break;
+                }
+            }
+        }
+        
+        if(fds[0].revents & POLLIN) {
+            int client = accept(server, NULL, NULL);
+            if(client >= 0) {
+                fds.push_back(pollfd{client, POLLIN, 0});
+                buffers[client] = "";
+            }
+        }
+        
+        std::sort(closed.begin(), closed.end());
+        closed.erase(std::unique(closed.begin(), closed.end()), closed.end());
+        for(int client : closed) {
+            close(client);
+            buffers.erase(client);
+            fds.erase(std::find_if(fds.begin() + 1, fds.end(), [client](const pollfd& fd) { return fd.fd == client; }));
+        }
+    }
+    
+    for(size_t i = 1; i < fds.size(); i++) close(fds[i].fd);
+    close(server);
+    unlink(socket_path);
+    drain();
+}
+
+std::vector<cl::Device> BatchServer::findDevices(int cpu_parts) {
+    // every GPU of every platform, and the CPU split into cpu_parts sub-devices (one per NUMA node for 0, none if negative)
+    
+    std::vector<cl::Platform> platforms;
+    std::vector<cl::Device> devices, gpus;
+    try {
+        cl::Platform::get(&platforms);
+        for(cl::Platform& platform : platforms) {
+            try {
+                platform.getDevices(CL_DEVICE_TYPE_GPU, &gpus);
+            } catch(cl::Error e) {
+                gpus.clear(); // the platform has no GPUs
+            }
+            devices.insert(devices.end(), gpus.begin(), gpus.end());
+        }
+    } catch(cl::Error e) {
+        std::cerr << "ERROR: BatchServer: OpenCL: " << e.what() << ": " << e.err() << std::endl;
+        exit(-1);
+    }
+    
+    if(cpu_parts >= 0) {
+        std::vector<cl::Device> cpus = ClothStrips<float>::partitionCPU(cpu_parts);
+        devices.insert(devices.end(), cpus.begin(), cpus.end());
+    }
+    return devices;
+}
+
+void BatchServer::benchmarkThroughput(const std::vector<std::string>& specs, int cpu_parts, const char* cloth_kernel_path, const char* nbody_kernel_path, const std::string& out_dir) {
+    // the processes are forked before this process has any OpenCL state, each of them finds the devices, builds the one program
+    // of its job and precision and runs the job as a separate run of the program would; the server builds once and keeps its workers busy
+    
+    typedef std::chrono::high_resolution_clock clock;
+    
+    std::vector<BatchJob> jobs(specs.size());
+    for(size_t i = 0; i < specs.size(); i++) {
+        std::string error;
+        if(!BatchJob::parse(specs[i], jobs[i], error)) {
+            std::cerr << "ERROR: BatchServer: " << error << ": " << specs[i] << std::endl;
+            exit(-1);
+        }
+        jobs[i].id = (long)i;
+    }
+    
+    // the number of workers is found by a child, which then exits with it
+    
+    pid_t probe = fork();
+    if(probe == 0) _exit((int)std::min(findDevices(cpu_parts).size(), (size_t)255));
+    int status = 0;
+    waitpid(probe, &status, 0);
+    int slots = WIFEXITED(status) ? WEXITSTATUS(status) : 0;
+    if(slots == 0) {
+        std::cerr << "ERROR: BatchServer: NO DEVICES TO RUN THE JOBS ON" << std::endl;
+        exit(-1);
+    }
+    
+    std::string process_dir = out_dir + "/process", server_dir = out_dir + "/server";
+    mkdir(out_dir.c_str(), 0755);
+    mkdir(process_dir.c_str(), 0755);
+    
+    clock::time_point t0 = clock::now();
+    std::map<pid_t, int> slot_of;
+    std::vector<bool> busy(slots, false);
+    for(size_t i = 0; i < jobs.size(); i++) {
+        if((int)slot_of.size() == slots) {
+            pid_t finished = wait(NULL);
+            busy[slot_of[finished]] = false;
+            slot_of.erase(finished);
+        }
+        int slot = int(std::find(busy.begin(), busy.end(), false) - busy.begin());
+        
+        pid_t pid = fork();
+        if(pid == 0) {
+            Worker worker;
+            worker.device = findDevices(cpu_parts)[slot];
+            prepareWorker(worker, KernelGL::loadSource(cloth_kernel_path, "BatchServer"), KernelGL::loadSource(nbody_kernel_path, "BatchServer"), &jobs[i]);
+            if(supports(worker, jobs[i])) runJob(jobs[i], worker, process_dir);
+            _exit(0);
+        }
+        busy[slot] = true;
+        slot_of[pid] = slot;
+    }
+    while(wait(NULL) > 0);
+    double process_time = std::chrono::duration<double>(clock::now() - t0).count();
+    
+    // the start of the server is paid once a night, it is reported apart from the jobs
+    
+    clock::time_point t1 = clock::now();
+    BatchServer* server = new BatchServer(findDevices(cpu_parts), cloth_kernel_path, nbody_kernel_path, server_dir, jobs.size());
+    clock::time_point t2 = clock::now();
+    for(const BatchJob& job : jobs) server->submit(job);
+    server->drain();
+    clock::time_point t3 = clock::now();
+    delete server;
+    
+    double startup = std::chrono::duration<double>(t2 - t1).count(), server_time = std::chrono::duration<double>(t3 - t2).count();
+    std::cout << "BENCHMARK: BatchServer: " << jobs.size() << " JOBS ON " << slots << " WORKERS: PROCESS PER JOB " << jobs.size() * 3600.0 / process_time << " jobs/h, SERVER " << jobs.size() * 3600.0 / server_time << " jobs/h (STARTUP " << startup << " s)" << std::endl;
+}
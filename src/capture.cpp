@@ -0,0 +1,273 @@
+//
+//  capture.cpp
+//  Vertex Simulations
+//
+//  Created by Antoni Wójcik on 04/06/2020.
+//  Copyright © 2020 Antoni Wójcik. All rights reserved.
+//
+
+#include "capture.h"
+
+#include <zlib.h>
+
+#include <iostream>
+#include <sstream>
+#include <iomanip>
+#include <chrono>
+#include <cstring>
+
+#define CAPTURE_TIMEOUT 1000000000ull // ns to wait for a fence before checking again
+#define PNG_LEVEL Z_BEST_SPEED
+
+static void putBigEndian(unsigned char* out, unsigned int value) {
+    out[0] = (value >> 24) & 0xff;
+    out[1] = (value >> 16) & 0xff;
+    out[2] = (value >> 8) & 0xff;
+    out[3] = value & 0xff;
+}
+
+static void writeChunk(std::ofstream& file, const char* type, const unsigned char* data, size_t size) {
+    // length, type, data and the CRC of the type and the data
+    
+    unsigned char word[4];
+    putBigEndian(word, (unsigned int)size);
+    file.write((char*)word, 4);
+    file.write(type, 4);
+    if(size > 0) file.write((const char*)data, size);
+    
+    uLong crc = crc32(0, (const Bytef*)type, 4);
+    if(size > 0) crc = crc32(crc, data, (uInt)size);
+    putBigEndian(word, (unsigned int)crc);
+    file.write((char*)word, 4);
+}
+
+FrameCapture::FrameCapture(int w, int h, CaptureFormat f, const std::string& p, int frame_rate, bool show, int ring, int queue_frames) : width(w), height(h), format(f), path(p), fps(frame_rate), present(show), ring_size(ring), ring_head(0), ring_tail(0), PBOs(ring), fences(ring, nullptr), frame_size(size_t(w) * h * 4), free_frames(queue_frames, std::vector<unsigned char>(size_t(w) * h * 4)), finished(false), frame_count(0), stall_time(0.0) {
+    createFramebuffer();
+    
+    glGenBuffers(ring_size, PBOs.data());
+    for(int i = 0; i < ring_size; i++) {
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, PBOs[i]);
+        glBufferData(GL_PIXEL_PACK_BUFFER, frame_size, NULL, GL_STREAM_READ);
+    }
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+    
+    writer = std::thread(&FrameCapture::write, this);
+}
+
+FrameCapture::~FrameCapture() {
+    // wait for the reads in flight and let the writer empty the queue
+    
+    while(ring_tail < ring_head) collect(true);
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        finished = true;
+    }
+    cond_write.notify_one();
+    writer.join();
+    
+    glDeleteBuffers(ring_size, PBOs.data());
+    glDeleteRenderbuffers(1, &colour_RBO);
+    glDeleteRenderbuffers(1, &depth_RBO);
+    glDeleteFramebuffers(1, &FBO);
+    
+    std::cout << "BENCHMARK: FrameCapture: " << frame_count << " FRAMES " << width << "x" << height << ", RENDER THREAD WAITED " << stall_time * 1000.0 << " ms IN TOTAL" << std::endl;
+}
+
+void FrameCapture::createFramebuffer() {
+    // the frames are drawn offscreen, so that they do not depend on the window or on a display
+    
+    glGenFramebuffers(1, &FBO);
+    glGenRenderbuffers(1, &colour_RBO);
+    glGenRenderbuffers(1, &depth_RBO);
+    
+    glBindRenderbuffer(GL_RENDERBUFFER, colour_RBO);
+    glRenderbufferStorage(GL_RENDERBUFFER, GL_RGBA8, width, height);
+    glBindRenderbuffer(GL_RENDERBUFFER, depth_RBO);
+    glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT24, width, height);
+    glBindRenderbuffer(GL_RENDERBUFFER, 0);
+    
+    glBindFramebuffer(GL_FRAMEBUFFER, FBO);
+    glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, colour_RBO);
+    glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, depth_RBO);
+    if(glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE) {
+        std::cerr << "ERROR: FrameCapture: INCOMPLETE FRAMEBUFFER" << std::endl;
+        exit(-1);
+    }
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+}
+
+void FrameCapture::begin() {
+    glBindFramebuffer(GL_FRAMEBUFFER, FBO);
+    glViewport(0, 0, width, height);
+}
+
+void FrameCapture::end(int window_width, int window_height) {
+    // the oldest read has to be finished before its pixel buffer is reused
+    
+    if(ring_head - ring_tail == ring_size) collect(true);
+    
+    // start the read of this frame, it is copied out once the device has passed the fence
+    
+    int slot = ring_head % ring_size;
+    glBindFramebuffer(GL_READ_FRAMEBUFFER, FBO);
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, PBOs[slot]);
+    glReadPixels(0, 0, width, height, GL_RGBA, GL_UNSIGNED_BYTE, (void*)0);
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+    fences[slot] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    ring_head++;
+    frame_count++;
+    
+    if(present) {
+        glBindFramebuffer(GL_DRAW_FRAMEBUFFER, 0);
+        glBlitFramebuffer(0, 0, width, height, 0, 0, window_width, window_height, GL_COLOR_BUFFER_BIT, GL_LINEAR);
+    }
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    glViewport(0, 0, window_width, window_height);
+    
+    collect(false);
+}
+
+void FrameCapture::collect(bool block) {
+    // copy out the finished reads in order, only the oldest one is waited for when blocking
+    
+    typedef std::chrono::high_resolution_clock clock;
+    
+    while(ring_tail < ring_head) {
+        int slot = ring_tail % ring_size;
+        
+        clock::time_point t0 = clock::now();
+        GLenum status = glClientWaitSync(fences[slot], GL_SYNC_FLUSH_COMMANDS_BIT, block ? CAPTURE_TIMEOUT : 0);
+        if(status == GL_WAIT_FAILED) {
+            std::cerr << "ERROR: FrameCapture: WAITING FOR THE READ FAILED" << std::endl;
+            exit(-1);
+        }
+        if(status == GL_TIMEOUT_EXPIRED) {
+            if(block) {
+                stall_time += std::chrono::duration<double>(clock::now() - t0).count();
+                continue;
+            }
+            break;
+        }
+        glDeleteSync(fences[slot]);
+        fences[slot] = nullptr;
+        
+        // the writer returns the frames to the free list, wait for it if it is behind
+        
+        std::vector<unsigned char> frame;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            cond_free.wait(lock, [this]{ return !free_frames.empty(); });
+            frame.swap(free_frames.back());
+            free_frames.pop_back();
+        }
+        stall_time += std::chrono::duration<double>(clock::now() - t0).count();
+        
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, PBOs[slot]);
+        void* data = glMapBufferRange(GL_PIXEL_PACK_BUFFER, 0, frame_size, GL_MAP_READ_BIT);
+        std::memcpy(frame.data(), data, frame_size);
+        glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+        ring_tail++;
+        
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            queue.push_back(std::move(frame));
+        }
+        cond_write.notify_one();
+        
+        block = false;
+    }
+}
+
+void FrameCapture::write() {
+    // runs on the writer thread until the queue is empty and the capture has finished
+    
+    std::ofstream stream;
+    if(format == CAPTURE_Y4M) {
+        stream.open(path + ".y4m", std::ios::out | std::ios::binary);
+        if(!stream) {
+            std::cerr << "ERROR: FrameCapture: CANNOT OPEN " << path << ".y4m" << std::endl;
+            exit(-1);
+        }
+        stream << "YUV4MPEG2 W" << width << " H" << height << " F" << fps << ":1 Ip A1:1 C444\n";
+    }
+    
+    for(long index = 0;; index++) {
+        std::vector<unsigned char> frame;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            cond_write.wait(lock, [this]{ return !queue.empty() || finished; });
+            if(queue.empty()) break;
+            frame.swap(queue.front());
+            queue.pop_front();
+        }
+        
+        if(format == CAPTURE_PNG) writePNG(frame, index);
+        else writeY4M(stream, frame);
+        
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            free_frames.push_back(std::move(frame));
+        }
+        cond_free.notify_one();
+    }
+}
+
+void FrameCapture::writePNG(const std::vector<unsigned char>& rgba, long index) const {
+    // 8-bit RGB, the rows are flipped since OpenGL reads them from the bottom, every row uses no filter
+    
+    size_t row = size_t(width) * 3 + 1;
+    std::vector<unsigned char> raw(row * height);
+    for(int j = 0; j < height; j++) {
+        unsigned char* out = &raw[j * row];
+        const unsigned char* in = &rgba[size_t(height - 1 - j) * width * 4];
+        *out++ = 0;
+        for(int i = 0; i < width; i++, in += 4) {
+            *out++ = in[0];
+            *out++ = in[1];
+            *out++ = in[2];
+        }
+    }
+    
+    uLongf compressed_size = compressBound(raw.size());
+    std::vector<unsigned char> compressed(compressed_size);
+    compress2(compressed.data(), &compressed_size, raw.data(), raw.size(), PNG_LEVEL);
+    
+    std::ostringstream name;
+    name << path << "_" << std::setw(6) << std::setfill('0') << index << ".png";
+    std::ofstream file(name.str(), std::ios::out | std::ios::binary);
+    if(!file) {
+        std::cerr << "ERROR: FrameCapture: CANNOT OPEN " << name.str() << std::endl;
+        exit(-1);
+    }
+    
+    static const unsigned char signature[8] = {137, 80, 78, 71, 13, 10, 26, 10};
+    unsigned char header[13] = {0, 0, 0, 0, 0, 0, 0, 0, 8, 2, 0, 0, 0}; // bit depth 8, colour type 2 (RGB)
+    putBigEndian(header, width);
+    putBigEndian(header + 4, height);
+    
+    file.write((const char*)signature, 8);
+    writeChunk(file, "IHDR", header, 13);
+    writeChunk(file, "IDAT", compressed.data(), compressed_size);
+    writeChunk(file, "IEND", nullptr, 0);
+}
+
+void FrameCapture::writeY4M(std::ofstream& stream, const std::vector<unsigned char>& rgba) const {
+    // BT.601 studio range, the planes are written one after another
+    
+    size_t pixels = size_t(width) * height;
+    std::vector<unsigned char> yuv(pixels * 3);
+    for(int j = 0; j < height; j++) {
+        const unsigned char* in = &rgba[size_t(height - 1 - j) * width * 4];
+        for(int i = 0; i < width; i++, in += 4) {
+            int r = in[0], g = in[1], b = in[2];
+            size_t id = size_t(j) * width + i;
+            yuv[id] = (unsigned char)(((66 * r + 129 * g + 25 * b + 128) >> 8) + 16);
+            yuv[pixels + id] = (unsigned char)(((-38 * r - 74 * g + 112 * b + 128) >> 8) + 128);
+            yuv[2 * pixels + id] = (unsigned char)(((112 * r - 94 * g - 18 * b + 128) >> 8) + 128);
+        }
+    }
+    
+    stream << "FRAME\n";
+    stream.write((const char*)yuv.data(), yuv.size());
+}
@@ -8,37 +8,74 @@
 
 #include <GL/glew.h>
 #include "cloth.h"
+#include "trianglemesh.h"
 
 #include "gtc/matrix_transform.hpp"
 #include "gtc/type_ptr.hpp"
 
+#include <algorithm>
+#include <cmath>
+#include <chrono>
+#include <iostream>
+#include <sstream>
 #include <vector>
 #include <string>
 
 #define KERNEL_POS "iteratePos"
 #define KERNEL_VEL "iterateVel"
+#define KERNEL_DIAG "calculateDiagnostics"
+#define KERNEL_STORE "storePos"
+#define KERNEL_LIMIT "calculateStepLimit"
+#define KERNEL_ADAPT "adaptStep"
+#define KERNEL_VERLET "iterateVerlet"
+#define KERNEL_START_VERLET "startVerlet"
+#define KERNEL_DIAG_VERLET "calculateDiagnosticsVerlet"
+#define KERNEL_VEL_STENCIL "iterateVelStencil"
 
+#define LIMIT_GROUP_SIZE 256
+#define STENCIL_GROUP_SIZE 16 // work-group side of the extended stencil, each group caches its tile with the halo
+#define STENCIL_MIN_GROUP 4 // smallest side worth the halo, below it the extended springs are dropped
+#define STENCIL_HALO 2 // has to match kernel_cloth.ocl
+#define ADAPT_SAFETY 0.9f // fraction of the stability limit of the explicit step used as the largest adaptive step
+#define ADAPT_MIN_FRACTION 1e-3f // smallest adaptive step as a fraction of the largest
+#define FIXED_TILE 16 // vertices along each side of a fixed point tile
+#define FIXED_MARGIN 0.25f // deformation allowed past the rest extent of a tile, as a fraction of the larger side of the cloth
 
-Cloth::ClothProperties::ClothProperties(int x, int y, float l, float m, float k, float b, const glm::vec3& p, float dt) {
+
+template<typename T>
+Cloth<T>::ClothProperties::ClothProperties(int x, int y, float l, float m, float k, float b, const glm::vec3& p, float dt) {
     size_x = x;
     size_y = y;
     length = l;
     mass = m;
     stiffness = k;
     damping = b;
+    shear_stiffness = 0.0f;
+    bend_stiffness = 0.0f;
     pos = p;
     time_step = dt;
 }
 
-void Cloth::ClothProperties::updateModelMatrix(const Camera* camera) {
+template<typename T>
+void Cloth<T>::ClothProperties::updateModelMatrix(const Camera* camera) {
     model_matrix = glm::mat4(1.0f);
     model_matrix = glm::translate(model_matrix, pos - camera->getPosition());
     model_matrix = glm::scale(model_matrix, glm::vec3(1.0f, -1.0f, 1.0f));
 }
 
-Cloth::Cloth(int x, int y, float l, float m, float k, float b, const glm::vec3& p, float dt, const char* vs_path, const char* gs_path, const char* fs_path, const char* kernel_path) : KernelGL(kernel_path), cloth_prop(x, y, l, m, k, b, p, dt), shader(vs_path, fs_path, gs_path) {
+template<typename T>
+Cloth<T>::Cloth(int x, int y, float l, float m, float k, float b, const glm::vec3& p, float dt, const char* vs_path, const char* gs_path, const char* fs_path, const char* kernel_path, StateStorage s, ClothIntegrator i) : KernelGL(kernel_path, programOptions(x, y, l, s), sizeof(T) == sizeof(cl_double)), cloth_prop(x, y, l, m, k, b, p, dt), storage(s), integrator(i), adaptive(false), step_dt(dt), dt_max(dt), sim_time(0.0), steps_taken(0), dt_lowest(dt), dt_highest(dt), shader(vs_path, fs_path, gs_path), stencil_group(0) {
+    // the program is being built in the background, the kernels are created by initialiseKernels once it is done
+    
+    // the Verlet step takes the velocity from the difference of the two stored positions, which the half and fixed point storage
+    // round to a fraction of their step, so it keeps the full precision
+    
+    if(integrator == INTEGRATOR_VERLET && storage != STORAGE_FLOAT) {
+        std::cerr << "ERROR: Cloth: THE VERLET INTEGRATOR NEEDS THE FLOAT STORAGE" << std::endl;
+        exit(-1);
+    }
+    
     try {
-        createKernels();
         createGLBuffers();
         createCLBuffers();
     } catch(cl::Error e) {
@@ -46,45 +83,37 @@ Cloth::Cloth(int x, int y, float l, float m, float k, float b, const glm::vec3&
     }
 }
 
-Cloth::~Cloth() {
+template<typename T>
+std::string Cloth<T>::programOptions(int x, int y, float l, StateStorage s) {
+    // the fixed point tiles need the rest positions of the vertices; the range of a tile is its own rest extent and the margin of
+    // the deformation, a vertex that moves further from the origin of its tile is clamped to the edge of the range when stored
+    // and stays there until the forces bring it back, so the margin has to cover the sag and the folds of the cloth
+    
+    float span = (float)(FIXED_TILE - 1) * l + FIXED_MARGIN * (float)(std::max(x, y) - 1) * l;
+    
+    std::ostringstream options;
+    options << storageOptions(s, span);
+    if(s == STORAGE_FIXED) {
+        options.precision(9);
+        options << std::fixed << " -D FIXED_TILE=" << FIXED_TILE << " -D FIXED_LENGTH=" << l << "f -D FIXED_HALF_WIDTH=" << (float)(x - 1) * l * 0.5f << "f -D FIXED_HALF_HEIGHT=" << (float)(y - 1) * l * 0.5f << "f";
+    }
+    return options.str();
+}
+
+template<typename T>
+Cloth<T>::~Cloth() {
     glDeleteVertexArrays(1, &VAO);
     glDeleteBuffers(1, &VBO);
     glDeleteBuffers(1, &EBO);
 }
 
-void Cloth::createGLBuffers() {
-    int size_x = cloth_prop.size_x;
-    int size_y = cloth_prop.size_y;
-    indices_num = (size_x - 1) * (size_y - 1) * 6;
-    buff_size = cloth_prop.size_x * cloth_prop.size_y * 3 * sizeof(cl_float);
-    
-    float* vertices = new float[size_x * size_y * 3];
-    unsigned int* indices = new unsigned int[indices_num];
-    
-    float half_width = (float)((size_x - 1) * cloth_prop.length) * 0.5f;
-    float half_height = (float)((size_y - 1) * cloth_prop.length) * 0.5f;
+template<typename T>
+void Cloth<T>::createGLBuffers() {
+    // the springs of the lattice are implicit in the kernels, only its vertices and triangles are needed to draw it
     
-    // create vertices of the cloth
-    
-    for(int j = 0; j < size_y; j++) for(int i = 0; i < size_x; i++) {
-        vertices[(j * size_x + i) * 3]     = -half_width  + (float)i * cloth_prop.length;
-        vertices[(j * size_x + i) * 3 + 1] =  0.0f;
-        vertices[(j * size_x + i) * 3 + 2] =  half_height - (float)j * cloth_prop.length;
-    }
-    
-    // create indices to set drawing order of the triangle vertices
-    
-    for(int j = 0; j < size_y - 1; j++) for(int i = 0; i < size_x - 1; i++) {
-        // first triangle
-        indices[(j * (size_x - 1) + i) * 6]     = j * size_x + i;
-        indices[(j * (size_x - 1) + i) * 6 + 1] = j * size_x + i + 1;
-        indices[(j * (size_x - 1) + i) * 6 + 2] = (j + 1) * size_x + i;
-        
-        // second triangle
-        indices[(j * (size_x - 1) + i) * 6 + 3] = j * size_x + i + 1;
-        indices[(j * (size_x - 1) + i) * 6 + 4] = (j + 1) * size_x + i + 1;
-        indices[(j * (size_x - 1) + i) * 6 + 5] = (j + 1) * size_x + i;
-    }
+    TriangleMesh mesh = TriangleMesh::lattice(cloth_prop.size_x, cloth_prop.size_y, cloth_prop.length);
+    indices_num = (GLsizei)mesh.triangles.size();
+    buff_size = cloth_prop.size_x * cloth_prop.size_y * 3 * sizeof(cl_float);
     
     glGenVertexArrays(1, &VAO);
     glGenBuffers(1, &VBO);
@@ -93,109 +122,539 @@ void Cloth::createGLBuffers() {
     glBindVertexArray(VAO);
     
     glBindBuffer(GL_ARRAY_BUFFER, VBO);
-    glBufferData(GL_ARRAY_BUFFER, buff_size, vertices, GL_DYNAMIC_DRAW);
+    glBufferData(GL_ARRAY_BUFFER, buff_size, mesh.positions.data(), GL_DYNAMIC_DRAW);
     
     glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, EBO);
-    glBufferData(GL_ELEMENT_ARRAY_BUFFER, indices_num * sizeof(float), indices, GL_STATIC_DRAW);
+    glBufferData(GL_ELEMENT_ARRAY_BUFFER, indices_num * sizeof(unsigned int), mesh.triangles.data(), GL_STATIC_DRAW);
     
     glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 3 * sizeof(float), (void*)0);
     
     glEnableVertexAttribArray(0);
     glBindBuffer(GL_ARRAY_BUFFER, 0);
     glBindVertexArray(0);
-    
-    delete [] vertices;
-    delete [] indices;
 }
 
-void Cloth::createCLBuffers() {
-    buff_pos_prev = cl::Buffer(context, CL_MEM_READ_WRITE, buff_size);
+template<typename T>
+void Cloth<T>::createCLBuffers() {
+    buff_state_size = cloth_prop.size_x * cloth_prop.size_y * 3 * storageSize<T>(storage);
+    
+    buff_pos_prev = cl::Buffer(context, stateFlags(), buff_state_size);
     buff_pos_next = cl::BufferGL(context, CL_MEM_READ_WRITE, VBO);
-    buff_vel_prev = cl::Buffer(context, CL_MEM_READ_WRITE, buff_size);
-    buff_vel_next = cl::Buffer(context, CL_MEM_READ_WRITE, buff_size);
+    
+    // the previous positions of the Verlet integrator take the place of both velocity buffers, they swap with the positions
+    
+    if(integrator == INTEGRATOR_VERLET) buff_pos_old = cl::Buffer(context, stateFlags(), buff_state_size);
+    else {
+        buff_vel_prev = cl::Buffer(context, stateFlags(), buff_state_size);
+        buff_vel_next = cl::Buffer(context, CL_MEM_READ_WRITE, buff_state_size);
+    }
+    
+    // the step record and the partial limits of the adaptive step
+    
+    size_t groups = (size_t(cloth_prop.size_x) * cloth_prop.size_y + LIMIT_GROUP_SIZE - 1) / LIMIT_GROUP_SIZE;
+    buff_step = cl::Buffer(context, CL_MEM_READ_WRITE, 4 * sizeof(T));
+    buff_limit = cl::Buffer(context, CL_MEM_READ_WRITE, groups * sizeof(cl_float2));
+    
+    if(integrator == INTEGRATOR_VERLET) return;
     
     cl::CommandQueue queue(context, device);
-    queue.enqueueFillBuffer(buff_vel_prev, 0, 0, buff_size);
-    queue.enqueueCopyBuffer(buff_pos_next, buff_pos_prev, 0, 0, buff_size);
+    queue.enqueueFillBuffer(buff_vel_prev, (cl_uchar)0, 0, buff_state_size);
+    queue.finish();
+}
+
+template<typename T>
+void Cloth<T>::initialiseKernels() {
+    createKernels();
+    
+    cl::CommandQueue queue(context, device);
+    
+    // convert the initial positions to the state storage
+    
+    std::vector<cl::Memory> mem_objs;
+    mem_objs.push_back(buff_pos_next);
+    
+    cl::Kernel kernel_store(program, KERNEL_STORE);
+    kernel_store.setArg(0, buff_pos_next);
+    kernel_store.setArg(1, buff_pos_prev);
+    kernel_store.setArg(2, cloth_prop.size_x);
+    
+    queue.enqueueAcquireGLObjects(&mem_objs);
+    queue.enqueueNDRangeKernel(kernel_store, cl::NullRange, cl::NDRange(size_t(cloth_prop.size_x), size_t(cloth_prop.size_y)), cl::NullRange);
+    queue.enqueueReleaseGLObjects(&mem_objs);
     queue.enqueueBarrierWithWaitList();
     
     setConstKernelArgs();
     
-    // set the velocity step from 0 to 1/2
+    // the pinned border keeps its positions in both buffers, the interior starts half a kick back
+    
+    if(integrator == INTEGRATOR_VERLET) {
+        queue.enqueueCopyBuffer(buff_pos_prev, buff_pos_old, 0, 0, buff_state_size);
+        queue.enqueueBarrierWithWaitList();
+        
+        cl::Kernel kernel_start(program, KERNEL_START_VERLET);
+        kernel_start.setArg(0, buff_pos_prev);
+        kernel_start.setArg(1, buff_pos_old);
+        kernel_start.setArg(2, cloth_prop.size_x);
+        kernel_start.setArg(3, cloth_prop.size_y);
+        kernel_start.setArg(4, (T)cloth_prop.length);
+        kernel_start.setArg(5, (T)cloth_prop.stiffness / cloth_prop.mass);
+        kernel_start.setArg(6, (T)cloth_prop.time_step);
+        
+        queue.enqueueNDRangeKernel(kernel_start, cl::NDRange(1, 1), cl::NDRange(size_t(cloth_prop.size_x - 2), size_t(cloth_prop.size_y - 2)), cl::NullRange);
+        queue.finish();
+        return;
+    }
+    
+    // set the velocity step from 0 to 1/2, afterwards every kick spans a whole step
     
-    queue.enqueueNDRangeKernel(kernel_vel, cl::NDRange(1, 1), cl::NDRange(size_t(cloth_prop.size_x - 2), size_t(cloth_prop.size_y - 2)), cl::NullRange);
-    queue.enqueueCopyBuffer(buff_vel_next, buff_vel_prev, 0, 0, buff_size);
+    writeStep(queue, (T)cloth_prop.time_step, (T)cloth_prop.time_step * (T)0.5);
+    enqueueVel(queue);
+    queue.enqueueCopyBuffer(buff_vel_next, buff_vel_prev, 0, 0, buff_state_size);
     queue.enqueueBarrierWithWaitList();
+    writeStep(queue, (T)cloth_prop.time_step, (T)cloth_prop.time_step);
 
     queue.finish();
+}
+    
+template<typename T>
+void Cloth<T>::writeStep(cl::CommandQueue& queue, T dt, T kick) {
+    // the step record holds the step of the next drift, the next kick, the simulated time and the number of steps
     
-    kernel_vel.setArg(8, cloth_prop.time_step);
+    T step[4] = {dt, kick, 0, 0};
+    queue.enqueueWriteBuffer(buff_step, CL_TRUE, 0, sizeof(step), step);
+    step_dt = dt;
 }
 
-void Cloth::createKernels() {
+template<typename T>
+void Cloth<T>::enqueueVel(cl::CommandQueue& queue) {
+    // the extended stencil runs in whole tiles starting at the first vertex of the interior, the direct springs alone need no
+    // local memory; a device without a large enough work-group only runs the direct springs
+    
+    if((cloth_prop.shear_stiffness == 0.0f && cloth_prop.bend_stiffness == 0.0f) || stencil_group == 0) {
+        queue.enqueueNDRangeKernel(kernel_vel, cl::NDRange(1, 1), cl::NDRange(size_t(cloth_prop.size_x - 2), size_t(cloth_prop.size_y - 2)), cl::NullRange);
+        return;
+    }
+    
+    size_t groups_x = (size_t(cloth_prop.size_x - 2) + stencil_group - 1) / stencil_group;
+    size_t groups_y = (size_t(cloth_prop.size_y - 2) + stencil_group - 1) / stencil_group;
+    queue.enqueueNDRangeKernel(kernel_stencil, cl::NDRange(1, 1), cl::NDRange(groups_x * stencil_group, groups_y * stencil_group), cl::NDRange(stencil_group, stencil_group));
+}
+
+template<typename T>
+void Cloth<T>::createKernels() {
     // create the kernels given the names
     
     kernel_pos = cl::Kernel(program, KERNEL_POS);
     kernel_vel = cl::Kernel(program, KERNEL_VEL);
+    kernel_limit = cl::Kernel(program, KERNEL_LIMIT);
+    kernel_adapt = cl::Kernel(program, KERNEL_ADAPT);
+    kernel_verlet = cl::Kernel(program, KERNEL_VERLET);
+    kernel_stencil = cl::Kernel(program, KERNEL_VEL_STENCIL);
+    
+    // the work-group of the extended stencil is halved until the device takes it and its two tiles fit in the local memory
+    
+    size_t max_group = kernel_stencil.getWorkGroupInfo<CL_KERNEL_WORK_GROUP_SIZE>(device);
+    cl_ulong local_mem = device.getInfo<CL_DEVICE_LOCAL_MEM_SIZE>() - kernel_stencil.getWorkGroupInfo<CL_KERNEL_LOCAL_MEM_SIZE>(device);
+    for(stencil_group = STENCIL_GROUP_SIZE; stencil_group >= STENCIL_MIN_GROUP; stencil_group /= 2) {
+        size_t tile_size = (stencil_group + 2 * STENCIL_HALO) * (stencil_group + 2 * STENCIL_HALO) * 3 * sizeof(T);
+        if(stencil_group * stencil_group <= max_group && 2 * tile_size <= local_mem) break;
+    }
+    if(stencil_group < STENCIL_MIN_GROUP) {
+        stencil_group = 0;
+        std::cerr << "WARNING: Cloth: THE DEVICE CANNOT RUN THE EXTENDED STENCIL, THE SHEAR AND BEND SPRINGS ARE IGNORED" << std::endl;
+    }
 }
 
-void Cloth::setConstKernelArgs() {
+template<typename T>
+void Cloth<T>::setConstKernelArgs() {
+    T effective_stiffness = (T)cloth_prop.stiffness / cloth_prop.mass;
+    T effective_damping = (T)cloth_prop.damping / cloth_prop.mass;
+    
+    // the current and the previous positions swap every step, they are set in stepVerlet
+    
+    if(integrator == INTEGRATOR_VERLET) {
+        kernel_verlet.setArg(2, buff_pos_next);
+        kernel_verlet.setArg(3, cloth_prop.size_x);
+        kernel_verlet.setArg(4, cloth_prop.size_y);
+        kernel_verlet.setArg(5, (T)cloth_prop.length);
+        kernel_verlet.setArg(6, effective_stiffness);
+        kernel_verlet.setArg(7, effective_damping);
+        kernel_verlet.setArg(8, (T)cloth_prop.time_step);
+        return;
+    }
+    
     kernel_pos.setArg(0, buff_pos_prev);
     kernel_pos.setArg(1, buff_pos_next);
     kernel_pos.setArg(2, buff_vel_prev);
     kernel_pos.setArg(3, cloth_prop.size_x);
     kernel_pos.setArg(4, cloth_prop.size_y);
-    kernel_pos.setArg(5, cloth_prop.time_step);
+    kernel_pos.setArg(5, buff_step);
     
     kernel_vel.setArg(0, buff_vel_prev);
     kernel_vel.setArg(1, buff_vel_next);
     kernel_vel.setArg(2, buff_pos_prev);
     kernel_vel.setArg(3, cloth_prop.size_x);
     kernel_vel.setArg(4, cloth_prop.size_y);
-    kernel_vel.setArg(5, cloth_prop.length);
-    
-    float effective_stiffness = cloth_prop.stiffness / cloth_prop.mass;
-    float effective_damping = cloth_prop.damping / cloth_prop.mass;
-    
+    kernel_vel.setArg(5, (T)cloth_prop.length);
     kernel_vel.setArg(6, effective_stiffness);
     kernel_vel.setArg(7, effective_damping);
-    kernel_vel.setArg(8, cloth_prop.time_step * 0.5f);
+    kernel_vel.setArg(8, buff_step);
+    
+    // the first arguments of the extended stencil are those of kernel_vel, the tiles are of the positions and velocities
+    
+    size_t tile_size = (stencil_group + 2 * STENCIL_HALO) * (stencil_group + 2 * STENCIL_HALO) * 3 * sizeof(T);
+    
+    kernel_stencil.setArg(0, buff_vel_prev);
+    kernel_stencil.setArg(1, buff_vel_next);
+    kernel_stencil.setArg(2, buff_pos_prev);
+    kernel_stencil.setArg(3, cloth_prop.size_x);
+    kernel_stencil.setArg(4, cloth_prop.size_y);
+    kernel_stencil.setArg(5, (T)cloth_prop.length);
+    kernel_stencil.setArg(6, effective_stiffness);
+    kernel_stencil.setArg(7, effective_damping);
+    kernel_stencil.setArg(8, buff_step);
+    kernel_stencil.setArg(9, (T)cloth_prop.shear_stiffness / cloth_prop.mass);
+    kernel_stencil.setArg(10, (T)cloth_prop.bend_stiffness / cloth_prop.mass);
+    kernel_stencil.setArg(11, cl::Local(tile_size));
+    kernel_stencil.setArg(12, cl::Local(tile_size));
+    
+    // the largest adaptive step stays below the stability limit of the explicit step: the stiffest mode of the grid has omega^2 = 8 k / m,
+    // with the extended stencil k is the sum of the stiffnesses of the three types of springs, and the damping by the four neighbours
+    // needs dt < m / (4 b)
+    
+    T total_stiffness = effective_stiffness + (T)(cloth_prop.shear_stiffness + cloth_prop.bend_stiffness) / cloth_prop.mass;
+    T dt_stable = (T)2.0 / std::sqrt((T)8.0 * total_stiffness);
+    if(effective_damping > (T)0) dt_stable = std::min(dt_stable, (T)1.0 / ((T)4.0 * effective_damping));
+    dt_max = std::min((T)cloth_prop.time_step, (T)ADAPT_SAFETY * dt_stable);
+    size_t groups = (size_t(cloth_prop.size_x) * cloth_prop.size_y + LIMIT_GROUP_SIZE - 1) / LIMIT_GROUP_SIZE;
+    
+    kernel_limit.setArg(0, buff_pos_prev);
+    kernel_limit.setArg(1, buff_vel_prev);
+    kernel_limit.setArg(2, cloth_prop.size_x);
+    kernel_limit.setArg(3, cloth_prop.size_y);
+    kernel_limit.setArg(4, (T)cloth_prop.length);
+    kernel_limit.setArg(5, buff_limit);
+    kernel_limit.setArg(6, cl::Local(LIMIT_GROUP_SIZE * sizeof(cl_float2)));
+    
+    kernel_adapt.setArg(0, buff_limit);
+    kernel_adapt.setArg(1, buff_step);
+    kernel_adapt.setArg(2, cl::Local(LIMIT_GROUP_SIZE * sizeof(cl_float2)));
+    kernel_adapt.setArg(3, (cl_int)groups);
+    kernel_adapt.setArg(4, (T)cloth_prop.length);
+    kernel_adapt.setArg(5, dt_max);
+    kernel_adapt.setArg(6, dt_max * (T)ADAPT_MIN_FRACTION);
+}
+
+template<typename T>
+void Cloth<T>::createDiagnostics(const cl::Program& diagnostics_program, const std::function<void(const DiagnosticsRecord&)>& callback) {
+    size_t vertices_num = cloth_prop.size_x * cloth_prop.size_y;
+    diagnostics = new Diagnostics(context, diagnostics_program, vertices_num, cloth_prop.mass * vertices_num, callback);
+    
+    // the Verlet state is set before each sample, its buffers swap every step
+    
+    if(integrator == INTEGRATOR_VERLET) {
+        kernel_diag = cl::Kernel(program, KERNEL_DIAG_VERLET);
+        kernel_diag.setArg(2, cloth_prop.size_x);
+        kernel_diag.setArg(3, cloth_prop.size_y);
+        kernel_diag.setArg(4, (T)cloth_prop.length);
+        kernel_diag.setArg(5, (T)cloth_prop.stiffness);
+        kernel_diag.setArg(6, (T)cloth_prop.mass);
+        kernel_diag.setArg(7, (T)cloth_prop.time_step);
+        kernel_diag.setArg(8, diagnostics->getPartialBuffer());
+        kernel_diag.setArg(9, cl::Local(Diagnostics::getGroupSize() * sizeof(cl_float8)));
+        return;
+    }
+    
+    kernel_diag = cl::Kernel(program, KERNEL_DIAG);
+    kernel_diag.setArg(0, buff_pos_prev);
+    kernel_diag.setArg(1, buff_vel_prev);
+    kernel_diag.setArg(2, cloth_prop.size_x);
+    kernel_diag.setArg(3, cloth_prop.size_y);
+    kernel_diag.setArg(4, (T)cloth_prop.length);
+    kernel_diag.setArg(5, (T)cloth_prop.stiffness);
+    kernel_diag.setArg(6, (T)cloth_prop.mass);
+    kernel_diag.setArg(7, diagnostics->getPartialBuffer());
+    kernel_diag.setArg(8, cl::Local(Diagnostics::getGroupSize() * sizeof(cl_float8)));
+    kernel_diag.setArg(9, (T)cloth_prop.shear_stiffness);
+    kernel_diag.setArg(10, (T)cloth_prop.bend_stiffness);
+}
+
+template<typename T>
+bool Cloth<T>::stateBuffer(StateField field, cl::Buffer& buffer, size_t& size, size_t& item_size) {
+    // the fixed point positions are relative to the tiles and the Verlet state has no velocities, neither has a host view
+    
+    if(field == FIELD_POSITIONS && storage == STORAGE_FIXED) return false;
+    if(field == FIELD_VELOCITIES && integrator == INTEGRATOR_VERLET) return false;
+    
+    buffer = field == FIELD_POSITIONS ? buff_pos_prev : buff_vel_prev;
+    size = buff_state_size;
+    item_size = storageSize<T>(storage);
+    return true;
+}
+
+template<typename T>
+bool Cloth<T>::setParameter(const std::string& name, float value) {
+    // the spring constants only enter the kernel arguments, the state is kept
+    
+    wait();
+    if(name == "stiffness") cloth_prop.stiffness = value;
+    else if(name == "damping") cloth_prop.damping = value;
+    else if(name == "shear_stiffness" && integrator == INTEGRATOR_LEAPFROG) cloth_prop.shear_stiffness = value;
+    else if(name == "bend_stiffness" && integrator == INTEGRATOR_LEAPFROG) cloth_prop.bend_stiffness = value;
+    else return false;
+    
+    setConstKernelArgs();
+    if(diagnostics) {
+        kernel_diag.setArg(5, (T)cloth_prop.stiffness);
+        if(integrator == INTEGRATOR_LEAPFROG) {
+            kernel_diag.setArg(9, (T)cloth_prop.shear_stiffness);
+            kernel_diag.setArg(10, (T)cloth_prop.bend_stiffness);
+        }
+    }
+    return true;
 }
 
-void Cloth::iterate(int steps) {
+template<typename T>
+void Cloth<T>::iterate(int steps) {
     try {
         std::vector<cl::Memory> mem_objs;
         mem_objs.push_back(buff_pos_next);
         
-        // use the leapfrog algorithm
+        // use the leapfrog algorithm, or the fused position Verlet step
         
         cl::CommandQueue queue(context, device);
         
-        for(int i = 0; i < steps; i++) {
-        
-            // calculate new position
+        // the controller counts the time and the steps of this call on the device
         
-            // make sure the OpenGL has released the buffer
-            queue.enqueueAcquireGLObjects(&mem_objs);
-            queue.enqueueNDRangeKernel(kernel_pos, cl::NDRange(1, 1), cl::NDRange(size_t(cloth_prop.size_x - 2), size_t(cloth_prop.size_y - 2)), cl::NullRange);
-            queue.enqueueCopyBuffer(buff_pos_next, buff_pos_prev, 0, 0, buff_size);
-            queue.enqueueReleaseGLObjects(&mem_objs);
+        size_t groups = (size_t(cloth_prop.size_x) * cloth_prop.size_y + LIMIT_GROUP_SIZE - 1) / LIMIT_GROUP_SIZE;
+        if(adaptive && step_dt > dt_max) {
+            // the first adaptive step starts from the fixed step, which may be above the bound of the controller; the velocities
+            // get the kick that moves them half of the shorter step ahead, as when the adaptive step is switched off
+            
+            writeStep(queue, dt_max, (dt_max - step_dt) * (T)0.5);
+            enqueueVel(queue);
+            queue.enqueueCopyBuffer(buff_vel_next, buff_vel_prev, 0, 0, buff_state_size);
             queue.enqueueBarrierWithWaitList();
+            writeStep(queue, dt_max, dt_max);
+        }
+        if(adaptive) queue.enqueueFillBuffer(buff_step, (T)0, 2 * sizeof(T), 2 * sizeof(T));
+        
+        T step[4];
+        cl::Event step_done;
+        for(int i = 0; i < steps; i++) {
+            if(integrator == INTEGRATOR_VERLET) stepVerlet(queue, mem_objs);
+            else {
+                // calculate new position
+                
+                // make sure the OpenGL has released the buffer
+                queue.enqueueAcquireGLObjects(&mem_objs);
+                queue.enqueueNDRangeKernel(kernel_pos, cl::NDRange(1, 1), cl::NDRange(size_t(cloth_prop.size_x - 2), size_t(cloth_prop.size_y - 2)), cl::NullRange);
+                queue.enqueueReleaseGLObjects(&mem_objs);
+                queue.enqueueBarrierWithWaitList();
+                
+                // choose the next step from the new positions, it sets the kick of the velocity update
+                
+                if(adaptive) {
+                    queue.enqueueNDRangeKernel(kernel_limit, cl::NullRange, cl::NDRange(groups * LIMIT_GROUP_SIZE), cl::NDRange(LIMIT_GROUP_SIZE));
+                    queue.enqueueNDRangeKernel(kernel_adapt, cl::NullRange, cl::NDRange(LIMIT_GROUP_SIZE), cl::NDRange(LIMIT_GROUP_SIZE));
+                    queue.enqueueBarrierWithWaitList();
+                }
+                
+                // calculate new velocity
+                
+                enqueueVel(queue);
+                queue.enqueueCopyBuffer(buff_vel_next, buff_vel_prev, 0, 0, buff_state_size);
+                queue.enqueueBarrierWithWaitList();
+            }
             
-            // calculate new velocity
+            // the drawing and the step record only wait for the last step, the diagnostics after it are delivered by their callbacks
             
-            queue.enqueueNDRangeKernel(kernel_vel, cl::NDRange(1, 1), cl::NDRange(size_t(cloth_prop.size_x - 2), size_t(cloth_prop.size_y - 2)), cl::NullRange);
-            queue.enqueueCopyBuffer(buff_vel_next, buff_vel_prev, 0, 0, buff_size);
-            queue.enqueueBarrierWithWaitList();
+            if(i == steps - 1) {
+                if(adaptive) queue.enqueueReadBuffer(buff_step, CL_FALSE, 0, sizeof(step), step);
+                queue.enqueueMarkerWithWaitList(NULL, &step_done);
+            }
+            
+            // sample the energy and momentum, the result is read back without blocking
+            
+            if(diagnosticsDue()) {
+                if(integrator == INTEGRATOR_VERLET) {
+                    kernel_diag.setArg(0, buff_pos_prev);
+                    kernel_diag.setArg(1, buff_pos_old);
+                }
+                queue.enqueueNDRangeKernel(kernel_diag, cl::NullRange, cl::NDRange(diagnostics->getGlobalSize()), cl::NDRange(Diagnostics::getGroupSize()));
+                diagnostics->enqueue(queue, step_count);
+            }
+        }
+        
+        queue.flush();
+        if(steps > 0) step_done.wait();
+        
+        // the step record is only read once per call, with the last step
+        
+        if(!adaptive) sim_time += steps * (double)cloth_prop.time_step;
+        else if(steps > 0) {
+            step_dt = step[0];
+            sim_time += step[2];
+            dt_lowest = std::min(dt_lowest, (float)step_dt);
+            dt_highest = std::max(dt_highest, (float)step_dt);
         }
+        steps_taken += steps;
+    } catch(cl::Error e) {
+        processError(e);
+    }
+}
+
+template<typename T>
+void Cloth<T>::stepVerlet(cl::CommandQueue& queue, std::vector<cl::Memory>& mem_objs) {
+    // one fused kernel per step, the new positions are written over the previous ones and the two buffers swap their roles
+    
+    kernel_verlet.setArg(0, buff_pos_prev);
+    kernel_verlet.setArg(1, buff_pos_old);
+    
+    queue.enqueueAcquireGLObjects(&mem_objs);
+    queue.enqueueNDRangeKernel(kernel_verlet, cl::NDRange(1, 1), cl::NDRange(size_t(cloth_prop.size_x - 2), size_t(cloth_prop.size_y - 2)), cl::NullRange);
+    queue.enqueueReleaseGLObjects(&mem_objs);
+    queue.enqueueBarrierWithWaitList();
+    
+    std::swap(buff_pos_prev, buff_pos_old);
+}
+
+template<typename T>
+float Cloth<T>::advance(float time, int max_steps) {
+    // step until the simulated time is covered, the adaptive steps are only known on the device so they are enqueued in batches
+    // estimated from the last step, the time advanced can overshoot by a fraction of a step and is returned
+    
+    double start = sim_time;
+    int taken = 0;
+    while(taken < max_steps) {
+        int batch = std::min((int)((time - (sim_time - start)) / step_dt + 0.5), max_steps - taken);
+        if(batch <= 0) break;
+        iterate(batch);
+        taken += batch;
+    }
+    return (float)(sim_time - start);
+}
+
+template<typename T>
+void Cloth<T>::setAdaptive(bool a) {
+    // switching on only sets the flag, the next iterate clamps the step to dt_max and the controller picks it from there, so the
+    // asynchronous build is not waited for; the fixed step starts from the step the controller left, the velocities get the
+    // missing part of the kick
+    
+    if(a && integrator == INTEGRATOR_VERLET) {
+        std::cerr << "ERROR: Cloth: THE ADAPTIVE STEP NEEDS THE LEAPFROG INTEGRATOR" << std::endl;
+        exit(-1);
+    }
+    adaptive = a;
+    if(adaptive || step_dt == (T)cloth_prop.time_step) return;
+    
+    // the step only differs after iterate, so the programs are built by now and wait returns at once
+    
+    wait();
+    try {
+        cl::CommandQueue queue(context, device);
+        writeStep(queue, (T)cloth_prop.time_step, ((T)cloth_prop.time_step - step_dt) * (T)0.5);
+        enqueueVel(queue);
+        queue.enqueueCopyBuffer(buff_vel_next, buff_vel_prev, 0, 0, buff_state_size);
+        queue.enqueueBarrierWithWaitList();
+        writeStep(queue, (T)cloth_prop.time_step, (T)cloth_prop.time_step);
+        queue.finish();
+    } catch(cl::Error e) {
+        processError(e);
+    }
+}
+
+template<typename T>
+void Cloth<T>::setSpringStiffness(float shear, float bend) {
+    // the diagonal and the bend springs only enter the kernel arguments, the state is kept
+    
+    if(integrator == INTEGRATOR_VERLET && (shear != 0.0f || bend != 0.0f)) {
+        std::cerr << "ERROR: Cloth: THE EXTENDED STENCIL NEEDS THE LEAPFROG INTEGRATOR" << std::endl;
+        exit(-1);
+    }
+    setParameter("shear_stiffness", shear);
+    setParameter("bend_stiffness", bend);
+}
+
+template<typename T>
+void Cloth<T>::printStepStats() {
+    // compares the steps taken with the fixed step of the construction over the same simulated time
+    
+    std::cout << "BENCHMARK: Cloth: " << steps_taken << " STEPS OVER " << sim_time << " s OF SIMULATED TIME (dt " << dt_lowest << " - " << dt_highest << " s), THE FIXED STEP OF " << cloth_prop.time_step << " s NEEDS " << (long)std::ceil(sim_time / cloth_prop.time_step) << " STEPS" << std::endl;
+}
+
+template<typename T>
+double Cloth<T>::benchmarkIterate(int steps) {
+    wait();
+    typedef std::chrono::high_resolution_clock clock;
+    
+    clock::time_point t0 = clock::now();
+    iterate(steps);
+    clock::time_point t1 = clock::now();
+    
+    // the state read and written per vertex: the positions and two velocities of the leapfrog or the two positions of Verlet,
+    // with the float positions for drawing
+    
+    double time = std::chrono::duration<double>(t1 - t0).count();
+    const char* names[] = {"FLOAT", "HALF", "FIXED"};
+    size_t state_bytes = (integrator == INTEGRATOR_VERLET ? 2 : 3) * 3 * storageSize<T>(storage) + 3 * sizeof(cl_float);
+    int springs = cloth_prop.shear_stiffness == 0.0f && cloth_prop.bend_stiffness == 0.0f ? 4 : 12;
+    std::cout << "BENCHMARK: Cloth: " << (sizeof(T) == sizeof(cl_double) ? "DOUBLE" : "FLOAT") << " PRECISION, " << names[storage] << " STORAGE, " << (integrator == INTEGRATOR_VERLET ? "VERLET" : "LEAPFROG") << " INTEGRATOR, " << springs << " SPRINGS, " << state_bytes << " BYTES/VERTEX: " << time * 1000.0 / steps << " ms/step, " << (double)steps * cloth_prop.size_x * cloth_prop.size_y / time * 1e-6 << " Mvertex/s" << std::endl;
+    return time * 1000.0 / steps;
+}
+
+template<typename T>
+void Cloth<T>::readPositions(std::vector<float>& positions) {
+    // the drawn positions are always stored as floats
+    
+    wait();
+    try {
+        std::vector<cl::Memory> mem_objs;
+        mem_objs.push_back(buff_pos_next);
+        positions.resize(buff_size / sizeof(cl_float));
         
+        cl::CommandQueue queue(context, device);
+        queue.enqueueAcquireGLObjects(&mem_objs);
+        queue.enqueueReadBuffer(buff_pos_next, CL_TRUE, 0, buff_size, positions.data());
+        queue.enqueueReleaseGLObjects(&mem_objs);
         queue.finish();
     } catch(cl::Error e) {
         processError(e);
     }
 }
 
-void Cloth::draw(const Camera* camera) {
+template<typename T>
+void Cloth<T>::readVelocities(std::vector<float>& velocities) {
+    // the leapfrog velocities are half a step ahead of the positions, the Verlet ones are the backward difference of its two
+    // positions and half a step behind them
+    
+    wait();
+    try {
+        size_t count = size_t(cloth_prop.size_x) * cloth_prop.size_y * 3;
+        velocities.resize(count);
+        
+        cl::CommandQueue queue(context, device);
+        if(integrator == INTEGRATOR_VERLET) {
+            std::vector<T> pos(count), old(count);
+            queue.enqueueReadBuffer(buff_pos_prev, CL_TRUE, 0, buff_state_size, pos.data());
+            queue.enqueueReadBuffer(buff_pos_old, CL_TRUE, 0, buff_state_size, old.data());
+            for(size_t i = 0; i < count; i++) velocities[i] = (float)((pos[i] - old[i]) / (T)cloth_prop.time_step);
+        } else if(storage == STORAGE_FLOAT) {
+            std::vector<T> vel(count);
+            queue.enqueueReadBuffer(buff_vel_prev, CL_TRUE, 0, buff_state_size, vel.data());
+            velocities.assign(vel.begin(), vel.end());
+        } else {
+            std::vector<cl_half> vel(count);
+            queue.enqueueReadBuffer(buff_vel_prev, CL_TRUE, 0, buff_state_size, vel.data());
+            std::transform(vel.begin(), vel.end(), velocities.begin(), halfToFloat);
+        }
+    } catch(cl::Error e) {
+        processError(e);
+    }
+}
+
+template<typename T>
+void Cloth<T>::draw(const Camera* camera) {
     shader.use();
     
     cloth_prop.updateModelMatrix(camera);
@@ -208,3 +667,6 @@ void Cloth::draw(const Camera* camera) {
     glDrawElements(GL_TRIANGLES, indices_num, GL_UNSIGNED_INT, 0);
     glBindVertexArray(0);
 }
+
+template class Cloth<float>;
+template class Cloth<double>;
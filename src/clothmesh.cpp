@@ -0,0 +1,268 @@
+//
+//  clothmesh.cpp
+//  Vertex Simulations
+//
+//  Created by Antoni Wójcik on 10/06/2020.
+//  Copyright © 2020 Antoni Wójcik. All rights reserved.
+//
+
+#include <GL/glew.h>
+#include "clothmesh.h"
+
+#include "gtc/matrix_transform.hpp"
+#include "gtc/type_ptr.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+#include <vector>
+
+#define KERNEL_POS "iteratePosMesh"
+#define KERNEL_VEL "iterateVelMesh"
+#define KERNEL_DIAG "calculateDiagnosticsMesh"
+
+template<typename T>
+ClothMesh<T>::ClothMesh(const TriangleMesh& mesh, float m, float k, float b, const glm::vec3& p, float dt, const char* vs_path, const char* gs_path, const char* fs_path, const char* kernel_path) : KernelGL(kernel_path, storageOptions(STORAGE_FLOAT, 0.0f), sizeof(T) == sizeof(cl_double)), vertex_num(mesh.vertexCount()), spring_num(mesh.springCount()), mass(m), stiffness(k), damping(b), time_step(dt), order(mesh.order), mean_span(mesh.meanSpan()), pos(p), shader(vs_path, fs_path, gs_path) {
+    // the program is being built in the background, the kernels are created by initialiseKernels once it is done
+    
+    try {
+        createGLBuffers(mesh);
+        createCLBuffers(mesh);
+    } catch(cl::Error e) {
+        processError(e);
+    }
+}
+
+template<typename T>
+ClothMesh<T>::~ClothMesh() {
+    glDeleteVertexArrays(1, &VAO);
+    glDeleteBuffers(1, &VBO);
+    glDeleteBuffers(1, &EBO);
+}
+
+template<typename T>
+void ClothMesh<T>::createGLBuffers(const TriangleMesh& mesh) {
+    indices_num = (GLsizei)mesh.triangles.size();
+    buff_size = vertex_num * 3 * sizeof(cl_float);
+    
+    glGenVertexArrays(1, &VAO);
+    glGenBuffers(1, &VBO);
+    glGenBuffers(1, &EBO);
+    
+    glBindVertexArray(VAO);
+    
+    glBindBuffer(GL_ARRAY_BUFFER, VBO);
+    glBufferData(GL_ARRAY_BUFFER, buff_size, mesh.positions.data(), GL_DYNAMIC_DRAW);
+    
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, EBO);
+    glBufferData(GL_ELEMENT_ARRAY_BUFFER, indices_num * sizeof(unsigned int), mesh.triangles.data(), GL_STATIC_DRAW);
+    
+    glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 3 * sizeof(float), (void*)0);
+    
+    glEnableVertexAttribArray(0);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+    glBindVertexArray(0);
+}
+
+template<typename T>
+void ClothMesh<T>::createCLBuffers(const TriangleMesh& mesh) {
+    // the adjacency and the rest lengths are uploaded once, the state starts at rest
+    
+    buff_state_size = vertex_num * 3 * sizeof(T);
+    size_t entries = mesh.neighbours.size();
+    
+    std::vector<T> positions(mesh.positions.begin(), mesh.positions.end());
+    std::vector<T> rest(mesh.rest_lengths.begin(), mesh.rest_lengths.end());
+    std::vector<T> inv_mass(vertex_num);
+    for(int i = 0; i < vertex_num; i++) inv_mass[i] = mesh.pinned[i] ? (T)0 : (T)1 / mass;
+    
+    buff_pos = cl::Buffer(context, CL_MEM_READ_WRITE, buff_state_size);
+    buff_pos_gl = cl::BufferGL(context, CL_MEM_READ_WRITE, VBO);
+    buff_vel_prev = cl::Buffer(context, CL_MEM_READ_WRITE, buff_state_size);
+    buff_vel_next = cl::Buffer(context, CL_MEM_READ_WRITE, buff_state_size);
+    buff_offsets = cl::Buffer(context, CL_MEM_READ_ONLY, (vertex_num + 1) * sizeof(cl_int));
+    buff_neighbours = cl::Buffer(context, CL_MEM_READ_ONLY, std::max(entries, (size_t)1) * sizeof(cl_int));
+    buff_rest = cl::Buffer(context, CL_MEM_READ_ONLY, std::max(entries, (size_t)1) * sizeof(T));
+    buff_inv_mass = cl::Buffer(context, CL_MEM_READ_ONLY, vertex_num * sizeof(T));
+    
+    cl::CommandQueue queue(context, device);
+    queue.enqueueWriteBuffer(buff_pos, CL_TRUE, 0, buff_state_size, positions.data());
+    queue.enqueueWriteBuffer(buff_offsets, CL_TRUE, 0, (vertex_num + 1) * sizeof(cl_int), mesh.offsets.data());
+    if(entries > 0) {
+        queue.enqueueWriteBuffer(buff_neighbours, CL_TRUE, 0, entries * sizeof(cl_int), mesh.neighbours.data());
+        queue.enqueueWriteBuffer(buff_rest, CL_TRUE, 0, entries * sizeof(T), rest.data());
+    }
+    queue.enqueueWriteBuffer(buff_inv_mass, CL_TRUE, 0, vertex_num * sizeof(T), inv_mass.data());
+    queue.enqueueFillBuffer(buff_vel_prev, (cl_uchar)0, 0, buff_state_size);
+    queue.finish();
+}
+
+template<typename T>
+void ClothMesh<T>::initialiseKernels() {
+    createKernels();
+    setConstKernelArgs();
+    
+    // set the velocity step from 0 to 1/2, afterwards every kick spans a whole step
+    
+    cl::CommandQueue queue(context, device);
+    kernel_vel.setArg(9, (T)time_step * (T)0.5);
+    queue.enqueueNDRangeKernel(kernel_vel, cl::NullRange, cl::NDRange(size_t(vertex_num)), cl::NullRange);
+    queue.enqueueCopyBuffer(buff_vel_next, buff_vel_prev, 0, 0, buff_state_size);
+    kernel_vel.setArg(9, (T)time_step);
+    queue.finish();
+}
+
+template<typename T>
+void ClothMesh<T>::createKernels() {
+    kernel_pos = cl::Kernel(program, KERNEL_POS);
+    kernel_vel = cl::Kernel(program, KERNEL_VEL);
+}
+
+template<typename T>
+void ClothMesh<T>::setConstKernelArgs() {
+    kernel_pos.setArg(0, buff_pos);
+    kernel_pos.setArg(1, buff_pos_gl);
+    kernel_pos.setArg(2, buff_vel_prev);
+    kernel_pos.setArg(3, (T)time_step);
+    
+    kernel_vel.setArg(0, buff_vel_prev);
+    kernel_vel.setArg(1, buff_vel_next);
+    kernel_vel.setArg(2, buff_pos);
+    kernel_vel.setArg(3, buff_offsets);
+    kernel_vel.setArg(4, buff_neighbours);
+    kernel_vel.setArg(5, buff_rest);
+    kernel_vel.setArg(6, buff_inv_mass);
+    kernel_vel.setArg(7, (T)stiffness);
+    kernel_vel.setArg(8, (T)damping);
+    kernel_vel.setArg(9, (T)time_step);
+}
+
+template<typename T>
+void ClothMesh<T>::createDiagnostics(const cl::Program& diagnostics_program, const std::function<void(const DiagnosticsRecord&)>& callback) {
+    diagnostics = new Diagnostics(context, diagnostics_program, vertex_num, mass * vertex_num, callback);
+    
+    kernel_diag = cl::Kernel(program, KERNEL_DIAG);
+    kernel_diag.setArg(0, buff_pos);
+    kernel_diag.setArg(1, buff_vel_prev);
+    kernel_diag.setArg(2, buff_offsets);
+    kernel_diag.setArg(3, buff_neighbours);
+    kernel_diag.setArg(4, buff_rest);
+    kernel_diag.setArg(5, vertex_num);
+    kernel_diag.setArg(6, (T)stiffness);
+    kernel_diag.setArg(7, (T)mass);
+    kernel_diag.setArg(8, diagnostics->getPartialBuffer());
+    kernel_diag.setArg(9, cl::Local(Diagnostics::getGroupSize() * sizeof(cl_float8)));
+}
+
+template<typename T>
+void ClothMesh<T>::iterate(int steps) {
+    try {
+        std::vector<cl::Memory> mem_objs;
+        mem_objs.push_back(buff_pos_gl);
+        
+        // use the leapfrog algorithm, the pinned vertices keep zero velocity
+        
+        cl::CommandQueue queue(context, device);
+        
+        cl::Event step_done;
+        for(int i = 0; i < steps; i++) {
+            queue.enqueueAcquireGLObjects(&mem_objs);
+            queue.enqueueNDRangeKernel(kernel_pos, cl::NullRange, cl::NDRange(size_t(vertex_num)), cl::NullRange);
+            queue.enqueueReleaseGLObjects(&mem_objs);
+            queue.enqueueBarrierWithWaitList();
+            
+            queue.enqueueNDRangeKernel(kernel_vel, cl::NullRange, cl::NDRange(size_t(vertex_num)), cl::NullRange);
+            queue.enqueueCopyBuffer(buff_vel_next, buff_vel_prev, 0, 0, buff_state_size);
+            queue.enqueueBarrierWithWaitList();
+            
+            // the drawing only waits for the last step, the diagnostics after it are delivered by their callbacks
+            
+            if(i == steps - 1) queue.enqueueMarkerWithWaitList(NULL, &step_done);
+            
+            // sample the energy and momentum, the result is read back without blocking
+            
+            if(diagnosticsDue()) {
+                queue.enqueueNDRangeKernel(kernel_diag, cl::NullRange, cl::NDRange(diagnostics->getGlobalSize()), cl::NDRange(Diagnostics::getGroupSize()));
+                diagnostics->enqueue(queue, step_count);
+            }
+        }
+        
+        queue.flush();
+        if(steps > 0) step_done.wait();
+    } catch(cl::Error e) {
+        processError(e);
+    }
+}
+
+template<typename T>
+void ClothMesh<T>::benchmarkIterate(int steps) {
+    // the mean span of the springs tells how far apart in memory the neighbours of a vertex lie in the chosen order
+    
+    wait();
+    typedef std::chrono::high_resolution_clock clock;
+    
+    clock::time_point t0 = clock::now();
+    iterate(steps);
+    clock::time_point t1 = clock::now();
+    
+    double time = std::chrono::duration<double>(t1 - t0).count();
+    const char* names[] = {"FILE", "RCM", "MORTON"};
+    std::cout << "BENCHMARK: ClothMesh: " << names[order] << " ORDER, " << vertex_num << " VERTICES, " << spring_num << " SPRINGS, MEAN SPRING SPAN " << mean_span << ": " << time * 1000.0 / steps << " ms/step, " << (double)steps * vertex_num / time * 1e-6 << " Mvertex/s" << std::endl;
+}
+
+template<typename T>
+void ClothMesh<T>::readPositions(std::vector<float>& positions) {
+    // the drawn positions are always stored as floats
+    
+    wait();
+    try {
+        std::vector<cl::Memory> mem_objs;
+        mem_objs.push_back(buff_pos_gl);
+        positions.resize(buff_size / sizeof(cl_float));
+        
+        cl::CommandQueue queue(context, device);
+        queue.enqueueAcquireGLObjects(&mem_objs);
+        queue.enqueueReadBuffer(buff_pos_gl, CL_TRUE, 0, buff_size, positions.data());
+        queue.enqueueReleaseGLObjects(&mem_objs);
+        queue.finish();
+    } catch(cl::Error e) {
+        processError(e);
+    }
+}
+
+template<typename T>
+void ClothMesh<T>::readVelocities(std::vector<float>& velocities) {
+    // half a step ahead of the positions
+    
+    wait();
+    try {
+        std::vector<T> vel(size_t(vertex_num) * 3);
+        cl::CommandQueue queue(context, device);
+        queue.enqueueReadBuffer(buff_vel_prev, CL_TRUE, 0, buff_state_size, vel.data());
+        velocities.assign(vel.begin(), vel.end());
+    } catch(cl::Error e) {
+        processError(e);
+    }
+}
+
+template<typename T>
+void ClothMesh<T>::draw(const Camera* camera) {
+    // the same shaders and model matrix as Cloth
+    
+    shader.use();
+    
+    model_matrix = glm::mat4(1.0f);
+    model_matrix = glm::translate(model_matrix, pos - camera->getPosition());
+    model_matrix = glm::scale(model_matrix, glm::vec3(1.0f, -1.0f, 1.0f));
+    
+    shader.setMat4("PVM", camera->getPVMatrix() * model_matrix);
+    shader.setMat3("M_normals", glm::mat3(glm::transpose(glm::inverse(model_matrix))));
+    shader.setVec3("camera_dir", camera->getNormal());
+    
+    glBindVertexArray(VAO);
+    glDrawElements(GL_TRIANGLES, indices_num, GL_UNSIGNED_INT, 0);
+    glBindVertexArray(0);
+}
+
+template class ClothMesh<float>;
+template class ClothMesh<double>;
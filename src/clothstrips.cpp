@@ -0,0 +1,405 @@
+//
+//  clothstrips.cpp
+//  Vertex Simulations
+//
+//  Created by Antoni Wójcik on 05/06/2020.
+//  Copyright © 2020 Antoni Wójcik. All rights reserved.
+//
+
+#include "clothstrips.h"
+#include "kernelgl.h"
+
+#include <algorithm>
+#include <cmath>
+#include <chrono>
+#include <iostream>
+
+#define KERNEL_POS "iteratePos"
+#define KERNEL_VEL "iterateVel"
+
+#define CALIBRATION_STEPS 10 // steps timed on the equal split before the rows are balanced
+#define MIN_STRIP_ROWS 3 // a boundary row on either side and at least one interior row
+
+static double kernelTime(const cl::Event& event) {
+    // seconds between the start and the end of a command of a queue with profiling enabled
+    
+    return (event.getProfilingInfo<CL_PROFILING_COMMAND_END>() - event.getProfilingInfo<CL_PROFILING_COMMAND_START>()) * 1e-9;
+}
+
+template<typename T>
+ClothStrips<T>::ClothStrips(int x, int y, float l, float m, float k, float b, float dt, const std::vector<cl::Device>& devices, const char* kernel_path, bool balance) : size_x(x), size_y(y), length(l), mass(m), stiffness(k), damping(b), time_step(dt), parity(0), row_size(size_t(x) * 3 * sizeof(T)) {
+    // all the devices share one context, so that the halo rows are copied between their buffers directly
+    
+    try {
+        context = cl::Context(devices);
+        
+        // the strips keep the state in the scalar type and are not drawn
+        
+        program = KernelGL::buildProgram(context, devices, KernelGL::loadSource(kernel_path, "ClothStrips"), "-D HEADLESS", sizeof(T) == sizeof(cl_double), "ClothStrips");
+    } catch(cl::Error e) {
+        KernelGL::processError(e, "ClothStrips");
+    }
+    initialise(devices, balance);
+}
+
+template<typename T>
+ClothStrips<T>::ClothStrips(int x, int y, float l, float m, float k, float b, float dt, const std::vector<cl::Device>& devices, const cl::Context& c, const cl::Program& p, bool balance) : size_x(x), size_y(y), length(l), mass(m), stiffness(k), damping(b), time_step(dt), context(c), program(p), parity(0), row_size(size_t(x) * 3 * sizeof(T)) {
+    initialise(devices, balance);
+}
+
+template<typename T>
+void ClothStrips<T>::initialise(const std::vector<cl::Device>& devices, bool balance) {
+    // the first and the last row are fixed, the rows between them are split
+    
+    int rows_num = size_y - 2;
+    if(devices.empty() || (int)devices.size() * MIN_STRIP_ROWS > rows_num) {
+        std::cerr << "ERROR: ClothStrips: " << rows_num << " ROWS CANNOT BE SPLIT BETWEEN " << devices.size() << " DEVICES" << std::endl;
+        exit(-1);
+    }
+    
+    try {
+        std::vector<int> rows(devices.size());
+        for(size_t d = 0; d < devices.size(); d++) rows[d] = int(rows_num * (d + 1) / devices.size() - rows_num * d / devices.size());
+        createStrips(devices, rows);
+        uploadInitial();
+        
+        // the calibration steps are discarded, the cloth starts again from the balanced split
+        
+        if(balance && devices.size() > 1) {
+            rows = balanceRows(CALIBRATION_STEPS);
+            createStrips(devices, rows);
+            uploadInitial();
+        }
+        printRows();
+    } catch(cl::Error e) {
+        KernelGL::processError(e, "ClothStrips");
+    }
+}
+
+template<typename T>
+void ClothStrips<T>::createStrips(const std::vector<cl::Device>& devices, const std::vector<int>& rows) {
+    // every strip holds its rows and one halo row of its neighbours on either side, the halo of the first and the last strip is the fixed row
+    
+    strips.clear();
+    parity = 0;
+    
+    T effective_stiffness = (T)stiffness / mass;
+    T effective_damping = (T)damping / mass;
+    
+    int row_start = 1;
+    for(size_t d = 0; d < devices.size(); d++) {
+        Strip s;
+        s.device = devices[d];
+        s.queue = cl::CommandQueue(context, s.device, CL_QUEUE_PROFILING_ENABLE);
+        s.copy_queue = cl::CommandQueue(context, s.device);
+        s.row_start = row_start;
+        s.row_num = rows[d];
+        row_start += rows[d];
+        
+        size_t strip_size = size_t(s.row_num + 2) * row_size;
+        s.buff_pos = cl::Buffer(context, CL_MEM_READ_WRITE, strip_size);
+        s.buff_vel[0] = cl::Buffer(context, CL_MEM_READ_WRITE, strip_size);
+        s.buff_vel[1] = cl::Buffer(context, CL_MEM_READ_WRITE, strip_size);
+        s.buff_step = cl::Buffer(context, CL_MEM_READ_WRITE, 4 * sizeof(T));
+        
+        // the velocity buffers swap every step, their arguments are set by the steps
+        
+        s.kernel_pos = cl::Kernel(program, KERNEL_POS);
+        s.kernel_pos.setArg(0, s.buff_pos);
+        s.kernel_pos.setArg(1, s.buff_pos); // the OpenGL positions, not written without drawing
+        s.kernel_pos.setArg(3, size_x);
+        s.kernel_pos.setArg(4, s.row_num + 2);
+        s.kernel_pos.setArg(5, s.buff_step);
+        
+        s.kernel_vel = cl::Kernel(program, KERNEL_VEL);
+        s.kernel_vel.setArg(2, s.buff_pos);
+        s.kernel_vel.setArg(3, size_x);
+        s.kernel_vel.setArg(4, s.row_num + 2);
+        s.kernel_vel.setArg(5, (T)length);
+        s.kernel_vel.setArg(6, effective_stiffness);
+        s.kernel_vel.setArg(7, effective_damping);
+        s.kernel_vel.setArg(8, s.buff_step);
+        
+        strips.push_back(s);
+    }
+}
+
+template<typename T>
+void ClothStrips<T>::uploadInitial() {
+    // the same flat cloth as Cloth, every strip gets its rows with the halos, the whole cloth is never held on the host
+    
+    T half_width = (T)((size_x - 1) * length) * (T)0.5;
+    T half_height = (T)((size_y - 1) * length) * (T)0.5;
+    
+    T step[4] = {(T)time_step, (T)time_step * (T)0.5, 0, 0};
+    for(Strip& s : strips) {
+        std::vector<T> rows(size_t(s.row_num + 2) * size_x * 3);
+        for(int j = 0; j < s.row_num + 2; j++) for(int i = 0; i < size_x; i++) {
+            rows[(size_t(j) * size_x + i) * 3]     = -half_width  + (T)i * length;
+            rows[(size_t(j) * size_x + i) * 3 + 1] =  (T)0;
+            rows[(size_t(j) * size_x + i) * 3 + 2] =  half_height - (T)(s.row_start - 1 + j) * length;
+        }
+        
+        size_t strip_size = size_t(s.row_num + 2) * row_size;
+        s.queue.enqueueWriteBuffer(s.buff_pos, CL_TRUE, 0, strip_size, rows.data());
+        s.queue.enqueueFillBuffer(s.buff_vel[0], (cl_uchar)0, 0, strip_size);
+        s.queue.enqueueFillBuffer(s.buff_vel[1], (cl_uchar)0, 0, strip_size);
+        s.queue.enqueueWriteBuffer(s.buff_step, CL_TRUE, 0, sizeof(step), step);
+        s.queue.finish();
+    }
+    
+    // set the velocity step from 0 to 1/2, afterwards every kick spans a whole step
+    
+    stepVelocities();
+    parity ^= 1;
+    
+    step[1] = (T)time_step;
+    for(Strip& s : strips) {
+        s.queue.enqueueWriteBuffer(s.buff_step, CL_TRUE, 0, sizeof(step), step);
+        s.queue.finish();
+        s.copy_queue.finish();
+    }
+}
+
+template<typename T>
+std::vector<int> ClothStrips<T>::balanceRows(int calibration_steps) {
+    // the rows per second of every device are measured on its interior rows, the first step is not counted
+    
+    std::vector<double> busy(strips.size(), 0.0);
+    for(int i = 0; i <= calibration_steps; i++) {
+        iterate(1);
+        if(i == 0) continue;
+        for(size_t d = 0; d < strips.size(); d++) {
+            const Strip& s = strips[d];
+            busy[d] += kernelTime(s.pos_interior) + kernelTime(s.vel_interior);
+        }
+    }
+    
+    std::vector<double> speed(strips.size());
+    double speed_sum = 0.0;
+    for(size_t d = 0; d < strips.size(); d++) {
+        speed[d] = (strips[d].row_num - 2) / std::max(busy[d], 1e-9);
+        speed_sum += speed[d];
+    }
+    
+    // split the rows in proportion to the speeds, the rounding error goes to the largest strip
+    
+    int rows_num = size_y - 2;
+    std::vector<int> rows(strips.size());
+    int assigned = 0;
+    size_t largest = 0;
+    for(size_t d = 0; d < strips.size(); d++) {
+        rows[d] = std::max(MIN_STRIP_ROWS, (int)std::lround(rows_num * speed[d] / speed_sum));
+        assigned += rows[d];
+        if(rows[d] > rows[largest]) largest = d;
+    }
+    rows[largest] += rows_num - assigned;
+    return rows;
+}
+
+template<typename T>
+void ClothStrips<T>::launchRows(Strip& s, cl::Kernel& kernel, int first, int num, const std::vector<cl::Event>* wait, cl::Event* event) {
+    // rows of the strip counted from its upper halo row, the columns at the edges are fixed
+    
+    s.queue.enqueueNDRangeKernel(kernel, cl::NDRange(1, size_t(first)), cl::NDRange(size_t(size_x - 2), size_t(num)), cl::NullRange, wait, event);
+}
+
+template<typename T>
+void ClothStrips<T>::copyHalo(Strip& from, Strip& to, const cl::Buffer& src, const cl::Buffer& dst, const std::vector<cl::Event>& wait, std::vector<cl::Event>& halo) {
+    // the first row of a strip is the lower halo of the strip above it, the last row is the upper halo of the strip below
+    
+    bool up = to.row_start < from.row_start;
+    size_t from_row = up ? 1 : from.row_num;
+    size_t to_row = up ? to.row_num + 1 : 0;
+    
+    // the events of the first step do not exist yet
+    
+    std::vector<cl::Event> events;
+    for(const cl::Event& e : wait) if(e() != nullptr) events.push_back(e);
+    
+    cl::Event event;
+    from.copy_queue.enqueueCopyBuffer(src, dst, from_row * row_size, to_row * row_size, row_size, &events, &event);
+    halo.push_back(event);
+    from.sent.push_back(event);
+}
+
+template<typename T>
+void ClothStrips<T>::stepPositions() {
+    // the boundary rows go first, so that their copies to the neighbours overlap with the interior rows
+    
+    for(Strip& s : strips) {
+        std::vector<cl::Event> sent;
+        sent.swap(s.sent);
+        
+        s.kernel_pos.setArg(2, s.buff_vel[parity]);
+        launchRows(s, s.kernel_pos, 1, 1, &sent, nullptr);
+        launchRows(s, s.kernel_pos, s.row_num, 1, nullptr, &s.pos_boundary);
+        launchRows(s, s.kernel_pos, 2, s.row_num - 2, nullptr, &s.pos_interior);
+        s.queue.flush();
+        s.pos_halo.clear();
+    }
+    
+    // a halo row is overwritten once the velocity update of the previous step has read it
+    
+    for(size_t d = 0; d < strips.size(); d++) {
+        Strip& s = strips[d];
+        if(d > 0) copyHalo(s, strips[d - 1], s.buff_pos, strips[d - 1].buff_pos, {s.pos_boundary, strips[d - 1].vel_interior}, strips[d - 1].pos_halo);
+        if(d < strips.size() - 1) copyHalo(s, strips[d + 1], s.buff_pos, strips[d + 1].buff_pos, {s.pos_boundary, strips[d + 1].vel_interior}, strips[d + 1].pos_halo);
+        s.copy_queue.flush();
+    }
+}
+
+template<typename T>
+void ClothStrips<T>::stepVelocities() {
+    // the forces need the halo positions of this step and the halo velocities of the last one
+    
+    for(Strip& s : strips) {
+        std::vector<cl::Event> halo(s.pos_halo);
+        halo.insert(halo.end(), s.vel_halo.begin(), s.vel_halo.end());
+        
+        s.kernel_vel.setArg(0, s.buff_vel[parity]);
+        s.kernel_vel.setArg(1, s.buff_vel[parity ^ 1]);
+        launchRows(s, s.kernel_vel, 1, 1, &halo, nullptr);
+        launchRows(s, s.kernel_vel, s.row_num, 1, nullptr, &s.vel_boundary);
+        launchRows(s, s.kernel_vel, 2, s.row_num - 2, nullptr, &s.vel_interior);
+        s.queue.flush();
+    }
+    
+    // the new velocities go to the halos of the buffers the neighbours read in the next step, which they do not write in this one
+    
+    for(Strip& s : strips) s.vel_halo.clear();
+    for(size_t d = 0; d < strips.size(); d++) {
+        Strip& s = strips[d];
+        if(d > 0) copyHalo(s, strips[d - 1], s.buff_vel[parity ^ 1], strips[d - 1].buff_vel[parity ^ 1], {s.vel_boundary}, strips[d - 1].vel_halo);
+        if(d < strips.size() - 1) copyHalo(s, strips[d + 1], s.buff_vel[parity ^ 1], strips[d + 1].buff_vel[parity ^ 1], {s.vel_boundary}, strips[d + 1].vel_halo);
+        s.copy_queue.flush();
+    }
+}
+
+template<typename T>
+void ClothStrips<T>::iterate(int steps) {
+    // use the leapfrog algorithm, the velocity buffers swap instead of being copied
+    
+    try {
+        for(int i = 0; i < steps; i++) {
+            stepPositions();
+            stepVelocities();
+            parity ^= 1;
+        }
+        for(Strip& s : strips) {
+            s.queue.finish();
+            s.copy_queue.finish();
+        }
+    } catch(cl::Error e) {
+        KernelGL::processError(e, "ClothStrips");
+    }
+}
+
+template<typename T>
+void ClothStrips<T>::readPositions(std::vector<float>& positions) {
+    // gathers the whole cloth as floats, in the same layout as Cloth::readPositions
+    
+    gatherRows(false, positions);
+}
+
+template<typename T>
+void ClothStrips<T>::readVelocities(std::vector<float>& velocities) {
+    // the velocities half a step behind the positions, as the leapfrog keeps them
+    
+    gatherRows(true, velocities);
+}
+
+template<typename T>
+void ClothStrips<T>::gatherRows(bool velocities, std::vector<float>& values) {
+    try {
+        values.resize(size_t(size_x) * size_y * 3);
+        std::vector<T> rows;
+        for(size_t d = 0; d < strips.size(); d++) {
+            Strip& s = strips[d];
+            rows.resize(size_t(s.row_num + 2) * size_x * 3);
+            s.queue.enqueueReadBuffer(velocities ? s.buff_vel[parity] : s.buff_pos, CL_TRUE, 0, rows.size() * sizeof(T), rows.data());
+            
+            // the owned rows, and the fixed rows from the halos of the first and the last strip
+            
+            int first = d == 0 ? 0 : 1;
+            int last = d == strips.size() - 1 ? s.row_num + 1 : s.row_num;
+            for(int j = first; j <= last; j++) for(int i = 0; i < size_x * 3; i++) {
+                values[size_t(s.row_start - 1 + j) * size_x * 3 + i] = (float)rows[size_t(j) * size_x * 3 + i];
+            }
+        }
+    } catch(cl::Error e) {
+        KernelGL::processError(e, "ClothStrips");
+    }
+}
+
+template<typename T>
+void ClothStrips<T>::printRows() const {
+    for(const Strip& s : strips) {
+        const cl::Device& device = s.device;
+        std::cout << "SUCCESS: ClothStrips: ROWS " << s.row_start << " - " << s.row_start + s.row_num - 1 << " (" << 100.0 * s.row_num / (size_y - 2) << "%) ON " << device.getInfo<CL_DEVICE_NAME>() << std::endl;
+    }
+}
+
+template<typename T>
+std::vector<cl::Device> ClothStrips<T>::partitionCPU(int parts) {
+    // splits the first CPU device into parts sub-devices with equal compute units, or into one sub-device per NUMA node if parts is 0
+    
+    std::vector<cl::Platform> platforms;
+    std::vector<cl::Device> cpus, sub_devices;
+    
+    try {
+        cl::Platform::get(&platforms);
+        for(cl::Platform& platform : platforms) {
+            try {
+                platform.getDevices(CL_DEVICE_TYPE_CPU, &cpus);
+            } catch(cl::Error e) {
+                cpus.clear(); // the platform has no CPU devices
+            }
+            if(cpus.size() > 0) break;
+        }
+        if(cpus.size() == 0) {
+            std::cerr << "ERROR: ClothStrips: NO CPU DEVICES FOUND" << std::endl;
+            exit(-1);
+        }
+        
+        if(parts > 0) {
+            cl_uint units = (cl_uint)cpus[0].getInfo<CL_DEVICE_MAX_COMPUTE_UNITS>();
+            cl_device_partition_property properties[] = {CL_DEVICE_PARTITION_EQUALLY, (cl_device_partition_property)std::max(1u, units / parts), 0};
+            cpus[0].createSubDevices(properties, &sub_devices);
+            if((int)sub_devices.size() > parts) sub_devices.resize(parts); // the compute units left over form an extra sub-device
+        } else {
+            cl_device_partition_property properties[] = {CL_DEVICE_PARTITION_BY_AFFINITY_DOMAIN, CL_DEVICE_AFFINITY_DOMAIN_NUMA, 0};
+            cpus[0].createSubDevices(properties, &sub_devices);
+        }
+    } catch(cl::Error e) {
+        KernelGL::processError(e, "ClothStrips");
+    }
+    
+    std::cout << "SUCCESS: ClothStrips: " << sub_devices.size() << " SUB-DEVICES OF " << cpus[0].getInfo<CL_DEVICE_NAME>() << std::endl;
+    return sub_devices;
+}
+
+template<typename T>
+void ClothStrips<T>::benchmarkScaling(int x, int y, float l, float m, float k, float b, float dt, const std::vector<cl::Device>& devices, const char* kernel_path, int steps) {
+    // strong scaling: the same cloth on the first 1 to N devices, the efficiency is relative to the single device
+    
+    typedef std::chrono::high_resolution_clock clock;
+    
+    double time_single = 0.0;
+    for(size_t n = 1; n <= devices.size(); n++) {
+        std::vector<cl::Device> subset(devices.begin(), devices.begin() + n);
+        ClothStrips<T> cloth(x, y, l, m, k, b, dt, subset, kernel_path);
+        cloth.iterate(1);
+        
+        clock::time_point t0 = clock::now();
+        cloth.iterate(steps);
+        clock::time_point t1 = clock::now();
+        
+        double time = std::chrono::duration<double>(t1 - t0).count();
+        if(n == 1) time_single = time;
+        std::cout << "BENCHMARK: ClothStrips: " << x << "x" << y << " ON " << n << " DEVICES: " << time * 1000.0 / steps << " ms/step, " << (double)steps * x * y / time * 1e-6 << " Mvertex/s, SPEEDUP " << time_single / time << ", EFFICIENCY " << 100.0 * time_single / (n * time) << "%" << std::endl;
+    }
+}
+
+template class ClothStrips<float>;
+template class ClothStrips<double>;
@@ -0,0 +1,316 @@
+//
+//  clothtiles.cpp
+//  Vertex Simulations
+//
+//  Created by Antoni Wójcik on 07/06/2020.
+//  Copyright © 2020 Antoni Wójcik. All rights reserved.
+//
+
+#include "clothtiles.h"
+#include "clothstrips.h"
+#include "kernelgl.h"
+
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cmath>
+#include <chrono>
+#include <cstring>
+#include <cerrno>
+#include <iostream>
+
+#define KERNEL_POS "iteratePos"
+#define KERNEL_VEL "iterateVel"
+
+#define TILE_SLOTS 3 // upload, compute and download
+#define TILE_MEMORY 0.5 // fraction of the device memory used by the slots
+#define COMPARISON_TILES 8 // tiles of the cloth streamed in the comparison with the in-core run
+
+template<typename T>
+ClothTiles<T>::ClothTiles(int x, int y, float l, float m, float k, float b, float dt, const cl::Device& d, const char* kernel_path, const std::string& path, int rows) : size_x(x), size_y(y), length(l), mass(m), stiffness(k), damping(b), time_step(dt), row_size(size_t(x) * 3 * sizeof(T)), state_path(path), state_file(-1), state(nullptr), parity(0), device(d) {
+    if(size_y < 3) {
+        std::cerr << "ERROR: ClothTiles: THE CLOTH NEEDS AT LEAST ONE ROW BETWEEN THE FIXED ONES" << std::endl;
+        exit(-1);
+    }
+    
+    try {
+        context = cl::Context(device);
+        transfer_queue = cl::CommandQueue(context, device);
+        compute_queue = cl::CommandQueue(context, device);
+        program = KernelGL::buildProgram(context, {device}, KernelGL::loadSource(kernel_path, "ClothTiles"), "-D HEADLESS", sizeof(T) == sizeof(cl_double), "ClothTiles");
+        
+        // without a given size the tiles fill a part of the device memory, each slot holds three buffers of the tile and its halos
+        
+        if(rows <= 0) {
+            size_t memory = (size_t)(device.getInfo<CL_DEVICE_GLOBAL_MEM_SIZE>() * TILE_MEMORY);
+            size_t max_alloc = (size_t)device.getInfo<CL_DEVICE_MAX_MEM_ALLOC_SIZE>();
+            size_t slot_rows = std::min(memory / (TILE_SLOTS * 3 * row_size), max_alloc / row_size);
+            rows = (int)std::min((size_t)(size_y - 2), slot_rows > 3 ? slot_rows - 2 : 1);
+        }
+        tile_rows = std::min(rows, size_y - 2);
+        tile_num = (size_y - 2 + tile_rows - 1) / tile_rows;
+        
+        mapState();
+        createSlots(tile_rows);
+        
+        std::cout << "SUCCESS: ClothTiles: " << tile_num << " TILES OF " << tile_rows << " ROWS ON " << device.getInfo<CL_DEVICE_NAME>() << ", STATE OF " << state_size / (1024 * 1024) << " MB " << (state_path.empty() ? "IN MEMORY" : "MAPPED FROM " + state_path) << std::endl;
+        
+        // set the velocity step from 0 to 1/2, afterwards every kick spans a whole step
+        
+        T step[4] = {(T)time_step, (T)time_step * (T)0.5, 0, 0};
+        compute_queue.enqueueWriteBuffer(buff_step, CL_TRUE, 0, sizeof(step), step);
+        pass(false);
+        
+        step[1] = (T)time_step;
+        compute_queue.enqueueWriteBuffer(buff_step, CL_TRUE, 0, sizeof(step), step);
+    } catch(cl::Error e) {
+        KernelGL::processError(e, "ClothTiles");
+    }
+}
+
+template<typename T>
+ClothTiles<T>::~ClothTiles() {
+    // the state file is scratch space, it is removed with the cloth
+    
+    if(state != nullptr) munmap(state, state_size);
+    if(state_file >= 0) {
+        close(state_file);
+        unlink(state_path.c_str());
+    }
+}
+
+template<typename T>
+void ClothTiles<T>::mapState() {
+    // two copies of the positions followed by two copies of the velocities, the pages of a file are written back by the system
+    // when the memory runs out, so the cloth is limited by the disk
+    
+    size_t copy_size = size_t(size_y) * row_size;
+    state_size = 4 * copy_size;
+    
+    if(state_path.empty()) {
+        state = (char*)mmap(nullptr, state_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    } else {
+        state_file = open(state_path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0600);
+        if(state_file < 0 || ftruncate(state_file, (off_t)state_size) != 0) {
+            std::cerr << "ERROR: ClothTiles: CANNOT CREATE THE STATE FILE " << state_path << ": " << std::strerror(errno) << std::endl;
+            exit(-1);
+        }
+        state = (char*)mmap(nullptr, state_size, PROT_READ | PROT_WRITE, MAP_SHARED, state_file, 0);
+    }
+    if(state == MAP_FAILED) {
+        state = nullptr;
+        std::cerr << "ERROR: ClothTiles: CANNOT MAP THE STATE OF " << state_size << " BYTES: " << std::strerror(errno) << std::endl;
+        exit(-1);
+    }
+    
+    // every pass reads the rows in order
+    
+    madvise(state, state_size, MADV_SEQUENTIAL);
+    
+    // the same flat cloth as Cloth, generated row by row, the velocities of a new mapping are already zero
+    
+    T half_width = (T)((size_x - 1) * length) * (T)0.5;
+    T half_height = (T)((size_y - 1) * length) * (T)0.5;
+    for(int p = 0; p < 2; p++) {
+        T* pos = hostPos(p);
+        for(int j = 0; j < size_y; j++) for(int i = 0; i < size_x; i++) {
+            pos[(size_t(j) * size_x + i) * 3]     = -half_width  + (T)i * length;
+            pos[(size_t(j) * size_x + i) * 3 + 1] =  (T)0;
+            pos[(size_t(j) * size_x + i) * 3 + 2] =  half_height - (T)j * length;
+        }
+    }
+}
+
+template<typename T>
+void ClothTiles<T>::createSlots(int rows) {
+    // the kernels are shared by the slots, their buffer arguments are set for every tile
+    
+    size_t slot_size = size_t(rows + 2) * row_size;
+    for(Slot& s : slots) {
+        s.buff_pos = cl::Buffer(context, CL_MEM_READ_WRITE, slot_size);
+        s.buff_vel_i = cl::Buffer(context, CL_MEM_READ_WRITE, slot_size);
+        s.buff_vel_f = cl::Buffer(context, CL_MEM_READ_WRITE, slot_size);
+        
+        // the columns at the edges are not written by the kernels, their velocities stay zero
+        
+        compute_queue.enqueueFillBuffer(s.buff_vel_f, (cl_uchar)0, 0, slot_size);
+    }
+    buff_step = cl::Buffer(context, CL_MEM_READ_WRITE, 4 * sizeof(T));
+    compute_queue.finish();
+    
+    kernel_pos = cl::Kernel(program, KERNEL_POS);
+    kernel_pos.setArg(3, size_x);
+    kernel_pos.setArg(5, buff_step);
+    
+    kernel_vel = cl::Kernel(program, KERNEL_VEL);
+    kernel_vel.setArg(3, size_x);
+    kernel_vel.setArg(5, (T)length);
+    kernel_vel.setArg(6, (T)stiffness / mass);
+    kernel_vel.setArg(7, (T)damping / mass);
+    kernel_vel.setArg(8, buff_step);
+}
+
+template<typename T>
+T* ClothTiles<T>::hostPos(int p) const {
+    return (T*)(state + size_t(p) * size_y * row_size);
+}
+
+template<typename T>
+T* ClothTiles<T>::hostVel(int p) const {
+    return (T*)(state + size_t(2 + p) * size_y * row_size);
+}
+
+template<typename T>
+void ClothTiles<T>::upload(int tile) {
+    // the rows of the tile with the halo rows above and below it, always inside the cloth thanks to the fixed rows
+    
+    Slot& s = slots[tile % TILE_SLOTS];
+    int row_start = 1 + tile * tile_rows;
+    int row_num = std::min(tile_rows, size_y - 1 - row_start);
+    size_t offset = size_t(row_start - 1) * row_size;
+    size_t size = size_t(row_num + 2) * row_size;
+    
+    // the slot is free once its last download is done, which the transfer queue orders
+    
+    transfer_queue.enqueueWriteBuffer(s.buff_pos, CL_FALSE, 0, size, (char*)hostPos(parity) + offset);
+    transfer_queue.enqueueWriteBuffer(s.buff_vel_i, CL_FALSE, 0, size, (char*)hostVel(parity) + offset, nullptr, &s.uploaded);
+    transfer_queue.flush();
+}
+
+template<typename T>
+void ClothTiles<T>::compute(int tile, bool drift) {
+    // the halo rows drift together with the tile, so that the forces see the positions of this step
+    
+    Slot& s = slots[tile % TILE_SLOTS];
+    int row_start = 1 + tile * tile_rows;
+    int row_num = std::min(tile_rows, size_y - 1 - row_start);
+    std::vector<cl::Event> wait = {s.uploaded};
+    
+    if(drift) {
+        // the fixed rows of the cloth are not moved, the rows are counted from the upper halo
+        
+        int first = std::max(row_start - 1, 1) - (row_start - 1);
+        int last = std::min(row_start + row_num, size_y - 2) - (row_start - 1);
+        kernel_pos.setArg(0, s.buff_pos);
+        kernel_pos.setArg(1, s.buff_pos); // the OpenGL positions, not written without drawing
+        kernel_pos.setArg(2, s.buff_vel_i);
+        kernel_pos.setArg(4, row_num + 2);
+        compute_queue.enqueueNDRangeKernel(kernel_pos, cl::NDRange(1, size_t(first)), cl::NDRange(size_t(size_x - 2), size_t(last - first + 1)), cl::NullRange, &wait);
+        wait.clear();
+    }
+    
+    kernel_vel.setArg(0, s.buff_vel_i);
+    kernel_vel.setArg(1, s.buff_vel_f);
+    kernel_vel.setArg(2, s.buff_pos);
+    kernel_vel.setArg(4, row_num + 2);
+    compute_queue.enqueueNDRangeKernel(kernel_vel, cl::NDRange(1, 1), cl::NDRange(size_t(size_x - 2), size_t(row_num)), cl::NullRange, wait.empty() ? nullptr : &wait, &s.computed);
+    compute_queue.flush();
+}
+
+template<typename T>
+void ClothTiles<T>::download(int tile) {
+    // only the rows of the tile go back, into the other copy of the state, which the uploads of this pass do not read
+    
+    Slot& s = slots[tile % TILE_SLOTS];
+    int row_start = 1 + tile * tile_rows;
+    int row_num = std::min(tile_rows, size_y - 1 - row_start);
+    size_t offset = size_t(row_start) * row_size;
+    size_t size = size_t(row_num) * row_size;
+    std::vector<cl::Event> wait = {s.computed};
+    
+    transfer_queue.enqueueReadBuffer(s.buff_pos, CL_FALSE, row_size, size, (char*)hostPos(parity ^ 1) + offset, &wait);
+    transfer_queue.enqueueReadBuffer(s.buff_vel_f, CL_FALSE, row_size, size, (char*)hostVel(parity ^ 1) + offset);
+    transfer_queue.flush();
+}
+
+template<typename T>
+void ClothTiles<T>::pass(bool drift) {
+    // the upload of the next tile is queued before the download of the current one, which waits for its computation,
+    // so the transfers of the neighbouring tiles overlap with every computation
+    
+    upload(0);
+    for(int t = 0; t < tile_num; t++) {
+        if(t + 1 < tile_num) upload(t + 1);
+        compute(t, drift);
+        download(t);
+    }
+    transfer_queue.finish();
+    compute_queue.finish();
+    
+    // the fixed rows are never downloaded and are the same in both copies
+    
+    parity ^= 1;
+}
+
+template<typename T>
+void ClothTiles<T>::iterate(int steps) {
+    // use the leapfrog algorithm, every step is one pass over the tiles
+    
+    try {
+        for(int i = 0; i < steps; i++) pass(true);
+    } catch(cl::Error e) {
+        KernelGL::processError(e, "ClothTiles");
+    }
+}
+
+template<typename T>
+void ClothTiles<T>::readPositions(std::vector<float>& positions) const {
+    // the whole cloth as floats, in the same layout as Cloth::readPositions
+    
+    const T* pos = hostPos(parity);
+    positions.resize(size_t(size_x) * size_y * 3);
+    for(size_t i = 0; i < positions.size(); i++) positions[i] = (float)pos[i];
+}
+
+template<typename T>
+void ClothTiles<T>::readVelocities(std::vector<float>& velocities) const {
+    // the velocities half a step behind the positions, as the leapfrog keeps them
+    
+    const T* vel = hostVel(parity);
+    velocities.resize(size_t(size_x) * size_y * 3);
+    for(size_t i = 0; i < velocities.size(); i++) velocities[i] = (float)vel[i];
+}
+
+template<typename T>
+void ClothTiles<T>::benchmarkOutOfCore(int x_core, int x_large, float l, float m, float k, float b, float dt, const cl::Device& d, const char* kernel_path, const std::string& path, int steps) {
+    // the in-core rate is the same cloth held on the device by ClothStrips, the tiled run of that cloth also has to match its positions
+    
+    typedef std::chrono::high_resolution_clock clock;
+    
+    ClothStrips<T> in_core(x_core, x_core, l, m, k, b, dt, {d}, kernel_path);
+    in_core.iterate(1);
+    clock::time_point t0 = clock::now();
+    in_core.iterate(steps);
+    clock::time_point t1 = clock::now();
+    double rate_core = (double)steps * x_core * x_core / std::chrono::duration<double>(t1 - t0).count();
+    std::cout << "BENCHMARK: ClothTiles: " << x_core << "x" << x_core << " IN-CORE: " << rate_core * 1e-6 << " Mvertex/s" << std::endl;
+    
+    ClothTiles<T> streamed(x_core, x_core, l, m, k, b, dt, d, kernel_path, "", (x_core - 2 + COMPARISON_TILES - 1) / COMPARISON_TILES);
+    streamed.iterate(1);
+    t0 = clock::now();
+    streamed.iterate(steps);
+    t1 = clock::now();
+    double rate_streamed = (double)steps * x_core * x_core / std::chrono::duration<double>(t1 - t0).count();
+    
+    std::vector<float> pos_core, pos_streamed;
+    in_core.readPositions(pos_core);
+    streamed.readPositions(pos_streamed);
+    float difference = 0.0f;
+    for(size_t i = 0; i < pos_core.size(); i++) difference = std::max(difference, std::abs(pos_core[i] - pos_streamed[i]));
+    std::cout << "BENCHMARK: ClothTiles: " << x_core << "x" << x_core << " IN " << COMPARISON_TILES << " TILES: " << rate_streamed * 1e-6 << " Mvertex/s, " << 100.0 * rate_streamed / rate_core << "% OF IN-CORE, MAX DIFFERENCE " << difference << std::endl;
+    
+    // the large cloth does not fit on the device, its tiles are sized from the device memory
+    
+    ClothTiles<T> large(x_large, x_large, l, m, k, b, dt, d, kernel_path, path);
+    large.iterate(1);
+    t0 = clock::now();
+    large.iterate(steps);
+    t1 = clock::now();
+    double rate_large = (double)steps * x_large * x_large / std::chrono::duration<double>(t1 - t0).count();
+    std::cout << "BENCHMARK: ClothTiles: " << x_large << "x" << x_large << " OUT-OF-CORE: " << rate_large * 1e-6 << " Mvertex/s, " << 100.0 * rate_large / rate_core << "% OF IN-CORE" << std::endl;
+}
+
+template class ClothTiles<float>;
+template class ClothTiles<double>;
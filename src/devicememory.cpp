@@ -0,0 +1,133 @@
+//
+//  devicememory.cpp
+//  Vertex Simulations
+//
+//  Created by Antoni Wójcik on 03/06/2020.
+//  Copyright © 2020 Antoni Wójcik. All rights reserved.
+//
+
+#include "devicememory.h"
+
+#include <iostream>
+#include <algorithm>
+#include <numeric>
+
+#define MB (1024.0 * 1024.0)
+
+DeviceMemory::DeviceMemory() : budget(0), max_alloc(0), peak(0), planned(false) {}
+
+void DeviceMemory::request(cl::Buffer& buffer, size_t size, unsigned int phases, const char* name, cl_mem_flags flags) {
+    if(planned) {
+        std::cerr << "ERROR: DeviceMemory: REQUEST AFTER THE PLAN: " << name << std::endl;
+        exit(-1);
+    }
+    requests.push_back({name, size, phases, flags, &buffer, -1});
+}
+
+void DeviceMemory::reserve(size_t size, const char* name) {
+    // reserving the same name again replaces the size, a planned pool checks the budget again
+    
+    auto it = std::find_if(reserved.begin(), reserved.end(), [name](const std::pair<std::string, size_t>& r) { return r.first == name; });
+    if(it != reserved.end()) it->second = size;
+    else reserved.push_back({name, size});
+    
+    if(planned) check();
+}
+
+void DeviceMemory::plan(const cl::Device& device) {
+    budget = device.getInfo<CL_DEVICE_GLOBAL_MEM_SIZE>();
+    max_alloc = device.getInfo<CL_DEVICE_MAX_MEM_ALLOC_SIZE>();
+    
+    // place the largest requests first, each one goes to the first slab none of whose requests is live at the same time
+    
+    std::vector<size_t> order(requests.size());
+    std::iota(order.begin(), order.end(), 0);
+    std::stable_sort(order.begin(), order.end(), [this](size_t a, size_t b) { return requests[a].size > requests[b].size; });
+    
+    slabs.clear();
+    for(size_t i : order) {
+        Request& r = requests[i];
+        r.slab = -1;
+        for(size_t s = 0; s < slabs.size() && r.slab < 0; s++) if((slabs[s].phases & r.phases) == 0 && slabs[s].flags == r.flags) r.slab = (int)s;
+        if(r.slab < 0) {
+            r.slab = (int)slabs.size();
+            slabs.push_back({0, 0, r.flags, false, cl::Buffer()});
+        }
+        slabs[r.slab].size = std::max(slabs[r.slab].size, r.size);
+        slabs[r.slab].phases |= r.phases;
+        
+        if(r.size > max_alloc) {
+            std::cerr << "ERROR: DeviceMemory: " << r.name << " (" << r.size / MB << " MB) EXCEEDS THE LARGEST ALLOCATION OF " << max_alloc / MB << " MB" << std::endl;
+            exit(-1);
+        }
+    }
+    
+    planned = true;
+    check();
+    report();
+}
+
+size_t DeviceMemory::liveSize(unsigned int phase) const {
+    // the memory in use during the phase, the reserved memory is always live
+    
+    size_t size = 0;
+    for(const Slab& s : slabs) if(s.phases & phase) size += s.size;
+    for(const std::pair<std::string, size_t>& r : reserved) size += r.second;
+    return size;
+}
+
+void DeviceMemory::check() {
+    // the peak is the largest live size over the phases, refuse the configuration before it fails mid-run
+    
+    unsigned int phases = 0;
+    for(const Slab& s : slabs) phases |= s.phases;
+    
+    peak = liveSize(0);
+    for(int bit = 0; bit < 32; bit++) if(phases & (1u << bit)) peak = std::max(peak, liveSize(1u << bit));
+    
+    if(peak > budget) {
+        std::cerr << "ERROR: DeviceMemory: THE PEAK OF " << peak / MB << " MB EXCEEDS THE DEVICE MEMORY OF " << budget / MB << " MB" << std::endl;
+        report();
+        exit(-1);
+    }
+}
+
+void DeviceMemory::acquire(const cl::Context& context, unsigned int phases) {
+    // allocate the slabs live in any of the phases, every request sharing a slab gets the same buffer
+    
+    for(size_t s = 0; s < slabs.size(); s++) {
+        if(slabs[s].allocated || (slabs[s].phases & phases) == 0) continue;
+        
+        slabs[s].buffer = cl::Buffer(context, slabs[s].flags, slabs[s].size);
+        slabs[s].allocated = true;
+        for(Request& r : requests) if(r.slab == (int)s) *r.target = slabs[s].buffer;
+    }
+}
+
+void DeviceMemory::release(unsigned int phases) {
+    // free the slabs that are live only in the given phases
+    
+    for(size_t s = 0; s < slabs.size(); s++) {
+        if(!slabs[s].allocated || (slabs[s].phases & ~phases) != 0) continue;
+        
+        slabs[s].buffer = cl::Buffer();
+        slabs[s].allocated = false;
+        for(Request& r : requests) if(r.slab == (int)s) *r.target = cl::Buffer();
+    }
+}
+
+void DeviceMemory::report() const {
+    size_t requested = 0;
+    for(const Request& r : requests) requested += r.size;
+    for(const std::pair<std::string, size_t>& r : reserved) requested += r.second;
+    
+    std::cout << "SUCCESS: DeviceMemory: PEAK " << peak / MB << " MB OF " << budget / MB << " MB, " << requested / MB << " MB WITHOUT ALIASING" << std::endl;
+    for(size_t s = 0; s < slabs.size(); s++) {
+        std::string names;
+        int count = 0;
+        for(const Request& r : requests) if(r.slab == (int)s) {
+            names += (count++ > 0 ? ", " : "") + r.name;
+        }
+        if(count > 1) std::cout << "SUCCESS: DeviceMemory: SHARED " << slabs[s].size / MB << " MB: " << names << std::endl;
+    }
+}
@@ -0,0 +1,90 @@
+//
+//  diagnostics.cpp
+//  Vertex Simulations
+//
+//  Created by Antoni Wójcik on 02/06/2020.
+//  Copyright © 2020 Antoni Wójcik. All rights reserved.
+//
+
+#include "diagnostics.h"
+
+#define KERNEL_REDUCE "reduceDiagnostics"
+
+#define GROUP_SIZE 256
+
+Diagnostics::Diagnostics(const cl::Context& context, const cl::Program& program, size_t items, float mass, const std::function<void(const DiagnosticsRecord&)>& cb, int ring) : total_mass(mass), ring_size(ring), ring_head(0), ring_tail(0), host_ring(ring), ring_step(ring, 0), ring_events(ring), ring_ready(new std::atomic<int>[ring]), dropped(0), callback(cb) {
+    group_num = (items + GROUP_SIZE - 1) / GROUP_SIZE;
+    for(int i = 0; i < ring_size; i++) ring_ready[i] = 0;
+    
+    buff_partial = cl::Buffer(context, CL_MEM_READ_WRITE, group_num * sizeof(cl_float8));
+    buff_ring = cl::Buffer(context, CL_MEM_READ_WRITE, ring_size * sizeof(cl_float8));
+    
+    kernel_reduce = cl::Kernel(program, KERNEL_REDUCE);
+    kernel_reduce.setArg(0, buff_partial);
+    kernel_reduce.setArg(1, buff_ring);
+    kernel_reduce.setArg(2, cl::Local(GROUP_SIZE * sizeof(cl_float8)));
+    kernel_reduce.setArg(3, (cl_int)group_num);
+}
+
+Diagnostics::~Diagnostics() {
+    // the reads still in flight write to the host ring
+    
+    for(int i = ring_tail; i < ring_head; i++) ring_events[i % ring_size].wait();
+}
+
+size_t Diagnostics::getGroupSize() {
+    return GROUP_SIZE;
+}
+
+void CL_CALLBACK Diagnostics::readComplete(cl_event event, cl_int status, void* ready) {
+    // called by the OpenCL runtime, possibly from another thread; a read that failed leaves the slot without a record
+    
+    static_cast<std::atomic<int>*>(ready)->store(status < 0 ? -1 : 1);
+}
+
+void Diagnostics::enqueue(cl::CommandQueue& queue, long step) {
+    // the simulation kernel has already written the partial sums to buff_partial
+    
+    if(ring_head - ring_tail == ring_size) {
+        // never wait for the host to catch up, skip the sample instead
+        dropped++;
+        return;
+    }
+    
+    int slot = ring_head % ring_size;
+    ring_step[slot] = step;
+    ring_ready[slot] = 0;
+    
+    kernel_reduce.setArg(4, slot);
+    queue.enqueueNDRangeKernel(kernel_reduce, cl::NullRange, cl::NDRange(GROUP_SIZE), cl::NDRange(GROUP_SIZE));
+    queue.enqueueReadBuffer(buff_ring, CL_FALSE, slot * sizeof(cl_float8), sizeof(cl_float8), &host_ring[slot], NULL, &ring_events[slot]);
+    ring_events[slot].setCallback(CL_COMPLETE, readComplete, &ring_ready[slot]);
+    
+    ring_head++;
+}
+
+void Diagnostics::poll() {
+    // deliver the finished records in order
+    
+    while(ring_tail != ring_head) {
+        int slot = ring_tail % ring_size;
+        int ready = ring_ready[slot];
+        if(ready == 0) break;
+        if(ready < 0) {
+            ring_tail++;
+            dropped++;
+            continue;
+        }
+        
+        const cl_float8& r = host_ring[slot];
+        DiagnosticsRecord record;
+        record.step = ring_step[slot];
+        record.kinetic = r.s[0];
+        record.potential = r.s[1];
+        record.momentum = glm::vec3(r.s[2], r.s[3], r.s[4]);
+        record.centre = glm::vec3(r.s[5], r.s[6], r.s[7]) / total_mass;
+        
+        ring_tail++;
+        if(callback) callback(record);
+    }
+}
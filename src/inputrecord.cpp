@@ -0,0 +1,253 @@
+//
+//  inputrecord.cpp
+//  Vertex Simulations
+//
+//  Created by Antoni Wójcik on 11/06/2020.
+//  Copyright © 2020 Antoni Wójcik. All rights reserved.
+//
+
+#include "inputrecord.h"
+
+#include <iostream>
+#include <sstream>
+#include <iomanip>
+#include <algorithm>
+#include <map>
+#include <cmath>
+
+#define HISTOGRAM_BINS 10
+#define HISTOGRAM_WIDTH 40 // characters of the largest bin
+
+// upper edges of the frame time bins in ms, the last bin takes the rest
+static const double histogram_edges[HISTOGRAM_BINS - 1] = {2.0, 4.0, 8.0, 12.0, 16.7, 20.0, 25.0, 33.3, 50.0};
+
+InputRecorder::InputRecorder(GLFWwindow* w, InputMode m, const std::string& path, GLFWcursorposfun cursor, GLFWscrollfun scroll, GLFWmousebuttonfun button) : window(w), mode(m), cursor_callback(cursor), scroll_callback(scroll), button_callback(button), frame_index(0), keys(GLFW_KEY_LAST + 1, GLFW_RELEASE), last_steps(0) {
+    glfwSetWindowUserPointer(window, this);
+    
+    if(mode == INPUT_REPLAY) {
+        // the real mouse and keyboard are ignored, the recorded events are sent to the callbacks in pollEvents
+        
+        load(path);
+        glfwSetCursorPosCallback(window, NULL);
+        glfwSetScrollCallback(window, NULL);
+        glfwSetMouseButtonCallback(window, NULL);
+        std::cout << "SUCCESS: InputRecorder: REPLAYING " << frames.size() << " FRAMES FROM " << path << std::endl;
+    } else {
+        if(mode == INPUT_RECORD) {
+            log.open(path);
+            if(!log.is_open()) {
+                std::cerr << "ERROR: InputRecorder: Cannot open the file: " << path << std::endl;
+                exit(-1);
+            }
+            log << std::setprecision(17);
+            glfwSetKeyCallback(window, keyCallback);
+            
+            // the keys already held are the state the replay starts from, they come before the first frame
+            
+            for(int key = GLFW_KEY_SPACE; key <= GLFW_KEY_LAST; key++) if(glfwGetKey(window, key) == GLFW_PRESS) log << "K " << key << " " << GLFW_PRESS << "\n";
+        }
+        glfwSetCursorPosCallback(window, cursorCallback);
+        glfwSetScrollCallback(window, scrollCallback);
+        glfwSetMouseButtonCallback(window, buttonCallback);
+    }
+}
+
+InputRecorder::~InputRecorder() {
+    if(mode == INPUT_RECORD) {
+        glfwSetKeyCallback(window, NULL);
+        log.close();
+        std::cout << "SUCCESS: InputRecorder: RECORDED " << frame_steps.size() << " FRAMES" << std::endl;
+    }
+    glfwSetCursorPosCallback(window, cursor_callback);
+    glfwSetScrollCallback(window, scroll_callback);
+    glfwSetMouseButtonCallback(window, button_callback);
+    glfwSetWindowUserPointer(window, NULL);
+}
+
+void InputRecorder::load(const std::string& path) {
+    std::ifstream file(path);
+    if(!file.is_open()) {
+        std::cerr << "ERROR: InputRecorder: Cannot open the file: " << path << std::endl;
+        exit(-1);
+    }
+    
+    std::string line;
+    long line_number = 0;
+    while(std::getline(file, line)) {
+        line_number++;
+        if(line.empty()) continue;
+        
+        std::istringstream stream(line.substr(1));
+        Event event = {line[0], 0, 0, 0, 0.0, 0.0};
+        bool valid;
+        
+        switch(event.type) {
+            case 'F': {
+                Frame frame;
+                valid = (bool)(stream >> frame.delta_time);
+                if(valid) frames.push_back(frame);
+                break;
+            }
+            case 'K':
+                valid = (bool)(stream >> event.a >> event.b) && event.a >= 0 && event.a <= GLFW_KEY_LAST;
+                break;
+            case 'C':
+            case 'S':
+                valid = (bool)(stream >> event.x >> event.y);
+                break;
+            case 'B':
+                valid = (bool)(stream >> event.a >> event.b >> event.c);
+                break;
+            default:
+                valid = false;
+        }
+        
+        if(!valid || (event.type != 'F' && event.type != 'K' && frames.empty())) {
+            std::cerr << "ERROR: InputRecorder: Invalid line " << line_number << " of " << path << ": " << line << std::endl;
+            exit(-1);
+        }
+        if(event.type == 'K' && frames.empty()) keys[event.a] = (char)event.b; // held when the recording started
+        else if(event.type != 'F') frames.back().events.push_back(event);
+    }
+    
+    if(frames.empty()) {
+        std::cerr << "ERROR: InputRecorder: No frames in the file: " << path << std::endl;
+        exit(-1);
+    }
+}
+
+InputRecorder* InputRecorder::fromWindow(GLFWwindow* window) {
+    return (InputRecorder*)glfwGetWindowUserPointer(window);
+}
+
+void InputRecorder::keyCallback(GLFWwindow* window, int key, int scancode, int action, int mods) {
+    // only the state of the keys is read by the loop, the repeats do not change it
+    
+    if(key < 0 || action == GLFW_REPEAT) return;
+    fromWindow(window)->log << "K " << key << " " << action << "\n";
+}
+
+void InputRecorder::cursorCallback(GLFWwindow* window, double x, double y) {
+    InputRecorder* recorder = fromWindow(window);
+    if(recorder->mode == INPUT_RECORD) recorder->log << "C " << x << " " << y << "\n";
+    if(recorder->cursor_callback) recorder->cursor_callback(window, x, y);
+}
+
+void InputRecorder::scrollCallback(GLFWwindow* window, double x, double y) {
+    InputRecorder* recorder = fromWindow(window);
+    if(recorder->mode == INPUT_RECORD) recorder->log << "S " << x << " " << y << "\n";
+    if(recorder->scroll_callback) recorder->scroll_callback(window, x, y);
+}
+
+void InputRecorder::buttonCallback(GLFWwindow* window, int button, int action, int mods) {
+    InputRecorder* recorder = fromWindow(window);
+    if(recorder->mode == INPUT_RECORD) recorder->log << "B " << button << " " << action << " " << mods << "\n";
+    if(recorder->button_callback) recorder->button_callback(window, button, action, mods);
+}
+
+float InputRecorder::beginFrame(float delta_time) {
+    // the frame time is the period of the loop, from the start of a frame to the start of the next, once the previous frame has ended
+    
+    std::chrono::high_resolution_clock::time_point now = std::chrono::high_resolution_clock::now();
+    if(frame_steps.size() > frame_times.size()) frame_times.push_back(std::chrono::duration<double>(now - frame_start).count() * 1000.0);
+    frame_start = now;
+    
+    if(mode == INPUT_RECORD) log << "F " << delta_time << "\n";
+    else if(mode == INPUT_REPLAY) {
+        // the frames after the end of the recording are not measured
+        
+        if(frame_index >= frames.size()) {
+            glfwSetWindowShouldClose(window, true);
+            return 0.0f;
+        }
+        return frames[frame_index].delta_time;
+    }
+    return delta_time;
+}
+
+void InputRecorder::endFrame(long steps_taken) {
+    if(mode == INPUT_REPLAY) {
+        if(frame_index >= frames.size()) return;
+        frame_index++;
+    }
+    
+    frame_steps.push_back(steps_taken - last_steps);
+    last_steps = steps_taken;
+}
+
+int InputRecorder::getKey(int key) const {
+    if(mode == INPUT_REPLAY) return keys[key];
+    return glfwGetKey(window, key);
+}
+
+void InputRecorder::pollEvents() {
+    if(mode != INPUT_REPLAY) {
+        glfwPollEvents();
+        return;
+    }
+    
+    // the events of the window, such as resizing and closing, are still processed, then the recorded input of the frame is sent
+    
+    glfwPollEvents();
+    if(frame_index >= frames.size()) return;
+    
+    for(const Event& event : frames[frame_index].events) {
+        switch(event.type) {
+            case 'K':
+                keys[event.a] = (char)event.b;
+                break;
+            case 'C':
+                if(cursor_callback) cursor_callback(window, event.x, event.y);
+                break;
+            case 'S':
+                if(scroll_callback) scroll_callback(window, event.x, event.y);
+                break;
+            case 'B':
+                if(button_callback) button_callback(window, event.a, event.b, event.c);
+                break;
+        }
+    }
+}
+
+void InputRecorder::printStats() const {
+    if(frame_times.empty()) return;
+    
+    size_t n = frame_times.size();
+    std::vector<double> sorted(frame_times);
+    std::sort(sorted.begin(), sorted.end());
+    
+    // nearest-rank percentiles
+    
+    auto percentile = [&](double p) { return sorted[std::max((size_t)std::ceil(p * n), (size_t)1) - 1]; };
+    
+    double total = 0.0;
+    for(double t : frame_times) total += t;
+    
+    std::cout << "BENCHMARK: InputRecorder: " << n << " FRAMES, FRAME TIME MEAN " << total / n << " ms, P50 " << percentile(0.5) << " ms, P95 " << percentile(0.95) << " ms, P99 " << percentile(0.99) << " ms, WORST " << sorted.back() << " ms" << std::endl;
+    
+    size_t bins[HISTOGRAM_BINS] = {0};
+    for(double t : frame_times) bins[std::upper_bound(histogram_edges, histogram_edges + HISTOGRAM_BINS - 1, t) - histogram_edges]++;
+    size_t largest = *std::max_element(bins, bins + HISTOGRAM_BINS);
+    
+    for(int i = 0; i < HISTOGRAM_BINS; i++) {
+        std::ostringstream range;
+        if(i == 0) range << "< " << histogram_edges[0];
+        else if(i == HISTOGRAM_BINS - 1) range << ">= " << histogram_edges[i - 1];
+        else range << histogram_edges[i - 1] << " - " << histogram_edges[i];
+        
+        std::cout << "STATS: FRAME TIME " << std::setw(12) << range.str() << " ms: " << std::setw(6) << bins[i] << " " << std::string(bins[i] * HISTOGRAM_WIDTH / largest, '#') << std::endl;
+    }
+    
+    // steps of the simulation per frame, the frames without any step only drew the cloth; the last frame has steps but no period
+    
+    n = frame_steps.size();
+    long steps_total = 0;
+    std::map<long, size_t> step_counts;
+    for(long s : frame_steps) {
+        steps_total += s;
+        step_counts[s]++;
+    }
+    
+    std::cout << "BENCHMARK: InputRecorder: " << steps_total << " STEPS, " << (double)steps_total / n << " STEPS PER FRAME (" << step_counts.begin()->first << " - " << step_counts.rbegin()->first << ")" << std::endl;
+    for(const std::pair<const long, size_t>& count : step_counts) std::cout << "STATS: " << count.first << " STEPS: " << count.second << " FRAMES (" << 100.0 * count.second / n << " %)" << std::endl;
+}
@@ -12,21 +12,33 @@
 
 // include the standard libraries
 #include <iostream>
+#include <cmath>
 #include <vector>
 #include <string>
 #include <fstream>
 #include <sstream>
+#include <thread>
+#include <chrono>
 
-KernelGL::KernelGL(const char* kernel_path) {
+thread_local int KernelGL::recoverable_errors = 0;
+
+KernelGL::KernelGL(const char* kernel_path, const std::string& options, bool fp64, const std::vector<const char*>& fp64_extensions) : builds_pending(0), kernels_ready(false), diagnostics_every(0), diagnostics_pending(false), diagnostics(nullptr), step_count(0) {
     try {
         initialiseOpenCL();
-        buildProgram(kernel_path);
+        
+        // the double precision programs are built with REAL defined, check the support before building
+        
+        if(fp64) {
+            requireExtension({device}, "cl_khr_fp64", "OpenCL");
+            for(const char* extension : fp64_extensions) requireExtension({device}, extension, "OpenCL");
+        }
+        buildProgram(kernel_path, program, fp64 ? "-D REAL=double " + options : options, true);
     } catch(cl::Error e) {
         processError(e);
     }
 }
 
-std::string KernelGL::loadSource(const char* kernel_path) {
+std::string KernelGL::loadSource(const char* kernel_path, const char* owner) {
     std::string kernel_code;
     std::ifstream kernel_file;
     kernel_file.exceptions(std::ifstream::failbit | std::ifstream::badbit);
@@ -38,7 +50,7 @@ std::string KernelGL::loadSource(const char* kernel_path) {
         kernel_file.close();
         kernel_code = kernel_stream.str();
     } catch(std::ifstream::failure e) {
-        std::cerr << "ERROR: OpenCL KERNEL: CANNOT READ KERNEL CODE" << std::endl;
+        std::cerr << "ERROR: " << owner << ": CANNOT READ KERNEL CODE " << kernel_path << std::endl;
         exit(-1); //stop executing the program with the error code -1;
     }
     return kernel_code;
@@ -55,6 +67,56 @@ void KernelGL::processError(cl::Error& e) {
     exit(-1);
 }
 
+void KernelGL::processError(cl::Error& e, const char* owner) {
+    std::cerr << "ERROR: " << owner << ": OpenCL: " << e.what() << ": " << e.err() << std::endl;
+    std::cerr << oclErrorString(e.err()) << std::endl;
+    if(recoverable_errors > 0) throw e;
+    exit(-1);
+}
+
+float KernelGL::halfToFloat(cl_half h) {
+    // IEEE 754 binary16, with the subnormals
+    
+    int exponent = (h >> 10) & 0x1f, mantissa = h & 0x3ff;
+    float value;
+    if(exponent == 0) value = std::ldexp((float)mantissa, -24);
+    else if(exponent == 31) value = mantissa == 0 ? INFINITY : NAN;
+    else value = std::ldexp((float)(mantissa | 0x400), exponent - 25);
+    return (h & 0x8000) ? -value : value;
+}
+
+bool KernelGL::deviceSupports(const cl::Device& device, const char* extension) {
+    return device.getInfo<CL_DEVICE_EXTENSIONS>().find(extension) != std::string::npos;
+}
+
+void KernelGL::requireExtension(const std::vector<cl::Device>& devices, const char* extension, const char* owner) {
+    for(const cl::Device& device : devices) if(!deviceSupports(device, extension)) {
+        std::cerr << "ERROR: " << owner << ": " << device.getInfo<CL_DEVICE_NAME>() << " DOES NOT SUPPORT " << extension << std::endl;
+        exit(-1);
+    }
+}
+
+cl::Program KernelGL::buildProgram(const cl::Context& context, const std::vector<cl::Device>& devices, const std::string& source, const std::string& options, bool fp64, const char* owner, const std::vector<const char*>& fp64_extensions) {
+    // blocking build for the given devices, the double precision is checked and selected as for the simulations
+    
+    if(fp64) {
+        requireExtension(devices, "cl_khr_fp64", owner);
+        for(const char* extension : fp64_extensions) requireExtension(devices, extension, owner);
+    }
+    
+    cl::Program::Sources sources;
+    sources.push_back({source.c_str(), source.length()});
+    cl::Program program(context, sources);
+    try {
+        program.build(devices, (fp64 ? "-D REAL=double " + options : options).c_str());
+    } catch(cl::Error e) {
+        if(e.err() != CL_BUILD_PROGRAM_FAILURE) throw;
+        for(const cl::Device& device : devices) std::cerr << "ERROR: " << owner << ": CANNOT BUILD PROGRAM: " << program.getBuildInfo<CL_PROGRAM_BUILD_LOG>(device) << std::endl;
+        exit(-1);
+    }
+    return program;
+}
+
 void KernelGL::initialiseOpenCL() {
     std::vector<cl::Platform> platforms;
     std::vector<cl::Device> devices;
@@ -92,15 +154,145 @@ void KernelGL::initialiseOpenCL() {
     context = cl::Context(device, properties);
 }
 
-void KernelGL::buildProgram(const char* kernel_path) {
+void KernelGL::buildProgram(const char* kernel_path, cl::Program& prog, const std::string& options, bool async) {
     // upload program source
     
     std::string kernel_code = loadSource(kernel_path);
     cl::Program::Sources sources;
-    sources.push_back({kernel_code.c_str(), kernel_code.length()});
+    sources.push_back({kernel_code.c_str(), kernel_code.length()}); // the source is copied by the program
+    
+    // build the program, with a callback the build returns immediately and the result is checked by ready()
+    
+    prog = cl::Program(context, sources);
+    if(async) {
+        builds_pending++;
+        prog.build({device}, options.c_str(), buildComplete, &builds_pending);
+    } else prog.build({device}, options.c_str());
+}
+
+void CL_CALLBACK KernelGL::buildComplete(cl_program prog, void* pending) {
+    // called by the OpenCL runtime, possibly from another thread
+    
+    (*(std::atomic<int>*)pending)--;
+}
+
+void KernelGL::checkBuild(const cl::Program& prog) {
+    if(prog.getBuildInfo<CL_PROGRAM_BUILD_STATUS>(device) != CL_BUILD_SUCCESS) {
+        std::cerr << "ERROR: OpenCL: CANNOT BUILD PROGRAM: " << prog.getBuildInfo<CL_PROGRAM_BUILD_LOG>(device) << std::endl;
+        exit(-1);
+    }
+}
+
+bool KernelGL::ready() {
+    // polled by the render loop, the first call after the builds have finished creates the kernels on the calling thread
+    
+    if(kernels_ready) return true;
+    if(builds_pending > 0) return false;
+    
+    try {
+        checkBuild(program);
+        kernels_ready = true;
+        initialiseKernels();
+        
+        if(diagnostics_pending) {
+            checkBuild(diagnostics_program);
+            createDiagnostics(diagnostics_program, diagnostics_callback);
+            diagnostics_pending = false;
+        }
+    } catch(cl::Error e) {
+        processError(e);
+    }
+    return true;
+}
+
+void KernelGL::wait() {
+    while(!ready()) std::this_thread::sleep_for(std::chrono::milliseconds(1));
+}
+
+std::string KernelGL::storageOptions(StateStorage storage, float fixed_span) {
+    // build options selecting the state storage in the kernels, fixed_span is the largest distance from a tile origin
     
-    // build the program
+    std::ostringstream options;
+    options.precision(9);
+    if(storage == STORAGE_HALF) options << "-D STORAGE_HALF";
+    else if(storage == STORAGE_FIXED) options << "-D STORAGE_FIXED -D FIXED_SPAN=" << std::fixed << fixed_span << "f";
+    return options.str();
+}
+
+void KernelGL::enableDiagnostics(const char* kernel_path, int every, const std::function<void(const DiagnosticsRecord&)>& callback) {
+    // the reduction program is shared by all the simulations, the first pass lives in the simulation program
+    
+    try {
+        delete diagnostics;
+        diagnostics = nullptr;
+        diagnostics_every = every;
+        step_count = 0;
+        
+        // before the simulation is ready the reduction program is built in the background as well
+        
+        buildProgram(kernel_path, diagnostics_program, "", !kernels_ready);
+        if(kernels_ready) createDiagnostics(diagnostics_program, callback);
+        else {
+            diagnostics_callback = callback;
+            diagnostics_pending = true;
+        }
+    } catch(cl::Error e) {
+        if(e.err() == CL_BUILD_PROGRAM_FAILURE) program = diagnostics_program; // report the build log of the failing program
+        processError(e);
+    }
+}
+
+bool KernelGL::diagnosticsDue() {
+    // count the steps, true every diagnostics_every steps
     
-    program = cl::Program(context, sources);
-    program.build({device});
+    step_count++;
+    return diagnostics && step_count % diagnostics_every == 0;
+}
+
+void KernelGL::pollDiagnostics() {
+    if(diagnostics) diagnostics->poll();
+}
+
+cl_mem_flags KernelGL::stateFlags() const {
+    // the memory allocated by the runtime is the one an integrated device maps without a copy; a discrete device keeps the
+    // state in its own memory, where the kernels read it at full speed, and the runtime copies it when it is mapped
+    
+    if(device.getInfo<CL_DEVICE_HOST_UNIFIED_MEMORY>()) return CL_MEM_READ_WRITE | CL_MEM_ALLOC_HOST_PTR;
+    return CL_MEM_READ_WRITE;
+}
+
+void* KernelGL::mapState(StateField field, size_t& count, size_t& item_size) {
+    // the buffer is mapped where it lives: on a device sharing the host memory the view is the buffer itself, otherwise the
+    // runtime moves it once into its own host memory and back when it is unmapped
+    
+    wait();
+    cl::Buffer buffer;
+    size_t size;
+    if(!stateBuffer(field, buffer, size, item_size)) return nullptr;
+    
+    try {
+        cl::CommandQueue queue(context, device);
+        void* ptr = queue.enqueueMapBuffer(buffer, CL_TRUE, CL_MAP_READ | CL_MAP_WRITE, 0, size);
+        mapped.push_back(std::make_pair(ptr, buffer));
+        count = size / (3 * item_size);
+        return ptr;
+    } catch(cl::Error e) {
+        processError(e);
+    }
+    return nullptr;
+}
+
+void KernelGL::unmapState(void* ptr) {
+    for(size_t i = 0; i < mapped.size(); i++) {
+        if(mapped[i].first != ptr) continue;
+        try {
+            cl::CommandQueue queue(context, device);
+            queue.enqueueUnmapMemObject(mapped[i].second, ptr);
+            queue.finish();
+        } catch(cl::Error e) {
+            processError(e);
+        }
+        mapped.erase(mapped.begin() + i);
+        return;
+    }
 }
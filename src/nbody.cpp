@@ -14,17 +14,80 @@
 
 #include <vector>
 #include <string>
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <iostream>
 
 #define KERNEL_POS "iteratePos"
 #define KERNEL_VEL "iterateVel"
 #define KERNEL_DENS "calculateDens"
 #define KERNEL_POT "calculatePot"
 #define KERNEL_ACC "calculateAcc"
+#define KERNEL_PACK "packGrid"
+#define KERNEL_FFT "fftPass"
 #define KERNEL_FFT_H "calculateFFTH"
+#define KERNEL_CELL "buildCellList"
+#define KERNEL_ACC_SHORT "calculateAccShort"
+#define KERNEL_ACC_DIRECT "calculateAccDirect"
+#define KERNEL_MG_SOURCE "mgSource"
+#define KERNEL_MG_SMOOTH "mgSmooth"
+#define KERNEL_MG_RESIDUAL "mgResidual"
+#define KERNEL_MG_RESTRICT "mgRestrict"
+#define KERNEL_MG_PROLONG "mgProlong"
+#define KERNEL_MG_NORM "mgNorm"
+#define KERNEL_COMPACT "compactActive"
+#define KERNEL_DRIFT "driftActive"
+#define KERNEL_KICK "kickActive"
+#define KERNEL_LEVEL "assignLevels"
+#define KERNEL_DIAG "calculateDiagnostics"
+#define KERNEL_IC_UNIFORM "initialUniform"
+#define KERNEL_IC_PLUMMER "initialPlummer"
+#define KERNEL_IC_NOISE "initialNoise"
+#define KERNEL_IC_DISP "initialDisplacement"
+#define KERNEL_IC_LATTICE "initialLattice"
+#define KERNEL_LOAD_POS "loadPos"
+#define KERNEL_CULL "cullBodies"
+#define KERNEL_AMR_DEPOSIT "amrDeposit"
+#define KERNEL_AMR_BOUNDARY "amrBoundary"
+#define KERNEL_AMR_SMOOTH "amrSmooth"
+#define KERNEL_AMR_ACC "amrAcc"
 
-NBody::NBody(int g, int n, float m, const char* vs_path, const char* fs_path, const char* kernel_path) : KernelGL(kernel_path), grid_num(g), body_num(n), body_mass(m), shader(vs_path, fs_path) {
+#define R_CUT_FACTOR 4.5f // default cutoff of the short-range force in units of r_split
+
+#define MG_TOLERANCE 1e-4f
+#define MG_MAX_CYCLES 20
+#define MG_PRE_SWEEPS 2
+#define MG_POST_SWEEPS 2
+#define MG_COARSE_SWEEPS 16
+#define MG_COARSEST_NUM 4 // cells along each axis of the coarsest level
+#define MG_GROUP_SIZE 256
+
+#define CULL_GROUP_SIZE 256
+
+#define AMR_PATCH_CELLS 16 // cells of a refinement patch along each axis, even
+#define AMR_MAX_LEVELS 4
+#define AMR_SWEEPS 8 // relaxation sweeps per force evaluation, the patches keep their potential until the next rebuild
+#define AMR_REBUILD_SWEEPS 64 // starting from the interpolated parent potential
+#define AMR_OMEGA 1.6f // over-relaxation of the sweeps
+
+#define BLOCK_ETA 0.025f // accuracy parameter of the time-step criterion
+#define BLOCK_MAX_LEVELS 16
+#define BLOCK_GROUP_SIZE 256
+#define BLOCK_SKIN 0.25f // margin of the cells as a fraction of r_cut, the bodies of the inactive levels move within it
+
+#define IC_SEED 1234u
+#define PLUMMER_SCALE 0.025f // Plummer radius as a fraction of the box
+#define PLUMMER_MASS_CUT 0.99f // fraction of the Plummer mass profile sampled
+#define ZELDOVICH_INDEX -2.0f // spectral index of the displacement power spectrum
+#define ZELDOVICH_AMPLITUDE 0.5f
+#define ZELDOVICH_GRAV_CONST 1.0 // GRAV_CONST of the kernel, sets the growth rate of the initial velocities
+
+template<typename T>
+NBody<T>::NBody(int g, int n, float m, float dt, const char* vs_path, const char* fs_path, const char* kernel_path, NBodyInitial init, NBodySolver s, float rs, float rc, StateStorage st) : KernelGL(kernel_path, storageOptions(st, (float)g), sizeof(T) == sizeof(cl_double), {"cl_khr_int64_base_atomics"}), grid_num(g), body_num(n), body_mass(m), time_step(dt), initial(init), solver(s), storage(st), r_split(rs), r_cut(rc > 0.0f ? rc : R_CUT_FACTOR * rs), mg_tolerance(MG_TOLERANCE), mg_max_cycles(MG_MAX_CYCLES), mg_cycles(0), max_level(0), min_level(0), block_eta(BLOCK_ETA), level_count(BLOCK_MAX_LEVELS, 0), block_steps(0), block_updates(0), amr_levels(0), amr_threshold(0.0f), amr_every(1), amr_max_patches(0), amr_evaluations(0), amr_memory(0), shader(vs_path, fs_path), splatter(nullptr) {
+    // the program is being built in the background, the kernels are created by initialiseKernels once it is done
+    
     try {
-        createKernels();
         createGLBuffers();
         createCLBuffers();
     } catch(cl::Error e) {
@@ -32,23 +95,19 @@ NBody::NBody(int g, int n, float m, const char* vs_path, const char* fs_path, co
     }
 }
 
-NBody::~NBody() {
+template<typename T>
+NBody<T>::~NBody() {
+    delete splatter;
     glDeleteVertexArrays(1, &VAO);
     glDeleteBuffers(1, &VBO);
 }
 
-void NBody::createGLBuffers() {
-    buff_v_size = body_num * 3 * sizeof(cl_float);
-    
-    float* vertices = new float[body_num * 3];
-    
-    // create vertices of the cloth
+template<typename T>
+void NBody<T>::createGLBuffers() {
+    buff_v_size = body_num * 3 * sizeof(T);
+    buff_gl_size = body_num * 3 * sizeof(cl_float);
     
-    for(int i = 0; i < body_num * 3; i++) {
-        vertices[i * 3]     = 0.0f; // TODO
-        vertices[i * 3 + 1] = 0.0f; // TODO
-        vertices[i * 3 + 2] = 0.0f; // TODO
-    }
+    // the positions are generated on the device, see generateInitial
     
     glGenVertexArrays(1, &VAO);
     glGenBuffers(1, &VBO);
@@ -56,85 +115,1349 @@ void NBody::createGLBuffers() {
     glBindVertexArray(VAO);
     
     glBindBuffer(GL_ARRAY_BUFFER, VBO);
-    glBufferData(GL_ARRAY_BUFFER, buff_v_size, vertices, GL_DYNAMIC_DRAW);
+    glBufferData(GL_ARRAY_BUFFER, buff_gl_size, NULL, GL_DYNAMIC_DRAW);
     
     glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 3 * sizeof(float), (void*)0);
     
     glEnableVertexAttribArray(0);
     glBindBuffer(GL_ARRAY_BUFFER, 0);
     glBindVertexArray(0);
-    
-    delete [] vertices;
 }
 
-void NBody::createCLBuffers() {
-    buff_pos_0 = cl::Buffer(context, CL_MEM_READ_WRITE, buff_v_size);
-    buff_pos_1 = cl::BufferGL(context, CL_MEM_READ_WRITE, VBO);
-    buff_vel_0 = cl::Buffer(context, CL_MEM_READ_WRITE, buff_v_size);
-    buff_vel_1 = cl::Buffer(context, CL_MEM_READ_WRITE, buff_v_size);
-    buff_acc = cl::Buffer(context, CL_MEM_READ_WRITE, buff_v_size);
+template<typename T>
+void NBody<T>::createCLBuffers() {
+    // request every buffer with the phases in which it is live, the plan is checked against the device before anything is allocated
     
-    buff_s_size = grid_num * grid_num * grid_num * sizeof(cl_float);
+    buff_state_size = body_num * 3 * storageSize<T>(storage);
+    buff_s_size = grid_num * grid_num * grid_num * sizeof(T);
     
-    buff_dens = cl::Buffer(context, CL_MEM_READ_WRITE, buff_s_size);
-    buff_pot = cl::Buffer(context, CL_MEM_READ_WRITE, buff_s_size);
-    buff_FFT_h = cl::Buffer(context, CL_MEM_READ_WRITE, buff_s_size);
+    memory.reserve(buff_gl_size, "positions (OpenGL)");
+    memory.request(buff_pos_0, buff_state_size, DeviceMemory::PERSISTENT, "positions", stateFlags());
+    memory.request(buff_vel_0, buff_state_size, DeviceMemory::PERSISTENT, "velocities", stateFlags());
+    memory.request(buff_vel_1, buff_state_size, DeviceMemory::PERSISTENT, "velocities (next)");
+    memory.request(buff_acc, buff_v_size, DeviceMemory::PERSISTENT, "acceleration");
     
-    setConstKernelArgs();
+    // the density is dead once it has been packed into the potential (FFT) or once the V-cycles are done (multigrid)
+    
+    memory.request(buff_dens, buff_s_size, PHASE_DEPOSIT | PHASE_SOLVE, "density");
+    
+    if(solver == SOLVER_FFT) {
+        // the potential and the FFT scratch space hold complex numbers, the FFT scratch space can reuse the density
+        
+        memory.request(buff_pot, 2 * buff_s_size, PHASE_SOLVE | PHASE_TRANSFORM | PHASE_FORCE, "potential");
+        memory.request(buff_FFT_tmp, 2 * buff_s_size, PHASE_TRANSFORM, "FFT scratch");
+        memory.request(buff_FFT_h, buff_s_size, DeviceMemory::PERSISTENT, "FFT kernel");
+    } else {
+        // the potential is the initial guess of the next solve
+        
+        memory.request(buff_pot, buff_s_size, DeviceMemory::PERSISTENT, "potential");
+        createMultigridBuffers();
+    }
     
-    cl::Kernel kernel_FFT_h(program, KERNEL_FFT_H);
+    // the Zel'dovich grids reuse the step grids and are freed after the initial conditions
     
-    // TODO set the args of the kernel_FFT_h
-    kernel_FFT_h.setArg(0, buff_FFT_h);
+    memory.request(buff_ic_noise, 2 * buff_s_size, PHASE_INITIAL, "initial noise");
+    memory.request(buff_ic_disp, 2 * buff_s_size, PHASE_INITIAL, "initial displacement");
+    memory.request(buff_ic_tmp, 2 * buff_s_size, PHASE_INITIAL, "initial FFT scratch");
+    
+    createCellBuffers();
+    
+    memory.plan(device);
+    memory.acquire(context, PHASE_STEP);
+    
+    buff_pos_1 = cl::BufferGL(context, CL_MEM_READ_WRITE, VBO);
+    if(solver == SOLVER_MULTIGRID) {
+        buff_mg_phi[0] = buff_pot;
+        buff_mg_rhs[0] = buff_dens;
+    }
+}
+    
+template<typename T>
+void NBody<T>::initialiseKernels() {
+    createKernels();
+    setConstKernelArgs();
     
     cl::CommandQueue queue(context, device);
     
-    // copy buff_pos_1 to buff_pos_0 and fill buff_vel_0 with zeros
+    // calculate the fft_h to be later used to speed up claculations by convolution thm, the multigrid solver starts from a zero potential instead
     
-    queue.enqueueFillBuffer(buff_vel_0, 0, 0, buff_v_size);
-    queue.enqueueCopyBuffer(buff_pos_1, buff_pos_0, 0, 0, buff_v_size);
-    queue.enqueueBarrierWithWaitList();
+    if(solver == SOLVER_FFT) queue.enqueueNDRangeKernel(kernel_FFT_h, cl::NullRange, cl::NDRange(size_t(grid_num), size_t(grid_num), size_t(grid_num)), cl::NullRange);
+    else queue.enqueueFillBuffer(buff_pot, (T)0, 0, buff_s_size);
+    queue.finish();
+    
+    generateInitial(initial, IC_SEED);
+}
+
+template<typename T>
+void NBody<T>::generateInitial(NBodyInitial init, unsigned int seed) {
+    // the kernels are needed, block until the program is built
+    
+    wait();
+    
+    try {
+        cl::CommandQueue queue(context, device);
+        
+        if(init == INITIAL_ZELDOVICH) generateZeldovich(queue, seed);
+        else if(init == INITIAL_PLUMMER) {
+            cl::Kernel kernel_ic(program, KERNEL_IC_PLUMMER);
+            kernel_ic.setArg(0, buff_pos_0);
+            kernel_ic.setArg(1, buff_vel_0);
+            kernel_ic.setArg(2, grid_num);
+            kernel_ic.setArg(3, (cl_uint)seed);
+            kernel_ic.setArg(4, (T)(PLUMMER_SCALE * grid_num));
+            kernel_ic.setArg(5, (T)(body_num * body_mass));
+            kernel_ic.setArg(6, (T)PLUMMER_MASS_CUT);
+            queue.enqueueNDRangeKernel(kernel_ic, cl::NullRange, cl::NDRange(size_t(body_num)), cl::NullRange);
+        } else {
+            cl::Kernel kernel_ic(program, KERNEL_IC_UNIFORM);
+            kernel_ic.setArg(0, buff_pos_0);
+            kernel_ic.setArg(1, buff_vel_0);
+            kernel_ic.setArg(2, grid_num);
+            kernel_ic.setArg(3, (cl_uint)seed);
+            queue.enqueueNDRangeKernel(kernel_ic, cl::NullRange, cl::NDRange(size_t(body_num)), cl::NullRange);
+        }
+        queue.enqueueBarrierWithWaitList();
+        
+        // fill the OpenGL buffer on the device as well
+        
+        std::vector<cl::Memory> mem_objs;
+        mem_objs.push_back(buff_pos_1);
+        
+        cl::Kernel kernel_load(program, KERNEL_LOAD_POS);
+        kernel_load.setArg(0, buff_pos_0);
+        kernel_load.setArg(1, buff_pos_1);
+        
+        queue.enqueueAcquireGLObjects(&mem_objs);
+        queue.enqueueNDRangeKernel(kernel_load, cl::NullRange, cl::NDRange(size_t(body_num)), cl::NullRange);
+        queue.enqueueReleaseGLObjects(&mem_objs);
+        queue.enqueueBarrierWithWaitList();
+        
+        // the velocities stay synchronised with the positions, so only the initial forces are needed
+        
+        calculateForces(queue);
+        if(r_split > 0.0f) assignLevels(queue);
+        
+        queue.finish();
+    } catch(cl::Error e) {
+        processError(e);
+    }
+}
+
+template<typename T>
+void NBody<T>::generateZeldovich(cl::CommandQueue& queue, unsigned int seed) {
+    // displace a cubic lattice by a gaussian random field, the transforms use temporary complex grids
+    
+    int lattice_num = (int)std::round(std::cbrt((double)body_num));
+    if(lattice_num * lattice_num * lattice_num != body_num) {
+        std::cerr << "ERROR: NBody: THE ZEL'DOVICH LATTICE NEEDS A CUBIC NUMBER OF BODIES: " << body_num << std::endl;
+        exit(-1);
+    }
     
-    // calculate the fft_h to be later used to speed up claculations by convolution thm
+    // the transforms swap the handles, work on copies so that the planned buffers stay in place
     
-    queue.enqueueNDRangeKernel(kernel_FFT_h, cl::NullRange, cl::NDRange(size_t(grid_num), size_t(grid_num), size_t(grid_num)), cl::NullRange);
+    size_t grid_size = size_t(grid_num) * grid_num * grid_num;
+    memory.acquire(context, PHASE_INITIAL);
+    cl::Buffer buff_noise = buff_ic_noise;
+    cl::Buffer buff_disp = buff_ic_disp;
+    cl::Buffer buff_tmp = buff_ic_tmp;
     
-    // increment velocity half the step
+    cl::Kernel kernel_noise(program, KERNEL_IC_NOISE);
+    kernel_noise.setArg(0, buff_noise);
+    kernel_noise.setArg(1, (cl_uint)seed);
+    queue.enqueueNDRangeKernel(kernel_noise, cl::NullRange, cl::NDRange(grid_size), cl::NullRange);
+    transformFFT(queue, buff_noise, buff_tmp, grid_num, -1.0f);
     
-    queue.enqueueNDRangeKernel(kernel_vel, cl::NullRange, cl::NDRange(size_t(body_num), size_t(body_num), size_t(body_num)), cl::NullRange);
-    queue.enqueueCopyBuffer(buff_vel_1, buff_vel_0, 0, 0, buff_v_size);
+    cl::Kernel kernel_disp(program, KERNEL_IC_DISP);
+    cl::Kernel kernel_lattice(program, KERNEL_IC_LATTICE);
+    
+    // the bodies start on the growing mode of the static box: the periodic solver removes the mean density, so a linear
+    // displacement grows as exp(t sqrt(4 pi G rho)) and the velocity is that rate times the displacement
+    
+    double mean_density = (double)body_num * body_mass / ((double)grid_num * grid_num * grid_num);
+    T growth_rate = (T)std::sqrt(4.0 * 3.14159265358979323846 * ZELDOVICH_GRAV_CONST * mean_density);
+    
+    for(int axis = 0; axis < 3; axis++) {
+        kernel_disp.setArg(0, buff_noise);
+        kernel_disp.setArg(1, buff_disp);
+        kernel_disp.setArg(2, grid_num);
+        kernel_disp.setArg(3, axis);
+        kernel_disp.setArg(4, (T)ZELDOVICH_INDEX);
+        kernel_disp.setArg(5, (T)ZELDOVICH_AMPLITUDE);
+        queue.enqueueNDRangeKernel(kernel_disp, cl::NullRange, cl::NDRange(size_t(grid_num), size_t(grid_num), size_t(grid_num)), cl::NullRange);
+        transformFFT(queue, buff_disp, buff_tmp, grid_num, 1.0f);
+        
+        kernel_lattice.setArg(0, buff_pos_0);
+        kernel_lattice.setArg(1, buff_vel_0);
+        kernel_lattice.setArg(2, buff_disp);
+        kernel_lattice.setArg(3, grid_num);
+        kernel_lattice.setArg(4, lattice_num);
+        kernel_lattice.setArg(5, axis);
+        kernel_lattice.setArg(6, growth_rate);
+        queue.enqueueNDRangeKernel(kernel_lattice, cl::NullRange, cl::NDRange(size_t(body_num)), cl::NullRange);
+    }
     
     queue.finish();
+    memory.release(PHASE_INITIAL);
+}
+
+template<typename T>
+void NBody<T>::createCellBuffers() {
+    if(r_split > 0.0f && solver != SOLVER_FFT) {
+        std::cerr << "ERROR: NBody: THE SHORT-RANGE CORRECTION REQUIRES THE FFT SOLVER" << std::endl;
+        exit(-1);
+    }
+    
+    createCellLists();
+    memory.reserve(r_split > 0.0f ? buff_v_size + (2 * body_num + BLOCK_MAX_LEVELS + 1) * sizeof(cl_int) : 0, "block time-steps");
     
-    // set time step to the full range
+    // the short-range force is integrated with the block time-steps, every body starts on the level 0
+    
+    if(r_split > 0.0f) {
+        buff_acc_short = cl::Buffer(context, CL_MEM_READ_WRITE, buff_v_size);
+        buff_level = cl::Buffer(context, CL_MEM_READ_WRITE, body_num * sizeof(cl_int));
+        buff_level_count = cl::Buffer(context, CL_MEM_READ_WRITE, BLOCK_MAX_LEVELS * sizeof(cl_int));
+        buff_active = cl::Buffer(context, CL_MEM_READ_WRITE, body_num * sizeof(cl_int));
+        buff_active_num = cl::Buffer(context, CL_MEM_READ_WRITE, sizeof(cl_int));
+        
+        cl::CommandQueue queue(context, device);
+        queue.enqueueFillBuffer(buff_acc_short, (T)0, 0, buff_v_size);
+        queue.enqueueFillBuffer(buff_level, (cl_int)0, 0, body_num * sizeof(cl_int));
+        queue.finish();
+        
+        std::fill(level_count.begin(), level_count.end(), 0);
+        level_count[0] = body_num;
+    } else max_level = min_level = 0;
 }
 
-void NBody::createKernels() {
+template<typename T>
+void NBody<T>::createCellLists() {
+    // the cells have to be at least r_cut wide, with the skin once the levels are drifted apart, and there have to be at least 3 of
+    // them along each axis, so that the 27 neighbouring cells are distinct
+    
+    float width = max_level > 0 ? r_cut * (1.0f + BLOCK_SKIN) : r_cut;
+    cell_num = r_split > 0.0f ? (int)((float)grid_num / width) : 1;
+    if(r_split > 0.0f && cell_num < 3) {
+        std::cerr << "ERROR: NBody: SHORT-RANGE CUTOFF TOO LARGE FOR THE GRID: " << r_cut << std::endl;
+        exit(-1);
+    }
+    
+    // the cell lists change with the split and the levels, they are allocated outside the plan but counted in its peak
+    
+    size_t cells = size_t(cell_num) * cell_num * cell_num * (max_level + 1);
+    memory.reserve((cells + body_num) * sizeof(cl_int), "cell lists");
+    
+    buff_cell_head = cl::Buffer(context, CL_MEM_READ_WRITE, cells * sizeof(cl_int));
+    buff_cell_next = cl::Buffer(context, CL_MEM_READ_WRITE, body_num * sizeof(cl_int));
+}
+
+template<typename T>
+void NBody<T>::createMultigridBuffers() {
+    // level 0 works directly on buff_pot and buff_dens
+    
+    mg_levels = 0;
+    for(int n = grid_num; n >= MG_COARSEST_NUM && n % 2 == 0; n /= 2) mg_levels++;
+    if(mg_levels == 0) {
+        std::cerr << "ERROR: NBody: GRID TOO SMALL FOR THE MULTIGRID SOLVER: " << grid_num << std::endl;
+        exit(-1);
+    }
+    
+    buff_mg_phi.assign(mg_levels, cl::Buffer());
+    buff_mg_rhs.assign(mg_levels, cl::Buffer());
+    buff_mg_res.assign(mg_levels, cl::Buffer());
+    
+    // the coarse levels and the residuals are only live during the V-cycles
+    
+    for(int l = 0; l < mg_levels; l++) {
+        int n = grid_num >> l;
+        size_t size = size_t(n) * n * n * sizeof(T);
+        if(l > 0) {
+            memory.request(buff_mg_phi[l], size, PHASE_SOLVE, "multigrid potential");
+            memory.request(buff_mg_rhs[l], size, PHASE_SOLVE, "multigrid source");
+        }
+        memory.request(buff_mg_res[l], size, PHASE_SOLVE, "multigrid residual");
+    }
+    
+    size_t groups = (size_t(grid_num) * grid_num * grid_num + MG_GROUP_SIZE - 1) / MG_GROUP_SIZE;
+    memory.request(buff_mg_partial, groups * sizeof(T), PHASE_SOLVE, "multigrid norm");
+}
+
+template<typename T>
+void NBody<T>::createKernels() {
     kernel_pos = cl::Kernel(program, KERNEL_POS);
     kernel_vel = cl::Kernel(program, KERNEL_VEL);
     kernel_dens = cl::Kernel(program, KERNEL_DENS);
     kernel_pot = cl::Kernel(program, KERNEL_POT);
     kernel_acc = cl::Kernel(program, KERNEL_ACC);
+    kernel_pack = cl::Kernel(program, KERNEL_PACK);
+    kernel_FFT = cl::Kernel(program, KERNEL_FFT);
+    kernel_FFT_h = cl::Kernel(program, KERNEL_FFT_H);
+    kernel_cell = cl::Kernel(program, KERNEL_CELL);
+    kernel_acc_short = cl::Kernel(program, KERNEL_ACC_SHORT);
+    kernel_acc_direct = cl::Kernel(program, KERNEL_ACC_DIRECT);
+    kernel_mg_source = cl::Kernel(program, KERNEL_MG_SOURCE);
+    kernel_mg_smooth = cl::Kernel(program, KERNEL_MG_SMOOTH);
+    kernel_mg_residual = cl::Kernel(program, KERNEL_MG_RESIDUAL);
+    kernel_mg_restrict = cl::Kernel(program, KERNEL_MG_RESTRICT);
+    kernel_mg_prolong = cl::Kernel(program, KERNEL_MG_PROLONG);
+    kernel_mg_norm = cl::Kernel(program, KERNEL_MG_NORM);
+    kernel_compact = cl::Kernel(program, KERNEL_COMPACT);
+    kernel_drift = cl::Kernel(program, KERNEL_DRIFT);
+    kernel_kick = cl::Kernel(program, KERNEL_KICK);
+    kernel_level = cl::Kernel(program, KERNEL_LEVEL);
+    kernel_cull = cl::Kernel(program, KERNEL_CULL);
+    kernel_amr_deposit = cl::Kernel(program, KERNEL_AMR_DEPOSIT);
+    kernel_amr_boundary = cl::Kernel(program, KERNEL_AMR_BOUNDARY);
+    kernel_amr_smooth = cl::Kernel(program, KERNEL_AMR_SMOOTH);
+    kernel_amr_acc = cl::Kernel(program, KERNEL_AMR_ACC);
+}
+
+template<typename T>
+void NBody<T>::setConstKernelArgs() {
+    cl_int periodic = solver == SOLVER_FFT;
+    
+    kernel_pos.setArg(0, buff_pos_0);
+    kernel_pos.setArg(1, buff_pos_1);
+    kernel_pos.setArg(2, buff_vel_0);
+    kernel_pos.setArg(3, grid_num);
+    kernel_pos.setArg(4, (T)time_step);
+    kernel_pos.setArg(5, periodic);
+    
+    kernel_vel.setArg(0, buff_vel_0);
+    kernel_vel.setArg(1, buff_vel_1);
+    kernel_vel.setArg(2, buff_acc);
+    kernel_vel.setArg(3, (T)(time_step * 0.5f));
+    
+    kernel_dens.setArg(0, buff_pos_0);
+    kernel_dens.setArg(1, buff_dens);
+    kernel_dens.setArg(2, grid_num);
+    kernel_dens.setArg(3, (T)body_mass);
+    kernel_dens.setArg(4, periodic);
+    
+    kernel_acc.setArg(0, buff_pos_0);
+    kernel_acc.setArg(2, periodic ? 2 : 1);
+    kernel_acc.setArg(3, buff_acc);
+    kernel_acc.setArg(4, grid_num);
+    kernel_acc.setArg(5, periodic);
+    kernel_acc.setArg(6, (T)(body_num * body_mass));
+    
+    if(solver == SOLVER_FFT) {
+        kernel_pack.setArg(0, buff_dens);
+        
+        kernel_pot.setArg(1, buff_FFT_h);
+        
+        kernel_FFT_h.setArg(0, buff_FFT_h);
+        kernel_FFT_h.setArg(1, grid_num);
+        kernel_FFT_h.setArg(2, (T)r_split);
+    } else {
+        kernel_mg_source.setArg(0, buff_dens);
+        kernel_mg_norm.setArg(1, buff_mg_partial);
+        kernel_mg_norm.setArg(2, cl::Local(MG_GROUP_SIZE * sizeof(T)));
+    }
+    
+    if(r_split > 0.0f) {
+        kernel_cell.setArg(0, buff_pos_0);
+        kernel_cell.setArg(1, buff_active);
+        kernel_cell.setArg(2, buff_level);
+        kernel_cell.setArg(3, buff_cell_head);
+        kernel_cell.setArg(4, buff_cell_next);
+        kernel_cell.setArg(5, grid_num);
+        kernel_cell.setArg(6, cell_num);
+        
+        kernel_acc_short.setArg(0, buff_pos_0);
+        kernel_acc_short.setArg(1, buff_vel_0);
+        kernel_acc_short.setArg(2, buff_cell_head);
+        kernel_acc_short.setArg(3, buff_cell_next);
+        kernel_acc_short.setArg(4, buff_active);
+        kernel_acc_short.setArg(5, buff_acc_short);
+        kernel_acc_short.setArg(6, grid_num);
+        kernel_acc_short.setArg(7, cell_num);
+        kernel_acc_short.setArg(9, (T)body_mass);
+        kernel_acc_short.setArg(10, (T)r_split);
+        kernel_acc_short.setArg(11, (T)r_cut);
+        
+        kernel_compact.setArg(0, buff_level);
+        kernel_compact.setArg(1, buff_active);
+        kernel_compact.setArg(2, buff_active_num);
+        kernel_compact.setArg(3, cl::Local(BLOCK_GROUP_SIZE * sizeof(cl_int)));
+        kernel_compact.setArg(4, (cl_int)body_num);
+        
+        kernel_drift.setArg(0, buff_pos_0);
+        kernel_drift.setArg(1, buff_pos_1);
+        kernel_drift.setArg(2, buff_vel_0);
+        kernel_drift.setArg(3, buff_active);
+        kernel_drift.setArg(4, buff_level);
+        kernel_drift.setArg(5, grid_num);
+        kernel_drift.setArg(6, (T)time_step);
+        kernel_drift.setArg(7, periodic);
+        
+        kernel_kick.setArg(0, buff_vel_0);
+        kernel_kick.setArg(1, buff_acc_short);
+        kernel_kick.setArg(2, buff_active);
+        kernel_kick.setArg(3, buff_level);
+        kernel_kick.setArg(4, (T)time_step);
+        
+        kernel_level.setArg(0, buff_acc);
+        kernel_level.setArg(1, buff_acc_short);
+        kernel_level.setArg(2, buff_vel_0);
+        kernel_level.setArg(3, buff_level);
+        kernel_level.setArg(4, buff_level_count);
+        kernel_level.setArg(5, (T)time_step);
+    }
+    
+    kernel_acc_direct.setArg(0, buff_pos_0);
+    kernel_acc_direct.setArg(2, (cl_int)body_num);
+    kernel_acc_direct.setArg(3, grid_num);
+    kernel_acc_direct.setArg(4, (T)body_mass);
+    kernel_acc_direct.setArg(5, periodic);
 }
 
-void NBody::setConstKernelArgs() {
-    //kernel_pos.setArg(0, buff_pos_prev);
-    // TODO
+template<typename T>
+void NBody<T>::setShortRange(float rs, float rc) {
+    wait();
+    r_split = rs;
+    r_cut = rc > 0.0f ? rc : R_CUT_FACTOR * rs;
+    
+    try {
+        createCellBuffers();
+        setConstKernelArgs();
+        
+        // the long-range filter of the mesh has to match the new split, the cell lists are filled with the bodies back on the level 0
+        
+        cl::CommandQueue queue(context, device);
+        if(solver == SOLVER_FFT) queue.enqueueNDRangeKernel(kernel_FFT_h, cl::NullRange, cl::NDRange(size_t(grid_num), size_t(grid_num), size_t(grid_num)), cl::NullRange);
+        if(r_split > 0.0f) binActive(queue, 0, compactActive(queue, 0));
+        queue.finish();
+    } catch(cl::Error e) {
+        processError(e);
+    }
+}
+
+template<typename T>
+void NBody<T>::setMultigrid(float tolerance, int max_cycles) {
+    mg_tolerance = tolerance;
+    mg_max_cycles = max_cycles;
 }
 
-void NBody::iterate(int steps) {
+template<typename T>
+void NBody<T>::setBlockSteps(int max_l, float eta) {
+    wait();
+    if(r_split <= 0.0f) {
+        std::cerr << "ERROR: NBody: BLOCK TIME-STEPS REQUIRE THE SHORT-RANGE CORRECTION" << std::endl;
+        exit(-1);
+    }
+    
+    max_level = std::min(std::max(max_l, 0), BLOCK_MAX_LEVELS - 1);
+    min_level = std::min(min_level, max_level);
+    block_eta = eta;
+    
+    // the cell lists get a list per level and the skin, the levels fill them
+    
+    try {
+        createCellLists();
+        setConstKernelArgs();
+        cl::CommandQueue queue(context, device);
+        assignLevels(queue);
+        queue.finish();
+    } catch(cl::Error e) {
+        processError(e);
+    }
+}
+
+template<typename T>
+void NBody<T>::setRefinement(int levels, float threshold, int every, int max_patches) {
+    wait();
+    if(r_split > 0.0f) {
+        std::cerr << "ERROR: NBody: MESH REFINEMENT REQUIRES THE PURE PARTICLE-MESH FORCE" << std::endl;
+        exit(-1);
+    }
+    if((2 * grid_num) % AMR_PATCH_CELLS != 0) {
+        std::cerr << "ERROR: NBody: GRID TOO SMALL FOR THE REFINEMENT PATCHES: " << grid_num << std::endl;
+        exit(-1);
+    }
+    
+    amr_levels = std::min(std::max(levels, 0), AMR_MAX_LEVELS);
+    amr_threshold = threshold;
+    amr_every = std::max(every, 1);
+    amr_max_patches = std::max(max_patches, 1);
+    amr_evaluations = 0;
+    amr_patches.clear();
+    amr_first.assign(amr_levels + 1, 0);
+    amr_count.assign(amr_levels + 1, 0);
+    amr_map_offset.assign(amr_levels + 1, 0);
+    amr_memory = 0;
+    if(amr_levels == 0) return;
+    
+    // the block maps cover the whole box on every level, the patches are allocated for the largest count; the memory plan is
+    // already made, so the buffers are allocated directly and counted separately
+    
+    size_t map_size = 0;
+    for(int l = 1; l <= amr_levels; l++) {
+        size_t blocks = (size_t(grid_num) << l) / AMR_PATCH_CELLS;
+        amr_map_offset[l] = (int)map_size;
+        map_size += blocks * blocks * blocks;
+    }
+    size_t patch_cells = size_t(AMR_PATCH_CELLS) * AMR_PATCH_CELLS * AMR_PATCH_CELLS;
+    size_t ghost_cells = size_t(AMR_PATCH_CELLS + 2) * (AMR_PATCH_CELLS + 2) * (AMR_PATCH_CELLS + 2);
+    cl_int periodic = solver == SOLVER_FFT;
+    
+    try {
+        buff_amr_patch = cl::Buffer(context, CL_MEM_READ_ONLY, amr_max_patches * 4 * sizeof(cl_int));
+        buff_amr_map = cl::Buffer(context, CL_MEM_READ_ONLY, map_size * sizeof(cl_int));
+        buff_amr_mass = cl::Buffer(context, CL_MEM_READ_WRITE, amr_max_patches * patch_cells * sizeof(T));
+        buff_amr_pot = cl::Buffer(context, CL_MEM_READ_WRITE, amr_max_patches * ghost_cells * sizeof(T));
+        amr_memory = amr_max_patches * (4 * sizeof(cl_int) + (patch_cells + ghost_cells) * sizeof(T)) + map_size * sizeof(cl_int);
+        
+        kernel_amr_deposit.setArg(0, buff_pos_0);
+        kernel_amr_deposit.setArg(1, buff_amr_patch);
+        kernel_amr_deposit.setArg(2, buff_amr_map);
+        kernel_amr_deposit.setArg(4, buff_amr_mass);
+        kernel_amr_deposit.setArg(5, AMR_PATCH_CELLS);
+        kernel_amr_deposit.setArg(8, (T)body_mass);
+        kernel_amr_deposit.setArg(9, periodic);
+        
+        kernel_amr_boundary.setArg(2, buff_amr_pot);
+        kernel_amr_boundary.setArg(3, buff_amr_patch);
+        kernel_amr_boundary.setArg(5, AMR_PATCH_CELLS);
+        kernel_amr_boundary.setArg(6, grid_num);
+        kernel_amr_boundary.setArg(7, periodic);
+        
+        // the mean density is subtracted from the source in a periodic domain, as the FFT solver drops the k = 0 mode
+        
+        kernel_amr_smooth.setArg(0, buff_amr_pot);
+        kernel_amr_smooth.setArg(1, buff_amr_mass);
+        kernel_amr_smooth.setArg(3, AMR_PATCH_CELLS);
+        kernel_amr_smooth.setArg(6, (T)(periodic ? body_num * body_mass / ((double)grid_num * grid_num * grid_num) : 0.0));
+        kernel_amr_smooth.setArg(7, (T)AMR_OMEGA);
+        
+        kernel_amr_acc.setArg(0, buff_pos_0);
+        kernel_amr_acc.setArg(1, buff_amr_pot);
+        kernel_amr_acc.setArg(2, buff_amr_patch);
+        kernel_amr_acc.setArg(3, buff_amr_map);
+        kernel_amr_acc.setArg(5, buff_acc);
+        kernel_amr_acc.setArg(6, AMR_PATCH_CELLS);
+        kernel_amr_acc.setArg(9, periodic);
+    } catch(cl::Error e) {
+        processError(e);
+    }
+}
+
+template<typename T>
+void NBody<T>::enableSplatting(float radius, const char* splat_vs, const char* splat_fs, const char* tone_vs, const char* tone_fs, float exposure) {
+    // the visible positions take as much memory as the drawn positions, in the worst case all the bodies are visible
+    
+    try {
+        delete splatter;
+        splatter = new ParticleSplatter(body_num, radius, splat_vs, splat_fs, tone_vs, tone_fs, exposure);
+        buff_visible = cl::BufferGL(context, CL_MEM_WRITE_ONLY, splatter->getVisibleBuffer());
+        buff_indirect = cl::BufferGL(context, CL_MEM_READ_WRITE, splatter->getIndirectBuffer());
+    } catch(cl::Error e) {
+        processError(e);
+    }
+}
+
+template<typename T>
+void NBody<T>::transformFFT(cl::CommandQueue& queue, cl::Buffer& data, cl::Buffer& scratch, int n, float sign) {
+    // transform the data in place along each axis, ping-ponging with the scratch buffer
+    
+    kernel_FFT.setArg(2, n);
+    kernel_FFT.setArg(5, (T)sign);
+    
+    for(int axis = 0; axis < 3; axis++) for(int span = 1; span < n; span *= 2) {
+        kernel_FFT.setArg(0, data);
+        kernel_FFT.setArg(1, scratch);
+        kernel_FFT.setArg(3, axis);
+        kernel_FFT.setArg(4, span);
+        queue.enqueueNDRangeKernel(kernel_FFT, cl::NullRange, cl::NDRange(size_t(n / 2), size_t(n), size_t(n)), cl::NullRange);
+        std::swap(data, scratch);
+    }
+}
+
+template<typename T>
+void NBody<T>::solveFFT(cl::CommandQueue& queue) {
+    size_t grid_size = size_t(grid_num) * grid_num * grid_num;
+    
+    kernel_pack.setArg(1, buff_pot);
+    queue.enqueueNDRangeKernel(kernel_pack, cl::NullRange, cl::NDRange(grid_size), cl::NullRange);
+    
+    // solve the Poisson equation by the convolution thm.
+    
+    transformFFT(queue, buff_pot, buff_FFT_tmp, grid_num, -1.0f);
+    kernel_pot.setArg(0, buff_pot);
+    queue.enqueueNDRangeKernel(kernel_pot, cl::NullRange, cl::NDRange(grid_size), cl::NullRange);
+    transformFFT(queue, buff_pot, buff_FFT_tmp, grid_num, 1.0f);
+}
+
+template<typename T>
+float NBody<T>::normMultigrid(cl::CommandQueue& queue, const cl::Buffer& buff, size_t size) {
+    // reduce within the work-groups on the device and sum the partial results on the host
+    
+    size_t groups = (size + MG_GROUP_SIZE - 1) / MG_GROUP_SIZE;
+    kernel_mg_norm.setArg(0, buff);
+    kernel_mg_norm.setArg(3, (cl_int)size);
+    queue.enqueueNDRangeKernel(kernel_mg_norm, cl::NullRange, cl::NDRange(groups * MG_GROUP_SIZE), cl::NDRange(MG_GROUP_SIZE));
+    
+    std::vector<T> partial(groups);
+    queue.enqueueReadBuffer(buff_mg_partial, CL_TRUE, 0, groups * sizeof(T), partial.data());
+    
+    double sum = 0.0;
+    for(size_t i = 0; i < groups; i++) sum += partial[i];
+    return (float)std::sqrt(sum);
+}
+
+template<typename T>
+void NBody<T>::smoothMultigrid(cl::CommandQueue& queue, int level, int sweeps) {
+    int n = grid_num >> level;
+    
+    // the boundary of the finest level is set by the whole mass, the coarse levels solve for the error with zero boundary
+    
+    kernel_mg_smooth.setArg(0, buff_mg_phi[level]);
+    kernel_mg_smooth.setArg(1, buff_mg_rhs[level]);
+    kernel_mg_smooth.setArg(2, n);
+    kernel_mg_smooth.setArg(3, (T)(1 << level) * (T)(1 << level));
+    kernel_mg_smooth.setArg(4, (T)(level == 0 ? body_num * body_mass : 0.0f));
+    
+    for(int i = 0; i < sweeps; i++) for(int colour = 0; colour < 2; colour++) {
+        kernel_mg_smooth.setArg(5, colour);
+        queue.enqueueNDRangeKernel(kernel_mg_smooth, cl::NullRange, cl::NDRange(size_t(n / 2), size_t(n), size_t(n)), cl::NullRange);
+    }
+}
+
+template<typename T>
+void NBody<T>::residualMultigrid(cl::CommandQueue& queue, int level) {
+    int n = grid_num >> level;
+    
+    kernel_mg_residual.setArg(0, buff_mg_phi[level]);
+    kernel_mg_residual.setArg(1, buff_mg_rhs[level]);
+    kernel_mg_residual.setArg(2, buff_mg_res[level]);
+    kernel_mg_residual.setArg(3, n);
+    kernel_mg_residual.setArg(4, (T)(1 << level) * (T)(1 << level));
+    kernel_mg_residual.setArg(5, (T)(level == 0 ? body_num * body_mass : 0.0f));
+    queue.enqueueNDRangeKernel(kernel_mg_residual, cl::NullRange, cl::NDRange(size_t(n), size_t(n), size_t(n)), cl::NullRange);
+}
+
+template<typename T>
+void NBody<T>::cycleMultigrid(cl::CommandQueue& queue, int level) {
+    int n = grid_num >> level;
+    
+    if(level == mg_levels - 1) {
+        smoothMultigrid(queue, level, MG_COARSE_SWEEPS);
+        return;
+    }
+    
+    smoothMultigrid(queue, level, MG_PRE_SWEEPS);
+    
+    // restrict the residual to the coarser level and solve for the error there
+    
+    residualMultigrid(queue, level);
+    kernel_mg_restrict.setArg(0, buff_mg_res[level]);
+    kernel_mg_restrict.setArg(1, buff_mg_rhs[level + 1]);
+    kernel_mg_restrict.setArg(2, n / 2);
+    queue.enqueueNDRangeKernel(kernel_mg_restrict, cl::NullRange, cl::NDRange(size_t(n / 2), size_t(n / 2), size_t(n / 2)), cl::NullRange);
+    queue.enqueueFillBuffer(buff_mg_phi[level + 1], (T)0, 0, size_t(n / 2) * (n / 2) * (n / 2) * sizeof(T));
+    
+    cycleMultigrid(queue, level + 1);
+    
+    // correct with the interpolated error
+    
+    kernel_mg_prolong.setArg(0, buff_mg_phi[level + 1]);
+    kernel_mg_prolong.setArg(1, buff_mg_phi[level]);
+    kernel_mg_prolong.setArg(2, n);
+    queue.enqueueNDRangeKernel(kernel_mg_prolong, cl::NullRange, cl::NDRange(size_t(n), size_t(n), size_t(n)), cl::NullRange);
+    
+    smoothMultigrid(queue, level, MG_POST_SWEEPS);
+}
+
+template<typename T>
+void NBody<T>::solveMultigrid(cl::CommandQueue& queue) {
+    // V-cycles until the residual drops below the tolerance, buff_pot keeps the last potential as the initial guess
+    
+    size_t grid_size = size_t(grid_num) * grid_num * grid_num;
+    float rhs_norm = normMultigrid(queue, buff_dens, grid_size);
+    
+    for(mg_cycles = 0; mg_cycles < mg_max_cycles;) {
+        cycleMultigrid(queue, 0);
+        mg_cycles++;
+        
+        residualMultigrid(queue, 0);
+        if(normMultigrid(queue, buff_mg_res[0], grid_size) <= mg_tolerance * rhs_norm) break;
+    }
+}
+
+template<typename T>
+void NBody<T>::depositRefinement(cl::CommandQueue& queue, int level) {
+    if(amr_count[level] == 0) return;
+    
+    size_t patch_size = size_t(AMR_PATCH_CELLS) * AMR_PATCH_CELLS * AMR_PATCH_CELLS * sizeof(T);
+    queue.enqueueFillBuffer(buff_amr_mass, (T)0, amr_first[level] * patch_size, amr_count[level] * patch_size);
+    
+    kernel_amr_deposit.setArg(3, amr_map_offset[level]);
+    kernel_amr_deposit.setArg(6, grid_num << level);
+    kernel_amr_deposit.setArg(7, (T)(1 << level));
+    queue.enqueueNDRangeKernel(kernel_amr_deposit, cl::NullRange, cl::NDRange(size_t(body_num)), cl::NullRange);
+}
+
+template<typename T>
+void NBody<T>::rebuildRefinement(cl::CommandQueue& queue) {
+    // a block of a level is refined if one of the cells of the level above it holds more than the threshold times the mean mass of a
+    // base cell, so every level has to be deposited before the next one is placed; the densest blocks are kept if there are too many
+    
+    struct Candidate {
+        double mass;
+        cl_int patch[4];
+    };
+    
+    int n = AMR_PATCH_CELLS, half = AMR_PATCH_CELLS / 2;
+    size_t patch_cells = size_t(n) * n * n;
+    double limit = amr_threshold * body_num * body_mass / ((double)grid_num * grid_num * grid_num);
+    
+    std::vector<T> mass(size_t(grid_num) * grid_num * grid_num);
+    queue.enqueueReadBuffer(buff_dens, CL_TRUE, 0, buff_s_size, mass.data());
+    amr_patches.clear();
+    
+    for(int l = 1; l <= amr_levels; l++) {
+        std::vector<Candidate> candidates;
+        
+        if(l == 1) {
+            // a block of the first level covers half as many base cells along each axis
+            
+            int blocks = 2 * grid_num / n;
+            for(int bz = 0; bz < blocks; bz++) for(int by = 0; by < blocks; by++) for(int bx = 0; bx < blocks; bx++) {
+                double max_mass = 0.0;
+                for(int z = bz * half; z < (bz + 1) * half; z++) for(int y = by * half; y < (by + 1) * half; y++) for(int x = bx * half; x < (bx + 1) * half; x++) {
+                    max_mass = std::max(max_mass, (double)mass[(size_t(z) * grid_num + y) * grid_num + x]);
+                }
+                if(max_mass > limit) candidates.push_back({max_mass, {bx * n, by * n, bz * n, -1}});
+            }
+        } else if(amr_count[l - 1] > 0) {
+            // every patch of the level above holds 8 blocks of this level
+            
+            mass.resize(amr_count[l - 1] * patch_cells);
+            queue.enqueueReadBuffer(buff_amr_mass, CL_TRUE, amr_first[l - 1] * patch_cells * sizeof(T), mass.size() * sizeof(T), mass.data());
+            
+            for(int q = 0; q < amr_count[l - 1]; q++) {
+                const cl_int* parent = &amr_patches[(amr_first[l - 1] + q) * 4];
+                for(int c = 0; c < 8; c++) {
+                    int ax = c & 1, ay = (c >> 1) & 1, az = (c >> 2) & 1;
+                    double max_mass = 0.0;
+                    for(int z = az * half; z < (az + 1) * half; z++) for(int y = ay * half; y < (ay + 1) * half; y++) for(int x = ax * half; x < (ax + 1) * half; x++) {
+                        max_mass = std::max(max_mass, (double)mass[q * patch_cells + (size_t(z) * n + y) * n + x]);
+                    }
+                    if(max_mass > limit) candidates.push_back({max_mass, {2 * parent[0] + ax * n, 2 * parent[1] + ay * n, 2 * parent[2] + az * n, amr_first[l - 1] + q}});
+                }
+            }
+        }
+        
+        std::sort(candidates.begin(), candidates.end(), [](const Candidate& a, const Candidate& b) { return a.mass > b.mass; });
+        size_t room = amr_max_patches - amr_patches.size() / 4;
+        if(candidates.size() > room) candidates.resize(room);
+        
+        amr_first[l] = (int)(amr_patches.size() / 4);
+        amr_count[l] = (int)candidates.size();
+        
+        // the block map of the level, -1 outside the patches
+        
+        int blocks = (grid_num << l) / n;
+        std::vector<cl_int> map(size_t(blocks) * blocks * blocks, -1);
+        for(size_t i = 0; i < candidates.size(); i++) {
+            const cl_int* o = candidates[i].patch;
+            map[(size_t(o[2] / n) * blocks + o[1] / n) * blocks + o[0] / n] = amr_first[l] + (int)i;
+            amr_patches.insert(amr_patches.end(), o, o + 4);
+        }
+        
+        queue.enqueueWriteBuffer(buff_amr_map, CL_TRUE, amr_map_offset[l] * sizeof(cl_int), map.size() * sizeof(cl_int), map.data());
+        if(amr_count[l] > 0) queue.enqueueWriteBuffer(buff_amr_patch, CL_TRUE, 0, amr_patches.size() * sizeof(cl_int), amr_patches.data());
+        depositRefinement(queue, l);
+    }
+}
+
+template<typename T>
+void NBody<T>::solveRefinement(cl::CommandQueue& queue, bool rebuilt) {
+    // from the coarsest level, the ghost cells of a level are interpolated from the potential of the level above it just solved;
+    // the patches do not correct their parents
+    
+    int n = AMR_PATCH_CELLS;
+    
+    kernel_amr_boundary.setArg(0, buff_pot); // the FFT swaps the potential buffer
+    kernel_amr_boundary.setArg(1, solver == SOLVER_FFT ? 2 : 1);
+    kernel_amr_boundary.setArg(8, (cl_int)rebuilt);
+    
+    for(int l = 1; l <= amr_levels && amr_count[l] > 0; l++) {
+        T h = (T)1 / (T)(1 << l);
+        size_t count = amr_count[l];
+        
+        kernel_amr_boundary.setArg(4, amr_first[l]);
+        queue.enqueueNDRangeKernel(kernel_amr_boundary, cl::NullRange, cl::NDRange(size_t(n + 2), size_t(n + 2), size_t(n + 2) * count), cl::NullRange);
+        
+        kernel_amr_smooth.setArg(2, amr_first[l]);
+        kernel_amr_smooth.setArg(4, h * h);
+        kernel_amr_smooth.setArg(5, (T)1 / (h * h * h));
+        for(int i = 0; i < (rebuilt ? AMR_REBUILD_SWEEPS : AMR_SWEEPS); i++) for(int colour = 0; colour < 2; colour++) {
+            kernel_amr_smooth.setArg(8, colour);
+            queue.enqueueNDRangeKernel(kernel_amr_smooth, cl::NullRange, cl::NDRange(size_t(n / 2), size_t(n), size_t(n) * count), cl::NullRange);
+        }
+    }
+    
+    // the finer levels overwrite the acceleration of the bodies inside them
+    
+    for(int l = 1; l <= amr_levels && amr_count[l] > 0; l++) {
+        kernel_amr_acc.setArg(4, amr_map_offset[l]);
+        kernel_amr_acc.setArg(7, grid_num << l);
+        kernel_amr_acc.setArg(8, (T)(1 << l));
+        queue.enqueueNDRangeKernel(kernel_amr_acc, cl::NullRange, cl::NDRange(size_t(body_num)), cl::NullRange);
+    }
+}
+
+template<typename T>
+void NBody<T>::calculateLongRange(cl::CommandQueue& queue) {
+    // deposit the mass on the mesh
+    
+    queue.enqueueFillBuffer(buff_dens, (T)0, 0, buff_s_size);
+    queue.enqueueNDRangeKernel(kernel_dens, cl::NullRange, cl::NDRange(size_t(body_num)), cl::NullRange);
+    
+    // and on the refinement patches, before the solver turns the density into its source
+    
+    bool rebuilt = amr_levels > 0 && amr_evaluations == 0;
+    if(rebuilt) rebuildRefinement(queue);
+    else for(int l = 1; l <= amr_levels; l++) depositRefinement(queue, l);
+    if(amr_levels > 0) amr_evaluations = (amr_evaluations + 1) % amr_every;
+    
+    if(solver == SOLVER_FFT) solveFFT(queue);
+    else {
+        queue.enqueueNDRangeKernel(kernel_mg_source, cl::NullRange, cl::NDRange(size_t(grid_num) * grid_num * grid_num), cl::NullRange);
+        solveMultigrid(queue);
+    }
+    
+    // interpolate the mesh force back to the bodies
+    
+    kernel_acc.setArg(1, buff_pot);
+    queue.enqueueNDRangeKernel(kernel_acc, cl::NullRange, cl::NDRange(size_t(body_num)), cl::NullRange);
+    
+    if(amr_levels > 0) solveRefinement(queue, rebuilt);
+}
+
+template<typename T>
+void NBody<T>::calculateShortRange(cl::CommandQueue& queue, int tick, size_t active_num) {
+    // rebin the active bodies and calculate the particle-particle correction for them, the other levels are extrapolated to the tick
+    
+    binActive(queue, tick, active_num);
+    if(active_num == 0) return;
+    
+    kernel_acc_short.setArg(8, max_level + 1);
+    kernel_acc_short.setArg(12, tick);
+    kernel_acc_short.setArg(13, (T)time_step / (1 << max_level));
+    queue.enqueueNDRangeKernel(kernel_acc_short, cl::NullRange, cl::NDRange(active_num), cl::NullRange);
+}
+
+template<typename T>
+void NBody<T>::calculateForces(cl::CommandQueue& queue) {
+    // every body is active at the tick 0
+    
+    calculateLongRange(queue);
+    if(r_split > 0.0f) calculateShortRange(queue, 0, compactActive(queue, 0));
+    queue.enqueueBarrierWithWaitList();
+}
+
+template<typename T>
+int NBody<T>::firstActiveLevel(int tick) const {
+    // the level l is active every 2^(max_level - l) ticks, so the active levels are the ones from the returned level up
+    
+    int first = max_level;
+    while(first > 0 && tick % (1 << (max_level - first + 1)) == 0) first--;
+    return first;
+}
+
+template<typename T>
+size_t NBody<T>::compactActive(cl::CommandQueue& queue, int tick) {
+    // gather the bodies whose steps start or end at the tick; the levels only change in assignLevels, which reads their counts,
+    // so the size of the list is known on the host without waiting for the device
+    
+    size_t groups = (body_num + BLOCK_GROUP_SIZE - 1) / BLOCK_GROUP_SIZE;
+    queue.enqueueFillBuffer(buff_active_num, (cl_int)0, 0, sizeof(cl_int));
+    kernel_compact.setArg(5, tick);
+    kernel_compact.setArg(6, max_level);
+    queue.enqueueNDRangeKernel(kernel_compact, cl::NullRange, cl::NDRange(groups * BLOCK_GROUP_SIZE), cl::NDRange(BLOCK_GROUP_SIZE));
+    
+    size_t active_num = 0;
+    for(int l = firstActiveLevel(tick); l <= max_level; l++) active_num += level_count[l];
+    return active_num;
+}
+
+template<typename T>
+void NBody<T>::binActive(cl::CommandQueue& queue, int tick, size_t active_num) {
+    // the lists of the active levels are cleared and filled with the compacted bodies, the lists of the other levels are kept
+    
+    size_t cells = size_t(cell_num) * cell_num * cell_num;
+    int first = firstActiveLevel(tick);
+    queue.enqueueFillBuffer(buff_cell_head, (cl_int)-1, first * cells * sizeof(cl_int), (max_level + 1 - first) * cells * sizeof(cl_int));
+    if(active_num > 0) queue.enqueueNDRangeKernel(kernel_cell, cl::NullRange, cl::NDRange(active_num), cl::NullRange);
+}
+
+template<typename T>
+void NBody<T>::driftActive(cl::CommandQueue& queue, std::vector<cl::Memory>& mem_objs, size_t active_num) {
+    if(active_num == 0) return;
+    
+    queue.enqueueAcquireGLObjects(&mem_objs);
+    queue.enqueueNDRangeKernel(kernel_drift, cl::NullRange, cl::NDRange(active_num), cl::NullRange);
+    queue.enqueueReleaseGLObjects(&mem_objs);
+    queue.enqueueBarrierWithWaitList();
+}
+
+template<typename T>
+void NBody<T>::kickActive(cl::CommandQueue& queue, size_t active_num, float factor) {
+    if(active_num == 0) return;
+    
+    kernel_kick.setArg(5, (T)factor);
+    queue.enqueueNDRangeKernel(kernel_kick, cl::NullRange, cl::NDRange(active_num), cl::NullRange);
+    queue.enqueueBarrierWithWaitList();
+}
+
+template<typename T>
+void NBody<T>::assignLevels(cl::CommandQueue& queue) {
+    // choose the levels from the total acceleration and count the bodies on each level
+    
+    queue.enqueueFillBuffer(buff_level_count, (cl_int)0, 0, BLOCK_MAX_LEVELS * sizeof(cl_int));
+    kernel_level.setArg(6, (T)block_eta);
+    kernel_level.setArg(7, (T)(max_level > 0 ? r_cut * BLOCK_SKIN : 0.0f));
+    kernel_level.setArg(8, min_level);
+    kernel_level.setArg(9, max_level);
+    queue.enqueueNDRangeKernel(kernel_level, cl::NullRange, cl::NDRange(size_t(body_num)), cl::NullRange);
+    queue.enqueueReadBuffer(buff_level_count, CL_TRUE, 0, BLOCK_MAX_LEVELS * sizeof(cl_int), level_count.data());
+    
+    // the bodies that changed their levels move to the lists of the new ones
+    
+    binActive(queue, 0, compactActive(queue, 0));
+}
+
+template<typename T>
+void NBody<T>::benchmarkForces(int repeats) {
+    wait();
+    try {
+        typedef std::chrono::high_resolution_clock clock;
+        
+        cl::CommandQueue queue(context, device);
+        cl::Buffer buff_acc_ref(context, CL_MEM_READ_WRITE, buff_v_size);
+        kernel_acc_direct.setArg(1, buff_acc_ref);
+        
+        // time each part of the force calculation separately
+        
+        queue.finish();
+        clock::time_point t0 = clock::now();
+        for(int i = 0; i < repeats; i++) calculateLongRange(queue);
+        queue.finish();
+        clock::time_point t1 = clock::now();
+        if(r_split > 0.0f) for(int i = 0; i < repeats; i++) calculateShortRange(queue, 0, compactActive(queue, 0));
+        queue.finish();
+        clock::time_point t2 = clock::now();
+        for(int i = 0; i < repeats; i++) queue.enqueueNDRangeKernel(kernel_acc_direct, cl::NullRange, cl::NDRange(size_t(body_num)), cl::NullRange);
+        queue.finish();
+        clock::time_point t3 = clock::now();
+        
+        // compare the P3M force with the direct summation
+        
+        calculateForces(queue);
+        std::vector<T> acc(body_num * 3), acc_short(body_num * 3, 0), acc_ref(body_num * 3);
+        queue.enqueueReadBuffer(buff_acc, CL_TRUE, 0, buff_v_size, acc.data());
+        if(r_split > 0.0f) queue.enqueueReadBuffer(buff_acc_short, CL_TRUE, 0, buff_v_size, acc_short.data());
+        queue.enqueueReadBuffer(buff_acc_ref, CL_TRUE, 0, buff_v_size, acc_ref.data());
+        for(int i = 0; i < body_num * 3; i++) acc[i] += acc_short[i];
+        
+        double err_sum = 0.0, err_max = 0.0;
+        for(int i = 0; i < body_num; i++) {
+            double diff = 0.0, norm = 0.0;
+            for(int j = 0; j < 3; j++) {
+                double d = acc[i * 3 + j] - acc_ref[i * 3 + j];
+                diff += d * d;
+                norm += (double)acc_ref[i * 3 + j] * acc_ref[i * 3 + j];
+            }
+            double err = norm > 0.0 ? std::sqrt(diff / norm) : 0.0;
+            err_sum += err * err;
+            if(err > err_max) err_max = err;
+        }
+        
+        double ms = 1000.0 / repeats;
+        std::cout << "BENCHMARK: NBody: " << body_num << " BODIES, GRID " << grid_num << "^3, R_SPLIT " << r_split << ", R_CUT " << r_cut << std::endl;
+        std::cout << "BENCHMARK: NBody: PM: " << std::chrono::duration<double>(t1 - t0).count() * ms << " ms, PP: " << std::chrono::duration<double>(t2 - t1).count() * ms << " ms, DIRECT: " << std::chrono::duration<double>(t3 - t2).count() * ms << " ms" << std::endl;
+        std::cout << "BENCHMARK: NBody: RELATIVE FORCE ERROR: RMS " << std::sqrt(err_sum / body_num) << ", MAX " << err_max << std::endl;
+    } catch(cl::Error e) {
+        processError(e);
+    }
+}
+
+template<typename T>
+void NBody<T>::benchmarkPoisson(int repeats) {
+    wait();
+    try {
+        typedef std::chrono::high_resolution_clock clock;
+        
+        cl::CommandQueue queue(context, device);
+        size_t grid_size = size_t(grid_num) * grid_num * grid_num;
+        
+        // deposit the current bodies once, every solver works on the same source
+        
+        queue.enqueueFillBuffer(buff_dens, (T)0, 0, buff_s_size);
+        queue.enqueueNDRangeKernel(kernel_dens, cl::NullRange, cl::NDRange(size_t(body_num)), cl::NullRange);
+        if(solver == SOLVER_MULTIGRID) queue.enqueueNDRangeKernel(kernel_mg_source, cl::NullRange, cl::NDRange(grid_size), cl::NullRange);
+        queue.finish();
+        
+        // time the solver in use, the multigrid solver starts from a zero potential each time
+        
+        size_t bytes = buff_s_size;
+        clock::time_point t0 = clock::now();
+        for(int i = 0; i < repeats; i++) {
+            if(solver == SOLVER_FFT) solveFFT(queue);
+            else {
+                queue.enqueueFillBuffer(buff_pot, (T)0, 0, buff_s_size);
+                solveMultigrid(queue);
+            }
+        }
+        queue.finish();
+        clock::time_point t1 = clock::now();
+        
+        if(solver == SOLVER_FFT) bytes += 5 * buff_s_size;
+        else {
+            for(int l = 0; l < mg_levels; l++) bytes += (l > 0 ? 3 : 2) * (buff_s_size >> (3 * l));
+            bytes += (grid_size + MG_GROUP_SIZE - 1) / MG_GROUP_SIZE * sizeof(T);
+        }
+        
+        double ms = 1000.0 / repeats;
+        std::cout << "BENCHMARK: NBody: POISSON SOLVER: " << (solver == SOLVER_FFT ? "PERIODIC FFT" : "MULTIGRID") << ", GRID " << grid_num << "^3: " << std::chrono::duration<double>(t1 - t0).count() * ms << " ms";
+        if(solver == SOLVER_MULTIGRID) std::cout << " (" << mg_cycles << " V-CYCLES)";
+        std::cout << ", " << bytes / (1024.0 * 1024.0) << " MB" << std::endl;
+        
+        // an isolated FFT solver needs the mesh zero-padded to twice the size along each axis
+        
+        try {
+            int n = 2 * grid_num;
+            size_t padded_size = size_t(n) * n * n;
+            cl::Buffer buff_a(context, CL_MEM_READ_WRITE, 2 * padded_size * sizeof(T));
+            cl::Buffer buff_b(context, CL_MEM_READ_WRITE, 2 * padded_size * sizeof(T));
+            cl::Buffer buff_h(context, CL_MEM_READ_WRITE, padded_size * sizeof(T));
+            queue.enqueueFillBuffer(buff_a, (T)0, 0, 2 * padded_size * sizeof(T));
+            queue.enqueueFillBuffer(buff_h, (T)0, 0, padded_size * sizeof(T));
+            queue.finish();
+            
+            t0 = clock::now();
+            for(int i = 0; i < repeats; i++) {
+                transformFFT(queue, buff_a, buff_b, n, -1.0f);
+                kernel_pot.setArg(0, buff_a);
+                kernel_pot.setArg(1, buff_h);
+                queue.enqueueNDRangeKernel(kernel_pot, cl::NullRange, cl::NDRange(padded_size), cl::NullRange);
+                transformFFT(queue, buff_a, buff_b, n, 1.0f);
+            }
+            queue.finish();
+            t1 = clock::now();
+            
+            bytes = buff_s_size + 5 * padded_size * sizeof(T);
+            std::cout << "BENCHMARK: NBody: POISSON SOLVER: ZERO-PADDED FFT, GRID " << grid_num << "^3: " << std::chrono::duration<double>(t1 - t0).count() * ms << " ms, " << bytes / (1024.0 * 1024.0) << " MB" << std::endl;
+        } catch(cl::Error e) {
+            std::cout << "BENCHMARK: NBody: POISSON SOLVER: ZERO-PADDED FFT, GRID " << grid_num << "^3: FAILED: " << oclErrorString(e.err()) << std::endl;
+        }
+        
+        if(solver == SOLVER_FFT) kernel_pot.setArg(1, buff_FFT_h);
+    } catch(cl::Error e) {
+        processError(e);
+    }
+}
+
+template<typename T>
+void NBody<T>::printBlockStats() {
+    // occupancy of the levels and the saving of the short-range force evaluations against every body taking the smallest step
+    
+    std::cout << "STATS: NBody: BLOCK TIME-STEPS: " << block_steps << " STEPS, MAX LEVEL " << max_level << std::endl;
+    for(int l = 0; l <= max_level; l++) std::cout << "STATS: NBody: LEVEL " << l << " (dt/" << (1 << l) << "): " << level_count[l] << " BODIES (" << 100.0 * level_count[l] / body_num << "%)" << std::endl;
+    
+    if(block_updates > 0) {
+        double uniform_updates = (double)block_steps * body_num * (1 << max_level);
+        std::cout << "STATS: NBody: SHORT-RANGE FORCE EVALUATIONS: " << block_updates << ", ESTIMATED SPEEDUP: " << uniform_updates / block_updates << std::endl;
+    }
+}
+
+template<typename T>
+void NBody<T>::printRefinementStats() {
+    // the patches of each level and the device memory with them, to compare with the uniform mesh of the finest spacing
+    
+    std::cout << "STATS: NBody: DEVICE MEMORY: " << getDeviceMemory() / 1048576.0 << " MB, GRID " << grid_num << "^3, MESH REFINEMENT " << amr_memory / 1048576.0 << " MB" << std::endl;
+    for(int l = 1; l <= amr_levels; l++) {
+        size_t cells = size_t(amr_count[l]) * AMR_PATCH_CELLS * AMR_PATCH_CELLS * AMR_PATCH_CELLS;
+        std::cout << "STATS: NBody: REFINEMENT LEVEL " << l << " (h = 1/" << (1 << l) << "): " << amr_count[l] << " PATCHES, " << cells << " CELLS" << std::endl;
+    }
+}
+
+template<typename T>
+void NBody<T>::benchmarkBlockSteps(int steps) {
+    // runs the simulation forward twice: with the block time-steps and with every body on the finest level
+    
+    wait();
+    if(r_split <= 0.0f) return;
+    
+    try {
+        typedef std::chrono::high_resolution_clock clock;
+        cl::CommandQueue queue(context, device);
+        
+        block_steps = block_updates = 0;
+        clock::time_point t0 = clock::now();
+        iterate(steps);
+        clock::time_point t1 = clock::now();
+        printBlockStats();
+        
+        int min_level_prev = min_level;
+        min_level = max_level;
+        assignLevels(queue);
+        clock::time_point t2 = clock::now();
+        iterate(steps);
+        clock::time_point t3 = clock::now();
+        min_level = min_level_prev;
+        assignLevels(queue);
+        
+        double block_time = std::chrono::duration<double>(t1 - t0).count();
+        double uniform_time = std::chrono::duration<double>(t3 - t2).count();
+        std::cout << "BENCHMARK: NBody: BLOCK TIME-STEPS: " << block_time * 1000.0 / steps << " ms/step, UNIFORM SMALLEST STEP: " << uniform_time * 1000.0 / steps << " ms/step, SPEEDUP: " << uniform_time / block_time << std::endl;
+    } catch(cl::Error e) {
+        processError(e);
+    }
+}
+
+template<typename T>
+void NBody<T>::benchmarkIterate(int steps) {
+    wait();
+    typedef std::chrono::high_resolution_clock clock;
+    
+    clock::time_point t0 = clock::now();
+    iterate(steps);
+    clock::time_point t1 = clock::now();
+    
+    double time = std::chrono::duration<double>(t1 - t0).count();
+    const char* names[] = {"FLOAT", "HALF", "FIXED"};
+    std::cout << "BENCHMARK: NBody: " << (sizeof(T) == sizeof(cl_double) ? "DOUBLE" : "FLOAT") << " PRECISION, " << names[storage] << " STORAGE: " << time * 1000.0 / steps << " ms/step, " << (double)steps * body_num / time * 1e-6 << " Mbody/s" << std::endl;
+}
+
+template<typename T>
+void NBody<T>::benchmarkDraw(const Camera* camera, int frames) {
+    // the first frame creates the splatting target and is not counted
+    
+    wait();
+    typedef std::chrono::high_resolution_clock clock;
+    
+    draw(camera);
+    glFinish();
+    
+    clock::time_point t0 = clock::now();
+    for(int i = 0; i < frames; i++) draw(camera);
+    glFinish();
+    clock::time_point t1 = clock::now();
+    
+    double time = std::chrono::duration<double>(t1 - t0).count();
+    GLuint visible = splatter ? splatter->readVisibleCount() : (GLuint)body_num;
+    std::cout << "BENCHMARK: NBody: " << (splatter ? "SPLATTED " : "POINTS ") << body_num << " BODIES, " << visible << " VISIBLE (" << 100.0 * visible / body_num << "%): " << time * 1000.0 / frames << " ms/frame" << std::endl;
+}
+
+template<typename T>
+void NBody<T>::readPositions(std::vector<float>& positions) {
+    // the drawn positions are always stored as floats
+    
+    wait();
     try {
         std::vector<cl::Memory> mem_objs;
         mem_objs.push_back(buff_pos_1);
+        positions.resize(buff_gl_size / sizeof(cl_float));
         
-        // TODO
+        cl::CommandQueue queue(context, device);
+        queue.enqueueAcquireGLObjects(&mem_objs);
+        queue.enqueueReadBuffer(buff_pos_1, CL_TRUE, 0, buff_gl_size, positions.data());
+        queue.enqueueReleaseGLObjects(&mem_objs);
+        queue.finish();
+    } catch(cl::Error e) {
+        processError(e);
+    }
+}
+
+template<typename T>
+void NBody<T>::readVelocities(std::vector<float>& velocities) {
+    // synchronised with the positions between the steps
+    
+    wait();
+    try {
+        size_t count = size_t(body_num) * 3;
+        velocities.resize(count);
+        
+        cl::CommandQueue queue(context, device);
+        if(storage == STORAGE_FLOAT) {
+            std::vector<T> vel(count);
+            queue.enqueueReadBuffer(buff_vel_0, CL_TRUE, 0, buff_state_size, vel.data());
+            velocities.assign(vel.begin(), vel.end());
+        } else {
+            std::vector<cl_half> vel(count);
+            queue.enqueueReadBuffer(buff_vel_0, CL_TRUE, 0, buff_state_size, vel.data());
+            std::transform(vel.begin(), vel.end(), velocities.begin(), halfToFloat);
+        }
+    } catch(cl::Error e) {
+        processError(e);
+    }
+}
+
+template<typename T>
+void NBody<T>::createDiagnostics(const cl::Program& diagnostics_program, const std::function<void(const DiagnosticsRecord&)>& callback) {
+    diagnostics = new Diagnostics(context, diagnostics_program, body_num, body_num * body_mass, callback);
+    
+    cl_int periodic = solver == SOLVER_FFT;
+    kernel_diag = cl::Kernel(program, KERNEL_DIAG);
+    kernel_diag.setArg(0, buff_pos_0);
+    kernel_diag.setArg(1, buff_vel_0);
+    kernel_diag.setArg(3, periodic ? 2 : 1);
+    kernel_diag.setArg(4, diagnostics->getPartialBuffer());
+    kernel_diag.setArg(5, cl::Local(Diagnostics::getGroupSize() * sizeof(cl_float8)));
+    kernel_diag.setArg(6, body_num);
+    kernel_diag.setArg(7, grid_num);
+    kernel_diag.setArg(8, periodic);
+    kernel_diag.setArg(9, (T)body_mass);
+}
+
+template<typename T>
+bool NBody<T>::stateBuffer(StateField field, cl::Buffer& buffer, size_t& size, size_t& item_size) {
+    // the fixed point positions are relative to the cells and have no host view
+    
+    if(field == FIELD_POSITIONS && storage == STORAGE_FIXED) return false;
+    
+    buffer = field == FIELD_POSITIONS ? buff_pos_0 : buff_vel_0;
+    size = buff_state_size;
+    item_size = storageSize<T>(storage);
+    return true;
+}
+
+template<typename T>
+bool NBody<T>::setParameter(const std::string& name, float value) {
+    // all the bodies are synchronised between the steps, so the step can change there
+    
+    wait();
+    if(name != "time_step") return false;
+    
+    time_step = value;
+    setConstKernelArgs();
+    return true;
+}
+
+template<typename T>
+void NBody<T>::iterate(int steps) {
+    try {
+        std::vector<cl::Memory> mem_objs;
+        mem_objs.push_back(buff_pos_1);
+        
+        // use the kick-drift-kick leapfrog, the short-range force is sub-cycled with the block time-steps
+        
+        cl::CommandQueue queue(context, device);
+        
+        int ticks = 1 << max_level;
+        
+        cl::Event step_done;
+        for(int i = 0; i < steps; i++) {
+            
+            // kick with the long-range force for half of the step
+            
+            queue.enqueueNDRangeKernel(kernel_vel, cl::NullRange, cl::NDRange(size_t(body_num)), cl::NullRange);
+            queue.enqueueCopyBuffer(buff_vel_1, buff_vel_0, 0, 0, buff_state_size);
+            queue.enqueueBarrierWithWaitList();
+            
+            if(r_split > 0.0f) kickActive(queue, compactActive(queue, 0), 0.5f);
+            
+            for(int tick = 1; tick <= ticks; tick++) {
+                
+                // without the short-range force there is a single tick, all the bodies drift by the whole step
+                
+                if(r_split <= 0.0f) {
+                    queue.enqueueAcquireGLObjects(&mem_objs);
+                    queue.enqueueNDRangeKernel(kernel_pos, cl::NullRange, cl::NDRange(size_t(body_num)), cl::NullRange);
+                    queue.enqueueReleaseGLObjects(&mem_objs);
+                    queue.enqueueBarrierWithWaitList();
+                    continue;
+                }
+                
+                // only the bodies whose steps end at this tick are drifted, over their whole steps, and kicked with the new short-range
+                // force; all of them are active at the last tick, so the long-range force sees the synchronised positions
+                
+                size_t active_num = compactActive(queue, tick);
+                driftActive(queue, mem_objs, active_num);
+                calculateShortRange(queue, tick, active_num);
+                queue.enqueueBarrierWithWaitList();
+                kickActive(queue, active_num, tick == ticks ? 0.5f : 1.0f);
+                block_updates += active_num;
+            }
+            
+            // kick with the new long-range force for the other half of the step
+            
+            calculateLongRange(queue);
+            queue.enqueueBarrierWithWaitList();
+            queue.enqueueNDRangeKernel(kernel_vel, cl::NullRange, cl::NDRange(size_t(body_num)), cl::NullRange);
+            queue.enqueueCopyBuffer(buff_vel_1, buff_vel_0, 0, 0, buff_state_size);
+            queue.enqueueBarrierWithWaitList();
+            
+            // all the bodies are synchronised again, choose the new levels
+            
+            if(r_split > 0.0f) assignLevels(queue);
+            block_steps++;
+            
+            // the drawing only waits for the last step, the diagnostics after it are delivered by their callbacks
+            
+            if(i == steps - 1) queue.enqueueMarkerWithWaitList(NULL, &step_done);
+            
+            // sample the energy and momentum, the result is read back without blocking
+            
+            if(diagnosticsDue()) {
+                kernel_diag.setArg(2, buff_pot); // the FFT swaps the potential buffer
+                queue.enqueueNDRangeKernel(kernel_diag, cl::NullRange, cl::NDRange(diagnostics->getGlobalSize()), cl::NDRange(Diagnostics::getGroupSize()));
+                diagnostics->enqueue(queue, step_count);
+            }
+        }
+        
+        queue.flush();
+        if(steps > 0) step_done.wait();
+    } catch(cl::Error e) {
+        processError(e);
+    }
+}
+
+template<typename T>
+void NBody<T>::cullBodies(const Camera* camera) {
+    // compacts the bodies inside the view and writes their number into the draw command, the order within a work-group is kept
+    
+    try {
+        std::vector<cl::Memory> mem_objs;
+        mem_objs.push_back(buff_pos_1);
+        mem_objs.push_back(buff_visible);
+        mem_objs.push_back(buff_indirect);
+        
+        cl_float16 pvm;
+        glm::mat4 pv = camera->getPVMatrix();
+        std::copy(glm::value_ptr(pv), glm::value_ptr(pv) + 16, pvm.s);
+        cl_uint command[4] = {0, 1, 0, 0};
         
+        kernel_cull.setArg(0, buff_pos_1);
+        kernel_cull.setArg(1, buff_visible);
+        kernel_cull.setArg(2, buff_indirect);
+        kernel_cull.setArg(3, cl::Local(CULL_GROUP_SIZE * sizeof(cl_int)));
+        kernel_cull.setArg(4, body_num);
+        kernel_cull.setArg(5, pvm);
+        
+        cl::CommandQueue queue(context, device);
+        queue.enqueueAcquireGLObjects(&mem_objs);
+        queue.enqueueWriteBuffer(buff_indirect, CL_FALSE, 0, sizeof(command), command);
+        queue.enqueueNDRangeKernel(kernel_cull, cl::NullRange, cl::NDRange((size_t(body_num) + CULL_GROUP_SIZE - 1) / CULL_GROUP_SIZE * CULL_GROUP_SIZE), cl::NDRange(CULL_GROUP_SIZE));
+        queue.enqueueReleaseGLObjects(&mem_objs);
+        queue.finish();
     } catch(cl::Error e) {
         processError(e);
     }
 }
 
-void NBody::draw(const Camera* camera) {
+template<typename T>
+void NBody<T>::draw(const Camera* camera) {
+    // the splatted bodies cost in proportion to the ones inside the view
+    
+    if(splatter) {
+        cullBodies(camera);
+        splatter->draw(camera, body_num);
+        return;
+    }
+    
     shader.use();
     
     GLint polygon_mode;
@@ -149,3 +1472,6 @@ void NBody::draw(const Camera* camera) {
     
     glPolygonMode(GL_FRONT_AND_BACK, polygon_mode);
 }
+
+template class NBody<float>;
+template class NBody<double>;
@@ -0,0 +1,451 @@
+//
+//  nbodyslab.cpp
+//  Vertex Simulations
+//
+//  Created by Antoni Wójcik on 06/06/2020.
+//  Copyright © 2020 Antoni Wójcik. All rights reserved.
+//
+
+#include "nbodyslab.h"
+#include "kernelgl.h"
+
+#include <algorithm>
+#include <chrono>
+#include <random>
+#include <iostream>
+#include <cstring>
+
+#define KERNEL_POS "iteratePos"
+#define KERNEL_VEL "iterateVel"
+#define KERNEL_DENS "calculateDensSlab"
+#define KERNEL_PACK "packGrid"
+#define KERNEL_FFT "fftPass"
+#define KERNEL_FFT_H "calculateFFTHSlab"
+#define KERNEL_POT "calculatePot"
+#define KERNEL_ACC "calculateAccSlab"
+
+#define SLAB_DEVICE_TYPE CL_DEVICE_TYPE_CPU // the ranks split the CPU into equal sub-devices, with CL_DEVICE_TYPE_GPU they take the GPUs in turn
+#define SLAB_CAPACITY 1.5 // room for the bodies of a rank relative to its share, grown when the bodies gather in one slab
+#define SLAB_SHM_NAME "/vertex_slabs"
+#define SLAB_MAILBOX (1 << 20) // bytes of one chunk of the shared memory transport
+
+template<typename T>
+NBodySlab<T>::NBodySlab(int g, long n, float m, float dt, Transport& t, const char* kernel_path, unsigned int seed) : transport(t), rank(t.getRank()), ranks(t.getSize()), grid_num(g), slab_num(g / t.getSize()), slab_start(t.getRank() * (g / t.getSize())), body_num(0), body_capacity(0), body_mass(m), time_step(dt), all_ranks(t.getSize()), exchange_time(0.0), plane_size(size_t(g) * g) {
+    try {
+        selectDevice();
+        context = cl::Context(device);
+        program = KernelGL::buildProgram(context, {device}, KernelGL::loadSource(kernel_path, "NBodySlab"), "-D HEADLESS", sizeof(T) == sizeof(cl_double), "NBodySlab", {"cl_khr_int64_base_atomics"});
+    } catch(cl::Error e) {
+        KernelGL::processError(e, "NBodySlab");
+    }
+    initialise(n, seed);
+}
+
+template<typename T>
+NBodySlab<T>::NBodySlab(int g, long n, float m, float dt, Transport& t, const cl::Device& d, const cl::Context& c, const cl::Program& p, unsigned int seed) : transport(t), rank(t.getRank()), ranks(t.getSize()), grid_num(g), slab_num(g / t.getSize()), slab_start(t.getRank() * (g / t.getSize())), body_num(0), body_capacity(0), body_mass(m), time_step(dt), all_ranks(t.getSize()), exchange_time(0.0), device(d), context(c), program(p), plane_size(size_t(g) * g) {
+    initialise(n, seed);
+}
+
+template<typename T>
+void NBodySlab<T>::initialise(long n, unsigned int seed) {
+    // the force interpolation reads two planes of the next slab
+    
+    if(grid_num % ranks != 0 || slab_num < 2) {
+        std::cerr << "ERROR: NBodySlab: A GRID OF " << grid_num << " PLANES CANNOT BE SPLIT INTO " << ranks << " SLABS OF AT LEAST 2 PLANES" << std::endl;
+        exit(-1);
+    }
+    for(int q = 0; q < ranks; q++) all_ranks[q] = q;
+    
+    try {
+        queue = cl::CommandQueue(context, device);
+        createKernels();
+        createBuffers();
+        generateUniform(n, seed);
+        calculateForces();
+        queue.finish();
+    } catch(cl::Error e) {
+        KernelGL::processError(e, "NBodySlab");
+    }
+}
+
+template<typename T>
+void NBodySlab<T>::selectDevice() {
+    // every rank is a separate process, the ranks on one machine agree on the split by their numbers
+    
+    std::vector<cl::Platform> platforms;
+    std::vector<cl::Device> devices;
+    cl::Platform::get(&platforms);
+    for(cl::Platform& platform : platforms) {
+        try {
+            platform.getDevices(SLAB_DEVICE_TYPE, &devices);
+        } catch(cl::Error e) {
+            devices.clear(); // the platform has no devices of the type
+        }
+        if(devices.size() > 0) break;
+    }
+    if(devices.size() == 0) {
+        std::cerr << "ERROR: NBodySlab: NO DEVICES FOUND" << std::endl;
+        exit(-1);
+    }
+    
+    if(SLAB_DEVICE_TYPE == CL_DEVICE_TYPE_CPU && ranks > 1) {
+        cl_uint units = (cl_uint)devices[0].getInfo<CL_DEVICE_MAX_COMPUTE_UNITS>();
+        cl_device_partition_property properties[] = {CL_DEVICE_PARTITION_EQUALLY, (cl_device_partition_property)std::max(1u, units / ranks), 0};
+        std::vector<cl::Device> sub_devices;
+        devices[0].createSubDevices(properties, &sub_devices);
+        device = sub_devices[rank % sub_devices.size()];
+    } else device = devices[rank % devices.size()];
+}
+
+template<typename T>
+void NBodySlab<T>::createKernels() {
+    kernel_pos = cl::Kernel(program, KERNEL_POS);
+    kernel_vel = cl::Kernel(program, KERNEL_VEL);
+    kernel_dens = cl::Kernel(program, KERNEL_DENS);
+    kernel_pack = cl::Kernel(program, KERNEL_PACK);
+    kernel_FFT = cl::Kernel(program, KERNEL_FFT);
+    kernel_pot = cl::Kernel(program, KERNEL_POT);
+    kernel_acc = cl::Kernel(program, KERNEL_ACC);
+}
+
+template<typename T>
+void NBodySlab<T>::createBuffers() {
+    buff_dens = cl::Buffer(context, CL_MEM_READ_WRITE, (slab_num + 1) * plane_size * sizeof(T));
+    buff_pot = cl::Buffer(context, CL_MEM_READ_WRITE, slab_num * plane_size * 2 * sizeof(T));
+    buff_FFT_tmp = cl::Buffer(context, CL_MEM_READ_WRITE, slab_num * plane_size * 2 * sizeof(T));
+    buff_FFT_h = cl::Buffer(context, CL_MEM_READ_WRITE, slab_num * plane_size * sizeof(T));
+    buff_pot_halo = cl::Buffer(context, CL_MEM_READ_WRITE, (slab_num + 3) * plane_size * 2 * sizeof(T));
+    
+    // the Green's function of the rows held after the transpose, the rows of a rank start at the same index as its planes
+    
+    cl::Kernel kernel_FFT_h(program, KERNEL_FFT_H);
+    kernel_FFT_h.setArg(0, buff_FFT_h);
+    kernel_FFT_h.setArg(1, grid_num);
+    kernel_FFT_h.setArg(2, (T)0);
+    kernel_FFT_h.setArg(3, slab_start);
+    queue.enqueueNDRangeKernel(kernel_FFT_h, cl::NullRange, cl::NDRange(size_t(grid_num), size_t(grid_num), size_t(slab_num)), cl::NullRange);
+    
+    kernel_dens.setArg(1, buff_dens);
+    kernel_dens.setArg(2, grid_num);
+    kernel_dens.setArg(3, slab_start);
+    kernel_dens.setArg(4, slab_num);
+    kernel_dens.setArg(5, (T)body_mass);
+    
+    kernel_pack.setArg(0, buff_dens);
+    kernel_FFT.setArg(2, grid_num);
+    kernel_pot.setArg(1, buff_FFT_h);
+    
+    kernel_acc.setArg(1, buff_pot_halo);
+    kernel_acc.setArg(2, 2);
+    kernel_acc.setArg(4, grid_num);
+    kernel_acc.setArg(5, slab_start);
+}
+
+template<typename T>
+void NBodySlab<T>::resizeBodies(size_t capacity) {
+    // the contents are not kept, the bodies are written again after every migration
+    
+    body_capacity = std::max(capacity, (size_t)1);
+    buff_pos = cl::Buffer(context, CL_MEM_READ_WRITE, body_capacity * 3 * sizeof(T));
+    buff_vel = cl::Buffer(context, CL_MEM_READ_WRITE, body_capacity * 3 * sizeof(T));
+    buff_acc = cl::Buffer(context, CL_MEM_READ_WRITE, body_capacity * 3 * sizeof(T));
+    
+    kernel_pos.setArg(0, buff_pos);
+    kernel_pos.setArg(1, buff_pos); // the OpenGL positions, not written without drawing
+    kernel_pos.setArg(2, buff_vel);
+    kernel_pos.setArg(3, grid_num);
+    kernel_pos.setArg(4, (T)time_step);
+    kernel_pos.setArg(5, 1);
+    
+    kernel_vel.setArg(0, buff_vel);
+    kernel_vel.setArg(1, buff_vel);
+    kernel_vel.setArg(2, buff_acc);
+    kernel_vel.setArg(3, (T)time_step * (T)0.5);
+    
+    kernel_dens.setArg(0, buff_pos);
+    kernel_acc.setArg(0, buff_pos);
+    kernel_acc.setArg(3, buff_acc);
+}
+
+template<typename T>
+void NBodySlab<T>::generateUniform(long n, unsigned int seed) {
+    // every rank places its share of the bodies uniformly in its slab, at rest
+    
+    body_num = size_t(n * (rank + 1) / ranks - n * rank / ranks);
+    resizeBodies(size_t(body_num * SLAB_CAPACITY));
+    
+    std::mt19937 random(seed + 7919u * rank);
+    std::uniform_real_distribution<double> uniform(0.0, 1.0);
+    std::vector<T> pos(body_num * 3);
+    for(size_t i = 0; i < body_num; i++) {
+        pos[i * 3]     = (T)(uniform(random) * grid_num);
+        pos[i * 3 + 1] = (T)(uniform(random) * grid_num);
+        pos[i * 3 + 2] = (T)(slab_start + uniform(random) * slab_num);
+    }
+    
+    if(body_num == 0) return;
+    queue.enqueueWriteBuffer(buff_pos, CL_TRUE, 0, body_num * 3 * sizeof(T), pos.data());
+    queue.enqueueFillBuffer(buff_vel, (T)0, 0, body_num * 3 * sizeof(T));
+}
+
+template<typename T>
+void NBodySlab<T>::exchange(const std::vector<int>& to, const std::vector<std::vector<char>>& send, const std::vector<int>& from, std::vector<std::vector<char>>& recv) {
+    typedef std::chrono::high_resolution_clock clock;
+    
+    clock::time_point t0 = clock::now();
+    transport.exchange(to, send, from, recv);
+    exchange_time += std::chrono::duration<double>(clock::now() - t0).count();
+}
+
+template<typename T>
+void NBodySlab<T>::migrateBodies() {
+    // after the drift every body goes to the rank owning its plane, usually one of the neighbours
+    
+    std::vector<T> pos(body_num * 3), vel(body_num * 3);
+    if(body_num > 0) {
+        queue.enqueueReadBuffer(buff_pos, CL_TRUE, 0, body_num * 3 * sizeof(T), pos.data());
+        queue.enqueueReadBuffer(buff_vel, CL_TRUE, 0, body_num * 3 * sizeof(T), vel.data());
+    }
+    
+    std::vector<std::vector<char>> send(ranks), recv;
+    size_t kept = 0;
+    for(size_t i = 0; i < body_num; i++) {
+        int owner = std::min(std::max((int)pos[i * 3 + 2], 0) / slab_num, ranks - 1);
+        if(owner == rank) {
+            std::copy(&pos[i * 3], &pos[i * 3] + 3, &pos[kept * 3]);
+            std::copy(&vel[i * 3], &vel[i * 3] + 3, &vel[kept * 3]);
+            kept++;
+        } else {
+            std::vector<char>& out = send[owner];
+            out.insert(out.end(), (char*)&pos[i * 3], (char*)&pos[i * 3] + 3 * sizeof(T));
+            out.insert(out.end(), (char*)&vel[i * 3], (char*)&vel[i * 3] + 3 * sizeof(T));
+        }
+    }
+    
+    exchange(all_ranks, send, all_ranks, recv);
+    
+    // the bodies received are appended, a record is the position followed by the velocity
+    
+    body_num = kept;
+    for(const std::vector<char>& r : recv) body_num += r.size() / (6 * sizeof(T));
+    pos.resize(body_num * 3);
+    vel.resize(body_num * 3);
+    size_t i = kept;
+    for(const std::vector<char>& r : recv) for(size_t offset = 0; offset < r.size(); offset += 6 * sizeof(T), i++) {
+        std::memcpy(&pos[i * 3], r.data() + offset, 3 * sizeof(T));
+        std::memcpy(&vel[i * 3], r.data() + offset + 3 * sizeof(T), 3 * sizeof(T));
+    }
+    
+    if(body_num > body_capacity) resizeBodies(size_t(body_num * SLAB_CAPACITY));
+    if(body_num > 0) {
+        queue.enqueueWriteBuffer(buff_pos, CL_FALSE, 0, body_num * 3 * sizeof(T), pos.data());
+        queue.enqueueWriteBuffer(buff_vel, CL_FALSE, 0, body_num * 3 * sizeof(T), vel.data());
+        queue.finish();
+    }
+}
+
+template<typename T>
+void NBodySlab<T>::depositDensity() {
+    // the plane above the slab is the first plane of the next slab, the last slab wraps around to the first
+    
+    size_t plane_bytes = plane_size * sizeof(T);
+    queue.enqueueFillBuffer(buff_dens, (T)0, 0, (slab_num + 1) * plane_bytes);
+    if(body_num > 0) queue.enqueueNDRangeKernel(kernel_dens, cl::NullRange, cl::NDRange(body_num), cl::NullRange);
+    
+    std::vector<std::vector<char>> send(1, std::vector<char>(plane_bytes)), recv;
+    queue.enqueueReadBuffer(buff_dens, CL_TRUE, slab_num * plane_bytes, plane_bytes, send[0].data());
+    exchange({(rank + 1) % ranks}, send, {(rank + ranks - 1) % ranks}, recv);
+    
+    std::vector<T> first(plane_size);
+    const T* halo = (const T*)recv[0].data();
+    queue.enqueueReadBuffer(buff_dens, CL_TRUE, 0, plane_bytes, first.data());
+    for(size_t i = 0; i < plane_size; i++) first[i] += halo[i];
+    queue.enqueueWriteBuffer(buff_dens, CL_TRUE, 0, plane_bytes, first.data());
+}
+
+template<typename T>
+void NBodySlab<T>::transformFFT(int axis, float sign) {
+    // the passes along one axis of all the planes held by the rank, ping-ponging with the scratch buffer
+    
+    kernel_FFT.setArg(3, axis);
+    kernel_FFT.setArg(5, (T)sign);
+    for(int span = 1; span < grid_num; span *= 2) {
+        kernel_FFT.setArg(0, buff_pot);
+        kernel_FFT.setArg(1, buff_FFT_tmp);
+        kernel_FFT.setArg(4, span);
+        queue.enqueueNDRangeKernel(kernel_FFT, cl::NullRange, cl::NDRange(size_t(grid_num / 2), size_t(grid_num), size_t(slab_num)), cl::NullRange);
+        std::swap(buff_pot, buff_FFT_tmp);
+    }
+}
+
+template<typename T>
+void NBodySlab<T>::transposeSlabs(bool forward) {
+    // forward: the x-y planes of the z planes of the rank become the z-x planes of its y rows, every pair of ranks
+    // exchanges a block of slab_num x slab_num rows of grid_num complex values, backward undoes it
+    
+    size_t row = size_t(grid_num) * 2; // values of a complex row
+    size_t row_bytes = row * sizeof(T);
+    std::vector<T> data(slab_num * plane_size * 2);
+    queue.enqueueReadBuffer(buff_pot, CL_TRUE, 0, data.size() * sizeof(T), data.data());
+    
+    // a block holds the rows [a][b], a is the z plane and b the y row, both counted within the slab of their owner
+    
+    std::vector<std::vector<char>> send(ranks), recv;
+    for(int q = 0; q < ranks; q++) {
+        send[q].resize(size_t(slab_num) * slab_num * row_bytes);
+        for(int a = 0; a < slab_num; a++) for(int b = 0; b < slab_num; b++) {
+            size_t src = forward ? size_t(a) * grid_num + q * slab_num + b : size_t(b) * grid_num + q * slab_num + a;
+            std::memcpy(send[q].data() + (size_t(a) * slab_num + b) * row_bytes, &data[src * row], row_bytes);
+        }
+    }
+    
+    exchange(all_ranks, send, all_ranks, recv);
+    
+    for(int r = 0; r < ranks; r++) for(int a = 0; a < slab_num; a++) for(int b = 0; b < slab_num; b++) {
+        size_t dst = forward ? size_t(b) * grid_num + r * slab_num + a : size_t(a) * grid_num + r * slab_num + b;
+        std::memcpy(&data[dst * row], recv[r].data() + (size_t(a) * slab_num + b) * row_bytes, row_bytes);
+    }
+    queue.enqueueWriteBuffer(buff_pot, CL_TRUE, 0, data.size() * sizeof(T), data.data());
+}
+
+template<typename T>
+void NBodySlab<T>::solvePotential() {
+    // solve the Poisson equation by the convolution thm., x and y are transformed locally and z after the transpose,
+    // where it is the middle axis of the planes
+    
+    kernel_pack.setArg(1, buff_pot);
+    queue.enqueueNDRangeKernel(kernel_pack, cl::NullRange, cl::NDRange(slab_num * plane_size), cl::NullRange);
+    
+    transformFFT(0, -1.0f);
+    transformFFT(1, -1.0f);
+    transposeSlabs(true);
+    transformFFT(1, -1.0f);
+    
+    kernel_pot.setArg(0, buff_pot);
+    queue.enqueueNDRangeKernel(kernel_pot, cl::NullRange, cl::NDRange(slab_num * plane_size), cl::NullRange);
+    
+    transformFFT(1, 1.0f);
+    transposeSlabs(false);
+    transformFFT(0, 1.0f);
+    transformFFT(1, 1.0f);
+}
+
+template<typename T>
+void NBodySlab<T>::exchangePotentialHalo() {
+    // the interpolation needs the last plane of the previous slab and the first two of the next one
+    
+    size_t plane_bytes = plane_size * 2 * sizeof(T);
+    queue.enqueueCopyBuffer(buff_pot, buff_pot_halo, 0, plane_bytes, slab_num * plane_bytes);
+    
+    std::vector<std::vector<char>> send(2), recv;
+    send[0].resize(2 * plane_bytes);
+    send[1].resize(plane_bytes);
+    queue.enqueueReadBuffer(buff_pot, CL_TRUE, 0, 2 * plane_bytes, send[0].data());
+    queue.enqueueReadBuffer(buff_pot, CL_TRUE, (slab_num - 1) * plane_bytes, plane_bytes, send[1].data());
+    
+    int prev = (rank + ranks - 1) % ranks, next = (rank + 1) % ranks;
+    exchange({prev, next}, send, {next, prev}, recv);
+    
+    queue.enqueueWriteBuffer(buff_pot_halo, CL_TRUE, (slab_num + 1) * plane_bytes, 2 * plane_bytes, recv[0].data());
+    queue.enqueueWriteBuffer(buff_pot_halo, CL_TRUE, 0, plane_bytes, recv[1].data());
+}
+
+template<typename T>
+void NBodySlab<T>::calculateForces() {
+    depositDensity();
+    solvePotential();
+    exchangePotentialHalo();
+    if(body_num > 0) queue.enqueueNDRangeKernel(kernel_acc, cl::NullRange, cl::NDRange(body_num), cl::NullRange);
+}
+
+template<typename T>
+void NBodySlab<T>::iterate(int steps) {
+    // use the kick-drift-kick leapfrog, the bodies migrate between the drift and the new force
+    
+    try {
+        for(int i = 0; i < steps; i++) {
+            if(body_num > 0) {
+                queue.enqueueNDRangeKernel(kernel_vel, cl::NullRange, cl::NDRange(body_num), cl::NullRange);
+                queue.enqueueNDRangeKernel(kernel_pos, cl::NullRange, cl::NDRange(body_num), cl::NullRange);
+            }
+            migrateBodies();
+            calculateForces();
+            if(body_num > 0) queue.enqueueNDRangeKernel(kernel_vel, cl::NullRange, cl::NDRange(body_num), cl::NullRange);
+        }
+        queue.finish();
+    } catch(cl::Error e) {
+        KernelGL::processError(e, "NBodySlab");
+    }
+}
+
+template<typename T>
+double NBodySlab<T>::benchmarkIterate(int steps) {
+    // the time of the slowest rank, every rank takes part in the sums
+    
+    typedef std::chrono::high_resolution_clock clock;
+    
+    transport.barrier();
+    exchange_time = 0.0;
+    clock::time_point t0 = clock::now();
+    iterate(steps);
+    transport.barrier();
+    clock::time_point t1 = clock::now();
+    
+    double time = std::chrono::duration<double>(t1 - t0).count();
+    double bodies = transport.sum((double)body_num);
+    double exchange = transport.sum(exchange_time) / ranks;
+    if(rank == 0) std::cout << "BENCHMARK: NBodySlab: " << ranks << " RANKS, " << (long)bodies << " BODIES, GRID " << grid_num << "^3: " << time * 1000.0 / steps << " ms/step, " << exchange * 1000.0 / steps << " ms/step IN THE TRANSPORT (MEAN OF THE RANKS)" << std::endl;
+    return time;
+}
+
+template<typename T>
+void NBodySlab<T>::benchmarkScaling(int g, long n, float dt, int max_ranks, const char* kernel_path, int steps) {
+    // strong scaling keeps the bodies, weak scaling keeps the bodies per rank, the grid is the same in both
+    // the calling process only forks the ranks, so that it never holds any OpenCL state
+    
+    const char* modes[] = {"STRONG", "WEAK"};
+    for(int weak = 0; weak < 2; weak++) {
+        double time_single = 0.0;
+        for(int ranks = 1; ranks <= max_ranks; ranks *= 2) {
+            long bodies = weak ? n * ranks : n;
+            double time = SharedMemoryTransport::launch(SLAB_SHM_NAME, ranks, SLAB_MAILBOX, [&](Transport& transport) {
+                NBodySlab<T> nbody(g, bodies, 1.0f / bodies, dt, transport, kernel_path);
+                nbody.iterate(1);
+                return nbody.benchmarkIterate(steps);
+            });
+            
+            if(ranks == 1) time_single = time;
+            double efficiency = weak ? time_single / time : time_single / (ranks * time);
+            std::cout << "BENCHMARK: NBodySlab: " << modes[weak] << " SCALING, " << ranks << " RANKS: " << time * 1000.0 / steps << " ms/step, EFFICIENCY " << efficiency * 100.0 << "%" << std::endl;
+        }
+    }
+}
+
+template<typename T>
+void NBodySlab<T>::readPositions(std::vector<float>& positions) {
+    // the bodies of this rank only, in the order they were left by the last migration
+    
+    try {
+        std::vector<T> pos(body_num * 3);
+        if(body_num > 0) queue.enqueueReadBuffer(buff_pos, CL_TRUE, 0, body_num * 3 * sizeof(T), pos.data());
+        positions.assign(pos.begin(), pos.end());
+    } catch(cl::Error e) {
+        KernelGL::processError(e, "NBodySlab");
+    }
+}
+
+template<typename T>
+void NBodySlab<T>::readVelocities(std::vector<float>& velocities) {
+    // in the order of readPositions
+    
+    try {
+        std::vector<T> vel(body_num * 3);
+        if(body_num > 0) queue.enqueueReadBuffer(buff_vel, CL_TRUE, 0, body_num * 3 * sizeof(T), vel.data());
+        velocities.assign(vel.begin(), vel.end());
+    } catch(cl::Error e) {
+        KernelGL::processError(e, "NBodySlab");
+    }
+}
+
+template class NBodySlab<float>;
+template class NBodySlab<double>;
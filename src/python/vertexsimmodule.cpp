@@ -0,0 +1,279 @@
+//
+//  vertexsimmodule.cpp
+//  Vertex Simulations
+//
+//  Created by Antoni Wójcik on 11/06/2020.
+//  Copyright © 2020 Antoni Wójcik. All rights reserved.
+//
+
+// Python module over the C interface of vertexsim.h, built as an extension together with the sources of the program:
+//
+//     import numpy as np, vertexsim
+//     vertexsim.initialise(".")
+//     cloth = vertexsim.cloth(500, 500, 0.01, 1.0, 500.0, 0.2, 0.03)
+//     cloth.step(10000)
+//     pos = np.asarray(cloth.positions()) # (vertices, 3), the mapped state buffer
+//     del pos # before the next step
+//
+// the views export the mapped buffer through the buffer protocol, the state is mapped by the first export and unmapped once the
+// last one is released, see vsMapState for when the mapping copies; step raises BufferError while any view is exported
+//
+// the OpenGL context is current on the thread that called initialise only, so every call has to come from that thread and the
+// others raise RuntimeError; step still releases the GIL, the other threads run their own Python code meanwhile
+
+#define PY_SSIZE_T_CLEAN
+#include <Python.h>
+
+#include "vertexsim.h"
+
+struct SimulationObject {
+    PyObject_HEAD
+    VSSimulation* sim;
+    Py_ssize_t exported; // views with at least one export
+};
+
+struct StateViewObject {
+    PyObject_HEAD
+    SimulationObject* owner;
+    int field;
+    void* data; // mapped while exports > 0
+    Py_ssize_t exports;
+    Py_ssize_t shape[2];
+    Py_ssize_t strides[2];
+    char format[2];
+};
+
+static PyTypeObject SimulationType = {PyVarObject_HEAD_INIT(NULL, 0)};
+static PyTypeObject StateViewType = {PyVarObject_HEAD_INIT(NULL, 0)};
+
+static bool initialised = false;
+static unsigned long initialise_thread;
+
+static bool onInitialiseThread() {
+    if(initialised && PyThread_get_thread_ident() == initialise_thread) return true;
+    PyErr_SetString(PyExc_RuntimeError, initialised ? "vertexsim can only be used from the thread that called initialise" : "call initialise first");
+    return false;
+}
+
+static PyObject* raiseStatus(int status) {
+    if(status == VS_ERROR_MAPPED) PyErr_SetString(PyExc_BufferError, "the state is exported, release its views first");
+    else if(status == VS_ERROR_UNSUPPORTED) PyErr_SetString(PyExc_ValueError, "the field has no host view in this storage or integrator");
+    else PyErr_SetString(PyExc_ValueError, "invalid argument");
+    return NULL;
+}
+
+// views of the state
+
+static int viewGetBuffer(PyObject* self, Py_buffer* view, int flags) {
+    StateViewObject* state = (StateViewObject*)self;
+    if(!onInitialiseThread()) return -1;
+    if(state->owner->sim == NULL) {
+        PyErr_SetString(PyExc_ValueError, "the simulation is closed");
+        return -1;
+    }
+    
+    if(state->exports == 0) {
+        size_t count, item_size;
+        int status = vsMapState(state->owner->sim, state->field, &state->data, &count, &item_size);
+        if(status != VS_OK) {
+            raiseStatus(status);
+            return -1;
+        }
+        state->format[0] = item_size == 2 ? 'e' : item_size == 4 ? 'f' : 'd';
+        state->format[1] = '\0';
+        state->shape[0] = (Py_ssize_t)count;
+        state->shape[1] = 3;
+        state->strides[0] = (Py_ssize_t)(3 * item_size);
+        state->strides[1] = (Py_ssize_t)item_size;
+        state->owner->exported++;
+    }
+    
+    view->buf = state->data;
+    view->obj = self;
+    view->len = state->shape[0] * state->strides[0];
+    view->readonly = 0;
+    view->itemsize = state->strides[1];
+    view->format = (flags & PyBUF_FORMAT) ? state->format : NULL;
+    // without the shape the consumer sees the flat bytes of the state
+    
+    view->ndim = (flags & PyBUF_ND) ? 2 : 1;
+    view->shape = (flags & PyBUF_ND) ? state->shape : NULL;
+    view->strides = (flags & PyBUF_STRIDES) == PyBUF_STRIDES ? state->strides : NULL;
+    view->suboffsets = NULL;
+    view->internal = NULL;
+    
+    Py_INCREF(self);
+    state->exports++;
+    return 0;
+}
+
+static void viewReleaseBuffer(PyObject* self, Py_buffer* view) {
+    StateViewObject* state = (StateViewObject*)self;
+    if(--state->exports == 0 && state->owner->sim != NULL) {
+        vsUnmapState(state->owner->sim, state->data);
+        state->data = NULL;
+        state->owner->exported--;
+    }
+}
+
+static void viewDealloc(PyObject* self) {
+    Py_XDECREF(((StateViewObject*)self)->owner);
+    Py_TYPE(self)->tp_free(self);
+}
+
+static PyBufferProcs view_buffer = {viewGetBuffer, viewReleaseBuffer};
+
+// simulations
+
+static PyObject* wrapSimulation(VSSimulation* sim) {
+    if(sim == NULL) {
+        PyErr_SetString(PyExc_RuntimeError, "cannot create the simulation, call initialise first");
+        return NULL;
+    }
+    SimulationObject* object = PyObject_New(SimulationObject, &SimulationType);
+    if(object == NULL) {
+        vsDestroy(sim);
+        return NULL;
+    }
+    object->sim = sim;
+    object->exported = 0;
+    return (PyObject*)object;
+}
+
+static PyObject* simulationStep(PyObject* self, PyObject* args) {
+    // the GIL is released for the whole call, the other Python threads run while the device steps
+    
+    SimulationObject* object = (SimulationObject*)self;
+    int steps = 1;
+    if(!PyArg_ParseTuple(args, "|i", &steps) || !onInitialiseThread()) return NULL;
+    if(object->sim == NULL) return raiseStatus(VS_ERROR_ARGUMENT);
+    
+    int status;
+    Py_BEGIN_ALLOW_THREADS
+    status = vsStep(object->sim, steps);
+    Py_END_ALLOW_THREADS
+    if(status != VS_OK) return raiseStatus(status);
+    Py_RETURN_NONE;
+}
+
+static PyObject* simulationSet(PyObject* self, PyObject* args) {
+    SimulationObject* object = (SimulationObject*)self;
+    const char* name;
+    float value;
+    if(!PyArg_ParseTuple(args, "sf", &name, &value) || !onInitialiseThread()) return NULL;
+    if(object->sim == NULL) return raiseStatus(VS_ERROR_ARGUMENT);
+    
+    int status = vsSetParameter(object->sim, name, value);
+    if(status != VS_OK) return raiseStatus(status);
+    Py_RETURN_NONE;
+}
+
+static PyObject* simulationView(PyObject* self, int field) {
+    if(!onInitialiseThread()) return NULL;
+    StateViewObject* view = PyObject_New(StateViewObject, &StateViewType);
+    if(view == NULL) return NULL;
+    Py_INCREF(self);
+    view->owner = (SimulationObject*)self;
+    view->field = field;
+    view->data = NULL;
+    view->exports = 0;
+    return (PyObject*)view;
+}
+
+static PyObject* simulationPositions(PyObject* self, PyObject*) {
+    return simulationView(self, VS_POSITIONS);
+}
+
+static PyObject* simulationVelocities(PyObject* self, PyObject*) {
+    return simulationView(self, VS_VELOCITIES);
+}
+
+static PyObject* simulationClose(PyObject* self, PyObject*) {
+    // the views left after closing refuse new exports
+    
+    SimulationObject* object = (SimulationObject*)self;
+    if(!onInitialiseThread()) return NULL;
+    if(object->exported > 0) return raiseStatus(VS_ERROR_MAPPED);
+    vsDestroy(object->sim);
+    object->sim = NULL;
+    Py_RETURN_NONE;
+}
+
+static void simulationDealloc(PyObject* self) {
+    // a simulation collected on another thread cannot release its OpenGL buffers there, it is left to the end of the process
+    
+    if(PyThread_get_thread_ident() == initialise_thread) vsDestroy(((SimulationObject*)self)->sim);
+    Py_TYPE(self)->tp_free(self);
+}
+
+static PyMethodDef simulation_methods[] = {
+    {"step", simulationStep, METH_VARARGS, "step(steps=1), advance the simulation without the GIL, from the thread of initialise"},
+    {"set", simulationSet, METH_VARARGS, "set(name, value), change a parameter between the steps"},
+    {"positions", simulationPositions, METH_NOARGS, "view of the positions, (vertices, 3)"},
+    {"velocities", simulationVelocities, METH_NOARGS, "view of the velocities, (vertices, 3)"},
+    {"close", simulationClose, METH_NOARGS, "release the simulation"},
+    {NULL, NULL, 0, NULL}
+};
+
+// module functions
+
+static PyObject* moduleInitialise(PyObject*, PyObject* args) {
+    const char* root = ".";
+    if(!PyArg_ParseTuple(args, "|s", &root)) return NULL;
+    if(initialised && !onInitialiseThread()) return NULL;
+    if(vsInitialise(root) != VS_OK) {
+        PyErr_SetString(PyExc_RuntimeError, "cannot create the OpenGL context");
+        return NULL;
+    }
+    initialised = true;
+    initialise_thread = PyThread_get_thread_ident();
+    Py_RETURN_NONE;
+}
+
+static PyObject* moduleCloth(PyObject*, PyObject* args, PyObject* kwargs) {
+    static const char* keywords[] = {"size_x", "size_y", "length", "mass", "stiffness", "damping", "time_step", "storage", "integrator", "double", NULL};
+    int size_x, size_y, storage = 0, integrator = 0, double_precision = 0;
+    float length, mass, stiffness, damping, time_step;
+    if(!PyArg_ParseTupleAndKeywords(args, kwargs, "iifffff|iip", (char**)keywords, &size_x, &size_y, &length, &mass, &stiffness, &damping, &time_step, &storage, &integrator, &double_precision) || !onInitialiseThread()) return NULL;
+    return wrapSimulation(vsCreateCloth(size_x, size_y, length, mass, stiffness, damping, time_step, storage, integrator, double_precision));
+}
+
+static PyObject* moduleNBody(PyObject*, PyObject* args, PyObject* kwargs) {
+    static const char* keywords[] = {"grid_num", "body_num", "body_mass", "time_step", "initial", "solver", "storage", "double", NULL};
+    int grid_num, body_num, initial = 0, solver = 0, storage = 0, double_precision = 0;
+    float body_mass, time_step;
+    if(!PyArg_ParseTupleAndKeywords(args, kwargs, "iiff|iiip", (char**)keywords, &grid_num, &body_num, &body_mass, &time_step, &initial, &solver, &storage, &double_precision) || !onInitialiseThread()) return NULL;
+    return wrapSimulation(vsCreateNBody(grid_num, body_num, body_mass, time_step, initial, solver, storage, double_precision));
+}
+
+static PyMethodDef module_methods[] = {
+    {"initialise", moduleInitialise, METH_VARARGS, "initialise(root='.'), create the hidden OpenGL context, root holds src/kernels and src/shaders"},
+    {"cloth", (PyCFunction)(void(*)(void))moduleCloth, METH_VARARGS | METH_KEYWORDS, "cloth(size_x, size_y, length, mass, stiffness, damping, time_step, storage=0, integrator=0, double=False)"},
+    {"nbody", (PyCFunction)(void(*)(void))moduleNBody, METH_VARARGS | METH_KEYWORDS, "nbody(grid_num, body_num, body_mass, time_step, initial=0, solver=0, storage=0, double=False)"},
+    {NULL, NULL, 0, NULL}
+};
+
+static struct PyModuleDef module_def = {PyModuleDef_HEAD_INIT, "vertexsim", "OpenCL cloth and n-body simulations.\n\nAll the calls have to come from the thread that called initialise, the other threads get RuntimeError.", -1, module_methods};
+
+PyMODINIT_FUNC PyInit_vertexsim(void) {
+    SimulationType.tp_name = "vertexsim.Simulation";
+    SimulationType.tp_basicsize = sizeof(SimulationObject);
+    SimulationType.tp_flags = Py_TPFLAGS_DEFAULT;
+    SimulationType.tp_dealloc = simulationDealloc;
+    SimulationType.tp_methods = simulation_methods;
+    
+    StateViewType.tp_name = "vertexsim.StateView";
+    StateViewType.tp_basicsize = sizeof(StateViewObject);
+    StateViewType.tp_flags = Py_TPFLAGS_DEFAULT;
+    StateViewType.tp_dealloc = viewDealloc;
+    StateViewType.tp_as_buffer = &view_buffer;
+    
+    if(PyType_Ready(&SimulationType) < 0 || PyType_Ready(&StateViewType) < 0) return NULL;
+    
+    PyObject* module = PyModule_Create(&module_def);
+    if(module == NULL) return NULL;
+    
+    PyModule_AddIntConstant(module, "POSITIONS", VS_POSITIONS);
+    PyModule_AddIntConstant(module, "VELOCITIES", VS_VELOCITIES);
+    return module;
+}
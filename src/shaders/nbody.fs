@@ -0,0 +1,6 @@
+#version 410 core
+out vec4 frag_color;
+
+void main() {
+    frag_color = vec4(1.0f);
+}
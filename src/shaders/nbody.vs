@@ -0,0 +1,8 @@
+#version 410 core
+layout (location = 0) in vec3 a_pos;
+
+uniform mat4 PVM;
+
+void main() {
+    gl_Position = PVM * vec4(a_pos, 1.0f);
+}
@@ -0,0 +1,15 @@
+#version 410 core
+out float frag_density;
+
+in float weight;
+
+uniform float intensity;
+
+void main() {
+    vec2 d = gl_PointCoord * 2.0f - 1.0f;
+    float r2 = dot(d, d);
+    if(r2 > 1.0f) discard;
+    
+    // the gaussian sums to about a fifth of the pixels of the splat, so a body adds about intensity in total
+    frag_density = intensity * weight * 5.0f * exp(-4.0f * r2);
+}
@@ -0,0 +1,17 @@
+#version 410 core
+layout (location = 0) in vec3 a_pos;
+
+out float weight;
+
+uniform mat4 PVM;
+uniform float point_scale; // size in pixels of a splat at unit distance
+uniform float point_max;
+
+void main() {
+    gl_Position = PVM * vec4(a_pos, 1.0f);
+    
+    // every body adds the same total to the target, spread over the pixels of its splat
+    float size = clamp(point_scale / gl_Position.w, 1.0f, point_max);
+    gl_PointSize = size;
+    weight = 1.0f / (size * size);
+}
@@ -0,0 +1,18 @@
+#version 410 core
+out vec4 frag_color;
+
+in vec2 uv;
+
+uniform sampler2D density;
+uniform float exposure;
+
+const vec3 faint_col = vec3(0.12f, 0.22f, 0.55f);
+const vec3 bright_col = vec3(1.0f, 0.92f, 0.78f);
+
+void main() {
+    // the density spans many orders of magnitude, it is compressed before the colour ramp
+    float d = texture(density, uv).r;
+    float b = 1.0f - exp(-exposure * d);
+    vec3 col = mix(faint_col, bright_col, b) * b;
+    frag_color = vec4(pow(col, vec3(1.0f / 2.2f)), 1.0f);
+}
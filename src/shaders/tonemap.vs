@@ -0,0 +1,9 @@
+#version 410 core
+out vec2 uv;
+
+void main() {
+    // one triangle covering the screen, without vertex buffers
+    vec2 p = vec2((gl_VertexID << 1) & 2, gl_VertexID & 2);
+    uv = p;
+    gl_Position = vec4(p * 2.0f - 1.0f, 0.0f, 1.0f);
+}
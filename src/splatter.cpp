@@ -0,0 +1,149 @@
+//
+//  splatter.cpp
+//  Vertex Simulations
+//
+//  Created by Antoni Wójcik on 09/06/2020.
+//  Copyright © 2020 Antoni Wójcik. All rights reserved.
+//
+
+#include "splatter.h"
+
+#include <iostream>
+#include <algorithm>
+
+#define SPLAT_MAX_SIZE 64.0f // pixels, the splats of the bodies right in front of the camera are capped
+
+ParticleSplatter::ParticleSplatter(GLsizei c, float r, const char* splat_vs, const char* splat_fs, const char* tone_vs, const char* tone_fs, float e) : capacity(c), width(0), height(0), radius(r), exposure(e), FBO(0), density_texture(0), splat_shader(splat_vs, splat_fs), tone_shader(tone_vs, tone_fs) {
+    createBuffers();
+}
+
+ParticleSplatter::~ParticleSplatter() {
+    glDeleteVertexArrays(1, &visible_VAO);
+    glDeleteVertexArrays(1, &empty_VAO);
+    glDeleteBuffers(1, &visible_VBO);
+    glDeleteBuffers(1, &indirect_buffer);
+    if(FBO != 0) {
+        glDeleteTextures(1, &density_texture);
+        glDeleteFramebuffers(1, &FBO);
+    }
+}
+
+void ParticleSplatter::createBuffers() {
+    // the buffers are written by OpenCL, OpenGL only reserves them
+    
+    glGenVertexArrays(1, &visible_VAO);
+    glGenBuffers(1, &visible_VBO);
+    
+    glBindVertexArray(visible_VAO);
+    glBindBuffer(GL_ARRAY_BUFFER, visible_VBO);
+    glBufferData(GL_ARRAY_BUFFER, size_t(capacity) * 3 * sizeof(float), NULL, GL_DYNAMIC_DRAW);
+    glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 3 * sizeof(float), (void*)0);
+    glEnableVertexAttribArray(0);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+    glBindVertexArray(0);
+    
+    GLuint command[4] = {0, 1, 0, 0};
+    glGenBuffers(1, &indirect_buffer);
+    glBindBuffer(GL_DRAW_INDIRECT_BUFFER, indirect_buffer);
+    glBufferData(GL_DRAW_INDIRECT_BUFFER, sizeof(command), command, GL_DYNAMIC_DRAW);
+    glBindBuffer(GL_DRAW_INDIRECT_BUFFER, 0);
+    
+    glGenVertexArrays(1, &empty_VAO);
+}
+
+void ParticleSplatter::resizeTarget(int w, int h) {
+    // one float channel, the sums of many faint splats need more than half precision
+    
+    if(FBO != 0) {
+        glDeleteTextures(1, &density_texture);
+        glDeleteFramebuffers(1, &FBO);
+    }
+    width = w;
+    height = h;
+    
+    glGenTextures(1, &density_texture);
+    glBindTexture(GL_TEXTURE_2D, density_texture);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_R32F, width, height, 0, GL_RED, GL_FLOAT, NULL);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    glBindTexture(GL_TEXTURE_2D, 0);
+    
+    glGenFramebuffers(1, &FBO);
+    glBindFramebuffer(GL_FRAMEBUFFER, FBO);
+    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, density_texture, 0);
+    if(glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE) {
+        std::cerr << "ERROR: ParticleSplatter: INCOMPLETE FRAMEBUFFER" << std::endl;
+        exit(-1);
+    }
+}
+
+void ParticleSplatter::draw(const Camera* camera, GLsizei total) {
+    // the target follows the viewport, the framebuffer bound by the caller (the window or the capture) gets the tone-mapped image
+    
+    GLint previous_FBO, viewport[4];
+    glGetIntegerv(GL_DRAW_FRAMEBUFFER_BINDING, &previous_FBO);
+    glGetIntegerv(GL_VIEWPORT, viewport);
+    if(viewport[2] != width || viewport[3] != height) resizeTarget(viewport[2], viewport[3]);
+    
+    GLboolean depth_test = glIsEnabled(GL_DEPTH_TEST);
+    glDisable(GL_DEPTH_TEST);
+    
+    // additive splats, the order of the visible bodies does not matter
+    
+    glBindFramebuffer(GL_FRAMEBUFFER, FBO);
+    glViewport(0, 0, width, height);
+    glClearColor(0.0f, 0.0f, 0.0f, 0.0f);
+    glClear(GL_COLOR_BUFFER_BIT);
+    glEnable(GL_BLEND);
+    glBlendFunc(GL_ONE, GL_ONE);
+    glEnable(GL_PROGRAM_POINT_SIZE);
+    
+    // the second row of the projection-view matrix has the length of the vertical focal scale, the view rows being unit vectors
+    
+    glm::mat4 pvm = camera->getPVMatrix();
+    float focal = glm::length(glm::vec3(pvm[0][1], pvm[1][1], pvm[2][1]));
+    
+    splat_shader.use();
+    splat_shader.setMat4("PVM", pvm);
+    splat_shader.setFloat("point_scale", radius * focal * height);
+    splat_shader.setFloat("point_max", SPLAT_MAX_SIZE);
+    splat_shader.setFloat("intensity", 1.0f);
+    
+    glBindVertexArray(visible_VAO);
+    glBindBuffer(GL_DRAW_INDIRECT_BUFFER, indirect_buffer);
+    glDrawArraysIndirect(GL_POINTS, (void*)0);
+    glBindBuffer(GL_DRAW_INDIRECT_BUFFER, 0);
+    
+    glDisable(GL_PROGRAM_POINT_SIZE);
+    glDisable(GL_BLEND);
+    
+    // the exposure is set so that the bodies spread evenly over the screen would reach the same brightness at any count
+    
+    glBindFramebuffer(GL_FRAMEBUFFER, previous_FBO);
+    glViewport(viewport[0], viewport[1], viewport[2], viewport[3]);
+    
+    tone_shader.use();
+    glActiveTexture(GL_TEXTURE0);
+    glBindTexture(GL_TEXTURE_2D, density_texture);
+    tone_shader.setInt("density", 0);
+    tone_shader.setFloat("exposure", exposure * width * height / std::max(total, (GLsizei)1));
+    
+    glBindVertexArray(empty_VAO);
+    glDrawArrays(GL_TRIANGLES, 0, 3);
+    glBindVertexArray(0);
+    glBindTexture(GL_TEXTURE_2D, 0);
+    
+    if(depth_test) glEnable(GL_DEPTH_TEST);
+}
+
+GLuint ParticleSplatter::readVisibleCount() const {
+    // stalls until the cull pass is done, only for the benchmarks
+    
+    GLuint count;
+    glBindBuffer(GL_DRAW_INDIRECT_BUFFER, indirect_buffer);
+    glGetBufferSubData(GL_DRAW_INDIRECT_BUFFER, 0, sizeof(GLuint), &count);
+    glBindBuffer(GL_DRAW_INDIRECT_BUFFER, 0);
+    return count;
+}
@@ -0,0 +1,225 @@
+//
+//  transport.cpp
+//  Vertex Simulations
+//
+//  Created by Antoni Wójcik on 06/06/2020.
+//  Copyright © 2020 Antoni Wójcik. All rights reserved.
+//
+
+#include "transport.h"
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <signal.h>
+
+#include <iostream>
+#include <algorithm>
+#include <thread>
+#include <cstring>
+#include <cerrno>
+#include <new>
+
+#define MAILBOX_ALIGN 64 // cache line, the mailboxes of different pairs do not share lines
+
+void Transport::allToAll(const std::vector<std::vector<char>>& send, std::vector<std::vector<char>>& recv) {
+    // send[q] goes to the rank q and recv[q] comes from it
+    
+    std::vector<int> ranks(getSize());
+    for(int q = 0; q < getSize(); q++) ranks[q] = q;
+    exchange(ranks, send, ranks, recv);
+}
+
+double Transport::sum(double value) {
+    std::vector<std::vector<char>> send(getSize(), std::vector<char>((char*)&value, (char*)&value + sizeof(double))), recv;
+    allToAll(send, recv);
+    
+    double total = 0.0;
+    for(const std::vector<char>& r : recv) total += *(const double*)r.data();
+    return total;
+}
+
+SharedMemoryTransport::SharedMemoryTransport(char* s, size_t s_size, int r, int n, size_t c) : rank(r), size(n), capacity(c), segment(s), segment_size(s_size) {}
+
+size_t SharedMemoryTransport::mailboxSize(size_t c) {
+    size_t s = sizeof(Mailbox) + c;
+    return (s + MAILBOX_ALIGN - 1) / MAILBOX_ALIGN * MAILBOX_ALIGN;
+}
+
+SharedMemoryTransport::Header* SharedMemoryTransport::header() const {
+    return (Header*)segment;
+}
+
+SharedMemoryTransport::Mailbox* SharedMemoryTransport::mailbox(int from, int to) const {
+    return (Mailbox*)(segment + MAILBOX_ALIGN + (size_t(from) * size + to) * mailboxSize(capacity));
+}
+
+char* SharedMemoryTransport::mailboxData(int from, int to) const {
+    return (char*)mailbox(from, to) + sizeof(Mailbox);
+}
+
+double SharedMemoryTransport::launch(const char* name, int ranks, size_t c, const std::function<double(Transport&)>& run) {
+    // the segment is unlinked as soon as it is mapped, the forked ranks inherit the mapping
+    
+    size_t segment_size = MAILBOX_ALIGN + size_t(ranks) * ranks * mailboxSize(c);
+    shm_unlink(name);
+    int fd = shm_open(name, O_CREAT | O_EXCL | O_RDWR, S_IRUSR | S_IWUSR);
+    if(fd < 0 || ftruncate(fd, segment_size) != 0) {
+        std::cerr << "ERROR: SharedMemoryTransport: CANNOT CREATE THE SEGMENT " << name << ": " << std::strerror(errno) << std::endl;
+        exit(-1);
+    }
+    char* segment = (char*)mmap(nullptr, segment_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    shm_unlink(name);
+    if(segment == MAP_FAILED) {
+        std::cerr << "ERROR: SharedMemoryTransport: CANNOT MAP THE SEGMENT " << name << ": " << std::strerror(errno) << std::endl;
+        exit(-1);
+    }
+    
+    Header* h = new(segment) Header();
+    h->arrived = 0;
+    h->generation = 0;
+    h->result = 0.0;
+    SharedMemoryTransport view(segment, segment_size, 0, ranks, c);
+    for(int from = 0; from < ranks; from++) for(int to = 0; to < ranks; to++) {
+        Mailbox* m = new(view.mailbox(from, to)) Mailbox();
+        m->full = 0;
+    }
+    
+    std::cout << std::flush;
+    std::cerr << std::flush;
+    std::vector<pid_t> pids;
+    for(int r = 0; r < ranks; r++) {
+        pid_t pid = fork();
+        if(pid < 0) {
+            std::cerr << "ERROR: SharedMemoryTransport: CANNOT FORK RANK " << r << std::endl;
+            for(pid_t p : pids) kill(p, SIGTERM);
+            exit(-1);
+        }
+        if(pid == 0) {
+            SharedMemoryTransport transport(segment, segment_size, r, ranks, c);
+            double result = run(transport);
+            if(r == 0) h->result = result;
+            std::cout << std::flush;
+            _exit(0);
+        }
+        pids.push_back(pid);
+    }
+    
+    // a rank that fails leaves the others waiting for its messages, stop all of them
+    
+    bool failed = false;
+    for(int r = 0; r < ranks; r++) {
+        int status;
+        pid_t pid = wait(&status);
+        if(!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+            if(!failed) for(pid_t p : pids) if(p != pid) kill(p, SIGTERM);
+            failed = true;
+        }
+    }
+    
+    double result = h->result;
+    munmap(segment, segment_size);
+    if(failed) {
+        std::cerr << "ERROR: SharedMemoryTransport: A RANK FAILED" << std::endl;
+        exit(-1);
+    }
+    return result;
+}
+
+void SharedMemoryTransport::exchange(const std::vector<int>& to, const std::vector<std::vector<char>>& send, const std::vector<int>& from, std::vector<std::vector<char>>& recv) {
+    // every mailbox holds one chunk: the sends and the receives are advanced together until all of them are done,
+    // so that the messages larger than the capacity cannot block each other
+    
+    recv.assign(from.size(), std::vector<char>());
+    std::vector<size_t> sent(to.size(), 0), received(from.size(), 0);
+    std::vector<bool> send_done(to.size(), false), recv_done(from.size(), false), recv_started(from.size(), false);
+    size_t remaining = to.size() + from.size();
+    
+    // the messages to itself are copied, in order
+    
+    for(size_t i = 0; i < to.size(); i++) if(to[i] == rank) {
+        for(size_t j = 0; j < from.size(); j++) if(from[j] == rank && !recv_done[j]) {
+            recv[j] = send[i];
+            recv_done[j] = true;
+            send_done[i] = true;
+            remaining -= 2;
+            break;
+        }
+    }
+    
+    while(remaining > 0) {
+        bool progress = false;
+        
+        // a message waits until the earlier messages to the same rank have been sent
+        
+        for(size_t i = 0; i < to.size(); i++) {
+            if(send_done[i]) continue;
+            bool earlier = false;
+            for(size_t k = 0; k < i && !earlier; k++) earlier = !send_done[k] && to[k] == to[i];
+            if(earlier) continue;
+            
+            Mailbox* m = mailbox(rank, to[i]);
+            if(m->full.load(std::memory_order_acquire)) continue;
+            
+            size_t chunk = std::min(capacity, send[i].size() - sent[i]);
+            m->total = send[i].size();
+            m->size = chunk;
+            if(chunk > 0) std::memcpy(mailboxData(rank, to[i]), send[i].data() + sent[i], chunk);
+            m->full.store(1, std::memory_order_release);
+            sent[i] += chunk;
+            if(sent[i] == send[i].size()) {
+                send_done[i] = true;
+                remaining--;
+            }
+            progress = true;
+        }
+        
+        for(size_t j = 0; j < from.size(); j++) {
+            if(recv_done[j]) continue;
+            bool earlier = false;
+            for(size_t k = 0; k < j && !earlier; k++) earlier = !recv_done[k] && from[k] == from[j];
+            if(earlier) continue;
+            
+            Mailbox* m = mailbox(from[j], rank);
+            if(!m->full.load(std::memory_order_acquire)) continue;
+            
+            if(!recv_started[j]) {
+                recv[j].resize(m->total);
+                recv_started[j] = true;
+            }
+            if(m->size > 0) std::memcpy(recv[j].data() + received[j], mailboxData(from[j], rank), m->size);
+            received[j] += m->size;
+            m->full.store(0, std::memory_order_release);
+            if(received[j] == recv[j].size()) {
+                recv_done[j] = true;
+                remaining--;
+            }
+            progress = true;
+        }
+        
+        if(!progress) std::this_thread::yield();
+    }
+}
+
+void SharedMemoryTransport::barrier() {
+    // the last rank to arrive starts the next generation
+    
+    Header* h = header();
+    int generation = h->generation.load(std::memory_order_acquire);
+    if(h->arrived.fetch_add(1, std::memory_order_acq_rel) == size - 1) {
+        h->arrived.store(0, std::memory_order_relaxed);
+        h->generation.fetch_add(1, std::memory_order_release);
+    } else {
+        while(h->generation.load(std::memory_order_acquire) == generation) std::this_thread::yield();
+    }
+}
+
+void LocalTransport::exchange(const std::vector<int>& to, const std::vector<std::vector<char>>& send, const std::vector<int>& from, std::vector<std::vector<char>>& recv) {
+    // the messages arrive in the order they were sent, as between the ranks of the shared memory transport
+    
+    recv.assign(from.size(), std::vector<char>());
+    for(size_t i = 0; i < from.size() && i < send.size(); i++) recv[i] = send[i];
+}
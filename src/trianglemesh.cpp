@@ -0,0 +1,310 @@
+//
+//  trianglemesh.cpp
+//  Vertex Simulations
+//
+//  Created by Antoni Wójcik on 10/06/2020.
+//  Copyright © 2020 Antoni Wójcik. All rights reserved.
+//
+
+#include "trianglemesh.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <utility>
+
+#define MORTON_BITS 21 // per axis, three axes fill a 64-bit code
+#define RCM_PERIPHERAL_PASSES 4 // searches for a start vertex of the largest eccentricity
+
+TriangleMesh::TriangleMesh() : order(ORDER_FILE) {}
+
+TriangleMesh TriangleMesh::grid(int x, int y, float l) {
+    TriangleMesh mesh = lattice(x, y, l);
+    mesh.buildAdjacency();
+    return mesh;
+}
+
+TriangleMesh TriangleMesh::lattice(int x, int y, float l) {
+    // the lattice of Cloth: the vertices in rows in the xz plane, each square split along the same diagonal and the border pinned
+    
+    TriangleMesh mesh;
+    float half_width = (float)((x - 1) * l) * 0.5f;
+    float half_height = (float)((y - 1) * l) * 0.5f;
+    
+    mesh.positions.resize(size_t(x) * y * 3);
+    mesh.pinned.resize(size_t(x) * y);
+    for(int j = 0; j < y; j++) for(int i = 0; i < x; i++) {
+        size_t id = size_t(j) * x + i;
+        mesh.positions[id * 3]     = -half_width  + (float)i * l;
+        mesh.positions[id * 3 + 1] =  0.0f;
+        mesh.positions[id * 3 + 2] =  half_height - (float)j * l;
+        mesh.pinned[id] = i == 0 || j == 0 || i == x - 1 || j == y - 1;
+    }
+    
+    mesh.triangles.reserve(size_t(x - 1) * (y - 1) * 6);
+    for(int j = 0; j < y - 1; j++) for(int i = 0; i < x - 1; i++) {
+        unsigned int quad[6] = {
+            (unsigned int)(j * x + i), (unsigned int)(j * x + i + 1), (unsigned int)((j + 1) * x + i),
+            (unsigned int)(j * x + i + 1), (unsigned int)((j + 1) * x + i + 1), (unsigned int)((j + 1) * x + i)
+        };
+        mesh.triangles.insert(mesh.triangles.end(), quad, quad + 6);
+    }
+    
+    return mesh;
+}
+
+bool TriangleMesh::loadOBJ(const char* path, TriangleMesh& mesh) {
+    // only the vertices and the faces are read, the polygons are split into fans and nothing is pinned
+    
+    std::ifstream file(path);
+    if(!file.is_open()) {
+        std::cerr << "ERROR: TriangleMesh: CANNOT OPEN " << path << std::endl;
+        return false;
+    }
+    
+    mesh = TriangleMesh();
+    std::string line;
+    std::vector<long> face;
+    while(std::getline(file, line)) {
+        std::istringstream stream(line);
+        std::string type;
+        stream >> type;
+        
+        if(type == "v") {
+            float v[3];
+            if(!(stream >> v[0] >> v[1] >> v[2])) {
+                std::cerr << "ERROR: TriangleMesh: INVALID VERTEX IN " << path << ": " << line << std::endl;
+                return false;
+            }
+            mesh.positions.insert(mesh.positions.end(), v, v + 3);
+        } else if(type == "f") {
+            // a corner is v, v/vt, v//vn or v/vt/vn, the negative indices count back from the last vertex
+            
+            face.clear();
+            std::string corner;
+            while(stream >> corner) {
+                long index = std::strtol(corner.c_str(), nullptr, 10);
+                long vertices = (long)(mesh.positions.size() / 3);
+                if(index < 0) index += vertices;
+                else index -= 1;
+                if(index < 0 || index >= vertices) {
+                    std::cerr << "ERROR: TriangleMesh: INVALID FACE IN " << path << ": " << line << std::endl;
+                    return false;
+                }
+                face.push_back(index);
+            }
+            for(size_t i = 2; i < face.size(); i++) {
+                mesh.triangles.push_back((unsigned int)face[0]);
+                mesh.triangles.push_back((unsigned int)face[i - 1]);
+                mesh.triangles.push_back((unsigned int)face[i]);
+            }
+        }
+    }
+    
+    if(mesh.triangles.empty()) {
+        std::cerr << "ERROR: TriangleMesh: NO FACES IN " << path << std::endl;
+        return false;
+    }
+    
+    mesh.pinned.assign(mesh.positions.size() / 3, 0);
+    mesh.buildAdjacency();
+    return true;
+}
+
+void TriangleMesh::pinTop(float tolerance) {
+    // hangs the mesh from its highest vertices
+    
+    float top = -INFINITY;
+    for(size_t i = 0; i < pinned.size(); i++) top = std::max(top, positions[i * 3 + 1]);
+    for(size_t i = 0; i < pinned.size(); i++) if(positions[i * 3 + 1] >= top - tolerance) pinned[i] = 1;
+}
+
+void TriangleMesh::buildAdjacency() {
+    // every edge of the triangles is a spring with the rest length of the initial positions, the edges shared by two triangles
+    // are counted once; the springs of each vertex are sorted, so that their order follows the order of the vertices
+    
+    std::vector<std::pair<int, int>> edges;
+    edges.reserve(triangles.size() * 2);
+    for(size_t t = 0; t < triangles.size(); t += 3) for(int e = 0; e < 3; e++) {
+        int a = (int)triangles[t + e], b = (int)triangles[t + (e + 1) % 3];
+        if(a == b) continue;
+        edges.push_back(std::make_pair(a, b));
+        edges.push_back(std::make_pair(b, a));
+    }
+    std::sort(edges.begin(), edges.end());
+    edges.erase(std::unique(edges.begin(), edges.end()), edges.end());
+    
+    int n = vertexCount();
+    offsets.assign(n + 1, 0);
+    neighbours.resize(edges.size());
+    rest_lengths.resize(edges.size());
+    for(size_t s = 0; s < edges.size(); s++) {
+        int a = edges[s].first, b = edges[s].second;
+        offsets[a + 1]++;
+        neighbours[s] = b;
+        
+        float d[3];
+        for(int k = 0; k < 3; k++) d[k] = positions[size_t(b) * 3 + k] - positions[size_t(a) * 3 + k];
+        rest_lengths[s] = std::sqrt(d[0] * d[0] + d[1] * d[1] + d[2] * d[2]);
+    }
+    for(int i = 0; i < n; i++) offsets[i + 1] += offsets[i];
+}
+
+void TriangleMesh::permute(const std::vector<int>& old_index) {
+    // old_index[i] is the vertex placed at i, the triangles are relabelled and sorted by their first vertex for the drawing
+    
+    int n = vertexCount();
+    std::vector<int> new_index(n);
+    for(int i = 0; i < n; i++) new_index[old_index[i]] = i;
+    
+    std::vector<float> old_positions;
+    std::vector<unsigned char> old_pinned;
+    old_positions.swap(positions);
+    old_pinned.swap(pinned);
+    positions.resize(old_positions.size());
+    pinned.resize(old_pinned.size());
+    for(int i = 0; i < n; i++) {
+        for(int k = 0; k < 3; k++) positions[size_t(i) * 3 + k] = old_positions[size_t(old_index[i]) * 3 + k];
+        pinned[i] = old_pinned[old_index[i]];
+    }
+    
+    size_t triangle_num = triangles.size() / 3;
+    std::vector<unsigned int> relabelled(triangles.size());
+    for(size_t i = 0; i < triangles.size(); i++) relabelled[i] = (unsigned int)new_index[triangles[i]];
+    
+    std::vector<size_t> sorted(triangle_num);
+    for(size_t t = 0; t < triangle_num; t++) sorted[t] = t;
+    std::stable_sort(sorted.begin(), sorted.end(), [&relabelled](size_t a, size_t b) {
+        return std::min(relabelled[a * 3], std::min(relabelled[a * 3 + 1], relabelled[a * 3 + 2])) < std::min(relabelled[b * 3], std::min(relabelled[b * 3 + 1], relabelled[b * 3 + 2]));
+    });
+    for(size_t t = 0; t < triangle_num; t++) for(int k = 0; k < 3; k++) triangles[t * 3 + k] = relabelled[sorted[t] * 3 + k];
+    
+    buildAdjacency();
+}
+
+int TriangleMesh::levelStructure(int start, std::vector<int>& level, std::vector<int>& component) const {
+    // breadth-first levels of the component of the start vertex, whose vertices are listed in component in the order of their
+    // levels; level has to be -1 on the component and the caller resets it through component, so only the component is touched
+    
+    component.assign(1, start);
+    level[start] = 0;
+    for(size_t head = 0; head < component.size(); head++) {
+        int v = component[head];
+        for(int s = offsets[v]; s < offsets[v + 1]; s++) if(level[neighbours[s]] < 0) {
+            level[neighbours[s]] = level[v] + 1;
+            component.push_back(neighbours[s]);
+        }
+    }
+    return level[component.back()];
+}
+
+std::vector<int> TriangleMesh::orderRCM() const {
+    // every component starts from a pseudo-peripheral vertex, found by restarting from the vertex of the smallest degree in the last
+    // level while the depth grows; the neighbours are visited in the order of increasing degree and the whole order is reversed
+    
+    int n = vertexCount();
+    std::vector<int> order, level(n, -1), component;
+    std::vector<char> visited(n, 0);
+    order.reserve(n);
+    
+    std::vector<int> by_degree(n);
+    for(int i = 0; i < n; i++) by_degree[i] = i;
+    std::stable_sort(by_degree.begin(), by_degree.end(), [this](int a, int b) { return offsets[a + 1] - offsets[a] < offsets[b + 1] - offsets[b]; });
+    
+    std::vector<int> adjacent;
+    for(int candidate : by_degree) {
+        if(visited[candidate]) continue;
+        
+        // the last level is the tail of the component, the ties of the degree go to the lower index
+        
+        int start = candidate;
+        int depth = levelStructure(start, level, component);
+        for(int pass = 0; pass < RCM_PERIPHERAL_PASSES; pass++) {
+            int next = -1;
+            for(size_t i = component.size(); i-- > 0 && level[component[i]] == depth;) {
+                int v = component[i], degree = offsets[v + 1] - offsets[v];
+                if(next < 0 || degree < offsets[next + 1] - offsets[next] || (degree == offsets[next + 1] - offsets[next] && v < next)) next = v;
+            }
+            
+            for(int v : component) level[v] = -1;
+            int next_depth = levelStructure(next, level, component);
+            if(next_depth <= depth) break;
+            start = next;
+            depth = next_depth;
+        }
+        for(int v : component) level[v] = -1;
+        
+        size_t head = order.size();
+        order.push_back(start);
+        visited[start] = 1;
+        for(; head < order.size(); head++) {
+            int v = order[head];
+            adjacent.clear();
+            for(int s = offsets[v]; s < offsets[v + 1]; s++) if(!visited[neighbours[s]]) {
+                visited[neighbours[s]] = 1;
+                adjacent.push_back(neighbours[s]);
+            }
+            std::stable_sort(adjacent.begin(), adjacent.end(), [this](int a, int b) { return offsets[a + 1] - offsets[a] < offsets[b + 1] - offsets[b]; });
+            order.insert(order.end(), adjacent.begin(), adjacent.end());
+        }
+    }
+    
+    std::reverse(order.begin(), order.end());
+    return order;
+}
+
+static uint64_t spreadBits(uint64_t v) {
+    // inserts two zero bits between the bits of a 21-bit number
+    
+    v &= 0x1fffff;
+    v = (v | v << 32) & 0x1f00000000ffffULL;
+    v = (v | v << 16) & 0x1f0000ff0000ffULL;
+    v = (v | v << 8) & 0x100f00f00f00f00fULL;
+    v = (v | v << 4) & 0x10c30c30c30c30c3ULL;
+    v = (v | v << 2) & 0x1249249249249249ULL;
+    return v;
+}
+
+std::vector<int> TriangleMesh::orderMorton() const {
+    // the positions quantised in their bounding box
+    
+    int n = vertexCount();
+    float lo[3] = {INFINITY, INFINITY, INFINITY}, hi[3] = {-INFINITY, -INFINITY, -INFINITY};
+    for(int i = 0; i < n; i++) for(int k = 0; k < 3; k++) {
+        lo[k] = std::min(lo[k], positions[size_t(i) * 3 + k]);
+        hi[k] = std::max(hi[k], positions[size_t(i) * 3 + k]);
+    }
+    float extent = std::max(hi[0] - lo[0], std::max(hi[1] - lo[1], hi[2] - lo[2]));
+    float scale = extent > 0.0f ? (float)((1 << MORTON_BITS) - 1) / extent : 0.0f;
+    
+    std::vector<std::pair<uint64_t, int>> codes(n);
+    for(int i = 0; i < n; i++) {
+        uint64_t code = 0;
+        for(int k = 0; k < 3; k++) code |= spreadBits((uint64_t)((positions[size_t(i) * 3 + k] - lo[k]) * scale)) << k;
+        codes[i] = std::make_pair(code, i);
+    }
+    std::sort(codes.begin(), codes.end());
+    
+    std::vector<int> order(n);
+    for(int i = 0; i < n; i++) order[i] = codes[i].second;
+    return order;
+}
+
+void TriangleMesh::reorder(MeshOrder o) {
+    if(o == ORDER_RCM) permute(orderRCM());
+    else if(o == ORDER_MORTON) permute(orderMorton());
+    order = o;
+}
+
+double TriangleMesh::meanSpan() const {
+    // mean distance between the indices of the two ends of a spring, a measure of the locality of the neighbour loads
+    
+    double sum = 0.0;
+    for(int i = 0; i < vertexCount(); i++) for(int s = offsets[i]; s < offsets[i + 1]; s++) sum += std::abs(neighbours[s] - i);
+    return neighbours.empty() ? 0.0 : sum / neighbours.size();
+}
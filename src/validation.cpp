@@ -0,0 +1,791 @@
+//
+//  validation.cpp
+//  Vertex Simulations
+//
+//  Created by Antoni Wójcik on 08/06/2020.
+//  Copyright © 2020 Antoni Wójcik. All rights reserved.
+//
+
+#include <GL/glew.h>
+
+#include "validation.h"
+#include "clothstrips.h"
+#include "clothtiles.h"
+#include "clothmesh.h"
+#include "nbodyslab.h"
+#include "transport.h"
+#include "kernelgl.h"
+
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+#include <fstream>
+#include <sstream>
+
+#define GRAV_ATTRACT 0.1 // has to match kernel_cloth.ocl
+#define ADAPT_COURANT 0.1 // the adaptive step controller, has to match adaptStep of kernel_cloth.ocl
+#define ADAPT_STRAIN 0.05
+#define ADAPT_GROWTH 1.2
+#define ADAPT_SAFETY 0.9 // the bound of the adaptive step, has to match cloth.cpp
+#define ADAPT_MIN_FRACTION 1e-3
+#define FIXED_TILE 16 // the fixed point tiles, has to match cloth.cpp
+#define FIXED_MARGIN 0.25
+#define VALIDATION_TILES 4 // tiles of the streamed backend, so that every configuration crosses tile boundaries
+#define STORAGE_ULPS 8.0 // steps of the reduced storage allowed on top of the position tolerance
+#define STORAGE_MAX_SPACING 0.05 // coarsest reduced storage validated, as a fraction of the rest length of the cloth
+
+#define GRAV_CONST 1.0 // has to match kernel_nbody_fft.ocl
+#define SOFTENING 0.05
+#define CUT_FACTOR 4.5 // cutoff of the short-range force in units of r_split
+#define CG_TOLERANCE 1e-10 // residual of the isolated reference relative to its right hand side
+
+template<typename S>
+static double timeIterate(S& simulation, int steps) {
+    // the first step is not timed, the state after it and the timed steps is what the reference reaches after all of them
+    
+    typedef std::chrono::high_resolution_clock clock;
+    
+    simulation.iterate(1);
+    clock::time_point t0 = clock::now();
+    simulation.iterate(steps - 1);
+    clock::time_point t1 = clock::now();
+    return std::chrono::duration<double>(t1 - t0).count() * 1000.0 / (steps - 1);
+}
+
+Validation::Validation(const char* o, const std::string& b_path, double reg) : baseline_path(b_path), regression(reg), baseline_changed(false), owner(o), failures(0) {}
+
+void Validation::readBaseline() {
+    // one line per backend, device and configuration: the key and the milliseconds per step separated by a tab, a missing file is an
+    // empty baseline; the validations share the file, each adds its own keys
+    
+    baseline.clear();
+    baseline_changed = false;
+    std::ifstream file(baseline_path);
+    std::string line;
+    while(std::getline(file, line)) {
+        size_t tab = line.rfind('\t');
+        if(tab == std::string::npos) continue;
+        baseline[line.substr(0, tab)] = std::stod(line.substr(tab + 1));
+    }
+}
+
+void Validation::writeBaseline() const {
+    std::ofstream file(baseline_path);
+    if(!file) {
+        std::cerr << "ERROR: " << owner << ": CANNOT WRITE THE BASELINE " << baseline_path << std::endl;
+        return;
+    }
+    for(const std::pair<const std::string, double>& entry : baseline) file << entry.first << '\t' << entry.second << '\n';
+}
+
+void Validation::checkTime(const std::string& key, double ms_per_step) {
+    // a new key is added to the baseline, an existing one is kept even if the run was faster, delete the file to record a new baseline
+    
+    std::map<std::string, double>::iterator entry = baseline.find(key);
+    if(entry == baseline.end()) {
+        baseline[key] = ms_per_step;
+        baseline_changed = true;
+        std::cout << "BENCHMARK: " << owner << ": " << key << ": " << ms_per_step << " ms/step, ADDED TO THE BASELINE" << std::endl;
+        return;
+    }
+    
+    double slowdown = ms_per_step / entry->second - 1.0;
+    bool passed = slowdown <= regression;
+    if(!passed) failures++;
+    std::cout << (passed ? "BENCHMARK" : "ERROR") << ": " << owner << ": " << key << ": " << ms_per_step << " ms/step, BASELINE " << entry->second << " ms/step (" << (slowdown >= 0.0 ? "+" : "") << 100.0 * slowdown << "%)" << std::endl;
+}
+
+bool Validation::finish() {
+    if(baseline_changed) writeBaseline();
+    
+    if(failures > 0) std::cout << "ERROR: " << owner << ": " << failures << " CHECKS FAILED" << std::endl;
+    else std::cout << "SUCCESS: " << owner << ": ALL CHECKS PASSED" << std::endl;
+    return failures == 0;
+}
+
+std::vector<cl::Device> Validation::allDevices() {
+    std::vector<cl::Platform> platforms;
+    std::vector<cl::Device> devices;
+    try {
+        cl::Platform::get(&platforms);
+        for(cl::Platform& platform : platforms) {
+            std::vector<cl::Device> platform_devices;
+            try {
+                platform.getDevices(CL_DEVICE_TYPE_ALL, &platform_devices);
+            } catch(cl::Error e) {
+                platform_devices.clear(); // the platform has no devices
+            }
+            devices.insert(devices.end(), platform_devices.begin(), platform_devices.end());
+        }
+    } catch(cl::Error e) {
+        KernelGL::processError(e, "Validation");
+    }
+    return devices;
+}
+
+std::string Validation::deviceName(const cl::Device& device) {
+    std::string name = device.getInfo<CL_DEVICE_NAME>();
+    name.erase(name.find_last_not_of(" \t\n\r") + 1);
+    return name;
+}
+
+template<typename T>
+ClothValidation<T>::ClothValidation(float l, float m, float k, float b, float dt, const char* k_path, const char* v_path, const char* g_path, const char* f_path, const std::string& b_path, double tol, double energy_tol, double reg) : Validation("ClothValidation", b_path, reg), kernel_path(k_path), vs_path(v_path), gs_path(g_path), fs_path(f_path), tolerance(tol), energy_tolerance(energy_tol), length(l), mass(m), stiffness(k), damping(b), shear_stiffness(0.0f), bend_stiffness(0.0f), time_step(dt) {}
+
+template<typename T>
+void ClothValidation<T>::setStencil(float shear, float bend) {
+    if(shear < 0.0f || bend < 0.0f || shear + bend >= stiffness) {
+        std::cerr << "ERROR: ClothValidation: THE EXTENDED SPRINGS HAVE TO BE WEAKER THAN THE STRUCTURAL STIFFNESS" << std::endl;
+        exit(-1);
+    }
+    shear_stiffness = shear;
+    bend_stiffness = bend;
+}
+
+template<typename T>
+void ClothValidation<T>::addConfiguration(int size, int steps) {
+    // the first step of a backend is not timed
+    
+    if(size < 3 + VALIDATION_TILES || steps < 2) {
+        std::cerr << "ERROR: ClothValidation: THE CONFIGURATION " << size << "x" << size << " OVER " << steps << " STEPS IS TOO SMALL" << std::endl;
+        exit(-1);
+    }
+    configurations.push_back({size, steps});
+}
+
+template<typename T>
+typename ClothValidation<T>::Network ClothValidation<T>::lattice(int size, const Variant& variant) const {
+    // the flat cloth at rest with its border pinned, each spring once from its end on the left or at the top; the direct springs
+    // are damped, the shear springs across the diagonals and the bend springs over two vertices of the extended stencil are not
+    
+    Network net;
+    net.pos.resize(size_t(size) * size * 3);
+    net.pinned.resize(size_t(size) * size);
+    
+    double half_width = (size - 1) * (double)length * 0.5;
+    for(int y = 0; y < size; y++) for(int x = 0; x < size; x++) {
+        size_t id = size_t(y) * size + x;
+        net.pos[id * 3]     = -half_width + x * (double)length;
+        net.pos[id * 3 + 1] =  0.0;
+        net.pos[id * 3 + 2] =  half_width - y * (double)length;
+        net.pinned[id] = x == 0 || y == 0 || x == size - 1 || y == size - 1;
+    }
+    
+    double shear = variant.stencil ? shear_stiffness : 0.0;
+    double bend = variant.stencil ? bend_stiffness : 0.0;
+    const int dx[6] = {1, 0, 1, -1, 2, 0};
+    const int dy[6] = {0, 1, 1, 1, 0, 2};
+    const double rest[6] = {1.0, 1.0, std::sqrt(2.0), std::sqrt(2.0), 2.0, 2.0};
+    const double k[6] = {stiffness - shear - bend, stiffness - shear - bend, shear, shear, bend, bend};
+    int kinds = variant.stencil ? 6 : 2;
+    
+    for(int y = 0; y < size; y++) for(int x = 0; x < size; x++) for(int s = 0; s < kinds; s++) {
+        int nx = x + dx[s], ny = y + dy[s];
+        if(nx < 0 || nx >= size || ny >= size) continue;
+        net.springs.push_back({y * size + x, ny * size + nx, rest[s] * length, k[s], s < 2 ? (double)damping : 0.0, s < 2});
+    }
+    return net;
+}
+
+template<typename T>
+typename ClothValidation<T>::Network ClothValidation<T>::mesh(const TriangleMesh& triangles) const {
+    // every edge of the triangles is a damped spring, each once from its end with the lower index
+    
+    Network net;
+    net.pos.assign(triangles.positions.begin(), triangles.positions.end());
+    net.pinned = triangles.pinned;
+    for(int i = 0; i < triangles.vertexCount(); i++) for(int e = triangles.offsets[i]; e < triangles.offsets[i + 1]; e++) {
+        int j = triangles.neighbours[e];
+        if(j > i) net.springs.push_back({i, j, (double)triangles.rest_lengths[e], (double)stiffness, (double)damping, true});
+    }
+    return net;
+}
+
+template<typename T>
+double ClothValidation<T>::maxStep() const {
+    // the stability limit of the explicit step for the stiffness around a vertex and the damping limit, with the safety margin; the
+    // extended stencil keeps the total stiffness
+    
+    double dt_max = ADAPT_SAFETY * 2.0 / std::sqrt(8.0 * stiffness / mass);
+    if(damping > 0.0f) dt_max = std::min(dt_max, mass / (4.0 * damping));
+    return std::min((double)time_step, dt_max);
+}
+
+template<typename T>
+double ClothValidation<T>::nextStep(const Network& net, const State& state, double dt_max) const {
+    // the largest speed moves a vertex by a fraction of the rest length, the largest strain of the direct springs shortens the step
+    // below its bound; the step grows by a limited factor and never falls below a fraction of its bound
+    
+    double speed = 0.0, strain = 0.0;
+    for(size_t v = 0; v < net.pinned.size(); v++) {
+        const double* vel = &state.vel[v * 3];
+        speed = std::max(speed, std::sqrt(vel[0] * vel[0] + vel[1] * vel[1] + vel[2] * vel[2]));
+    }
+    for(const Spring& s : net.springs) {
+        if(!s.structural) continue;
+        double d_len = 0.0;
+        for(int c = 0; c < 3; c++) d_len += (state.pos[s.j * 3 + c] - state.pos[s.i * 3 + c]) * (state.pos[s.j * 3 + c] - state.pos[s.i * 3 + c]);
+        strain = std::max(strain, std::abs(std::sqrt(d_len) - s.rest) / s.rest);
+    }
+    
+    double dt = dt_max;
+    if(speed > 0.0) dt = std::min(dt, ADAPT_COURANT * length / speed);
+    if(strain > ADAPT_STRAIN) dt = std::min(dt, dt_max * ADAPT_STRAIN / strain);
+    return std::max(std::min(dt, ADAPT_GROWTH * state.dt), dt_max * ADAPT_MIN_FRACTION);
+}
+
+template<typename T>
+void ClothValidation<T>::acceleration(const Network& net, const State& state, bool drag, std::vector<double>& acc) const {
+    // Hooke's law along each spring and the damping of the relative velocity of its ends, or with drag the damping of the velocity
+    // of each vertex as the Verlet integrator has it; the pinned vertices get no acceleration
+    
+    acc.assign(state.pos.size(), 0.0);
+    for(const Spring& s : net.springs) {
+        double d[3], d_len = 0.0;
+        for(int c = 0; c < 3; c++) {
+            d[c] = state.pos[s.j * 3 + c] - state.pos[s.i * 3 + c];
+            d_len += d[c] * d[c];
+        }
+        d_len = std::sqrt(d_len);
+        for(int c = 0; c < 3; c++) {
+            double f = (d[c] - d[c] / d_len * s.rest) * s.stiffness;
+            if(!drag) f += (state.vel[s.j * 3 + c] - state.vel[s.i * 3 + c]) * s.damping;
+            acc[s.i * 3 + c] += f;
+            acc[s.j * 3 + c] -= f;
+        }
+    }
+    
+    for(size_t v = 0; v < net.pinned.size(); v++) for(int c = 0; c < 3; c++) {
+        double& a = acc[v * 3 + c];
+        if(net.pinned[v]) a = 0.0;
+        else a = a / mass - (c == 1 ? GRAV_ATTRACT : 0.0) - (drag ? damping / mass * state.vel[v * 3 + c] : 0.0);
+    }
+}
+
+template<typename T>
+typename ClothValidation<T>::State ClothValidation<T>::runReference(const Network& net, const Variant& variant, int steps) const {
+    // the leapfrog starts with the velocity step from 0 to 1/2 as the backends do, an adaptive first step longer than its bound is
+    // shortened with the kick that keeps the velocities half of it ahead; the kick after each drift spans the old and the new half
+    // step. The Verlet positions are the same as a leapfrog with the kick before the drift and the velocities half a step behind,
+    // starting from the half kick backwards
+    
+    bool verlet = variant.integrator == INTEGRATOR_VERLET;
+    State state = {net.pos, std::vector<double>(net.pos.size(), 0.0), time_step};
+    std::vector<double> acc;
+    
+    acceleration(net, state, verlet, acc);
+    for(size_t i = 0; i < acc.size(); i++) state.vel[i] += acc[i] * time_step * (verlet ? -0.5 : 0.5);
+    
+    double dt_max = maxStep();
+    if(variant.adaptive && state.dt > dt_max) {
+        acceleration(net, state, false, acc);
+        for(size_t i = 0; i < acc.size(); i++) state.vel[i] += acc[i] * (dt_max - state.dt) * 0.5;
+        state.dt = dt_max;
+    }
+    
+    for(int n = 0; n < steps; n++) {
+        if(verlet) {
+            acceleration(net, state, true, acc);
+            for(size_t i = 0; i < acc.size(); i++) {
+                state.vel[i] += acc[i] * state.dt;
+                state.pos[i] += state.vel[i] * state.dt;
+            }
+            continue;
+        }
+        
+        for(size_t i = 0; i < state.pos.size(); i++) state.pos[i] += state.vel[i] * state.dt;
+        double dt = variant.adaptive ? nextStep(net, state, dt_max) : state.dt;
+        acceleration(net, state, false, acc);
+        for(size_t i = 0; i < acc.size(); i++) state.vel[i] += acc[i] * (state.dt + dt) * 0.5;
+        state.dt = dt;
+    }
+    return state;
+}
+
+template<typename T>
+typename ClothValidation<T>::Energy ClothValidation<T>::energy(const Network& net, const State& state, bool drag, double lead) const {
+    // the velocities are taken back to the time of the positions by the acceleration over their lead, so that the energy is not
+    // biased by the step
+    
+    std::vector<double> acc;
+    acceleration(net, state, drag, acc);
+    
+    Energy e = {0.0, 0.0};
+    for(const Spring& s : net.springs) {
+        double d_len = 0.0;
+        for(int c = 0; c < 3; c++) d_len += (state.pos[s.j * 3 + c] - state.pos[s.i * 3 + c]) * (state.pos[s.j * 3 + c] - state.pos[s.i * 3 + c]);
+        double stretch = std::sqrt(d_len) - s.rest;
+        e.potential += 0.5 * s.stiffness * stretch * stretch;
+    }
+    for(size_t v = 0; v < net.pinned.size(); v++) {
+        double speed = 0.0;
+        for(int c = 0; c < 3; c++) {
+            double vel = state.vel[v * 3 + c] - acc[v * 3 + c] * lead;
+            speed += vel * vel;
+        }
+        e.kinetic += 0.5 * mass * speed;
+        e.potential += mass * GRAV_ATTRACT * state.pos[v * 3 + 1];
+    }
+    return e;
+}
+
+template<typename T>
+double ClothValidation<T>::storageSpacing(StateStorage storage, int size) const {
+    // the step between the stored coordinates: fp16 at the largest coordinate of the flat cloth, the fixed point over the range of a
+    // tile; the single precision of the other backends is covered by the tolerance
+    
+    double extent = (size - 1) * (double)length * 0.5;
+    if(storage == STORAGE_HALF) return std::ldexp(1.0, (int)std::floor(std::log2(extent)) - 10);
+    if(storage == STORAGE_FIXED) return ((FIXED_TILE - 1) * (double)length + FIXED_MARGIN * (size - 1) * (double)length) / 32767.0;
+    return 0.0;
+}
+
+template<typename T>
+void ClothValidation<T>::check(const std::string& key, const Network& net, const Variant& variant, const State& reference, const std::vector<float>& pos, const std::vector<float>& vel, double spacing, double ms_per_step) {
+    // the positions within the tolerance of the reference, the energy close to its energy and not above the energy at rest; the
+    // reduced storage rounds the state every step, which adds a few of its steps to the position tolerance and the energy of the
+    // springs stretched by one step to the energy tolerance
+    
+    bool verlet = variant.integrator == INTEGRATOR_VERLET;
+    double lead = (verlet ? -0.5 : 0.5) * reference.dt;
+    
+    double error = 0.0;
+    for(size_t i = 0; i < pos.size(); i++) error = std::max(error, std::abs(pos[i] - reference.pos[i]));
+    error /= length;
+    double pos_tolerance = tolerance + STORAGE_ULPS * spacing / length;
+    
+    State state = {std::vector<double>(pos.begin(), pos.end()), std::vector<double>(vel.begin(), vel.end()), reference.dt};
+    State rest = {net.pos, std::vector<double>(net.pos.size(), 0.0), reference.dt};
+    Energy e_ref = energy(net, reference, verlet, lead);
+    Energy e = energy(net, state, verlet, lead);
+    Energy e_rest = energy(net, rest, verlet, 0.0);
+    double energy_error = std::abs(e.total() - e_ref.total()) / e_ref.scale();
+    double energy_gain = (e.total() - e_rest.total()) / e_ref.scale();
+    double e_tolerance = energy_tolerance + stiffness * net.springs.size() * spacing * spacing / e_ref.scale();
+    
+    bool passed = error <= pos_tolerance && energy_error <= e_tolerance && energy_gain <= e_tolerance;
+    if(!passed) failures++;
+    std::cout << (passed ? "SUCCESS" : "ERROR") << ": " << owner << ": " << key << ": POSITION ERROR " << error << " (" << pos_tolerance << "), ENERGY ERROR " << energy_error << ", ENERGY GAIN " << energy_gain << " (" << e_tolerance << ")" << std::endl;
+    
+    checkTime(key, ms_per_step);
+}
+
+template<typename T>
+bool ClothValidation<T>::run() {
+    readBaseline();
+    failures = 0;
+    std::vector<cl::Device> devices = allDevices();
+    
+    const Variant variants[] = {
+        {"Cloth",                STORAGE_FLOAT, INTEGRATOR_LEAPFROG, false, false},
+        {"Cloth HALF STORAGE",   STORAGE_HALF,  INTEGRATOR_LEAPFROG, false, false},
+        {"Cloth FIXED STORAGE",  STORAGE_FIXED, INTEGRATOR_LEAPFROG, false, false},
+        {"Cloth VERLET",         STORAGE_FLOAT, INTEGRATOR_VERLET,   false, false},
+        {"Cloth STENCIL",        STORAGE_FLOAT, INTEGRATOR_LEAPFROG, true,  false},
+        {"Cloth ADAPTIVE",       STORAGE_FLOAT, INTEGRATOR_LEAPFROG, false, true}
+    };
+    const Variant& direct = variants[0]; // the springs of the headless backends and of the mesh
+    
+    for(const Configuration& c : configurations) {
+        std::string size = " " + std::to_string(c.size) + "x" + std::to_string(c.size);
+        Network net = lattice(c.size, direct);
+        State reference = runReference(net, direct, c.steps);
+        std::vector<float> pos, vel;
+        
+        // the headless backends on every device
+        
+        for(const cl::Device& device : devices) {
+            std::string device_name = deviceName(device);
+            if(sizeof(T) == sizeof(cl_double) && !KernelGL::deviceSupports(device, "cl_khr_fp64")) {
+                std::cout << "SUCCESS: " << owner << ": " << device_name << " SKIPPED, NO DOUBLE PRECISION" << std::endl;
+                continue;
+            }
+            
+            {
+                ClothStrips<T> cloth(c.size, c.size, length, mass, stiffness, damping, time_step, {device}, kernel_path);
+                double ms_per_step = timeIterate(cloth, c.steps);
+                cloth.readPositions(pos);
+                cloth.readVelocities(vel);
+                check("ClothStrips ON " + device_name + size, net, direct, reference, pos, vel, 0.0, ms_per_step);
+            }
+            
+            {
+                ClothTiles<T> cloth(c.size, c.size, length, mass, stiffness, damping, time_step, device, kernel_path, "", (c.size - 2 + VALIDATION_TILES - 1) / VALIDATION_TILES);
+                double ms_per_step = timeIterate(cloth, c.steps);
+                cloth.readPositions(pos);
+                cloth.readVelocities(vel);
+                check("ClothTiles ON " + device_name + size, net, direct, reference, pos, vel, 0.0, ms_per_step);
+            }
+        }
+        
+        // the variants of Cloth on the device of the OpenGL context, each against its own springs and integrator
+        
+        for(const Variant& variant : variants) {
+            double spacing = storageSpacing(variant.storage, c.size);
+            if(spacing > STORAGE_MAX_SPACING * length) {
+                std::cout << "SUCCESS: " << owner << ": " << variant.name << size << " SKIPPED, THE STORAGE CANNOT RESOLVE THE SPRINGS" << std::endl;
+                continue;
+            }
+            
+            Network variant_net = lattice(c.size, variant);
+            State variant_reference = runReference(variant_net, variant, c.steps);
+            
+            float k = variant.stencil ? stiffness - shear_stiffness - bend_stiffness : stiffness;
+            Cloth<T> cloth(c.size, c.size, length, mass, k, damping, glm::vec3(0.0f), time_step, vs_path, gs_path, fs_path, kernel_path, variant.storage, variant.integrator);
+            cloth.wait();
+            if(variant.stencil) cloth.setSpringStiffness(shear_stiffness, bend_stiffness);
+            cloth.setAdaptive(variant.adaptive);
+            double ms_per_step = timeIterate(cloth, c.steps);
+            cloth.readPositions(pos);
+            cloth.readVelocities(vel);
+            check(variant.name + size, variant_net, variant, variant_reference, pos, vel, spacing, ms_per_step);
+        }
+        
+        // the same lattice as a triangle mesh, whose diagonals are springs as well, in the reverse Cuthill-McKee order
+        
+        TriangleMesh triangles = TriangleMesh::grid(c.size, c.size, length);
+        triangles.reorder(ORDER_RCM);
+        Network mesh_net = mesh(triangles);
+        State mesh_reference = runReference(mesh_net, direct, c.steps);
+        
+        ClothMesh<T> cloth(triangles, mass, stiffness, damping, glm::vec3(0.0f), time_step, vs_path, gs_path, fs_path, kernel_path);
+        cloth.wait();
+        double ms_per_step = timeIterate(cloth, c.steps);
+        cloth.readPositions(pos);
+        cloth.readVelocities(vel);
+        check("ClothMesh" + size, mesh_net, direct, mesh_reference, pos, vel, 0.0, ms_per_step);
+    }
+    
+    return finish();
+}
+
+template<typename T>
+NBodyValidation<T>::NBodyValidation(float dt, float rs, const char* k_path, const char* v_path, const char* f_path, const std::string& b_path, double tol, double momentum_tol, double reg) : Validation("NBodyValidation", b_path, reg), kernel_path(k_path), vs_path(v_path), fs_path(f_path), tolerance(tol), momentum_tolerance(momentum_tol), time_step(dt), r_split(rs) {}
+
+template<typename T>
+void NBodyValidation<T>::addConfiguration(int grid, int bodies, int steps) {
+    // the multigrid solver needs a power of two grid, the short-range cells at least three cutoffs across it
+    
+    if(grid < 8 || (grid & (grid - 1)) != 0 || grid < 3 * CUT_FACTOR * r_split || bodies < 1 || steps < 2) {
+        std::cerr << "ERROR: NBodyValidation: THE CONFIGURATION " << grid << "^3 WITH " << bodies << " BODIES OVER " << steps << " STEPS IS NOT SUPPORTED" << std::endl;
+        exit(-1);
+    }
+    configurations.push_back({grid, bodies, steps});
+}
+
+template<typename T>
+void NBodyValidation<T>::transform(std::vector<std::complex<double>>& grid, int n, double sign) const {
+    // the discrete Fourier transform along each axis in turn, summed directly and not normalised
+    
+    std::vector<std::complex<double>> twiddle(n), line(n);
+    for(int k = 0; k < n; k++) twiddle[k] = std::polar(1.0, sign * 2.0 * M_PI * k / n);
+    
+    const size_t strides[3] = {1, size_t(n), size_t(n) * n};
+    for(int axis = 0; axis < 3; axis++) {
+        size_t stride = strides[axis];
+        for(size_t base = 0; base < grid.size(); base++) {
+            if((base / stride) % n != 0) continue; // the first cell of each line along the axis
+            for(int k = 0; k < n; k++) {
+                std::complex<double> sum = 0.0;
+                for(int x = 0; x < n; x++) sum += grid[base + x * stride] * twiddle[(size_t(k) * x) % n];
+                line[k] = sum;
+            }
+            for(int k = 0; k < n; k++) grid[base + k * stride] = line[k];
+        }
+    }
+}
+
+template<typename T>
+void NBodyValidation<T>::solvePeriodic(const std::vector<double>& dens, int n, double rs, std::vector<double>& pot) const {
+    // the Green's function of the Poisson equation deconvolved by the CIC window of the deposition and of the interpolation, with the
+    // long-range filter of the short-range split; the mean density does not contribute
+    
+    std::vector<std::complex<double>> grid(dens.begin(), dens.end());
+    transform(grid, n, -1.0);
+    
+    for(int z = 0; z < n; z++) for(int y = 0; y < n; y++) for(int x = 0; x < n; x++) {
+        int w[3] = {x, y, z};
+        double k2 = 0.0, window = 1.0;
+        for(int c = 0; c < 3; c++) {
+            double k = (w[c] > n / 2 ? w[c] - n : w[c]) * 2.0 * M_PI / n;
+            double s = k == 0.0 ? 1.0 : std::sin(0.5 * k) / (0.5 * k);
+            k2 += k * k;
+            window *= s * s;
+        }
+        std::complex<double>& cell = grid[(size_t(z) * n + y) * n + x];
+        if(k2 == 0.0) cell = 0.0;
+        else cell *= -4.0 * M_PI * GRAV_CONST / k2 * std::exp(-k2 * rs * rs) / (window * window);
+    }
+    
+    transform(grid, n, 1.0);
+    pot.resize(grid.size());
+    for(size_t i = 0; i < grid.size(); i++) pot[i] = grid[i].real() / ((double)n * n * n);
+}
+
+template<typename T>
+void NBodyValidation<T>::solveIsolated(const std::vector<double>& dens, int n, double total_mass, std::vector<double>& pot) const {
+    // the seven-point Laplacian with the potential of the whole mass at the centre on the cells around the mesh, solved by conjugate
+    // gradients instead of the multigrid cycles: 6 phi minus the neighbours inside is the neighbours outside minus 4 pi G rho
+    
+    size_t cells = size_t(n) * n * n;
+    double centre = 0.5 * (n - 1);
+    const int dx[6] = {-1, 1, 0, 0, 0, 0};
+    const int dy[6] = {0, 0, -1, 1, 0, 0};
+    const int dz[6] = {0, 0, 0, 0, -1, 1};
+    
+    auto inside = [n](int x, int y, int z) { return x >= 0 && y >= 0 && z >= 0 && x < n && y < n && z < n; };
+    auto laplacian = [&](const std::vector<double>& phi, std::vector<double>& result) {
+        for(int z = 0; z < n; z++) for(int y = 0; y < n; y++) for(int x = 0; x < n; x++) {
+            double sum = 6.0 * phi[(size_t(z) * n + y) * n + x];
+            for(int s = 0; s < 6; s++) if(inside(x + dx[s], y + dy[s], z + dz[s])) sum -= phi[(size_t(z + dz[s]) * n + y + dy[s]) * n + x + dx[s]];
+            result[(size_t(z) * n + y) * n + x] = sum;
+        }
+    };
+    
+    std::vector<double> r(cells), p, ap(cells);
+    for(int z = 0; z < n; z++) for(int y = 0; y < n; y++) for(int x = 0; x < n; x++) {
+        double rhs = -4.0 * M_PI * GRAV_CONST * dens[(size_t(z) * n + y) * n + x];
+        for(int s = 0; s < 6; s++) {
+            int bx = x + dx[s], by = y + dy[s], bz = z + dz[s];
+            if(inside(bx, by, bz)) continue;
+            double d = std::sqrt((bx - centre) * (bx - centre) + (by - centre) * (by - centre) + (bz - centre) * (bz - centre));
+            rhs -= GRAV_CONST * total_mass / d;
+        }
+        r[(size_t(z) * n + y) * n + x] = rhs;
+    }
+    
+    pot.assign(cells, 0.0);
+    p = r;
+    double rr = 0.0;
+    for(double v : r) rr += v * v;
+    double limit = CG_TOLERANCE * CG_TOLERANCE * rr;
+    
+    for(size_t it = 0; it < cells && rr > limit; it++) {
+        laplacian(p, ap);
+        double pap = 0.0;
+        for(size_t i = 0; i < cells; i++) pap += p[i] * ap[i];
+        double alpha = rr / pap;
+        double rr_new = 0.0;
+        for(size_t i = 0; i < cells; i++) {
+            pot[i] += alpha * p[i];
+            r[i] -= alpha * ap[i];
+            rr_new += r[i] * r[i];
+        }
+        for(size_t i = 0; i < cells; i++) p[i] = r[i] + rr_new / rr * p[i];
+        rr = rr_new;
+    }
+}
+
+template<typename T>
+void NBodyValidation<T>::acceleration(const State& state, int n, const Variant& variant, double mass, std::vector<double>& acc) const {
+    bool periodic = variant.solver == SOLVER_FFT;
+    size_t body_num = state.pos.size() / 3;
+    double total_mass = mass * body_num;
+    
+    auto wrap = [n](int x) { return ((x % n) + n) % n; };
+    auto cellId = [n](int x, int y, int z) { return (size_t(z) * n + y) * n + x; };
+    
+    // cloud-in-cell deposition with the cell centres at integer coordinates, an isolated mesh drops the mass outside of it
+    
+    std::vector<double> dens(size_t(n) * n * n, 0.0), pot;
+    for(size_t b = 0; b < body_num; b++) {
+        const double* p = &state.pos[b * 3];
+        int x0 = (int)std::floor(p[0]), y0 = (int)std::floor(p[1]), z0 = (int)std::floor(p[2]);
+        double d[3] = {p[0] - x0, p[1] - y0, p[2] - z0};
+        for(int c = 0; c < 8; c++) {
+            int x = x0 + (c & 1), y = y0 + ((c >> 1) & 1), z = z0 + ((c >> 2) & 1);
+            double w = ((c & 1) ? d[0] : 1.0 - d[0]) * (((c >> 1) & 1) ? d[1] : 1.0 - d[1]) * (((c >> 2) & 1) ? d[2] : 1.0 - d[2]);
+            if(periodic) dens[cellId(wrap(x), wrap(y), wrap(z))] += mass * w;
+            else if(x >= 0 && y >= 0 && z >= 0 && x < n && y < n && z < n) dens[cellId(x, y, z)] += mass * w;
+        }
+    }
+    
+    if(periodic) solvePeriodic(dens, n, variant.short_range ? r_split : 0.0, pot);
+    else solveIsolated(dens, n, total_mass, pot);
+    
+    // the central difference gradient interpolated with the same weights, the isolated potential is clamped to the mesh and a body
+    // outside of it sees the whole mass at the centre
+    
+    auto potAt = [&](int x, int y, int z) {
+        if(periodic) return pot[cellId(wrap(x), wrap(y), wrap(z))];
+        return pot[cellId(std::min(std::max(x, 0), n - 1), std::min(std::max(y, 0), n - 1), std::min(std::max(z, 0), n - 1))];
+    };
+    
+    acc.assign(state.pos.size(), 0.0);
+    for(size_t b = 0; b < body_num; b++) {
+        const double* p = &state.pos[b * 3];
+        double* a = &acc[b * 3];
+        
+        if(!periodic && (std::min(p[0], std::min(p[1], p[2])) < 0.0 || std::max(p[0], std::max(p[1], p[2])) > n - 1)) {
+            double d[3] = {p[0] - 0.5 * (n - 1), p[1] - 0.5 * (n - 1), p[2] - 0.5 * (n - 1)};
+            double r2 = d[0] * d[0] + d[1] * d[1] + d[2] * d[2] + SOFTENING * SOFTENING;
+            for(int c = 0; c < 3; c++) a[c] = -d[c] * GRAV_CONST * total_mass / (r2 * std::sqrt(r2));
+            continue;
+        }
+        
+        int x0 = (int)std::floor(p[0]), y0 = (int)std::floor(p[1]), z0 = (int)std::floor(p[2]);
+        double d[3] = {p[0] - x0, p[1] - y0, p[2] - z0};
+        for(int c = 0; c < 8; c++) {
+            int x = x0 + (c & 1), y = y0 + ((c >> 1) & 1), z = z0 + ((c >> 2) & 1);
+            double w = ((c & 1) ? d[0] : 1.0 - d[0]) * (((c >> 1) & 1) ? d[1] : 1.0 - d[1]) * (((c >> 2) & 1) ? d[2] : 1.0 - d[2]);
+            a[0] -= 0.5 * w * (potAt(x + 1, y, z) - potAt(x - 1, y, z));
+            a[1] -= 0.5 * w * (potAt(x, y + 1, z) - potAt(x, y - 1, z));
+            a[2] -= 0.5 * w * (potAt(x, y, z + 1) - potAt(x, y, z - 1));
+        }
+    }
+    
+    if(!variant.short_range) return;
+    
+    // the particle-particle part of P3M summed over every pair within the cutoff, with the nearest periodic image of each body
+    
+    double r_cut = CUT_FACTOR * r_split;
+    for(size_t i = 0; i < body_num; i++) for(size_t j = i + 1; j < body_num; j++) {
+        double d[3], r2 = 0.0;
+        for(int c = 0; c < 3; c++) {
+            d[c] = state.pos[j * 3 + c] - state.pos[i * 3 + c];
+            d[c] -= n * std::round(d[c] / n);
+            r2 += d[c] * d[c];
+        }
+        if(r2 >= r_cut * r_cut) continue;
+        
+        double r = std::sqrt(r2);
+        double r2_soft = r2 + SOFTENING * SOFTENING;
+        double split = std::erfc(r / (2.0 * r_split)) + r / (r_split * std::sqrt(M_PI)) * std::exp(-r2 / (4.0 * r_split * r_split));
+        double f = GRAV_CONST * mass * split / (r2_soft * std::sqrt(r2_soft));
+        for(int c = 0; c < 3; c++) {
+            acc[i * 3 + c] += d[c] * f;
+            acc[j * 3 + c] -= d[c] * f;
+        }
+    }
+}
+
+template<typename T>
+typename NBodyValidation<T>::State NBodyValidation<T>::runReference(State state, int n, const Variant& variant, double mass, int steps) const {
+    // kick-drift-kick from the bodies the backend generated, the periodic box wraps the positions after each drift
+    
+    std::vector<double> acc;
+    acceleration(state, n, variant, mass, acc);
+    for(int s = 0; s < steps; s++) {
+        for(size_t i = 0; i < acc.size(); i++) {
+            state.vel[i] += acc[i] * time_step * 0.5;
+            state.pos[i] += state.vel[i] * time_step;
+            if(variant.solver == SOLVER_FFT) state.pos[i] -= n * std::floor(state.pos[i] / n);
+        }
+        acceleration(state, n, variant, mass, acc);
+        for(size_t i = 0; i < acc.size(); i++) state.vel[i] += acc[i] * time_step * 0.5;
+    }
+    return state;
+}
+
+template<typename T>
+double NBodyValidation<T>::storageSpacing(StateStorage storage, int n) const {
+    // the step between the stored coordinates at the far end of the grid
+    
+    if(storage == STORAGE_HALF) return std::ldexp(1.0, (int)std::floor(std::log2((double)n)) - 10);
+    if(storage == STORAGE_FIXED) return n / 32767.0;
+    return 0.0;
+}
+
+template<typename T>
+void NBodyValidation<T>::check(const std::string& key, int n, const Variant& variant, const State& reference, const std::vector<float>& pos, const std::vector<float>& vel, double mass, double ms_per_step) {
+    // the positions within the tolerance of the reference, in the periodic box against the nearest image, and the total momentum
+    // close to that of the reference relative to the sum of the momenta of the bodies
+    
+    bool periodic = variant.solver == SOLVER_FFT;
+    double error = 0.0;
+    for(size_t i = 0; i < pos.size(); i++) {
+        double d = pos[i] - reference.pos[i];
+        if(periodic) d -= n * std::round(d / n);
+        error = std::max(error, std::abs(d));
+    }
+    double pos_tolerance = tolerance + STORAGE_ULPS * storageSpacing(variant.storage, n);
+    
+    double momentum[3] = {0.0, 0.0, 0.0}, scale = 0.0;
+    for(size_t b = 0; b < vel.size() / 3; b++) {
+        double speed = 0.0;
+        for(int c = 0; c < 3; c++) {
+            momentum[c] += mass * (vel[b * 3 + c] - reference.vel[b * 3 + c]);
+            speed += reference.vel[b * 3 + c] * reference.vel[b * 3 + c];
+        }
+        scale += mass * std::sqrt(speed);
+    }
+    double momentum_error = std::sqrt(momentum[0] * momentum[0] + momentum[1] * momentum[1] + momentum[2] * momentum[2]) / std::max(scale, 1e-30);
+    
+    bool passed = error <= pos_tolerance && momentum_error <= momentum_tolerance;
+    if(!passed) failures++;
+    std::cout << (passed ? "SUCCESS" : "ERROR") << ": " << owner << ": " << key << ": POSITION ERROR " << error << " CELLS (" << pos_tolerance << "), MOMENTUM ERROR " << momentum_error << " (" << momentum_tolerance << ")" << std::endl;
+    
+    checkTime(key, ms_per_step);
+}
+
+template<typename T>
+bool NBodyValidation<T>::run() {
+    readBaseline();
+    failures = 0;
+    std::vector<cl::Device> devices = allDevices();
+    
+    const Variant variants[] = {
+        {"NBody",               SOLVER_FFT,       STORAGE_FLOAT, false},
+        {"NBody HALF STORAGE",  SOLVER_FFT,       STORAGE_HALF,  false},
+        {"NBody FIXED STORAGE", SOLVER_FFT,       STORAGE_FIXED, false},
+        {"NBody P3M",           SOLVER_FFT,       STORAGE_FLOAT, true},
+        {"NBody MULTIGRID",     SOLVER_MULTIGRID, STORAGE_FLOAT, false}
+    };
+    const Variant& periodic = variants[0]; // the force of NBodySlab
+    
+    for(const Configuration& c : configurations) {
+        std::string size = " " + std::to_string(c.grid) + "^3 " + std::to_string(c.bodies) + " BODIES";
+        float mass = 1.0f / c.bodies;
+        std::vector<float> pos, vel;
+        
+        // the variants of NBody on the device of the OpenGL context, from a Plummer sphere
+        
+        for(const Variant& variant : variants) {
+            float rs = variant.short_range ? r_split : 0.0f;
+            NBody<T> nbody(c.grid, c.bodies, mass, time_step, vs_path, fs_path, kernel_path, INITIAL_PLUMMER, variant.solver, rs, (float)CUT_FACTOR * rs, variant.storage);
+            nbody.readPositions(pos);
+            nbody.readVelocities(vel);
+            State start = {std::vector<double>(pos.begin(), pos.end()), std::vector<double>(vel.begin(), vel.end())};
+            
+            double ms_per_step = timeIterate(nbody, c.steps);
+            nbody.readPositions(pos);
+            nbody.readVelocities(vel);
+            check(variant.name + size, c.grid, variant, runReference(start, c.grid, variant, mass, c.steps), pos, vel, mass, ms_per_step);
+        }
+        
+        // NBodySlab as the only rank on every device, from its uniform bodies at rest
+        
+        for(const cl::Device& device : devices) {
+            std::string device_name = deviceName(device);
+            if(sizeof(T) == sizeof(cl_double) && (!KernelGL::deviceSupports(device, "cl_khr_fp64") || !KernelGL::deviceSupports(device, "cl_khr_int64_base_atomics"))) {
+                std::cout << "SUCCESS: " << owner << ": " << device_name << " SKIPPED, NO DOUBLE PRECISION ATOMICS" << std::endl;
+                continue;
+            }
+            
+            try {
+                cl::Context context(device);
+                cl::Program program = KernelGL::buildProgram(context, {device}, KernelGL::loadSource(kernel_path, owner), "-D HEADLESS", sizeof(T) == sizeof(cl_double), owner, {"cl_khr_int64_base_atomics"});
+                LocalTransport transport;
+                NBodySlab<T> slab(c.grid, c.bodies, mass, time_step, transport, device, context, program);
+                slab.readPositions(pos);
+                slab.readVelocities(vel);
+                State start = {std::vector<double>(pos.begin(), pos.end()), std::vector<double>(vel.begin(), vel.end())};
+                
+                double ms_per_step = timeIterate(slab, c.steps);
+                slab.readPositions(pos);
+                slab.readVelocities(vel);
+                check("NBodySlab ON " + device_name + size, c.grid, periodic, runReference(start, c.grid, periodic, mass, c.steps), pos, vel, mass, ms_per_step);
+            } catch(cl::Error e) {
+                KernelGL::processError(e, owner);
+            }
+        }
+    }
+    
+    return finish();
+}
+
+template class ClothValidation<float>;
+template class ClothValidation<double>;
+
+template class NBodyValidation<float>;
+template class NBodyValidation<double>;
@@ -0,0 +1,128 @@
+//
+//  vertexsim.cpp
+//  Vertex Simulations
+//
+//  Created by Antoni Wójcik on 11/06/2020.
+//  Copyright © 2020 Antoni Wójcik. All rights reserved.
+//
+
+#include <GL/glew.h>
+#include <GLFW/glfw3.h>
+
+#include "vertexsim.h"
+#include "cloth.h"
+#include "nbody.h"
+
+#include <iostream>
+#include <string>
+
+struct VSSimulation {
+    KernelGL* simulation;
+};
+
+// the context of the hidden window is current on the thread of vsInitialise, all the simulations share it
+static GLFWwindow* window = nullptr;
+static std::string root_path;
+
+static std::string path(const char* relative) {
+    return root_path + "/" + relative;
+}
+
+int vsInitialise(const char* root) {
+    if(window != nullptr) return VS_OK;
+    root_path = root ? root : ".";
+    
+    // the same context as the drawn program, nothing is shown so the swaps do not wait for the display
+    
+    glfwInit();
+    glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 4);
+    glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 1);
+    glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
+    glfwWindowHint(GLFW_OPENGL_FORWARD_COMPAT, GL_TRUE);
+    glfwWindowHint(GLFW_VISIBLE, GLFW_FALSE);
+    
+    window = glfwCreateWindow(64, 64, "Vertex Simulations", NULL, NULL);
+    if(window == NULL) {
+        std::cerr << "ERROR: OpenGL: Failed to create GLFW window" << std::endl;
+        glfwTerminate();
+        return VS_ERROR_UNSUPPORTED;
+    }
+    
+    glfwMakeContextCurrent(window);
+    glfwSwapInterval(0);
+    
+    if(glewInit() != GLEW_OK) {
+        std::cerr << "ERROR: OpenGL: Failed to initialize GLEW" << std::endl;
+        glGetError();
+        glfwDestroyWindow(window);
+        glfwTerminate();
+        window = nullptr;
+        return VS_ERROR_UNSUPPORTED;
+    }
+    
+    return VS_OK;
+}
+
+void vsTerminate(void) {
+    if(window == nullptr) return;
+    glfwDestroyWindow(window);
+    glfwTerminate();
+    window = nullptr;
+}
+
+VSSimulation* vsCreateCloth(int size_x, int size_y, float length, float mass, float stiffness, float damping, float time_step, int storage, int integrator, int double_precision) {
+    if(window == nullptr || size_x < 3 || size_y < 3 || (integrator == INTEGRATOR_VERLET && storage != STORAGE_FLOAT)) return nullptr;
+    
+    std::string vs = path("src/shaders/cloth.vs"), gs = path("src/shaders/cloth.gs"), fs = path("src/shaders/cloth.fs"), kernel = path("src/kernels/kernel_cloth.ocl");
+    VSSimulation* sim = new VSSimulation;
+    if(double_precision) sim->simulation = new Cloth<double>(size_x, size_y, length, mass, stiffness, damping, glm::vec3(0.0f), time_step, vs.c_str(), gs.c_str(), fs.c_str(), kernel.c_str(), (StateStorage)storage, (ClothIntegrator)integrator);
+    else sim->simulation = new Cloth<float>(size_x, size_y, length, mass, stiffness, damping, glm::vec3(0.0f), time_step, vs.c_str(), gs.c_str(), fs.c_str(), kernel.c_str(), (StateStorage)storage, (ClothIntegrator)integrator);
+    return sim;
+}
+
+VSSimulation* vsCreateNBody(int grid_num, int body_num, float body_mass, float time_step, int initial, int solver, int storage, int double_precision) {
+    if(window == nullptr || grid_num <= 0 || body_num <= 0) return nullptr;
+    
+    std::string vs = path("src/shaders/nbody.vs"), fs = path("src/shaders/nbody.fs"), kernel = path("src/kernels/kernel_nbody_fft.ocl");
+    VSSimulation* sim = new VSSimulation;
+    if(double_precision) sim->simulation = new NBody<double>(grid_num, body_num, body_mass, time_step, vs.c_str(), fs.c_str(), kernel.c_str(), (NBodyInitial)initial, (NBodySolver)solver, 0.0f, 0.0f, (StateStorage)storage);
+    else sim->simulation = new NBody<float>(grid_num, body_num, body_mass, time_step, vs.c_str(), fs.c_str(), kernel.c_str(), (NBodyInitial)initial, (NBodySolver)solver, 0.0f, 0.0f, (StateStorage)storage);
+    return sim;
+}
+
+void vsDestroy(VSSimulation* sim) {
+    if(sim == nullptr) return;
+    delete sim->simulation;
+    delete sim;
+}
+
+int vsStep(VSSimulation* sim, int steps) {
+    // the kernels would race the host writing into a mapped view, and an unmap after the steps would overwrite them
+    
+    if(sim == nullptr || steps < 0) return VS_ERROR_ARGUMENT;
+    if(sim->simulation->stateMapped()) return VS_ERROR_MAPPED;
+    
+    sim->simulation->wait();
+    sim->simulation->iterate(steps);
+    return VS_OK;
+}
+
+int vsSetParameter(VSSimulation* sim, const char* name, float value) {
+    if(sim == nullptr || name == nullptr) return VS_ERROR_ARGUMENT;
+    if(sim->simulation->stateMapped()) return VS_ERROR_MAPPED;
+    return sim->simulation->setParameter(name, value) ? VS_OK : VS_ERROR_ARGUMENT;
+}
+
+int vsMapState(VSSimulation* sim, int field, void** data, size_t* count, size_t* item_size) {
+    if(sim == nullptr || data == nullptr || count == nullptr || item_size == nullptr) return VS_ERROR_ARGUMENT;
+    if(field != VS_POSITIONS && field != VS_VELOCITIES) return VS_ERROR_ARGUMENT;
+    
+    *data = sim->simulation->mapState(field == VS_POSITIONS ? FIELD_POSITIONS : FIELD_VELOCITIES, *count, *item_size);
+    return *data != nullptr ? VS_OK : VS_ERROR_UNSUPPORTED;
+}
+
+int vsUnmapState(VSSimulation* sim, void* data) {
+    if(sim == nullptr || data == nullptr) return VS_ERROR_ARGUMENT;
+    sim->simulation->unmapState(data);
+    return VS_OK;
+}
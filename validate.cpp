@@ -0,0 +1,72 @@
+//
+//  validate.cpp
+//  Vertex Simulations
+//
+//  Created by Antoni Wójcik on 08/06/2020.
+//  Copyright © 2020 Antoni Wójcik. All rights reserved.
+//
+
+// compares every backend of the cloth and of the n-body simulation with the host references and the baseline timings, the exit code
+// is the result; linked with the sources of the simulations in place of main.cpp
+
+#define REAL float // double needs cl_khr_fp64 on the device of the OpenGL context
+
+#define VALIDATE_BASELINE "validation_baseline.txt"
+#define VALIDATE_STEPS 100
+#define VALIDATE_SHEAR_STIFFNESS 150.0f // the structural stiffness of the extended cloth is the rest of 500, as in main.cpp
+#define VALIDATE_BEND_STIFFNESS 50.0f
+#define VALIDATE_GRID 32
+#define VALIDATE_BODIES 2048
+#define VALIDATE_NBODY_STEPS 20
+#define VALIDATE_R_SPLIT 1.0f // in grid cells, of the P3M variant
+
+#include <iostream>
+
+// include the OpenGL libraries
+#include <GL/glew.h>
+#include <GLFW/glfw3.h>
+
+#include "validation.h"
+
+int main(int argc, const char * argv[]) {
+    // the backends drawn by OpenGL share their buffers with its context, the window is never shown
+    
+    glfwInit();
+    glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 4);
+    glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 1);
+    glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
+    glfwWindowHint(GLFW_OPENGL_FORWARD_COMPAT, GL_TRUE);
+    glfwWindowHint(GLFW_VISIBLE, GLFW_FALSE);
+    
+    GLFWwindow* window = glfwCreateWindow(64, 64, "Vertex Simulations", NULL, NULL);
+    if(window == NULL) {
+        std::cerr << "ERROR: OpenGL: Failed to create GLFW window" << std::endl;
+        glfwTerminate();
+        return -1;
+    }
+    glfwMakeContextCurrent(window);
+    glfwSwapInterval(0);
+    
+    if(glewInit() != GLEW_OK) {
+        std::cerr << "ERROR: OpenGL: Failed to initialize GLEW" << std::endl;
+        glfwDestroyWindow(window);
+        glfwTerminate();
+        return -1;
+    }
+    
+    // a small cloth and one large enough for the timings to matter, the same properties as the drawn cloth
+    
+    ClothValidation<REAL> cloth(0.01f, 1.0f, 500.0f, 0.2f, 0.03f, "src/kernels/kernel_cloth.ocl", "src/shaders/cloth.vs", "src/shaders/cloth.gs", "src/shaders/cloth.fs", VALIDATE_BASELINE);
+    cloth.setStencil(VALIDATE_SHEAR_STIFFNESS, VALIDATE_BEND_STIFFNESS);
+    cloth.addConfiguration(64, VALIDATE_STEPS);
+    cloth.addConfiguration(512, VALIDATE_STEPS);
+    bool passed = cloth.run();
+    
+    NBodyValidation<REAL> nbody(0.01f, VALIDATE_R_SPLIT, "src/kernels/kernel_nbody_fft.ocl", "src/shaders/nbody.vs", "src/shaders/nbody.fs", VALIDATE_BASELINE);
+    nbody.addConfiguration(VALIDATE_GRID, VALIDATE_BODIES, VALIDATE_NBODY_STEPS);
+    passed = nbody.run() && passed;
+    
+    glfwDestroyWindow(window);
+    glfwTerminate();
+    return passed ? 0 : -1;
+}